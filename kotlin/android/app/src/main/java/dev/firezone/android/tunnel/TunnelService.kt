@@ -26,6 +26,8 @@ import dev.firezone.android.core.data.Repository
 import dev.firezone.android.tunnel.callback.ConnlibCallback
 import dev.firezone.android.tunnel.model.Cidr
 import dev.firezone.android.tunnel.model.Resource
+import dev.firezone.android.tunnel.model.ResourceDelta
+import dev.firezone.android.tunnel.model.ResourceList
 import java.nio.file.Files
 import java.nio.file.Paths
 import java.util.UUID
@@ -49,6 +51,7 @@ class TunnelService : VpnService() {
     private var tunnelDnsAddresses: MutableList<String> = mutableListOf()
     private var tunnelRoutes: MutableList<Cidr> = mutableListOf()
     private var _tunnelResources: List<Resource> = emptyList()
+    private var resourceList = ResourceList()
     private var _tunnelState: State = State.DOWN
     private var networkCallback: NetworkMonitor? = null
 
@@ -89,12 +92,16 @@ class TunnelService : VpnService() {
 
     private val callback: ConnlibCallback =
         object : ConnlibCallback {
-            override fun onUpdateResources(resourceListJSON: String) {
-                Log.d(TAG, "onUpdateResources: $resourceListJSON")
-                Firebase.crashlytics.log("onUpdateResources: $resourceListJSON")
-                moshi.adapter<List<Resource>>().fromJson(resourceListJSON)?.let {
-                    tunnelResources = it
+            override fun onUpdateResources(resourceDelta: ByteArray) {
+                val delta = ResourceDelta.decode(resourceDelta)
+                Log.d(TAG, "onUpdateResources: seq ${delta.seq}, ${delta.upserted.size} upserted, ${delta.removed.size} removed")
+                Firebase.crashlytics.log("onUpdateResources: seq ${delta.seq}")
+
+                if (!resourceList.apply(delta)) {
+                    Log.e(TAG, "onUpdateResources: missed a resource delta before ${delta.seq}")
+                    return
                 }
+                tunnelResources = resourceList.toList()
             }
 
             override fun onSetInterfaceConfig(
@@ -13,7 +13,8 @@ interface ConnlibCallback {
         routes6JSON: String,
     ): Int
 
-    fun onUpdateResources(resourceListJSON: String)
+    // Only carries what changed since the last call, see `ResourceDelta`.
+    fun onUpdateResources(resourceDelta: ByteArray)
 
     // The JNI doesn't support nullable types, so we need two method signatures
     fun onDisconnect(error: String): Boolean
@@ -0,0 +1,116 @@
+/* Licensed under Apache 2.0 (C) 2024 Firezone, Inc. */
+package dev.firezone.android.tunnel.model
+
+import java.net.InetAddress
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
+import java.util.UUID
+
+// Decodes the resource deltas connlib hands us in `onUpdateResources`.
+// See `connlib_client_shared::resource_delta` for the layout.
+class ResourceDelta(
+    val seq: Long,
+    val upserted: List<Resource>,
+    val removed: List<String>,
+) {
+    companion object {
+        fun decode(bytes: ByteArray): ResourceDelta {
+            val buf = ByteBuffer.wrap(bytes).order(ByteOrder.LITTLE_ENDIAN)
+
+            val seq = buf.long
+            val numUpserted = buf.int
+            val numRemoved = buf.int
+
+            val upserted =
+                List(numUpserted) {
+                    val len = buf.int
+                    val resource = buf.slice().order(ByteOrder.LITTLE_ENDIAN).limit(len) as ByteBuffer
+                    buf.position(buf.position() + len)
+
+                    decodeResource(resource)
+                }
+            val removed = List(numRemoved) { decodeId(buf) }
+
+            return ResourceDelta(seq, upserted, removed)
+        }
+
+        private fun decodeResource(buf: ByteBuffer): Resource {
+            val type =
+                when (val kind = buf.get().toInt()) {
+                    0 -> TypeEnum.DNS
+                    1 -> TypeEnum.CIDR
+                    else -> throw IllegalArgumentException("Invalid resource kind: $kind")
+                }
+            val id = decodeId(buf)
+            val status =
+                when (val status = buf.get().toInt()) {
+                    0 -> StatusEnum.UNKNOWN
+                    1 -> StatusEnum.ONLINE
+                    2 -> StatusEnum.OFFLINE
+                    else -> throw IllegalArgumentException("Invalid resource status: $status")
+                }
+            val address =
+                when (type) {
+                    TypeEnum.DNS -> decodeString(buf)
+                    TypeEnum.IP, TypeEnum.CIDR -> decodeCidr(buf)
+                }
+            val name = decodeString(buf)
+            val addressDescription = if (buf.get().toInt() == 1) decodeString(buf) else null
+            val sites = List(buf.short.toInt() and 0xffff) { Site(decodeId(buf), decodeString(buf)) }
+
+            return Resource(type, id, address, addressDescription, sites, name, status)
+        }
+
+        private fun decodeCidr(buf: ByteBuffer): String {
+            val octets =
+                when (val family = buf.get().toInt()) {
+                    4 -> ByteArray(4)
+                    6 -> ByteArray(16)
+                    else -> throw IllegalArgumentException("Invalid address family: $family")
+                }
+            buf.get(octets)
+            val prefix = buf.get().toInt() and 0xff
+
+            return "${InetAddress.getByAddress(octets).hostAddress}/$prefix"
+        }
+
+        // UUIDs are in network byte order, regardless of the rest of the encoding.
+        private fun decodeId(buf: ByteBuffer): String {
+            val id = ByteArray(16)
+            buf.get(id)
+            val big = ByteBuffer.wrap(id)
+
+            return UUID(big.long, big.long).toString()
+        }
+
+        private fun decodeString(buf: ByteBuffer): String {
+            val bytes = ByteArray(buf.int)
+            buf.get(bytes)
+
+            return String(bytes, Charsets.UTF_8)
+        }
+    }
+}
+
+// Applies deltas to the resource list we last saw.
+class ResourceList {
+    private val resources = HashMap<String, Resource>()
+    private var lastSeq = 0L
+
+    // Returns false if a delta got lost, the list is stale until the next reset.
+    fun apply(delta: ResourceDelta): Boolean {
+        if (delta.seq == 0L) {
+            resources.clear()
+        } else if (delta.seq != lastSeq + 1) {
+            return false
+        }
+        lastSeq = delta.seq
+
+        delta.upserted.forEach { resources[it.id] = it }
+        delta.removed.forEach { resources.remove(it) }
+
+        return true
+    }
+
+    fun toList(): List<Resource> = resources.values.sortedWith(compareBy({ it.name }, { it.id }))
+}
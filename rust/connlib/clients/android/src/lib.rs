@@ -4,13 +4,13 @@
 // ecosystem, so it's used here for consistency.
 
 use connlib_client_shared::{
-    callbacks::ResourceDescription, file_logger, keypair, Callbacks, Cidrv4, Cidrv6, ConnectArgs,
-    Error, LoginUrl, LoginUrlError, Session, Sockets,
+    callbacks::ResourceDescription, file_logger, keypair, resource_delta::ResourceDeltas,
+    Callbacks, Cidrv4, Cidrv6, ConnectArgs, Error, LoginUrl, LoginUrlError, Session, Sockets,
 };
 use jni::{
     objects::{GlobalRef, JClass, JObject, JString, JValue},
     strings::JNIString,
-    sys::jlong,
+    sys::{jbyteArray, jlong},
     JNIEnv, JavaVM,
 };
 use secrecy::SecretString;
@@ -20,7 +20,10 @@ use std::{
     os::fd::RawFd,
     path::PathBuf,
 };
-use std::{sync::OnceLock, time::Duration};
+use std::{
+    sync::{Arc, Mutex, OnceLock},
+    time::Duration,
+};
 use thiserror::Error;
 use tokio::runtime::Runtime;
 use tracing_subscriber::prelude::*;
@@ -37,6 +40,8 @@ pub struct CallbackHandler {
     vm: JavaVM,
     callback_handler: GlobalRef,
     handle: file_logger::Handle,
+    /// The resources we last handed to Kotlin, we only send what changed.
+    resources: Arc<Mutex<ResourceDeltas>>,
 }
 
 impl Clone for CallbackHandler {
@@ -50,6 +55,7 @@ impl Clone for CallbackHandler {
             vm: unsafe { std::ptr::read(&self.vm) },
             callback_handler: self.callback_handler.clone(),
             handle: self.handle.clone(),
+            resources: self.resources.clone(),
         }
     }
 }
@@ -65,6 +71,11 @@ pub enum CallbackError {
         name: &'static str,
         source: jni::errors::Error,
     },
+    #[error("Failed to create byte array `{name}`: {source}")]
+    NewByteArrayFailed {
+        name: &'static str,
+        source: jni::errors::Error,
+    },
     #[error("Failed to call method `{name}`: {source}")]
     CallMethodFailed {
         name: &'static str,
@@ -223,19 +234,31 @@ impl Callbacks for CallbackHandler {
     }
 
     fn on_update_resources(&self, resource_list: Vec<ResourceDescription>) {
+        let Some(delta) = self
+            .resources
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .update_or_initial(&resource_list)
+        else {
+            return;
+        };
+
+        let mut buf = Vec::new();
+        delta.encode(&mut buf);
+
         self.env(|mut env| {
-            let resource_list = env
-                .new_string(serde_json::to_string(&resource_list)?)
-                .map_err(|source| CallbackError::NewStringFailed {
-                    name: "resource_list",
+            let resource_delta = env.byte_array_from_slice(&buf).map_err(|source| {
+                CallbackError::NewByteArrayFailed {
+                    name: "resource_delta",
                     source,
-                })?;
+                }
+            })?;
             call_method(
                 &mut env,
                 &self.callback_handler,
                 "onUpdateResources",
-                "(Ljava/lang/String;)V",
-                &[JValue::from(&resource_list)],
+                "([B)V",
+                &[JValue::from(&resource_delta)],
             )
         })
         .expect("onUpdateResources callback failed")
@@ -344,6 +367,7 @@ fn connect(
         vm: env.get_java_vm().map_err(ConnectError::GetJavaVmFailed)?,
         callback_handler,
         handle,
+        resources: Default::default(),
     };
 
     let (private_key, public_key) = keypair();
@@ -500,3 +524,29 @@ pub unsafe extern "system" fn Java_dev_firezone_android_tunnel_ConnlibSession_re
     let session = &*(session_ptr as *const SessionWrapper);
     session.inner.reconnect();
 }
+
+/// Copies the session's statistics into a new byte array, in the layout documented in `connlib_client_shared::stats_block`.
+///
+/// # Safety
+/// session_ptr should have been obtained from `connect` function, and shouldn't be dropped with disconnect
+/// at any point before or during operation of this function.
+#[allow(non_snake_case)]
+#[no_mangle]
+pub unsafe extern "system" fn Java_dev_firezone_android_tunnel_ConnlibSession_stats(
+    mut env: JNIEnv,
+    _: JClass,
+    session_ptr: jlong,
+) -> jbyteArray {
+    let session = &*(session_ptr as *const SessionWrapper);
+
+    let mut buf = Vec::with_capacity(session.inner.stats().size());
+    session.inner.stats().copy_to(&mut buf);
+
+    match env.byte_array_from_slice(&buf) {
+        Ok(array) => array.into_raw(),
+        Err(e) => {
+            tracing::error!("Failed to create stats array: {e}");
+            std::ptr::null_mut()
+        }
+    }
+}
@@ -4,15 +4,15 @@
 mod make_writer;
 
 use connlib_client_shared::{
-    callbacks::ResourceDescription, file_logger, keypair, Callbacks, Cidrv4, Cidrv6, ConnectArgs,
-    Error, LoginUrl, Session, Sockets,
+    callbacks::ResourceDescription, file_logger, keypair, resource_delta::ResourceDeltas,
+    Callbacks, Cidrv4, Cidrv6, ConnectArgs, Error, LoginUrl, Session, Sockets,
 };
 use secrecy::SecretString;
 use std::{
     net::{IpAddr, Ipv4Addr, Ipv6Addr},
     os::fd::RawFd,
     path::PathBuf,
-    sync::Arc,
+    sync::{Arc, Mutex},
     time::Duration,
 };
 use tokio::runtime::Runtime;
@@ -54,6 +54,10 @@ mod ffi {
         // <https://github.com/firezone/firezone/issues/4350>
         #[swift_bridge(swift_name = "setDns")]
         fn set_dns(&mut self, dns_servers: String);
+
+        // Copies the statistics of the session, see `connlib_client_shared::stats_block` for the layout.
+        fn stats(&self) -> Vec<u8>;
+
         fn disconnect(self);
     }
 
@@ -71,8 +75,9 @@ mod ffi {
         #[swift_bridge(swift_name = "onUpdateRoutes")]
         fn on_update_routes(&self, routeList4: String, routeList6: String);
 
+        // Only carries what changed since the last call, see `connlib_client_shared::resource_delta` for the layout.
         #[swift_bridge(swift_name = "onUpdateResources")]
-        fn on_update_resources(&self, resourceList: String);
+        fn on_update_resources(&self, resourceDelta: Vec<u8>);
 
         #[swift_bridge(swift_name = "onDisconnect")]
         fn on_disconnect(&self, error: String);
@@ -101,6 +106,8 @@ pub struct CallbackHandler {
     // refcount, but there's no way to generate a `Clone` impl that increments the
     // recount. Instead, we just wrap it in an `Arc`.
     inner: Arc<ffi::CallbackHandler>,
+    /// The resources we last handed to Swift, we only send what changed.
+    resources: Arc<Mutex<ResourceDeltas>>,
 }
 
 impl Callbacks for CallbackHandler {
@@ -134,10 +141,19 @@ impl Callbacks for CallbackHandler {
     }
 
     fn on_update_resources(&self, resource_list: Vec<ResourceDescription>) {
-        self.inner.on_update_resources(
-            serde_json::to_string(&resource_list)
-                .expect("developer error: failed to serialize resource list"),
-        );
+        let Some(delta) = self
+            .resources
+            .lock()
+            .unwrap_or_else(|e| e.into_inner())
+            .update_or_initial(&resource_list)
+        else {
+            return;
+        };
+
+        let mut buf = Vec::new();
+        delta.encode(&mut buf);
+
+        self.inner.on_update_resources(buf);
     }
 
     fn on_disconnect(&self, error: &Error) {
@@ -208,6 +224,7 @@ impl WrappedSession {
             app_version: env!("CARGO_PKG_VERSION").to_string(),
             callbacks: CallbackHandler {
                 inner: Arc::new(callback_handler),
+                resources: Default::default(),
             },
             max_partition_time: Some(MAX_PARTITION_TIME),
         };
@@ -229,6 +246,13 @@ impl WrappedSession {
             .set_dns(serde_json::from_str(&dns_servers).unwrap())
     }
 
+    fn stats(&self) -> Vec<u8> {
+        let mut buf = Vec::with_capacity(self.inner.stats().size());
+        self.inner.stats().copy_to(&mut buf);
+
+        buf
+    }
+
     fn disconnect(self) {
         self.inner.disconnect()
     }
@@ -0,0 +1,141 @@
+//! Coalesces bursts of state changes into a single callback.
+//!
+//! During a reconnect, sites flap between online and offline and each flip produces a new resource list.
+//! Handing every one of them to the OS layer makes the UI thrash, so we throttle them: the first change of a burst starts a [`WINDOW`] and only the latest state is delivered when it ends.
+//! Unlike a debounce, further changes don't push the deadline back, so a site that keeps flapping can't starve delivery.
+//! States that are identical to the one delivered last are dropped entirely.
+
+use std::time::{Duration, Instant};
+
+/// How long after the first change of a burst we deliver the latest state.
+pub(crate) const WINDOW: Duration = Duration::from_millis(100);
+
+/// Delivers the latest of a series of states, at most once per [`WINDOW`].
+///
+/// States are delivered in the order they were pushed; a newer state replaces a pending older one but never overtakes a delivered one.
+#[derive(Debug)]
+pub(crate) struct CallbackScheduler<T> {
+    pending: Option<(T, Instant)>,
+    last_delivered: Option<T>,
+
+    stats: Stats,
+}
+
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub(crate) struct Stats {
+    /// States we handed to the callback.
+    pub(crate) delivered: u64,
+    /// States that were replaced by a newer one before we delivered them.
+    pub(crate) coalesced: u64,
+    /// States that were identical to the last delivered one.
+    pub(crate) deduplicated: u64,
+}
+
+impl<T> CallbackScheduler<T>
+where
+    T: PartialEq,
+{
+    pub(crate) fn new() -> Self {
+        Self {
+            pending: None,
+            last_delivered: None,
+            stats: Stats::default(),
+        }
+    }
+
+    pub(crate) fn push(&mut self, state: T, now: Instant) {
+        match self.pending.as_mut() {
+            Some((pending, _)) => {
+                // Keep the original deadline so a continuous stream of changes can't starve delivery.
+                *pending = state;
+                self.stats.coalesced += 1;
+            }
+            None => self.pending = Some((state, now + WINDOW)),
+        }
+    }
+
+    pub(crate) fn poll_timeout(&self) -> Option<Instant> {
+        self.pending.as_ref().map(|(_, deadline)| *deadline)
+    }
+
+    /// Returns the state to deliver, if its window has passed.
+    pub(crate) fn handle_timeout(&mut self, now: Instant) -> Option<&T> {
+        if self.pending.as_ref()?.1 > now {
+            return None;
+        }
+
+        self.flush()
+    }
+
+    /// Returns the pending state to deliver, regardless of its window.
+    ///
+    /// Call this before shutting down so the last state isn't lost.
+    pub(crate) fn flush(&mut self) -> Option<&T> {
+        let (state, _) = self.pending.take()?;
+
+        if self.last_delivered.as_ref() == Some(&state) {
+            self.stats.deduplicated += 1;
+            return None;
+        }
+
+        self.stats.delivered += 1;
+
+        Some(self.last_delivered.insert(state))
+    }
+
+    pub(crate) fn stats(&self) -> Stats {
+        self.stats
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn delivers_latest_state_after_window() {
+        let now = Instant::now();
+        let mut scheduler = CallbackScheduler::new();
+
+        scheduler.push(1, now);
+        scheduler.push(2, now + Duration::from_millis(10));
+
+        assert_eq!(scheduler.handle_timeout(now), None);
+        assert_eq!(scheduler.poll_timeout(), Some(now + WINDOW));
+        assert_eq!(scheduler.handle_timeout(now + WINDOW), Some(&2));
+        assert_eq!(scheduler.poll_timeout(), None);
+        assert_eq!(
+            scheduler.stats(),
+            Stats {
+                delivered: 1,
+                coalesced: 1,
+                deduplicated: 0
+            }
+        );
+    }
+
+    #[test]
+    fn identical_state_is_not_delivered_again() {
+        let now = Instant::now();
+        let mut scheduler = CallbackScheduler::new();
+
+        scheduler.push(1, now);
+        scheduler.handle_timeout(now + WINDOW);
+
+        scheduler.push(1, now + WINDOW);
+
+        assert_eq!(scheduler.handle_timeout(now + WINDOW * 2), None);
+        assert_eq!(scheduler.stats().deduplicated, 1);
+    }
+
+    #[test]
+    fn flush_ignores_window() {
+        let now = Instant::now();
+        let mut scheduler = CallbackScheduler::new();
+
+        scheduler.push(1, now);
+
+        assert_eq!(scheduler.flush(), Some(&1));
+        assert_eq!(scheduler.flush(), None);
+    }
+}
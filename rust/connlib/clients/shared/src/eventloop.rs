@@ -1,12 +1,15 @@
 use crate::{
+    callback_scheduler::CallbackScheduler,
     messages::{
         Connect, ConnectionDetails, EgressMessages, GatewayIceCandidates, GatewaysIceCandidates,
         IngressMessages, InitClient, ReplyMessages,
     },
+    stats_block::StatsBlock,
     PHOENIX_TOPIC,
 };
 use anyhow::Result;
 use connlib_shared::{
+    callbacks::ResourceDescription,
     messages::{ConnectionAccepted, GatewayResponse, RelaysPresence, ResourceAccepted, ResourceId},
     Callbacks,
 };
@@ -14,10 +17,17 @@ use firezone_tunnel::ClientTunnel;
 use phoenix_channel::{ErrorReply, OutboundRequestId, PhoenixChannel};
 use std::{
     collections::{HashMap, HashSet},
+    future::Future as _,
     net::IpAddr,
+    pin::Pin,
+    sync::Arc,
     task::{Context, Poll},
+    time::{Duration, Instant},
 };
 
+/// How often we publish the tunnel's statistics to the [`StatsBlock`].
+pub(crate) const STATS_WRITE_INTERVAL: Duration = Duration::from_secs(1);
+
 pub struct Eventloop<C: Callbacks> {
     tunnel: ClientTunnel<C>,
 
@@ -25,6 +35,13 @@ pub struct Eventloop<C: Callbacks> {
     rx: tokio::sync::mpsc::UnboundedReceiver<Command>,
 
     connection_intents: SentConnectionIntents,
+
+    /// Coalesces resource updates before they reach [`Callbacks::on_update_resources`].
+    resource_updates: CallbackScheduler<Vec<ResourceDescription>>,
+    resource_updates_timer: Option<Pin<Box<tokio::time::Sleep>>>,
+
+    stats: Arc<StatsBlock>,
+    stats_timer: tokio::time::Interval,
 }
 
 /// Commands that can be sent to the [`Eventloop`].
@@ -39,12 +56,20 @@ impl<C: Callbacks> Eventloop<C> {
         tunnel: ClientTunnel<C>,
         portal: PhoenixChannel<(), IngressMessages, ReplyMessages>,
         rx: tokio::sync::mpsc::UnboundedReceiver<Command>,
+        stats: Arc<StatsBlock>,
     ) -> Self {
+        let mut stats_timer = tokio::time::interval(STATS_WRITE_INTERVAL);
+        stats_timer.set_missed_tick_behavior(tokio::time::MissedTickBehavior::Delay);
+
         Self {
             tunnel,
             portal,
             connection_intents: SentConnectionIntents::default(),
             rx,
+            resource_updates: CallbackScheduler::new(),
+            resource_updates_timer: None,
+            stats,
+            stats_timer,
         }
     }
 }
@@ -56,7 +81,11 @@ where
     pub fn poll(&mut self, cx: &mut Context<'_>) -> Poll<Result<(), phoenix_channel::Error>> {
         loop {
             match self.rx.poll_recv(cx) {
-                Poll::Ready(Some(Command::Stop)) | Poll::Ready(None) => return Poll::Ready(Ok(())),
+                Poll::Ready(Some(Command::Stop)) | Poll::Ready(None) => {
+                    self.flush_resource_updates();
+
+                    return Poll::Ready(Ok(()));
+                }
                 Poll::Ready(Some(Command::SetDns(dns))) => {
                     if let Err(e) = self.tunnel.set_new_dns(dns) {
                         tracing::warn!("Failed to update DNS: {e}");
@@ -85,18 +114,69 @@ where
                 Poll::Pending => {}
             }
 
-            match self.portal.poll(cx)? {
-                Poll::Ready(event) => {
+            match self.portal.poll(cx) {
+                Ok(Poll::Ready(event)) => {
                     self.handle_portal_event(event);
                     continue;
                 }
-                Poll::Pending => {}
+                Ok(Poll::Pending) => {}
+                Err(e) => {
+                    self.flush_resource_updates();
+
+                    return Poll::Ready(Err(e));
+                }
+            }
+
+            if self.poll_resource_updates(cx).is_ready() {
+                continue;
+            }
+
+            if self.stats_timer.poll_tick(cx).is_ready() {
+                self.stats
+                    .write(&self.tunnel.stats(), self.resource_updates.stats());
+                continue;
             }
 
             return Poll::Pending;
         }
     }
 
+    fn poll_resource_updates(&mut self, cx: &mut Context<'_>) -> Poll<()> {
+        let Some(deadline) = self.resource_updates.poll_timeout() else {
+            self.resource_updates_timer = None;
+            return Poll::Pending;
+        };
+        let deadline = tokio::time::Instant::from_std(deadline);
+
+        let timer = self
+            .resource_updates_timer
+            .get_or_insert_with(|| Box::pin(tokio::time::sleep_until(deadline)));
+        if timer.deadline() != deadline {
+            timer.as_mut().reset(deadline);
+        }
+
+        std::task::ready!(timer.as_mut().poll(cx));
+        self.resource_updates_timer = None;
+
+        if let Some(resources) = self.resource_updates.handle_timeout(Instant::now()) {
+            self.tunnel.callbacks.on_update_resources(resources.clone());
+        }
+
+        Poll::Ready(())
+    }
+
+    /// Delivers the pending resource update, if any, so it isn't lost when we stop.
+    ///
+    /// Also publishes the statistics one last time so the final counts aren't lost either.
+    fn flush_resource_updates(&mut self) {
+        if let Some(resources) = self.resource_updates.flush() {
+            self.tunnel.callbacks.on_update_resources(resources.clone());
+        }
+
+        self.stats
+            .write(&self.tunnel.stats(), self.resource_updates.stats());
+    }
+
     fn handle_tunnel_event(&mut self, event: firezone_tunnel::ClientEvent) {
         match event {
             firezone_tunnel::ClientEvent::AddedIceCandidates {
@@ -156,7 +236,7 @@ where
                 // We only access the callbacks here because `Tunnel` already has them and the callbacks are the current way of talking to the UI.
                 // At a later point, we will probably map to another event here that gets pushed further up.
 
-                self.tunnel.callbacks.on_update_resources(resources)
+                self.resource_updates.push(resources, Instant::now());
             }
             firezone_tunnel::ClientEvent::DnsServersChanged { .. } => {
                 // Unhandled for now.
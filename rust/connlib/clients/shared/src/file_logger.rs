@@ -1,9 +1,12 @@
 //! Connlib File Logger
 //!
-//! This module implements a file-based logger for connlib using tracing-appender.
+//! Events are captured as binary records on the thread that emits them and queued in a fixed-size ring buffer.
+//! Timestamps, levels and field values are formatted into plain-text lines by a background thread, which also owns the log file.
+//! Emitting an event therefore never touches the disk and never blocks on the writer:
+//! if the ring buffer is full, the event is dropped and the writer reports how many were lost once it catches up.
 //!
-//! The log files are never rotated for the duration of the process; this prevents
-//! tracing_appender from trying to prune old log files which triggers privacy
+//! Log files are rotated once they reach [`MAX_FILE_SIZE`] and the rotated file is gzip-compressed.
+//! Old log files are never pruned; scanning the log directory for them triggers privacy
 //! alerts in Apple app store submissions.
 //!
 //! Since these will be leaving the user's device, these logs should contain *only*
@@ -15,96 +18,613 @@
 //! - Device serials
 //! - MAC addresses
 
+use std::cell::RefCell;
+use std::fmt::{self, Write as _};
+use std::fs;
+use std::io::{self, Write as _};
 use std::path::{Path, PathBuf};
-use std::sync::Arc;
-use std::{fs, io};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex, MutexGuard};
+use std::thread::{self, JoinHandle};
+use std::time::{Duration, SystemTime};
 
-use time::OffsetDateTime;
-use tracing::Subscriber;
-use tracing_appender::non_blocking::{NonBlocking, WorkerGuard};
+use flate2::{write::GzEncoder, Compression};
+use time::{format_description::well_known::Rfc3339, OffsetDateTime};
+use tracing::field::{Field, Visit};
+use tracing::span::{Attributes, Id, Record};
+use tracing::{Event, Level, Subscriber};
+use tracing_subscriber::layer::Context;
+use tracing_subscriber::registry::LookupSpan;
 use tracing_subscriber::Layer;
 
 const LOG_FILE_BASE_NAME: &str = "connlib";
+const LOG_FILE_EXTENSION: &str = "log";
+
+/// Size of the ring buffer between the logging threads and the writer thread.
+const RING_CAPACITY: usize = 1024 * 1024;
+
+/// Size at which we start a new log file.
+const MAX_FILE_SIZE: u64 = 10 * 1024 * 1024;
+
+/// How often the writer flushes the log file if no new events arrive.
+const FLUSH_INTERVAL: Duration = Duration::from_secs(1);
 
 /// Create a new file logger layer.
 pub fn layer<T>(log_dir: &Path) -> (Box<dyn Layer<T> + Send + Sync + 'static>, Handle)
 where
-    T: Subscriber + for<'a> tracing_subscriber::registry::LookupSpan<'a>,
+    T: Subscriber + for<'a> LookupSpan<'a>,
 {
-    let (appender_json, handle_json) = new_appender(log_dir.to_path_buf(), "jsonl");
-    let layer_json = tracing_stackdriver::layer()
-        .with_writer(appender_json)
-        .boxed();
-
-    let (appender_fmt, handle_fmt) = new_appender(log_dir.to_path_buf(), "log");
-    let layer_fmt = tracing_subscriber::fmt::layer()
-        .with_writer(appender_fmt)
-        .boxed();
-
-    let handle = Handle {
-        _guard_json: Arc::new(handle_json),
-        _guard_fmt: Arc::new(handle_fmt),
-    };
-
-    // Return the guard so that the caller maintains a handle to it. Otherwise,
-    // we have to wait for tracing_appender to flush the logs before exiting.
-    // See https://docs.rs/tracing-appender/latest/tracing_appender/non_blocking/struct.WorkerGuard.html
-    (vec![layer_json, layer_fmt].boxed(), handle)
-}
-
-fn new_appender(directory: PathBuf, file_extension: &'static str) -> (NonBlocking, WorkerGuard) {
+    let ring = Arc::new(Ring::new(RING_CAPACITY));
     let appender = Appender {
-        directory,
+        directory: log_dir.to_path_buf(),
         current: None,
-        file_extension,
     };
 
-    let (non_blocking, guard) = tracing_appender::non_blocking(appender);
+    let worker = thread::Builder::new()
+        .name("connlib-file-logger".to_owned())
+        .spawn({
+            let ring = ring.clone();
+
+            move || run_writer(&ring, appender)
+        })
+        .expect("failed to spawn file logger thread");
+
+    let handle = Handle {
+        _guard: Arc::new(Guard {
+            ring: ring.clone(),
+            worker: Some(worker),
+        }),
+    };
 
-    (non_blocking, guard)
+    // Return the guard so that the caller maintains a handle to it.
+    // Dropping the last handle flushes all pending events to disk.
+    (Box::new(RecordLayer { ring }), handle)
 }
 
 /// A handle to our file-logger.
 ///
-/// This handle houses the [`WorkerGuard`]s of the underlying non-blocking appenders.
+/// This handle owns the writer thread.
 /// Thus, you MUST NOT drop this handle for as long as you want messages to arrive at the log files.
 #[must_use]
 #[derive(Clone, Debug)]
 pub struct Handle {
-    _guard_json: Arc<WorkerGuard>,
-    _guard_fmt: Arc<WorkerGuard>,
+    _guard: Arc<Guard>,
+}
+
+#[derive(Debug)]
+struct Guard {
+    ring: Arc<Ring>,
+    worker: Option<JoinHandle<()>>,
+}
+
+impl Drop for Guard {
+    fn drop(&mut self) {
+        self.ring.close();
+
+        if let Some(worker) = self.worker.take() {
+            let _ = worker.join();
+        }
+    }
+}
+
+/// Encodes events into binary records and pushes them into the [`Ring`].
+struct RecordLayer {
+    ring: Arc<Ring>,
+}
+
+/// The formatted fields of a span, stored in its extensions.
+///
+/// Spans are created far less often than events, so we format their fields once, up front.
+struct SpanFields(String);
+
+impl<S> Layer<S> for RecordLayer
+where
+    S: Subscriber + for<'a> LookupSpan<'a>,
+{
+    fn on_new_span(&self, attrs: &Attributes<'_>, id: &Id, ctx: Context<'_, S>) {
+        let Some(span) = ctx.span(id) else {
+            return;
+        };
+
+        let mut fields = String::new();
+        attrs.record(&mut SpanVisitor(&mut fields));
+        span.extensions_mut().insert(SpanFields(fields));
+    }
+
+    fn on_record(&self, id: &Id, values: &Record<'_>, ctx: Context<'_, S>) {
+        let Some(span) = ctx.span(id) else {
+            return;
+        };
+        let mut extensions = span.extensions_mut();
+        let Some(SpanFields(fields)) = extensions.get_mut::<SpanFields>() else {
+            return;
+        };
+
+        values.record(&mut SpanVisitor(fields));
+    }
+
+    fn on_event(&self, event: &Event<'_>, ctx: Context<'_, S>) {
+        with_scratch(|buf| {
+            encode_event(event, &ctx, buf);
+            self.ring.push(buf);
+        })
+    }
+}
+
+/// Runs `f` with an empty, thread-local buffer so that encoding an event doesn't allocate.
+fn with_scratch(f: impl FnOnce(&mut Vec<u8>)) {
+    thread_local! {
+        static SCRATCH: RefCell<Vec<u8>> = const { RefCell::new(Vec::new()) };
+    }
+
+    let mut f = Some(f);
+    let _ = SCRATCH.try_with(|scratch| {
+        // Fails if a `Debug` impl logs while we are encoding an event.
+        let Ok(mut scratch) = scratch.try_borrow_mut() else {
+            return;
+        };
+        scratch.clear();
+
+        (f.take().expect("only called once"))(&mut scratch)
+    });
+
+    if let Some(f) = f {
+        f(&mut Vec::new())
+    }
+}
+
+// Tags of the field values in a record.
+const VALUE_DEBUG: u8 = 0;
+const VALUE_STR: u8 = 1;
+const VALUE_I64: u8 = 2;
+const VALUE_U64: u8 = 3;
+const VALUE_BOOL: u8 = 4;
+const VALUE_F64: u8 = 5;
+
+/// Encodes an event as a binary record.
+///
+/// Layout: timestamp (u64 nanoseconds since the UNIX epoch), level (u8), target, spans, followed by the fields as name, tag and value.
+/// Strings are prefixed with their length as a u32.
+/// All integers are little-endian.
+fn encode_event<S>(event: &Event<'_>, ctx: &Context<'_, S>, buf: &mut Vec<u8>)
+where
+    S: Subscriber + for<'a> LookupSpan<'a>,
+{
+    let timestamp = SystemTime::now()
+        .duration_since(SystemTime::UNIX_EPOCH)
+        .unwrap_or_default()
+        .as_nanos() as u64;
+    let metadata = event.metadata();
+
+    buf.extend_from_slice(&timestamp.to_le_bytes());
+    buf.push(encode_level(metadata.level()));
+    put_str(buf, metadata.target());
+
+    // Reserve room for the length of the spans; we only know it once we've written them.
+    let spans_start = buf.len();
+    buf.extend_from_slice(&[0; 4]);
+    for span in ctx
+        .event_scope(event)
+        .into_iter()
+        .flat_map(|s| s.from_root())
+    {
+        buf.extend_from_slice(span.name().as_bytes());
+
+        let extensions = span.extensions();
+        if let Some(SpanFields(fields)) = extensions.get::<SpanFields>() {
+            if !fields.is_empty() {
+                buf.push(b'{');
+                buf.extend_from_slice(fields.as_bytes());
+                buf.push(b'}');
+            }
+        }
+        buf.push(b':');
+    }
+    let spans_len = (buf.len() - spans_start - 4) as u32;
+    buf[spans_start..spans_start + 4].copy_from_slice(&spans_len.to_le_bytes());
+
+    event.record(&mut EventVisitor(buf));
+}
+
+fn put_str(buf: &mut Vec<u8>, s: &str) {
+    buf.extend_from_slice(&(s.len() as u32).to_le_bytes());
+    buf.extend_from_slice(s.as_bytes());
+}
+
+struct EventVisitor<'a>(&'a mut Vec<u8>);
+
+impl Visit for EventVisitor<'_> {
+    fn record_f64(&mut self, field: &Field, value: f64) {
+        put_str(self.0, field.name());
+        self.0.push(VALUE_F64);
+        self.0.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn record_i64(&mut self, field: &Field, value: i64) {
+        put_str(self.0, field.name());
+        self.0.push(VALUE_I64);
+        self.0.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn record_u64(&mut self, field: &Field, value: u64) {
+        put_str(self.0, field.name());
+        self.0.push(VALUE_U64);
+        self.0.extend_from_slice(&value.to_le_bytes());
+    }
+
+    fn record_bool(&mut self, field: &Field, value: bool) {
+        put_str(self.0, field.name());
+        self.0.push(VALUE_BOOL);
+        self.0.push(u8::from(value));
+    }
+
+    fn record_str(&mut self, field: &Field, value: &str) {
+        put_str(self.0, field.name());
+        self.0.push(VALUE_STR);
+        put_str(self.0, value);
+    }
+
+    fn record_debug(&mut self, field: &Field, value: &dyn fmt::Debug) {
+        put_str(self.0, field.name());
+        self.0.push(VALUE_DEBUG);
+
+        // The value is borrowed, so this is the one thing we have to format on the hot path.
+        let len_start = self.0.len();
+        self.0.extend_from_slice(&[0; 4]);
+        let _ = write!(ByteWriter(self.0), "{value:?}");
+        let len = (self.0.len() - len_start - 4) as u32;
+        self.0[len_start..len_start + 4].copy_from_slice(&len.to_le_bytes());
+    }
+}
+
+/// Formats span fields the way they appear in the log file.
+struct SpanVisitor<'a>(&'a mut String);
+
+impl Visit for SpanVisitor<'_> {
+    fn record_debug(&mut self, field: &Field, value: &dyn fmt::Debug) {
+        if !self.0.is_empty() {
+            self.0.push(' ');
+        }
+
+        let _ = write!(self.0, "{}={value:?}", field.name());
+    }
+}
+
+/// Lets [`fmt::Write`] append to a byte buffer.
+struct ByteWriter<'a>(&'a mut Vec<u8>);
+
+impl fmt::Write for ByteWriter<'_> {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        self.0.extend_from_slice(s.as_bytes());
+
+        Ok(())
+    }
+}
+
+fn encode_level(level: &Level) -> u8 {
+    match *level {
+        Level::ERROR => 0,
+        Level::WARN => 1,
+        Level::INFO => 2,
+        Level::DEBUG => 3,
+        _ => 4,
+    }
+}
+
+fn level_name(level: u8) -> &'static str {
+    match level {
+        0 => "ERROR",
+        1 => " WARN",
+        2 => " INFO",
+        3 => "DEBUG",
+        _ => "TRACE",
+    }
+}
+
+/// Formats a binary record as a line of text.
+///
+/// Returns `None` if the record is malformed.
+fn format_record(mut record: &[u8], out: &mut String) -> Option<()> {
+    let timestamp = take_u64(&mut record)?;
+    let level = take(&mut record, 1)?[0];
+    let target = take_str(&mut record)?;
+    let spans = take_str(&mut record)?;
+
+    match OffsetDateTime::from_unix_timestamp_nanos(i128::from(timestamp))
+        .ok()
+        .and_then(|t| t.format(&Rfc3339).ok())
+    {
+        Some(timestamp) => out.push_str(&timestamp),
+        None => out.push_str("????-??-??T??:??:??Z"),
+    }
+    let _ = write!(out, " {} ", level_name(level));
+    if !spans.is_empty() {
+        out.push_str(spans);
+        out.push(' ');
+    }
+    out.push_str(target);
+    out.push(':');
+
+    while !record.is_empty() {
+        let name = take_str(&mut record)?;
+        let tag = take(&mut record, 1)?[0];
+
+        out.push(' ');
+        if name != "message" {
+            out.push_str(name);
+            out.push('=');
+        }
+
+        let _ = match tag {
+            VALUE_DEBUG => write!(out, "{}", take_str(&mut record)?),
+            VALUE_STR => write!(out, "{:?}", take_str(&mut record)?),
+            VALUE_I64 => write!(out, "{}", take_u64(&mut record)? as i64),
+            VALUE_U64 => write!(out, "{}", take_u64(&mut record)?),
+            VALUE_BOOL => write!(out, "{}", take(&mut record, 1)?[0] != 0),
+            VALUE_F64 => write!(out, "{}", f64::from_bits(take_u64(&mut record)?)),
+            _ => return None,
+        };
+    }
+    out.push('\n');
+
+    Some(())
+}
+
+fn take<'a>(buf: &mut &'a [u8], n: usize) -> Option<&'a [u8]> {
+    if buf.len() < n {
+        return None;
+    }
+
+    let (head, tail) = buf.split_at(n);
+    *buf = tail;
+
+    Some(head)
+}
+
+fn take_u32(buf: &mut &[u8]) -> Option<u32> {
+    Some(u32::from_le_bytes(take(buf, 4)?.try_into().ok()?))
+}
+
+fn take_u64(buf: &mut &[u8]) -> Option<u64> {
+    Some(u64::from_le_bytes(take(buf, 8)?.try_into().ok()?))
+}
+
+fn take_str<'a>(buf: &mut &'a [u8]) -> Option<&'a str> {
+    let len = take_u32(buf)? as usize;
+
+    std::str::from_utf8(take(buf, len)?).ok()
+}
+
+/// A fixed-size byte ring buffer of length-prefixed records.
+///
+/// Producers never wait for the consumer: a record that doesn't fit is dropped.
+#[derive(Debug)]
+struct Ring {
+    inner: Mutex<RingInner>,
+    readable: Condvar,
+    dropped: AtomicU64,
+}
+
+#[derive(Debug)]
+struct RingInner {
+    buf: Box<[u8]>,
+    /// Index of the first unread byte.
+    head: usize,
+    /// Number of unread bytes.
+    len: usize,
+    closed: bool,
+}
+
+impl Ring {
+    fn new(capacity: usize) -> Self {
+        Self {
+            inner: Mutex::new(RingInner {
+                buf: vec![0; capacity].into_boxed_slice(),
+                head: 0,
+                len: 0,
+                closed: false,
+            }),
+            readable: Condvar::new(),
+            dropped: AtomicU64::new(0),
+        }
+    }
+
+    /// Appends a record, or drops it if there isn't enough room.
+    fn push(&self, record: &[u8]) {
+        let mut inner = self.lock();
+
+        let needed = 4 + record.len();
+        if inner.closed || inner.buf.len() - inner.len < needed {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+
+        let was_empty = inner.len == 0;
+        inner.write(&(record.len() as u32).to_le_bytes());
+        inner.write(record);
+        drop(inner);
+
+        // The writer only waits if the ring is empty.
+        if was_empty {
+            self.readable.notify_one();
+        }
+    }
+
+    /// Moves all queued records into `out`, waiting up to `timeout` for the first one.
+    ///
+    /// `spare` must come from [`Ring::spare`].
+    /// Whilst holding the lock, we only swap it with the ring's buffer and copy the records out of it afterwards, so producers never wait for the copy.
+    ///
+    /// Returns `false` once the ring is closed and has been drained.
+    fn drain(&self, spare: &mut Box<[u8]>, out: &mut Vec<u8>, timeout: Duration) -> bool {
+        let mut inner = self.lock();
+
+        if inner.len == 0 && !inner.closed {
+            inner = self
+                .readable
+                .wait_timeout(inner, timeout)
+                .unwrap_or_else(|e| e.into_inner())
+                .0;
+        }
+
+        debug_assert_eq!(spare.len(), inner.buf.len());
+
+        let head = std::mem::take(&mut inner.head);
+        let len = std::mem::take(&mut inner.len);
+        let open = !inner.closed;
+        if len > 0 {
+            std::mem::swap(&mut inner.buf, spare);
+        }
+        drop(inner);
+
+        let (first, second) = if head + len <= spare.len() {
+            (&spare[head..head + len], &spare[..0])
+        } else {
+            (&spare[head..], &spare[..head + len - spare.len()])
+        };
+        out.extend_from_slice(first);
+        out.extend_from_slice(second);
+
+        open
+    }
+
+    /// A buffer to swap with the ring's in [`Ring::drain`].
+    fn spare(&self) -> Box<[u8]> {
+        vec![0; self.lock().buf.len()].into_boxed_slice()
+    }
+
+    fn close(&self) {
+        self.lock().closed = true;
+        self.readable.notify_one();
+    }
+
+    fn take_dropped(&self) -> u64 {
+        self.dropped.swap(0, Ordering::Relaxed)
+    }
+
+    fn lock(&self) -> MutexGuard<'_, RingInner> {
+        // A panic while holding the lock can't leave the ring inconsistent, and the logger must not panic.
+        self.inner.lock().unwrap_or_else(|e| e.into_inner())
+    }
+}
+
+impl RingInner {
+    fn write(&mut self, bytes: &[u8]) {
+        let capacity = self.buf.len();
+        let tail = (self.head + self.len) % capacity;
+
+        let first = bytes.len().min(capacity - tail);
+        self.buf[tail..tail + first].copy_from_slice(&bytes[..first]);
+        self.buf[..bytes.len() - first].copy_from_slice(&bytes[first..]);
+
+        self.len += bytes.len();
+    }
+}
+
+fn run_writer(ring: &Ring, mut appender: Appender) {
+    let mut spare = ring.spare();
+    let mut records = Vec::new();
+    let mut line = String::new();
+
+    loop {
+        let open = ring.drain(&mut spare, &mut records, FLUSH_INTERVAL);
+
+        let mut batch = records.as_slice();
+        while let Some(record) = take_u32(&mut batch).and_then(|len| take(&mut batch, len as usize))
+        {
+            line.clear();
+            if format_record(record, &mut line).is_some() {
+                let _ = appender.write(line.as_bytes());
+            }
+        }
+        records.clear();
+
+        let dropped = ring.take_dropped();
+        if dropped > 0 {
+            let _ = appender.write(
+                format!(
+                    "{dropped} log events were dropped because the file logger couldn't keep up\n"
+                )
+                .as_bytes(),
+            );
+        }
+
+        let _ = appender.flush();
+
+        if !open {
+            break;
+        }
+    }
 }
 
 #[derive(Debug)]
 struct Appender {
     directory: PathBuf,
-    file_extension: &'static str,
     // Leaving this so that I/O errors come up through `write` instead of panicking
     // in `layer`
-    current: Option<(fs::File, String)>,
+    current: Option<CurrentFile>,
+}
+
+#[derive(Debug)]
+struct CurrentFile {
+    writer: io::BufWriter<fs::File>,
+    path: PathBuf,
+    size: u64,
 }
 
 impl Appender {
-    fn with_current_file<R>(
-        &mut self,
-        cb: impl Fn(&mut fs::File) -> io::Result<R>,
-    ) -> io::Result<R> {
-        match self.current.as_mut() {
-            None => {
-                let (mut file, name) = self.create_new_writer()?;
+    fn write(&mut self, buf: &[u8]) -> io::Result<()> {
+        let current = match self.current.as_mut() {
+            Some(current) => current,
+            None => self.current.insert(self.create_new_writer()?),
+        };
 
-                let ret = cb(&mut file);
+        current.writer.write_all(buf)?;
+        current.size += buf.len() as u64;
 
-                self.current = Some((file, name));
+        if current.size >= MAX_FILE_SIZE {
+            self.rotate()?;
+        }
 
-                ret
-            }
-            Some((file, _)) => cb(file),
+        Ok(())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        match self.current.as_mut() {
+            Some(current) => current.writer.flush(),
+            None => Ok(()),
         }
     }
 
+    /// Closes the current file and compresses it.
+    ///
+    /// The next write starts a new file.
+    fn rotate(&mut self) -> io::Result<()> {
+        let Some(CurrentFile { writer, path, .. }) = self.current.take() else {
+            return Ok(());
+        };
+        drop(writer.into_inner().map_err(|e| e.into_error())?);
+
+        let mut gz_path = path.clone().into_os_string();
+        gz_path.push(".gz");
+
+        // If we rotate twice within a second, both files have the same name.
+        // Appending is fine: a gzip file may consist of several members, which are decompressed back-to-back.
+        let gz_file = fs::OpenOptions::new()
+            .append(true)
+            .create(true)
+            .open(&gz_path)?;
+        Self::set_permissions(&gz_file)?;
+
+        let mut encoder = GzEncoder::new(gz_file, Compression::default());
+        io::copy(&mut fs::File::open(&path)?, &mut encoder)?;
+        encoder.finish()?;
+
+        fs::remove_file(path)
+    }
+
     // Inspired from `tracing-appender/src/rolling.rs`.
-    fn create_new_writer(&self) -> io::Result<(fs::File, String)> {
+    fn create_new_writer(&self) -> io::Result<CurrentFile> {
         let format =
             time::format_description::parse("[year]-[month]-[day]-[hour]-[minute]-[second]")
                 .expect("static format description to be valid");
@@ -112,26 +632,26 @@ impl Appender {
             .format(&format)
             .expect("static format description to be valid");
 
-        let filename = format!("{LOG_FILE_BASE_NAME}.{date}.{}", self.file_extension);
+        let filename = format!("{LOG_FILE_BASE_NAME}.{date}.{LOG_FILE_EXTENSION}");
 
-        let path = self.directory.join(&filename);
+        let path = self.directory.join(filename);
         let mut open_options = fs::OpenOptions::new();
         open_options.append(true).create(true);
 
-        let new_file = open_options.open(path.as_path());
-        if new_file.is_err() {
-            if let Some(parent) = path.parent() {
-                fs::create_dir_all(parent)?;
-                let file = open_options.open(path)?;
-
-                return Ok((file, filename));
+        let file = match open_options.open(path.as_path()) {
+            Ok(file) => file,
+            Err(_) => {
+                fs::create_dir_all(&self.directory)?;
+                open_options.open(path.as_path())?
             }
-        }
-
-        let file = new_file?;
+        };
         Self::set_permissions(&file)?;
 
-        Ok((file, filename))
+        Ok(CurrentFile {
+            size: file.metadata()?.len(),
+            writer: io::BufWriter::with_capacity(64 * 1024, file),
+            path,
+        })
     }
 
     /// Make the logs group-readable so that the GUI, running as a user in the `firezone`
@@ -154,12 +674,103 @@ impl Appender {
     }
 }
 
-impl io::Write for Appender {
-    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
-        self.with_current_file(|f| f.write(buf))
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::io::Read as _;
+    use tracing_subscriber::layer::SubscriberExt as _;
+
+    #[test]
+    fn ring_wraps_around() {
+        let ring = Ring::new(16);
+        let mut spare = ring.spare();
+        let mut out = Vec::new();
+
+        ring.push(b"abcdef");
+        ring.drain(&mut spare, &mut out, Duration::ZERO);
+        ring.push(b"ghijkl");
+        ring.drain(&mut spare, &mut out, Duration::ZERO);
+
+        assert_eq!(out, b"\x06\0\0\0abcdef\x06\0\0\0ghijkl");
     }
 
-    fn flush(&mut self) -> io::Result<()> {
-        self.with_current_file(|f| f.flush())
+    #[test]
+    fn drained_buffer_is_reused_by_producers() {
+        let ring = Ring::new(16);
+        let mut spare = ring.spare();
+        let mut out = Vec::new();
+
+        ring.push(b"abcdef");
+        ring.drain(&mut spare, &mut out, Duration::ZERO);
+        ring.push(b"ghijkl");
+        ring.drain(&mut spare, &mut out, Duration::ZERO);
+        ring.push(b"mnopqr");
+        ring.drain(&mut spare, &mut out, Duration::ZERO);
+
+        assert_eq!(out, b"\x06\0\0\0abcdef\x06\0\0\0ghijkl\x06\0\0\0mnopqr");
+        assert_eq!(ring.take_dropped(), 0);
+    }
+
+    #[test]
+    fn full_ring_drops_records() {
+        let ring = Ring::new(16);
+
+        ring.push(b"abcdef");
+        ring.push(b"ghijkl");
+
+        assert_eq!(ring.take_dropped(), 1);
+        assert_eq!(ring.take_dropped(), 0);
+    }
+
+    #[test]
+    fn events_are_formatted_as_lines() {
+        let dir = tempfile::tempdir().unwrap();
+
+        let (layer, handle) = layer(dir.path());
+        tracing::subscriber::with_default(tracing_subscriber::registry().with(layer), || {
+            let span = tracing::info_span!("session", id = 7);
+            let _guard = span.enter();
+
+            tracing::info!(count = 3u64, name = "foo", ok = true, "Hello {}", "world");
+        });
+        drop(handle);
+
+        let contents = fs::read_to_string(single_file(dir.path())).unwrap();
+        let (_, line) = contents.split_once(' ').unwrap();
+
+        assert_eq!(
+            line,
+            " INFO session{id=7}: connlib_client_shared::file_logger::tests: Hello world count=3 name=\"foo\" ok=true\n"
+        );
+    }
+
+    #[test]
+    fn full_files_are_rotated_and_compressed() {
+        let dir = tempfile::tempdir().unwrap();
+        let mut appender = Appender {
+            directory: dir.path().to_path_buf(),
+            current: None,
+        };
+        let line = vec![b'a'; 1024];
+
+        for _ in 0..MAX_FILE_SIZE / 1024 {
+            appender.write(&line).unwrap();
+        }
+
+        let mut decompressed = Vec::new();
+        flate2::read::MultiGzDecoder::new(fs::File::open(single_file(dir.path())).unwrap())
+            .read_to_end(&mut decompressed)
+            .unwrap();
+        assert_eq!(decompressed.len() as u64, MAX_FILE_SIZE);
+    }
+
+    fn single_file(dir: &Path) -> PathBuf {
+        let mut entries = fs::read_dir(dir)
+            .unwrap()
+            .map(|e| e.unwrap().path())
+            .collect::<Vec<_>>();
+        assert_eq!(entries.len(), 1);
+
+        entries.pop().unwrap()
     }
 }
@@ -4,7 +4,6 @@ pub use connlib_shared::{
     callbacks, keypair, Callbacks, Cidrv4, Cidrv6, Error, LoginUrl, LoginUrlError, StaticSecret,
 };
 pub use firezone_tunnel::Sockets;
-pub use tracing_appender::non_blocking::WorkerGuard;
 
 use backoff::ExponentialBackoffBuilder;
 use connlib_shared::get_user_agent;
@@ -12,25 +11,35 @@ use firezone_tunnel::ClientTunnel;
 use phoenix_channel::PhoenixChannel;
 use std::collections::HashMap;
 use std::net::IpAddr;
+use std::sync::Arc;
 use std::time::Duration;
 use tokio::sync::mpsc::UnboundedReceiver;
 
+mod callback_scheduler;
 mod eventloop;
 pub mod file_logger;
 mod messages;
+pub mod resource_delta;
+pub mod stats_block;
 
 const PHOENIX_TOPIC: &str = "client";
 
 use eventloop::Command;
 pub use eventloop::Eventloop;
 use secrecy::Secret;
+use stats_block::StatsBlock;
 use tokio::task::JoinHandle;
 
+/// How many resources and gateways fit into a session's [`StatsBlock`].
+const STATS_RESOURCE_CAPACITY: usize = 1024;
+const STATS_GATEWAY_CAPACITY: usize = 256;
+
 /// A session is the entry-point for connlib, maintains the runtime and the tunnel.
 ///
 /// A session is created using [Session::connect], then to stop a session we use [Session::disconnect].
 pub struct Session {
     channel: tokio::sync::mpsc::UnboundedSender<Command>,
+    stats: Arc<StatsBlock>,
 }
 
 /// Arguments for `connect`, since Clippy said 8 args is too many
@@ -54,11 +63,23 @@ impl Session {
     ) -> Self {
         let (tx, rx) = tokio::sync::mpsc::unbounded_channel();
 
+        let stats = Arc::new(StatsBlock::new(
+            STATS_RESOURCE_CAPACITY,
+            STATS_GATEWAY_CAPACITY,
+        ));
+
         let callbacks = args.callbacks.clone();
-        let connect_handle = handle.spawn(connect(args, rx));
+        let connect_handle = handle.spawn(connect(args, rx, stats.clone()));
         handle.spawn(connect_supervisor(connect_handle, callbacks));
 
-        Self { channel: tx }
+        Self { channel: tx, stats }
+    }
+
+    /// The statistics of this [`Session`], updated once per second.
+    ///
+    /// The block stays valid for as long as the [`Session`] lives, even across reconnects.
+    pub fn stats(&self) -> &StatsBlock {
+        &self.stats
     }
 
     /// Attempts to reconnect a [`Session`].
@@ -106,7 +127,11 @@ impl Session {
 /// Connects to the portal and starts a tunnel.
 ///
 /// When this function exits, the tunnel failed unrecoverably and you need to call it again.
-async fn connect<CB>(args: ConnectArgs<CB>, rx: UnboundedReceiver<Command>) -> Result<(), Error>
+async fn connect<CB>(
+    args: ConnectArgs<CB>,
+    rx: UnboundedReceiver<Command>,
+    stats: Arc<StatsBlock>,
+) -> Result<(), Error>
 where
     CB: Callbacks + 'static,
 {
@@ -146,7 +171,7 @@ where
             .build(),
     );
 
-    let mut eventloop = Eventloop::new(tunnel, portal, rx);
+    let mut eventloop = Eventloop::new(tunnel, portal, rx, stats);
 
     std::future::poll_fn(|cx| eventloop.poll(cx))
         .await
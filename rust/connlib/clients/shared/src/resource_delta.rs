@@ -0,0 +1,521 @@
+//! Incremental updates of the resource list for the FFI clients.
+//!
+//! [`Callbacks::on_update_resources`](crate::Callbacks::on_update_resources) hands over the entire resource list, even if only the status of a single resource flipped.
+//! [`ResourceDeltas`] remembers what the client last saw and computes a [`Delta`] of added, changed and removed resources instead.
+//! Each delta carries a sequence number so the receiving side can detect a missed update and ask for a full list.
+//! The Android and Apple bridges and the IPC service hand these deltas to the host apps and the GUI.
+//!
+//! [`Delta::encode`] writes a compact, length-prefixed binary encoding that [`DeltaReader`] reads without copying any strings.
+//! All integers are little-endian.
+//!
+//! ```text
+//! delta    = seq:u64 num_upserted:u32 num_removed:u32 (len:u32 resource){num_upserted} id{num_removed}
+//! resource = kind:u8 id status:u8 address name:str description:opt-str num_sites:u16 (id name:str){num_sites}
+//! address  = str                          ; kind 0, DNS
+//!          | family:u8 (u8{4} | u8{16}) prefix:u8 ; kind 1, CIDR, family is 4 or 6
+//! id       = u8{16}
+//! str      = len:u32 u8{len}               ; UTF-8
+//! opt-str  = 0 | 1 str
+//! ```
+
+use connlib_shared::callbacks::{
+    ResourceDescription, ResourceDescriptionCidr, ResourceDescriptionDns, Status,
+};
+use connlib_shared::messages::client::{Site, SiteId};
+use connlib_shared::messages::ResourceId;
+use ip_network::{IpNetwork, Ipv4Network, Ipv6Network};
+use std::collections::HashMap;
+use std::fmt;
+use std::net::{Ipv4Addr, Ipv6Addr};
+
+const KIND_DNS: u8 = 0;
+const KIND_CIDR: u8 = 1;
+
+/// Tracks the resource list the client last saw.
+#[derive(Debug, Default)]
+pub struct ResourceDeltas {
+    seq: u64,
+    known: HashMap<ResourceId, ResourceDescription>,
+    /// Whether [`ResourceDeltas::update_or_initial`] handed out the initial list.
+    sent_initial: bool,
+}
+
+/// The difference between two resource lists.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct Delta {
+    /// Incremented for every delta, starting at 1.
+    pub seq: u64,
+    /// Resources that are new or changed in any way, including their status.
+    pub upserted: Vec<ResourceDescription>,
+    pub removed: Vec<ResourceId>,
+}
+
+impl ResourceDeltas {
+    /// Computes what changed since the last call, if anything.
+    ///
+    /// The first call yields all resources as upserted.
+    pub fn update(&mut self, resources: &[ResourceDescription]) -> Option<Delta> {
+        let mut upserted = Vec::new();
+        let mut current = HashMap::with_capacity(resources.len());
+
+        for resource in resources {
+            let id = resource.id();
+
+            match self.known.remove(&id) {
+                Some(known) if &known == resource => {
+                    current.insert(id, known);
+                }
+                _ => {
+                    upserted.push(resource.clone());
+                    current.insert(id, resource.clone());
+                }
+            }
+        }
+
+        // Everything left over wasn't in the new list.
+        let removed = std::mem::replace(&mut self.known, current)
+            .into_keys()
+            .collect::<Vec<_>>();
+
+        if upserted.is_empty() && removed.is_empty() {
+            return None;
+        }
+
+        self.seq += 1;
+
+        Some(Delta {
+            seq: self.seq,
+            upserted,
+            removed,
+        })
+    }
+
+    /// Like [`ResourceDeltas::update`], but the first call always yields a delta, even for an empty list.
+    ///
+    /// The receiving side waits for the initial list before it shows anything.
+    /// An initial empty list has sequence number 0.
+    pub fn update_or_initial(&mut self, resources: &[ResourceDescription]) -> Option<Delta> {
+        let delta = self.update(resources);
+        let is_initial = !std::mem::replace(&mut self.sent_initial, true);
+
+        match delta {
+            Some(delta) => Some(delta),
+            None if is_initial => Some(Delta {
+                seq: 0,
+                upserted: Vec::new(),
+                removed: Vec::new(),
+            }),
+            None => None,
+        }
+    }
+}
+
+impl Delta {
+    pub fn encode(&self, buf: &mut Vec<u8>) {
+        buf.extend_from_slice(&self.seq.to_le_bytes());
+        put_u32(buf, self.upserted.len());
+        put_u32(buf, self.removed.len());
+
+        for resource in &self.upserted {
+            let len_at = buf.len();
+            buf.extend_from_slice(&[0; 4]);
+
+            encode_resource(resource, buf);
+
+            let len = (buf.len() - len_at - 4) as u32;
+            buf[len_at..len_at + 4].copy_from_slice(&len.to_le_bytes());
+        }
+
+        for id in &self.removed {
+            buf.extend_from_slice(id.as_bytes());
+        }
+    }
+}
+
+fn encode_resource(resource: &ResourceDescription, buf: &mut Vec<u8>) {
+    match resource {
+        ResourceDescription::Dns(r) => {
+            buf.push(KIND_DNS);
+            buf.extend_from_slice(r.id.as_bytes());
+            buf.push(encode_status(r.status));
+            put_str(buf, &r.address);
+        }
+        ResourceDescription::Cidr(r) => {
+            buf.push(KIND_CIDR);
+            buf.extend_from_slice(r.id.as_bytes());
+            buf.push(encode_status(r.status));
+            match r.address {
+                IpNetwork::V4(n) => {
+                    buf.push(4);
+                    buf.extend_from_slice(&n.network_address().octets());
+                    buf.push(n.netmask());
+                }
+                IpNetwork::V6(n) => {
+                    buf.push(6);
+                    buf.extend_from_slice(&n.network_address().octets());
+                    buf.push(n.netmask());
+                }
+            }
+        }
+    }
+
+    put_str(buf, resource.name());
+    match resource.address_description() {
+        Some(description) => {
+            buf.push(1);
+            put_str(buf, description);
+        }
+        None => buf.push(0),
+    }
+
+    let sites = resource.sites();
+    buf.extend_from_slice(&(sites.len() as u16).to_le_bytes());
+    for site in sites {
+        buf.extend_from_slice(site.id.as_bytes());
+        put_str(buf, &site.name);
+    }
+}
+
+fn encode_status(status: Status) -> u8 {
+    match status {
+        Status::Unknown => 0,
+        Status::Online => 1,
+        Status::Offline => 2,
+    }
+}
+
+fn put_u32(buf: &mut Vec<u8>, n: usize) {
+    buf.extend_from_slice(&(n as u32).to_le_bytes());
+}
+
+fn put_str(buf: &mut Vec<u8>, s: &str) {
+    put_u32(buf, s.len());
+    buf.extend_from_slice(s.as_bytes());
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum DecodeError {
+    Truncated,
+    InvalidKind(u8),
+    InvalidStatus(u8),
+    InvalidAddress,
+    InvalidUtf8,
+}
+
+impl fmt::Display for DecodeError {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match self {
+            DecodeError::Truncated => write!(f, "Delta is truncated"),
+            DecodeError::InvalidKind(k) => write!(f, "Invalid resource kind {k}"),
+            DecodeError::InvalidStatus(s) => write!(f, "Invalid resource status {s}"),
+            DecodeError::InvalidAddress => write!(f, "Invalid CIDR address"),
+            DecodeError::InvalidUtf8 => write!(f, "String is not valid UTF-8"),
+        }
+    }
+}
+
+impl std::error::Error for DecodeError {}
+
+/// Reads an encoded [`Delta`] in place.
+#[derive(Debug, Clone, Copy)]
+pub struct DeltaReader<'a> {
+    seq: u64,
+    num_upserted: usize,
+    upserted: &'a [u8],
+    removed: &'a [u8],
+}
+
+/// A resource borrowed from an encoded [`Delta`].
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct ResourceView<'a> {
+    pub id: ResourceId,
+    pub status: Status,
+    pub address: AddressView<'a>,
+    pub name: &'a str,
+    pub address_description: Option<&'a str>,
+    pub sites: Vec<(SiteId, &'a str)>,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum AddressView<'a> {
+    Dns(&'a str),
+    Cidr(IpNetwork),
+}
+
+impl<'a> DeltaReader<'a> {
+    /// Validates the framing of `buf`, the resources themselves are only decoded when iterated.
+    pub fn new(buf: &'a [u8]) -> Result<Self, DecodeError> {
+        let mut cursor = Cursor(buf);
+
+        let seq = u64::from_le_bytes(cursor.array()?);
+        let num_upserted = cursor.u32()? as usize;
+        let num_removed = cursor.u32()? as usize;
+
+        let upserted_start = cursor.0;
+        for _ in 0..num_upserted {
+            let len = cursor.u32()? as usize;
+            cursor.take(len)?;
+        }
+        let upserted = &upserted_start[..upserted_start.len() - cursor.0.len()];
+
+        let removed = cursor.take(num_removed.checked_mul(16).ok_or(DecodeError::Truncated)?)?;
+
+        Ok(Self {
+            seq,
+            num_upserted,
+            upserted,
+            removed,
+        })
+    }
+
+    pub fn seq(&self) -> u64 {
+        self.seq
+    }
+
+    pub fn num_upserted(&self) -> usize {
+        self.num_upserted
+    }
+
+    pub fn upserted(&self) -> impl Iterator<Item = Result<ResourceView<'a>, DecodeError>> + 'a {
+        let mut cursor = Cursor(self.upserted);
+
+        (0..self.num_upserted).map(move |_| {
+            let len = cursor.u32()? as usize;
+
+            decode_resource(Cursor(cursor.take(len)?))
+        })
+    }
+
+    pub fn removed(&self) -> impl Iterator<Item = ResourceId> + 'a {
+        self.removed
+            .chunks_exact(16)
+            .map(|id| ResourceId::from_bytes(id.try_into().expect("chunks are 16 bytes")))
+    }
+}
+
+impl ResourceView<'_> {
+    pub fn to_owned(&self) -> ResourceDescription {
+        let sites = self
+            .sites
+            .iter()
+            .map(|(id, name)| Site {
+                id: *id,
+                name: name.to_string(),
+            })
+            .collect();
+
+        match self.address {
+            AddressView::Dns(address) => ResourceDescription::Dns(ResourceDescriptionDns {
+                id: self.id,
+                address: address.to_owned(),
+                name: self.name.to_owned(),
+                address_description: self.address_description.map(ToOwned::to_owned),
+                sites,
+                status: self.status,
+            }),
+            AddressView::Cidr(address) => ResourceDescription::Cidr(ResourceDescriptionCidr {
+                id: self.id,
+                address,
+                name: self.name.to_owned(),
+                address_description: self.address_description.map(ToOwned::to_owned),
+                sites,
+                status: self.status,
+            }),
+        }
+    }
+}
+
+fn decode_resource(mut cursor: Cursor<'_>) -> Result<ResourceView<'_>, DecodeError> {
+    let kind = cursor.u8()?;
+    let id = ResourceId::from_bytes(cursor.array()?);
+    let status = match cursor.u8()? {
+        0 => Status::Unknown,
+        1 => Status::Online,
+        2 => Status::Offline,
+        other => return Err(DecodeError::InvalidStatus(other)),
+    };
+    let address = match kind {
+        KIND_DNS => AddressView::Dns(cursor.str()?),
+        KIND_CIDR => {
+            let network = match cursor.u8()? {
+                4 => Ipv4Network::new(Ipv4Addr::from(cursor.array::<4>()?), cursor.u8()?)
+                    .map(IpNetwork::V4),
+                6 => Ipv6Network::new(Ipv6Addr::from(cursor.array::<16>()?), cursor.u8()?)
+                    .map(IpNetwork::V6),
+                _ => return Err(DecodeError::InvalidAddress),
+            };
+
+            AddressView::Cidr(network.map_err(|_| DecodeError::InvalidAddress)?)
+        }
+        other => return Err(DecodeError::InvalidKind(other)),
+    };
+    let name = cursor.str()?;
+    let address_description = match cursor.u8()? {
+        0 => None,
+        _ => Some(cursor.str()?),
+    };
+
+    let num_sites = u16::from_le_bytes(cursor.array()?);
+    let sites = (0..num_sites)
+        .map(|_| Ok((SiteId::from_bytes(cursor.array()?), cursor.str()?)))
+        .collect::<Result<Vec<_>, DecodeError>>()?;
+
+    Ok(ResourceView {
+        id,
+        status,
+        address,
+        name,
+        address_description,
+        sites,
+    })
+}
+
+struct Cursor<'a>(&'a [u8]);
+
+impl<'a> Cursor<'a> {
+    fn take(&mut self, n: usize) -> Result<&'a [u8], DecodeError> {
+        if self.0.len() < n {
+            return Err(DecodeError::Truncated);
+        }
+
+        let (head, tail) = self.0.split_at(n);
+        self.0 = tail;
+
+        Ok(head)
+    }
+
+    fn array<const N: usize>(&mut self) -> Result<[u8; N], DecodeError> {
+        Ok(self.take(N)?.try_into().expect("took N bytes"))
+    }
+
+    fn u8(&mut self) -> Result<u8, DecodeError> {
+        Ok(self.take(1)?[0])
+    }
+
+    fn u32(&mut self) -> Result<u32, DecodeError> {
+        Ok(u32::from_le_bytes(self.array()?))
+    }
+
+    fn str(&mut self) -> Result<&'a str, DecodeError> {
+        let len = self.u32()? as usize;
+
+        std::str::from_utf8(self.take(len)?).map_err(|_| DecodeError::InvalidUtf8)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn first_update_contains_everything() {
+        let mut deltas = ResourceDeltas::default();
+
+        let delta = deltas.update(&[dns(1, Status::Unknown), cidr(2)]).unwrap();
+
+        assert_eq!(delta.seq, 1);
+        assert_eq!(delta.upserted.len(), 2);
+        assert!(delta.removed.is_empty());
+    }
+
+    #[test]
+    fn unchanged_list_yields_no_delta() {
+        let mut deltas = ResourceDeltas::default();
+        deltas.update(&[dns(1, Status::Unknown), cidr(2)]);
+
+        assert_eq!(deltas.update(&[cidr(2), dns(1, Status::Unknown)]), None);
+    }
+
+    #[test]
+    fn initial_empty_list_yields_empty_delta_once() {
+        let mut deltas = ResourceDeltas::default();
+
+        let delta = deltas.update_or_initial(&[]).unwrap();
+
+        assert_eq!(delta.seq, 0);
+        assert!(delta.upserted.is_empty());
+        assert_eq!(deltas.update_or_initial(&[]), None);
+        assert_eq!(deltas.update_or_initial(&[cidr(1)]).unwrap().seq, 1);
+    }
+
+    #[test]
+    fn status_flip_only_contains_changed_resource() {
+        let mut deltas = ResourceDeltas::default();
+        deltas.update(&[dns(1, Status::Unknown), cidr(2), cidr(3)]);
+
+        let delta = deltas.update(&[dns(1, Status::Online), cidr(2)]).unwrap();
+
+        assert_eq!(delta.seq, 2);
+        assert_eq!(delta.upserted, vec![dns(1, Status::Online)]);
+        assert_eq!(delta.removed, vec![id(3)]);
+    }
+
+    #[test]
+    fn encoded_delta_roundtrips() {
+        let delta = Delta {
+            seq: 42,
+            upserted: vec![dns(1, Status::Offline), cidr(2)],
+            removed: vec![id(3), id(4)],
+        };
+
+        let mut buf = Vec::new();
+        delta.encode(&mut buf);
+        let reader = DeltaReader::new(&buf).unwrap();
+
+        assert_eq!(reader.seq(), 42);
+        assert_eq!(
+            reader
+                .upserted()
+                .map(|r| r.unwrap().to_owned())
+                .collect::<Vec<_>>(),
+            delta.upserted
+        );
+        assert_eq!(reader.removed().collect::<Vec<_>>(), delta.removed);
+    }
+
+    #[test]
+    fn truncated_delta_is_rejected() {
+        let delta = Delta {
+            seq: 1,
+            upserted: vec![cidr(1)],
+            removed: vec![id(2)],
+        };
+
+        let mut buf = Vec::new();
+        delta.encode(&mut buf);
+
+        assert_eq!(
+            DeltaReader::new(&buf[..buf.len() - 1]).unwrap_err(),
+            DecodeError::Truncated
+        );
+    }
+
+    fn id(n: u8) -> ResourceId {
+        ResourceId::from_bytes([n; 16])
+    }
+
+    fn dns(n: u8, status: Status) -> ResourceDescription {
+        ResourceDescription::Dns(ResourceDescriptionDns {
+            id: id(n),
+            address: "*.example.com".to_owned(),
+            name: "Example".to_owned(),
+            address_description: Some("https://example.com".to_owned()),
+            sites: vec![Site {
+                id: SiteId::from_bytes([n; 16]),
+                name: "Site".to_owned(),
+            }],
+            status,
+        })
+    }
+
+    fn cidr(n: u8) -> ResourceDescription {
+        ResourceDescription::Cidr(ResourceDescriptionCidr {
+            id: id(n),
+            address: "fd00::/64".parse().unwrap(),
+            name: "Network".to_owned(),
+            address_description: None,
+            sites: vec![],
+            status: Status::Online,
+        })
+    }
+}
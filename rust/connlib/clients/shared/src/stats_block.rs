@@ -0,0 +1,446 @@
+//! A fixed-size block of statistics that host apps can read without calling into the event loop.
+//!
+//! The [`Eventloop`](crate::Eventloop) writes a snapshot of [`ClientStats`] and of how many resource updates it delivered into the block once per second.
+//! Readers either copy it via [`StatsBlock::read`] / [`StatsBlock::copy_to`] or map it directly via [`StatsBlock::as_ptr`].
+//!
+//! The block is an array of native-endian `u64` words laid out as a [`StatsHeader`], followed by `resource_capacity` [`ResourceEntry`]s and `gateway_capacity` [`GatewayEntry`]s.
+//! It is protected by a seqlock: the first word of the header is a sequence number that is odd whilst a write is in progress.
+//! To read consistently from C:
+//!
+//! 1. Load `seq` with acquire ordering, retry if it is odd.
+//! 2. Copy the block.
+//! 3. Issue an acquire fence and load `seq` again, retry if it changed.
+//!
+//! Writing never blocks and never allocates, readers retry at most once per write.
+
+use crate::callback_scheduler;
+use connlib_shared::messages::{GatewayId, ResourceId};
+use firezone_tunnel::{ClientStats, PathType};
+use std::mem::size_of;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+
+/// Bumped whenever the layout changes.
+pub const LAYOUT_VERSION: u64 = 2;
+
+/// Marks an unknown round-trip time in [`GatewayEntry::rtt_micros`].
+pub const RTT_UNKNOWN: u64 = u64::MAX;
+
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct StatsHeader {
+    pub seq: u64,
+    pub version: u64,
+    pub resource_capacity: u64,
+    pub gateway_capacity: u64,
+    /// How many of the [`ResourceEntry`]s are valid.
+    pub num_resources: u64,
+    /// How many of the [`GatewayEntry`]s are valid.
+    pub num_gateways: u64,
+    pub encapsulate_drops: u64,
+    pub decapsulate_drops: u64,
+    /// Resource lists handed to the host app.
+    pub resource_updates_delivered: u64,
+    /// Resource lists replaced by a newer one before we handed them over.
+    pub resource_updates_coalesced: u64,
+    /// Resource lists dropped because they were identical to the last one handed over.
+    pub resource_updates_deduplicated: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct ResourceEntry {
+    pub id: [u8; 16],
+    pub packets_sent: u64,
+    pub bytes_sent: u64,
+    pub packets_received: u64,
+    pub bytes_received: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct GatewayEntry {
+    pub id: [u8; 16],
+    /// The smoothed round-trip time or [`RTT_UNKNOWN`].
+    pub rtt_micros: u64,
+    /// Packet loss in parts per million.
+    pub loss_ppm: u64,
+    /// 0 = no path yet, 1 = direct, 2 = relayed.
+    pub path: u64,
+}
+
+const HEADER_WORDS: usize = size_of::<StatsHeader>() / 8;
+const RESOURCE_WORDS: usize = size_of::<ResourceEntry>() / 8;
+const GATEWAY_WORDS: usize = size_of::<GatewayEntry>() / 8;
+
+const _: () = assert!(size_of::<StatsHeader>() % 8 == 0);
+const _: () = assert!(size_of::<ResourceEntry>() % 8 == 0);
+const _: () = assert!(size_of::<GatewayEntry>() % 8 == 0);
+
+/// A consistent copy of a [`StatsBlock`].
+#[derive(Debug, Default, Clone, PartialEq, Eq)]
+pub struct Snapshot {
+    pub header: StatsHeader,
+    pub resources: Vec<ResourceEntry>,
+    pub gateways: Vec<GatewayEntry>,
+}
+
+pub struct StatsBlock {
+    words: Box<[AtomicU64]>,
+    resource_capacity: usize,
+    gateway_capacity: usize,
+}
+
+impl StatsBlock {
+    pub fn new(resource_capacity: usize, gateway_capacity: usize) -> Self {
+        let len =
+            HEADER_WORDS + resource_capacity * RESOURCE_WORDS + gateway_capacity * GATEWAY_WORDS;
+
+        let block = Self {
+            words: (0..len).map(|_| AtomicU64::new(0)).collect(),
+            resource_capacity,
+            gateway_capacity,
+        };
+        block.words[1].store(LAYOUT_VERSION, Ordering::Relaxed);
+        block.words[2].store(resource_capacity as u64, Ordering::Relaxed);
+        block.words[3].store(gateway_capacity as u64, Ordering::Relaxed);
+
+        block
+    }
+
+    /// The start of the block, for hosts that want to map it.
+    ///
+    /// Valid for as long as `self` is alive, see the module docs on how to read it.
+    pub fn as_ptr(&self) -> *const u8 {
+        self.words.as_ptr().cast()
+    }
+
+    /// The size of the block in bytes.
+    pub fn size(&self) -> usize {
+        self.words.len() * 8
+    }
+
+    /// Copies the raw block into `buf`, in the layout described in the module docs.
+    pub fn copy_to(&self, buf: &mut Vec<u8>) {
+        let words = self.read_words();
+
+        buf.clear();
+        buf.reserve(words.len() * 8);
+        for word in words {
+            buf.extend_from_slice(&word.to_ne_bytes());
+        }
+    }
+
+    pub fn read(&self) -> Snapshot {
+        let words = self.read_words();
+
+        let header = StatsHeader {
+            seq: words[0],
+            version: words[1],
+            resource_capacity: words[2],
+            gateway_capacity: words[3],
+            num_resources: words[4],
+            num_gateways: words[5],
+            encapsulate_drops: words[6],
+            decapsulate_drops: words[7],
+            resource_updates_delivered: words[8],
+            resource_updates_coalesced: words[9],
+            resource_updates_deduplicated: words[10],
+        };
+
+        let resources = words[self.resources_offset()..]
+            .chunks_exact(RESOURCE_WORDS)
+            .take(header.num_resources as usize)
+            .map(|w| ResourceEntry {
+                id: id_from_words(w[0], w[1]),
+                packets_sent: w[2],
+                bytes_sent: w[3],
+                packets_received: w[4],
+                bytes_received: w[5],
+            })
+            .collect();
+        let gateways = words[self.gateways_offset()..]
+            .chunks_exact(GATEWAY_WORDS)
+            .take(header.num_gateways as usize)
+            .map(|w| GatewayEntry {
+                id: id_from_words(w[0], w[1]),
+                rtt_micros: w[2],
+                loss_ppm: w[3],
+                path: w[4],
+            })
+            .collect();
+
+        Snapshot {
+            header,
+            resources,
+            gateways,
+        }
+    }
+
+    /// Writes a new snapshot.
+    ///
+    /// There must only ever be a single writer, which is why this is only accessible from within connlib.
+    /// Resources and gateways beyond the capacity of the block are skipped.
+    pub(crate) fn write(&self, stats: &ClientStats, resource_updates: callback_scheduler::Stats) {
+        let seq = self.words[0].load(Ordering::Relaxed);
+        self.words[0].store(seq.wrapping_add(1), Ordering::Relaxed);
+        fence(Ordering::Release);
+
+        let num_resources = stats.resources.len().min(self.resource_capacity);
+        let num_gateways = stats.gateways.len().min(self.gateway_capacity);
+
+        self.store(4, num_resources as u64);
+        self.store(5, num_gateways as u64);
+        self.store(6, stats.encapsulate_drops);
+        self.store(7, stats.decapsulate_drops);
+        self.store(8, resource_updates.delivered);
+        self.store(9, resource_updates.coalesced);
+        self.store(10, resource_updates.deduplicated);
+
+        for (i, (id, traffic)) in stats.resources.iter().take(num_resources).enumerate() {
+            let at = self.resources_offset() + i * RESOURCE_WORDS;
+            let (id_lo, id_hi) = resource_id_words(id);
+
+            self.store(at, id_lo);
+            self.store(at + 1, id_hi);
+            self.store(at + 2, traffic.packets_sent);
+            self.store(at + 3, traffic.bytes_sent);
+            self.store(at + 4, traffic.packets_received);
+            self.store(at + 5, traffic.bytes_received);
+        }
+
+        for (i, (id, connection)) in stats.gateways.iter().take(num_gateways).enumerate() {
+            let at = self.gateways_offset() + i * GATEWAY_WORDS;
+            let (id_lo, id_hi) = gateway_id_words(id);
+
+            self.store(at, id_lo);
+            self.store(at + 1, id_hi);
+            self.store(
+                at + 2,
+                connection
+                    .rtt
+                    .map_or(RTT_UNKNOWN, |rtt| rtt.as_micros() as u64),
+            );
+            self.store(at + 3, (connection.loss * 1_000_000.0) as u64);
+            self.store(
+                at + 4,
+                match connection.path {
+                    PathType::None => 0,
+                    PathType::Direct => 1,
+                    PathType::Relayed => 2,
+                },
+            );
+        }
+
+        self.words[0].store(seq.wrapping_add(2), Ordering::Release);
+    }
+
+    fn read_words(&self) -> Vec<u64> {
+        let mut words = vec![0; self.words.len()];
+
+        loop {
+            let before = self.words[0].load(Ordering::Acquire);
+            if before % 2 == 1 {
+                std::hint::spin_loop();
+                continue;
+            }
+
+            for (dst, src) in words.iter_mut().zip(self.words.iter()).skip(1) {
+                *dst = src.load(Ordering::Relaxed);
+            }
+
+            fence(Ordering::Acquire);
+            if self.words[0].load(Ordering::Relaxed) == before {
+                words[0] = before;
+                return words;
+            }
+        }
+    }
+
+    fn store(&self, index: usize, value: u64) {
+        self.words[index].store(value, Ordering::Relaxed);
+    }
+
+    fn resources_offset(&self) -> usize {
+        HEADER_WORDS
+    }
+
+    fn gateways_offset(&self) -> usize {
+        HEADER_WORDS + self.resource_capacity * RESOURCE_WORDS
+    }
+}
+
+fn resource_id_words(id: &ResourceId) -> (u64, u64) {
+    id_words(id.as_bytes())
+}
+
+fn gateway_id_words(id: &GatewayId) -> (u64, u64) {
+    id_words(id.as_bytes())
+}
+
+/// Splits an ID into two words such that their native-endian memory representation is the ID's bytes.
+fn id_words(bytes: &[u8; 16]) -> (u64, u64) {
+    let (lo, hi) = bytes.split_at(8);
+
+    (
+        u64::from_ne_bytes(lo.try_into().expect("8 bytes")),
+        u64::from_ne_bytes(hi.try_into().expect("8 bytes")),
+    )
+}
+
+fn id_from_words(lo: u64, hi: u64) -> [u8; 16] {
+    let mut id = [0; 16];
+    id[..8].copy_from_slice(&lo.to_ne_bytes());
+    id[8..].copy_from_slice(&hi.to_ne_bytes());
+
+    id
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use firezone_tunnel::{GatewayConnection, ResourceTraffic};
+    use std::time::Duration;
+
+    #[test]
+    fn roundtrips_stats() {
+        let block = StatsBlock::new(4, 4);
+        let resource = ResourceId::random();
+
+        block.write(
+            &ClientStats {
+                resources: vec![(
+                    resource,
+                    ResourceTraffic {
+                        packets_sent: 1,
+                        bytes_sent: 100,
+                        packets_received: 2,
+                        bytes_received: 200,
+                    },
+                )],
+                gateways: vec![],
+                encapsulate_drops: 3,
+                decapsulate_drops: 4,
+            },
+            callback_scheduler::Stats {
+                delivered: 5,
+                coalesced: 6,
+                deduplicated: 7,
+            },
+        );
+        let snapshot = block.read();
+
+        assert_eq!(snapshot.header.seq, 2);
+        assert_eq!(snapshot.header.version, LAYOUT_VERSION);
+        assert_eq!(snapshot.header.encapsulate_drops, 3);
+        assert_eq!(snapshot.header.resource_updates_delivered, 5);
+        assert_eq!(snapshot.header.resource_updates_coalesced, 6);
+        assert_eq!(snapshot.header.resource_updates_deduplicated, 7);
+        assert_eq!(
+            snapshot.resources,
+            vec![ResourceEntry {
+                id: *resource.as_bytes(),
+                packets_sent: 1,
+                bytes_sent: 100,
+                packets_received: 2,
+                bytes_received: 200,
+            }]
+        );
+        assert!(snapshot.gateways.is_empty());
+    }
+
+    #[test]
+    fn skips_resources_beyond_capacity() {
+        let block = StatsBlock::new(1, 0);
+
+        block.write(
+            &ClientStats {
+                resources: vec![
+                    (ResourceId::random(), ResourceTraffic::default()),
+                    (ResourceId::random(), ResourceTraffic::default()),
+                ],
+                ..Default::default()
+            },
+            Default::default(),
+        );
+
+        assert_eq!(block.read().resources.len(), 1);
+    }
+
+    #[test]
+    fn raw_copy_matches_c_layout() {
+        let block = StatsBlock::new(0, 1);
+        let gateway: GatewayId = "8ab4e0a0-8a4c-4f3f-9b1a-59c5fbd1e5e4".parse().unwrap();
+
+        block.write(
+            &ClientStats {
+                gateways: vec![(
+                    gateway,
+                    GatewayConnection {
+                        rtt: Some(Duration::from_millis(25)),
+                        loss: 0.5,
+                        path: PathType::Relayed,
+                    },
+                )],
+                ..Default::default()
+            },
+            Default::default(),
+        );
+
+        let mut buf = Vec::new();
+        block.copy_to(&mut buf);
+
+        assert_eq!(buf.len(), block.size());
+        assert_eq!(
+            buf.len(),
+            size_of::<StatsHeader>() + size_of::<GatewayEntry>()
+        );
+
+        let entry = &buf[size_of::<StatsHeader>()..];
+        assert_eq!(&entry[..16], gateway.as_bytes());
+        assert_eq!(
+            u64::from_ne_bytes(entry[16..24].try_into().unwrap()),
+            25_000
+        );
+        assert_eq!(
+            u64::from_ne_bytes(entry[24..32].try_into().unwrap()),
+            500_000
+        );
+        assert_eq!(u64::from_ne_bytes(entry[32..40].try_into().unwrap()), 2);
+    }
+
+    #[test]
+    fn concurrent_reads_are_consistent() {
+        let block = std::sync::Arc::new(StatsBlock::new(1, 0));
+        let resource = ResourceId::random();
+
+        let writer = std::thread::spawn({
+            let block = block.clone();
+
+            move || {
+                for n in 0..10_000 {
+                    block.write(
+                        &ClientStats {
+                            resources: vec![(
+                                resource,
+                                ResourceTraffic {
+                                    packets_sent: n,
+                                    bytes_sent: n * 100,
+                                    ..Default::default()
+                                },
+                            )],
+                            ..Default::default()
+                        },
+                        Default::default(),
+                    );
+                }
+            }
+        });
+
+        while !writer.is_finished() {
+            if let Some(entry) = block.read().resources.first() {
+                assert_eq!(entry.bytes_sent, entry.packets_sent * 100);
+            }
+        }
+        writer.join().unwrap();
+    }
+}
@@ -53,6 +53,9 @@ pub enum ConnlibError {
     /// Invalid destination for packet
     #[error("Invalid dest address")]
     InvalidDst,
+    /// The client exceeded its rate limit
+    #[error("rate limit exceeded")]
+    RateLimited,
     /// Exhausted nat table
     #[error("exhausted nat")]
     ExhaustedNat,
@@ -40,7 +40,8 @@ pub type DomainName = domain::base::Name<Vec<u8>>;
 /// <https://learn.microsoft.com/en-us/windows/configuration/find-the-application-user-model-id-of-an-installed-app>
 pub const BUNDLE_ID: &str = "dev.firezone.client";
 
-pub const DEFAULT_MTU: u32 = 1280;
+/// Must match `snownet::MAX_MTU`; connlib discovers the actual MTU of each connection and answers oversized packets with ICMP "packet too big".
+pub const DEFAULT_MTU: u32 = 1436;
 
 const LIB_NAME: &str = "connlib";
 
@@ -44,6 +44,14 @@ impl ResourceId {
         ResourceId(Uuid::new_v4())
     }
 
+    pub fn from_bytes(bytes: [u8; 16]) -> ResourceId {
+        ResourceId(Uuid::from_bytes(bytes))
+    }
+
+    pub fn as_bytes(&self) -> &[u8; 16] {
+        self.0.as_bytes()
+    }
+
     #[cfg(feature = "proptest")]
     pub(crate) fn from_u128(v: u128) -> Self {
         Self(Uuid::from_u128(v))
@@ -51,6 +59,10 @@ impl ResourceId {
 }
 
 impl GatewayId {
+    pub fn as_bytes(&self) -> &[u8; 16] {
+        self.0.as_bytes()
+    }
+
     #[cfg(feature = "proptest")]
     pub fn from_u128(v: u128) -> Self {
         Self(Uuid::from_u128(v))
@@ -88,6 +88,14 @@ impl FromStr for SiteId {
 }
 
 impl SiteId {
+    pub fn from_bytes(bytes: [u8; 16]) -> SiteId {
+        SiteId(Uuid::from_bytes(bytes))
+    }
+
+    pub fn as_bytes(&self) -> &[u8; 16] {
+        self.0.as_bytes()
+    }
+
     #[cfg(feature = "proptest")]
     pub fn from_u128(v: u128) -> Self {
         Self(Uuid::from_u128(v))
@@ -23,6 +23,8 @@ pub struct ResourceDescriptionDns {
     pub name: String,
 
     pub filters: Filters,
+    #[serde(default)]
+    pub rate_limit: Option<RateLimit>,
 }
 
 /// Description of a resource that maps to a CIDR.
@@ -38,6 +40,8 @@ pub struct ResourceDescriptionCidr {
     pub name: String,
 
     pub filters: Filters,
+    #[serde(default)]
+    pub rate_limit: Option<RateLimit>,
 }
 
 /// Description of a resource that maps to a DNS record which had its domain already resolved.
@@ -54,6 +58,7 @@ pub struct ResolvedResourceDescriptionDns {
     pub addresses: Vec<IpAddr>,
 
     pub filters: Filters,
+    pub rate_limit: Option<RateLimit>,
 }
 
 #[derive(Debug, Deserialize, Clone, PartialEq, Eq)]
@@ -71,6 +76,21 @@ pub enum Filter {
     Icmp,
 }
 
+/// The bandwidth a client may use, in each direction.
+#[derive(Debug, Deserialize, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct RateLimit {
+    pub bytes_per_second: u64,
+    /// How many bytes may be sent at once after a pause, defaults to one second's worth.
+    #[serde(default)]
+    pub burst_bytes: Option<u64>,
+}
+
+impl RateLimit {
+    pub fn burst(&self) -> u64 {
+        self.burst_bytes.unwrap_or(self.bytes_per_second)
+    }
+}
+
 #[derive(Debug, Deserialize, Clone, Copy, PartialEq, Eq, Hash)]
 pub struct PortRange {
     // TODO: we can use a custom deserializer
@@ -102,6 +122,7 @@ impl ResourceDescription<ResourceDescriptionDns> {
                 address,
                 name,
                 filters,
+                rate_limit,
             }) => ResourceDescription::Dns(ResolvedResourceDescriptionDns {
                 id,
                 domain: address,
@@ -109,6 +130,7 @@ impl ResourceDescription<ResourceDescriptionDns> {
                 addresses,
 
                 filters,
+                rate_limit,
             }),
             ResourceDescription::Cidr(c) => ResourceDescription::Cidr(c),
         }
@@ -129,6 +151,13 @@ impl ResourceDescription<ResourceDescriptionDns> {
             ResourceDescription::Cidr(r) => r.filters.clone(),
         }
     }
+
+    pub fn rate_limit(&self) -> Option<RateLimit> {
+        match self {
+            ResourceDescription::Dns(r) => r.rate_limit,
+            ResourceDescription::Cidr(r) => r.rate_limit,
+        }
+    }
 }
 
 impl ResourceDescription<ResolvedResourceDescriptionDns> {
@@ -152,6 +181,13 @@ impl ResourceDescription<ResolvedResourceDescriptionDns> {
             ResourceDescription::Cidr(r) => r.filters.clone(),
         }
     }
+
+    pub fn rate_limit(&self) -> Option<RateLimit> {
+        match self {
+            ResourceDescription::Dns(r) => r.rate_limit,
+            ResourceDescription::Cidr(r) => r.rate_limit,
+        }
+    }
 }
 
 #[cfg(test)]
@@ -219,4 +255,18 @@ mod tests {
 
         assert_eq!(expected_filter, actual_filter);
     }
+
+    #[test]
+    fn can_deserialize_rate_limit() {
+        let msg = r#"{ "bytes_per_second": 1000000 }"#;
+        let expected = RateLimit {
+            bytes_per_second: 1_000_000,
+            burst_bytes: None,
+        };
+
+        let actual: RateLimit = serde_json::from_str(msg).unwrap();
+
+        assert_eq!(expected, actual);
+        assert_eq!(actual.burst(), 1_000_000);
+    }
 }
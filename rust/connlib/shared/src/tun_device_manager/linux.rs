@@ -5,7 +5,7 @@ use crate::{
     DEFAULT_MTU,
 };
 use anyhow::{anyhow, Context as _, Result};
-use futures::TryStreamExt;
+use futures::{stream, StreamExt as _, TryStreamExt};
 use ip_network::{IpNetwork, Ipv4Network, Ipv6Network};
 use netlink_packet_route::route::{RouteProtocol, RouteScope};
 use netlink_packet_route::rule::RuleAction;
@@ -19,10 +19,17 @@ pub const FIREZONE_MARK: u32 = 0xfd002021;
 pub const IFACE_NAME: &str = "tun-firezone";
 const FILE_ALREADY_EXISTS: i32 = -17;
 const FIREZONE_TABLE: u32 = 0x2021_fd00;
+/// How many route changes we have in flight at once.
+///
+/// The kernel queues an acknowledgement for every request on our netlink socket, too many at once overflow its receive buffer (`ENOBUFS`).
+const MAX_CONCURRENT_ROUTE_CHANGES: usize = 64;
 
 /// For lack of a better name
 pub struct TunDeviceManager {
     connection: Connection,
+    /// The index of [`IFACE_NAME`], looked up once and refreshed whenever we (re-)configure the interface.
+    index: Option<u32>,
+    /// The routes we installed, already aggregated.
     routes: HashSet<IpNetwork>,
 }
 
@@ -48,6 +55,7 @@ impl TunDeviceManager {
 
         Ok(Self {
             connection,
+            index: None,
             routes: Default::default(),
         })
     }
@@ -55,16 +63,8 @@ impl TunDeviceManager {
     #[tracing::instrument(level = "trace", skip(self))]
     pub async fn set_ips(&mut self, ipv4: Ipv4Addr, ipv6: Ipv6Addr) -> Result<()> {
         let handle = &self.connection.handle;
-        let index = handle
-            .link()
-            .get()
-            .match_name(IFACE_NAME.to_string())
-            .execute()
-            .try_next()
-            .await?
-            .ok_or_else(|| anyhow!("Interface '{IFACE_NAME}' does not exist"))?
-            .header
-            .index;
+        let index = interface_index(handle).await?;
+        self.index = Some(index);
 
         let ips = handle
             .address()
@@ -132,44 +132,165 @@ impl TunDeviceManager {
         Ok(())
     }
 
+    /// Installs the given routes, only adding and deleting the ones that changed.
+    ///
+    /// Adjacent and overlapping prefixes are aggregated first because they all point to our interface anyway.
+    /// Up to [`MAX_CONCURRENT_ROUTE_CHANGES`] changes are in flight at once instead of waiting for each route in turn.
     pub async fn set_routes(&mut self, ipv4: Vec<Cidrv4>, ipv6: Vec<Cidrv6>) -> Result<()> {
-        let new_routes: HashSet<IpNetwork> = ipv4
-            .into_iter()
-            .map(IpNetwork::from)
-            .chain(ipv6.into_iter().map(IpNetwork::from))
-            .collect();
+        let new_routes = aggregate(
+            ipv4.into_iter()
+                .map(IpNetwork::from)
+                .chain(ipv6.into_iter().map(IpNetwork::from)),
+        );
         if new_routes == self.routes {
             tracing::debug!("Routes are unchanged");
 
             return Ok(());
         }
 
-        tracing::info!(?new_routes, "Setting new routes");
+        tracing::info!(num_routes = %new_routes.len(), "Setting new routes");
+        tracing::debug!(?new_routes);
 
         let handle = &self.connection.handle;
 
-        let index = handle
-            .link()
-            .get()
-            .match_name(IFACE_NAME.to_string())
-            .execute()
-            .try_next()
-            .await?
-            .context("No interface")?
-            .header
-            .index;
-
-        for route in new_routes.difference(&self.routes) {
-            add_route(route, index, handle).await?;
+        let index = match self.index {
+            Some(index) => index,
+            None => {
+                let index = interface_index(handle).await?;
+                self.index = Some(index);
+
+                index
+            }
+        };
+
+        // Add new routes before deleting old ones so traffic covered by both never hits a gap.
+        let to_add = new_routes
+            .difference(&self.routes)
+            .copied()
+            .collect::<Vec<_>>();
+        let added = stream::iter(to_add.iter().map(|r| add_route(r, index, handle)))
+            .buffered(MAX_CONCURRENT_ROUTE_CHANGES)
+            .collect::<Vec<_>>()
+            .await;
+
+        let to_delete = self
+            .routes
+            .difference(&new_routes)
+            .copied()
+            .collect::<Vec<_>>();
+        let deleted = stream::iter(to_delete.iter().map(|r| delete_route(r, index, handle)))
+            .buffered(MAX_CONCURRENT_ROUTE_CHANGES)
+            .collect::<Vec<_>>()
+            .await;
+
+        // Only remember what the kernel actually accepted so the next call retries the rest.
+        let mut result = Ok(());
+
+        for (route, res) in to_add.into_iter().zip(added) {
+            match res {
+                Ok(()) => {
+                    self.routes.insert(route);
+                }
+                Err(e) => result = result.and(Err(e)),
+            }
         }
+        for (route, res) in to_delete.into_iter().zip(deleted) {
+            match res {
+                Ok(()) => {
+                    self.routes.remove(&route);
+                }
+                Err(e) => result = result.and(Err(e)),
+            }
+        }
+
+        result
+    }
+}
+
+async fn interface_index(handle: &Handle) -> Result<u32> {
+    let index = handle
+        .link()
+        .get()
+        .match_name(IFACE_NAME.to_string())
+        .execute()
+        .try_next()
+        .await?
+        .ok_or_else(|| anyhow!("Interface '{IFACE_NAME}' does not exist"))?
+        .header
+        .index;
 
-        for route in self.routes.difference(&new_routes) {
-            delete_route(route, index, handle).await?;
+    Ok(index)
+}
+
+/// Reduces `routes` to the smallest set of prefixes that covers exactly the same addresses.
+///
+/// Prefixes covered by another one are dropped and sibling prefixes (like `10.0.0.0/25` and `10.0.0.128/25`) are merged into their parent.
+fn aggregate(routes: impl IntoIterator<Item = IpNetwork>) -> HashSet<IpNetwork> {
+    let mut v4 = Vec::new();
+    let mut v6 = Vec::new();
+
+    for route in routes {
+        match route {
+            IpNetwork::V4(n) => v4.push((u32::from(n.network_address()) as u128, n.netmask())),
+            IpNetwork::V6(n) => v6.push((u128::from(n.network_address()), n.netmask())),
         }
+    }
 
-        self.routes = new_routes;
-        Ok(())
+    let v4 = aggregate_prefixes(v4, 32)
+        .into_iter()
+        .map(|(address, len)| {
+            IpNetwork::V4(
+                Ipv4Network::new(Ipv4Addr::from(address as u32), len)
+                    .expect("aggregated prefixes are valid"),
+            )
+        });
+    let v6 = aggregate_prefixes(v6, 128)
+        .into_iter()
+        .map(|(address, len)| {
+            IpNetwork::V6(
+                Ipv6Network::new(Ipv6Addr::from(address), len)
+                    .expect("aggregated prefixes are valid"),
+            )
+        });
+
+    v4.chain(v6).collect()
+}
+
+/// Aggregates `(network address, prefix length)` pairs of an address family that is `bits` wide.
+fn aggregate_prefixes(mut prefixes: Vec<(u128, u8)>, bits: u8) -> Vec<(u128, u8)> {
+    // Sorting by address and then length puts a covering prefix right before the ones it covers.
+    prefixes.sort_unstable();
+
+    let mut aggregated = Vec::<(u128, u8)>::with_capacity(prefixes.len());
+
+    for (address, len) in prefixes {
+        // The aggregated prefixes are sorted and disjoint, so only the last one can cover this one.
+        if aggregated
+            .last()
+            .is_some_and(|&(a, l)| l == 0 || (address ^ a) >> (bits - l) == 0)
+        {
+            continue;
+        }
+
+        aggregated.push((address, len));
+
+        // Merge siblings into their parent for as long as possible.
+        while let [.., (lower, lower_len), (upper, upper_len)] = aggregated[..] {
+            if lower_len != upper_len || lower_len == 0 {
+                break;
+            }
+
+            let size = 1u128 << (bits - lower_len);
+            if lower & size != 0 || upper != lower + size {
+                break;
+            }
+
+            aggregated.truncate(aggregated.len() - 2);
+            aggregated.push((lower, lower_len - 1));
+        }
     }
+
+    aggregated
 }
 
 fn make_rule(handle: &Handle) -> RuleAddRequest {
@@ -246,3 +367,97 @@ async fn delete_route(route: &IpNetwork, idx: u32, handle: &Handle) -> Result<()
         .context("Failed to delete route")?;
     Ok(())
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn covered_prefixes_are_dropped() {
+        let routes = aggregate([net("10.0.0.0/8"), net("10.1.0.0/16"), net("10.1.2.3/32")]);
+
+        assert_eq!(routes, HashSet::from([net("10.0.0.0/8")]));
+    }
+
+    #[test]
+    fn siblings_are_merged_recursively() {
+        let routes = aggregate([
+            net("10.0.0.0/25"),
+            net("10.0.0.128/26"),
+            net("10.0.0.192/26"),
+            net("10.0.1.0/24"),
+            net("fd00::/127"),
+            net("fd00::1/128"),
+        ]);
+
+        assert_eq!(
+            routes,
+            HashSet::from([net("10.0.0.0/23"), net("fd00::/127")])
+        );
+    }
+
+    #[test]
+    fn adjacent_non_siblings_are_kept() {
+        let routes = aggregate([net("10.0.1.0/24"), net("10.0.2.0/24")]);
+
+        assert_eq!(
+            routes,
+            HashSet::from([net("10.0.1.0/24"), net("10.0.2.0/24")])
+        );
+    }
+
+    #[test]
+    fn default_route_covers_everything() {
+        let routes = aggregate([
+            net("::/0"),
+            net("fd00::/8"),
+            net("0.0.0.0/1"),
+            net("128.0.0.0/1"),
+        ]);
+
+        assert_eq!(routes, HashSet::from([net("::/0"), net("0.0.0.0/0")]));
+    }
+
+    #[tokio::test]
+    #[ignore = "Performs system-wide I/O, needs sudo"]
+    async fn sets_thousands_of_routes() {
+        const NUM_ROUTES: u32 = 10_000;
+
+        let mut manager = TunDeviceManager::new().unwrap();
+        let handle = manager.connection.handle.clone();
+
+        // Routes only need an interface to point to, a dummy one stands in for the TUN device.
+        handle
+            .link()
+            .add()
+            .dummy(IFACE_NAME.to_owned())
+            .execute()
+            .await
+            .unwrap();
+        let index = interface_index(&handle).await.unwrap();
+        handle.link().set(index).up().execute().await.unwrap();
+
+        // Leave a gap between the prefixes so they aren't aggregated.
+        let routes = (0..NUM_ROUTES)
+            .map(|i| {
+                Cidrv4::from(Ipv4Network::new(Ipv4Addr::from(0x0a00_0000 + (i << 9)), 24).unwrap())
+            })
+            .collect::<Vec<_>>();
+
+        let added = manager.set_routes(routes, vec![]).await;
+        let num_added = manager.routes.len();
+        let deleted = manager.set_routes(vec![], vec![]).await;
+        let num_left = manager.routes.len();
+
+        handle.link().del(index).execute().await.unwrap();
+
+        added.unwrap();
+        assert_eq!(num_added, NUM_ROUTES as usize);
+        deleted.unwrap();
+        assert_eq!(num_left, 0);
+    }
+
+    fn net(s: &str) -> IpNetwork {
+        s.parse().unwrap()
+    }
+}
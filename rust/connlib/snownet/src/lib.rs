@@ -4,14 +4,17 @@ mod allocation;
 mod backoff;
 mod channel_data;
 mod index;
+mod mtu;
 mod node;
+mod quality;
 mod ringbuffer;
 mod stats;
 mod utils;
 
 pub use allocation::RelaySocket;
+pub use mtu::{MAX_MTU, MIN_MTU};
 pub use node::{
     Answer, Client, ClientNode, Credentials, Error, Event, Node, Offer, Server, ServerNode,
     Transmit, HANDSHAKE_TIMEOUT,
 };
-pub use stats::{ConnectionStats, NodeStats};
+pub use stats::{ConnectionStats, NodeStats, PathType};
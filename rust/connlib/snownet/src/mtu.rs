@@ -0,0 +1,342 @@
+//! Packetization-layer path MTU discovery (PLPMTUD) as per <https://www.rfc-editor.org/rfc/rfc8899>.
+//!
+//! ICMP "packet too big" messages are frequently filtered and never make it back to us, especially not through NATs.
+//! Instead, we discover the path MTU of each connection by sending padded probe packets through the WireGuard tunnel and waiting for the remote to acknowledge them.
+//! Probes are IPv4 packets with protocol number 253 ("use for experimentation and testing", RFC 3692) which the remote `snownet` intercepts before they reach the TUN device.
+//!
+//! The same messages carry the pings that measure the connection's round-trip time, see [`crate::quality`].
+//!
+//! All sizes in this module refer to the size of the IP packet inside the tunnel, i.e. the MTU of the TUN device.
+
+use std::time::{Duration, Instant};
+
+/// The MTU that every path must support (the minimum IPv6 MTU).
+pub const MIN_MTU: usize = 1280;
+
+/// The largest MTU we probe for.
+///
+/// A 1500 byte ethernet link minus IPv4, UDP and WireGuard headers (20 + 8 + 32 bytes) and the TURN channel-data header (4 bytes).
+/// Over IPv6 or via a relay with an IPv6 allocation, probes of this size will fail and we settle on something smaller.
+pub const MAX_MTU: usize = 1436;
+
+/// How long we wait for an acknowledgement of a probe before we consider it lost.
+const PROBE_TIMEOUT: Duration = Duration::from_secs(2);
+
+/// How often we send a probe of a certain size before we conclude that the path doesn't support it.
+const MAX_PROBES: u8 = 3;
+
+/// We stop searching once the interval between confirmed and failed size is smaller than this.
+const SEARCH_GRANULARITY: usize = 16;
+
+/// After this long, we try again to raise the MTU in case the path changed to a better one.
+const RAISE_INTERVAL: Duration = Duration::from_secs(10 * 60);
+
+/// Identifies probe packets; any packet of protocol 253 that doesn't start with this is not for us.
+const MAGIC: [u8; 8] = *b"fz-pmtud";
+
+const IP_PROTO_EXPERIMENTAL: u8 = 253;
+const IPV4_HEADER_LEN: usize = 20;
+const MESSAGE_LEN: usize = IPV4_HEADER_LEN + MAGIC.len() + 1 + 2;
+
+const KIND_PROBE: u8 = 1;
+const KIND_ACK: u8 = 2;
+const KIND_PING: u8 = 3;
+const KIND_PONG: u8 = 4;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum Message {
+    /// A probe of the given size, must be acknowledged.
+    Probe(usize),
+    /// The acknowledgement of a probe of the given size.
+    Ack(usize),
+    /// A ping with the given sequence number, must be answered with a pong.
+    Ping(u16),
+    /// The answer to the ping with the given sequence number.
+    Pong(u16),
+}
+
+impl Message {
+    /// Parses a decrypted IP packet as a probe message.
+    ///
+    /// Returns [`None`] for all packets that are not probe messages.
+    pub(crate) fn parse(packet: &[u8]) -> Option<Self> {
+        if packet.len() < MESSAGE_LEN
+            || packet[0] != 0x45
+            || packet[9] != IP_PROTO_EXPERIMENTAL
+            || packet[IPV4_HEADER_LEN..][..MAGIC.len()] != MAGIC
+        {
+            return None;
+        }
+
+        let payload = &packet[IPV4_HEADER_LEN + MAGIC.len()..];
+        let value = u16::from_be_bytes([payload[1], payload[2]]);
+
+        match payload[0] {
+            KIND_PROBE => Some(Self::Probe(value as usize)),
+            KIND_ACK => Some(Self::Ack(value as usize)),
+            KIND_PING => Some(Self::Ping(value)),
+            KIND_PONG => Some(Self::Pong(value)),
+            _ => None,
+        }
+    }
+
+    /// Writes this message as an IP packet into `buffer`, returning the number of bytes written.
+    ///
+    /// Probes are padded to their size, all other messages are as small as possible.
+    pub(crate) fn write(self, buffer: &mut [u8]) -> usize {
+        let (kind, value, len) = match self {
+            Message::Probe(size) => (KIND_PROBE, size as u16, size),
+            Message::Ack(size) => (KIND_ACK, size as u16, MESSAGE_LEN),
+            Message::Ping(seq) => (KIND_PING, seq, MESSAGE_LEN),
+            Message::Pong(seq) => (KIND_PONG, seq, MESSAGE_LEN),
+        };
+        let packet = &mut buffer[..len];
+        packet.fill(0);
+
+        // Source and destination remain unspecified (0.0.0.0), the packet never leaves the tunnel.
+        packet[0] = 0x45;
+        packet[2..4].copy_from_slice(&(len as u16).to_be_bytes());
+        packet[6] = 0x40; // Don't fragment.
+        packet[8] = 1; // TTL
+        packet[9] = IP_PROTO_EXPERIMENTAL;
+
+        let payload = &mut packet[IPV4_HEADER_LEN..];
+        payload[..MAGIC.len()].copy_from_slice(&MAGIC);
+        payload[MAGIC.len()] = kind;
+        payload[MAGIC.len() + 1..][..2].copy_from_slice(&value.to_be_bytes());
+
+        len
+    }
+}
+
+/// The path MTU of a single connection.
+///
+/// Starts at [`MIN_MTU`] and searches for a larger one by probing.
+/// We first try [`MAX_MTU`] directly because that is what most paths support and fall back to a binary search if that fails.
+#[derive(Debug)]
+pub(crate) struct PathMtu {
+    /// The largest size that was acknowledged by the remote.
+    confirmed: usize,
+    /// The smallest size that we know doesn't make it to the remote.
+    too_big: usize,
+
+    state: State,
+}
+
+#[derive(Debug)]
+enum State {
+    /// We need to send a probe of `size`.
+    ProbeDue { size: usize, attempt: u8 },
+    /// We have sent a probe of `size` and wait for its acknowledgement.
+    AwaitingAck {
+        size: usize,
+        attempt: u8,
+        deadline: Instant,
+    },
+    /// The search is complete, try to raise the MTU again at `raise_at`.
+    Complete { raise_at: Option<Instant> },
+}
+
+impl PathMtu {
+    pub(crate) fn new() -> Self {
+        Self {
+            confirmed: MIN_MTU,
+            too_big: MAX_MTU + 1,
+            state: State::ProbeDue {
+                size: MAX_MTU,
+                attempt: 0,
+            },
+        }
+    }
+
+    /// The currently known path MTU.
+    pub(crate) fn mtu(&self) -> usize {
+        self.confirmed
+    }
+
+    /// Start from scratch, e.g. because the path changed.
+    pub(crate) fn reset(&mut self) {
+        *self = Self::new();
+    }
+
+    pub(crate) fn poll_timeout(&self) -> Option<Instant> {
+        match self.state {
+            State::ProbeDue { .. } => None,
+            State::AwaitingAck { deadline, .. } => Some(deadline),
+            State::Complete { raise_at } => raise_at,
+        }
+    }
+
+    pub(crate) fn handle_timeout(&mut self, now: Instant) {
+        match self.state {
+            State::AwaitingAck {
+                size,
+                attempt,
+                deadline,
+            } if now >= deadline => {
+                if attempt + 1 < MAX_PROBES {
+                    self.state = State::ProbeDue {
+                        size,
+                        attempt: attempt + 1,
+                    };
+                    return;
+                }
+
+                tracing::debug!(%size, "Path does not support MTU");
+
+                self.too_big = size;
+                self.next_probe(now);
+            }
+            State::Complete {
+                raise_at: Some(raise_at),
+            } if now >= raise_at => {
+                self.too_big = MAX_MTU + 1;
+                self.state = State::ProbeDue {
+                    size: MAX_MTU,
+                    attempt: 0,
+                };
+            }
+            State::ProbeDue { .. } | State::AwaitingAck { .. } | State::Complete { .. } => {}
+        }
+    }
+
+    /// Returns the size of the next probe to send, if any.
+    pub(crate) fn poll_probe(&mut self, now: Instant) -> Option<usize> {
+        let State::ProbeDue { size, attempt } = self.state else {
+            return None;
+        };
+
+        self.state = State::AwaitingAck {
+            size,
+            attempt,
+            deadline: now + PROBE_TIMEOUT,
+        };
+
+        Some(size)
+    }
+
+    pub(crate) fn on_ack(&mut self, size: usize, now: Instant) {
+        let State::AwaitingAck { size: probed, .. } = self.state else {
+            return;
+        };
+
+        if size != probed {
+            return; // Stale ack of an earlier probe.
+        }
+
+        tracing::debug!(mtu = %size, "Discovered path MTU");
+
+        self.confirmed = size;
+        self.next_probe(now);
+    }
+
+    fn next_probe(&mut self, now: Instant) {
+        if self.too_big - self.confirmed <= SEARCH_GRANULARITY {
+            let raise_at = (self.confirmed < MAX_MTU).then_some(now + RAISE_INTERVAL);
+
+            self.state = State::Complete { raise_at };
+            return;
+        }
+
+        self.state = State::ProbeDue {
+            size: (self.confirmed + self.too_big) / 2,
+            attempt: 0,
+        };
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn probe_roundtrip() {
+        let mut buffer = [0u8; MAX_MTU];
+
+        let len = Message::Probe(1400).write(&mut buffer);
+
+        assert_eq!(len, 1400);
+        assert_eq!(Message::parse(&buffer[..len]), Some(Message::Probe(1400)));
+    }
+
+    #[test]
+    fn ack_is_small() {
+        let mut buffer = [0u8; MAX_MTU];
+
+        let len = Message::Ack(1400).write(&mut buffer);
+
+        assert_eq!(len, MESSAGE_LEN);
+        assert_eq!(Message::parse(&buffer[..len]), Some(Message::Ack(1400)));
+    }
+
+    #[test]
+    fn ping_roundtrip() {
+        let mut buffer = [0u8; MAX_MTU];
+
+        let len = Message::Ping(u16::MAX).write(&mut buffer);
+
+        assert_eq!(len, MESSAGE_LEN);
+        assert_eq!(
+            Message::parse(&buffer[..len]),
+            Some(Message::Ping(u16::MAX))
+        );
+    }
+
+    #[test]
+    fn ignores_regular_packets() {
+        let mut packet = [0u8; 60];
+        packet[0] = 0x45;
+        packet[9] = 6; // TCP
+
+        assert_eq!(Message::parse(&packet), None);
+    }
+
+    #[test]
+    fn max_mtu_acked_completes_search() {
+        let mut mtu = PathMtu::new();
+        let now = Instant::now();
+
+        assert_eq!(mtu.poll_probe(now), Some(MAX_MTU));
+        mtu.on_ack(MAX_MTU, now);
+
+        assert_eq!(mtu.mtu(), MAX_MTU);
+        assert_eq!(mtu.poll_probe(now), None);
+        assert_eq!(mtu.poll_timeout(), None);
+    }
+
+    #[test]
+    fn binary_search_after_lost_probes() {
+        let mut mtu = PathMtu::new();
+        let mut now = Instant::now();
+        let path_mtu = 1380;
+
+        while let Some(size) = mtu.poll_probe(now).or_else(|| {
+            now = mtu.poll_timeout()?;
+            mtu.handle_timeout(now);
+
+            mtu.poll_probe(now)
+        }) {
+            if size <= path_mtu {
+                mtu.on_ack(size, now);
+            }
+
+            if matches!(mtu.state, State::Complete { .. }) {
+                break;
+            }
+        }
+
+        assert!(mtu.mtu() <= path_mtu);
+        assert!(path_mtu - mtu.mtu() <= SEARCH_GRANULARITY);
+    }
+
+    #[test]
+    fn stale_ack_is_ignored() {
+        let mut mtu = PathMtu::new();
+        let now = Instant::now();
+
+        mtu.poll_probe(now);
+        mtu.on_ack(1300, now);
+
+        assert_eq!(mtu.mtu(), MIN_MTU);
+    }
+}
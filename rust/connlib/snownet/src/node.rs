@@ -1,7 +1,9 @@
 use crate::allocation::{Allocation, RelaySocket, Socket};
 use crate::index::IndexLfsr;
+use crate::mtu::{self, PathMtu};
+use crate::quality::Quality;
 use crate::ringbuffer::RingBuffer;
-use crate::stats::{ConnectionStats, NodeStats};
+use crate::stats::{ConnectionStats, NodeStats, PathType};
 use crate::utils::earliest;
 use boringtun::noise::errors::WireGuardError;
 use boringtun::noise::{Tunn, TunnResult};
@@ -41,6 +43,12 @@ pub const HANDSHAKE_TIMEOUT: Duration = Duration::from_secs(20);
 
 const MAX_UDP_SIZE: usize = (1 << 16) - 1;
 
+/// The message types of WireGuard handshake messages, see <https://www.wireguard.com/protocol/>.
+const HANDSHAKE_INIT: u8 = 1;
+const HANDSHAKE_RESPONSE: u8 = 2;
+const COOKIE_REPLY: u8 = 3;
+const DATA: u8 = 4;
+
 /// Manages a set of wireguard connections for a server.
 pub type ServerNode<TId, RId> = Node<Server, TId, RId>;
 /// Manages a set of wireguard connections for a client.
@@ -113,6 +121,8 @@ pub enum Error {
     UnhandledPacket { num_tunnels: usize },
     #[error("Not connected")]
     NotConnected,
+    #[error("Packet exceeds the path MTU of {mtu} bytes")]
+    PacketTooBig { mtu: usize },
     #[error("Invalid local address: {0}")]
     BadLocalAddress(#[from] str0m::error::IceError),
 }
@@ -189,6 +199,18 @@ where
         (self.stats, self.connections.stats())
     }
 
+    /// The number of allocations we have on relays.
+    pub fn num_allocations(&self) -> usize {
+        self.allocations.len()
+    }
+
+    /// The discovered path MTU of a connection, i.e. the largest IP packet we can send through its tunnel.
+    pub fn path_mtu(&self, id: TId) -> Option<usize> {
+        self.connections
+            .get_established(&id)
+            .map(|c| c.path_mtu.mtu())
+    }
+
     /// Add an address as a `host` candidate.
     ///
     /// For most network topologies, [`snownet`](crate) will automatically discover host candidates via the traffic to the configured STUN and TURN servers.
@@ -291,7 +313,10 @@ where
     /// - `Ok(None)` if the packet was handled internally, for example, a response from a TURN server.
     /// - `Ok(Some)` if the packet was an encrypted wireguard packet from a peer.
     ///   The `Option` contains the connection on which the packet was decrypted.
-    #[tracing::instrument(level = "debug", skip_all, fields(%from, num_bytes = %packet.len()))]
+    #[cfg_attr(
+        feature = "wire-trace",
+        tracing::instrument(level = "debug", skip_all, fields(%from, num_bytes = %packet.len()))
+    )]
     pub fn decapsulate<'s>(
         &mut self,
         local: SocketAddr,
@@ -330,7 +355,10 @@ where
     /// Wireguard is an IP tunnel, so we "enforce" that only IP packets are sent through it.
     /// We say "enforce" an [`IpPacket`] can be created from an (almost) arbitrary byte buffer at virtually no cost.
     /// Nevertheless, using [`IpPacket`] in our API has good documentation value.
-    #[tracing::instrument(level = "debug", skip_all, fields(id = %connection))]
+    #[cfg_attr(
+        feature = "wire-trace",
+        tracing::instrument(level = "debug", skip_all, fields(id = %connection))
+    )]
     pub fn encapsulate<'s>(
         &'s mut self,
         connection: TId,
@@ -345,6 +373,13 @@ where
         // Must bail early if we don't have a socket yet to avoid running into WG timeouts.
         let socket = conn.socket().ok_or(Error::NotConnected)?;
 
+        // The outer UDP datagram is sent with DF set because we probe the path MTU, so the kernel would drop it if it is too big.
+        // Thus, we reject IPv4 packets that may be fragmented too and let the caller report the MTU via ICMP, as for DF packets.
+        let mtu = conn.path_mtu.mtu();
+        if packet.packet().len() > mtu {
+            return Err(Error::PacketTooBig { mtu });
+        }
+
         // Encode the packet with an offset of 4 bytes, in case we need to wrap it in a channel-data message.
         let Some(packet_len) = conn
             .encapsulate(packet.packet(), &mut self.buffer[4..], now)?
@@ -553,6 +588,8 @@ where
     ) -> Connection<RId> {
         agent.handle_timeout(now);
 
+        let index = self.index.next();
+
         /// We set a Wireguard keep-alive to ensure the WG session doesn't timeout on an idle connection.
         ///
         /// Without such a timeout, using a tunnel after the REKEY_TIMEOUT requires handshaking a new session which delays the new application packet by 1 RTT.
@@ -565,12 +602,15 @@ where
                 remote,
                 Some(key),
                 WG_KEEP_ALIVE,
-                self.index.next(),
+                index,
                 Some(self.rate_limiter.clone()),
             ),
+            index,
             next_timer_update: now,
             stats: Default::default(),
             buffer: Box::new([0u8; MAX_UDP_SIZE]),
+            path_mtu: PathMtu::new(),
+            quality: Quality::new(now),
             intent_sent_at,
             signalling_completed_at: now,
             remote_pub_key: remote,
@@ -685,9 +725,9 @@ where
         };
 
         for (id, agent) in self.connections.agents_mut() {
-            let _span = info_span!("connection", %id).entered();
-
             if agent.accepts_message(&message) {
+                let _span = info_span!("connection", %id).entered();
+
                 agent.handle_packet(
                     now,
                     StunPacket {
@@ -715,42 +755,50 @@ where
         buffer: &'b mut [u8],
         now: Instant,
     ) -> ControlFlow<Result<(), Error>, (TId, MutableIpPacket<'b>)> {
-        for (id, conn) in self.connections.iter_established_mut() {
-            let _span = info_span!("connection", %id).entered();
+        let Some((id, conn)) = self
+            .connections
+            .find_established(&from, packet)
+            .and_then(|id| Some((id, self.connections.get_established_mut(&id)?)))
+        else {
+            return ControlFlow::Break(Err(Error::UnhandledPacket {
+                num_tunnels: self.connections.established.len(),
+            }));
+        };
 
-            if !conn.accepts(&from) {
-                continue;
-            }
+        #[cfg(feature = "wire-trace")]
+        let _span = info_span!("connection", %id).entered();
 
-            let handshake_complete_before_decapsulate = conn.wg_handshake_complete();
+        let handshake_complete_before_decapsulate = conn.wg_handshake_complete();
 
-            let control_flow = conn.decapsulate(
-                packet,
-                buffer,
-                &mut self.allocations,
-                &mut self.buffered_transmits,
-                now,
-            );
+        let control_flow = conn.decapsulate(
+            packet,
+            buffer,
+            &mut self.allocations,
+            &mut self.buffered_transmits,
+            now,
+        );
 
-            let handshake_complete_after_decapsulate = conn.wg_handshake_complete();
+        let handshake_complete_after_decapsulate = conn.wg_handshake_complete();
 
-            // I can't think of a better way to detect this ...
-            if !handshake_complete_before_decapsulate && handshake_complete_after_decapsulate {
-                tracing::info!(duration_since_intent = ?conn.duration_since_intent(now), "Completed wireguard handshake");
+        // Only count handshake messages that `boringtun` accepted, anybody can send us garbage with the right first byte.
+        if matches!(packet.first(), Some(&HANDSHAKE_INIT | &HANDSHAKE_RESPONSE))
+            && !matches!(control_flow, ControlFlow::Break(Err(_)))
+        {
+            self.stats.wireguard_handshakes += 1;
+        }
 
-                self.pending_events
-                    .push_back(Event::ConnectionEstablished(id))
-            }
+        // I can't think of a better way to detect this ...
+        if !handshake_complete_before_decapsulate && handshake_complete_after_decapsulate {
+            tracing::info!(%id, duration_since_intent = ?conn.duration_since_intent(now), "Completed wireguard handshake");
 
-            return match control_flow {
-                ControlFlow::Continue(c) => ControlFlow::Continue((id, c)),
-                ControlFlow::Break(b) => ControlFlow::Break(b),
-            };
+            self.pending_events
+                .push_back(Event::ConnectionEstablished(id))
         }
 
-        ControlFlow::Break(Err(Error::UnhandledPacket {
-            num_tunnels: self.connections.iter_established_mut().count(),
-        }))
+        match control_flow {
+            ControlFlow::Continue(c) => ControlFlow::Continue((id, c)),
+            ControlFlow::Break(b) => ControlFlow::Break(b),
+        }
     }
 
     fn bindings_and_allocations_drain_events(&mut self) {
@@ -796,7 +844,7 @@ where
             tracing::info!("Replacing existing initial connection");
         };
 
-        if self.connections.established.remove(&id).is_some() {
+        if self.connections.remove_established(&id).is_some() {
             tracing::info!("Replacing existing established connection");
         };
 
@@ -863,7 +911,7 @@ where
         );
         let duration_since_intent = connection.duration_since_intent(now);
 
-        let existing = self.connections.established.insert(id, connection);
+        let existing = self.connections.insert_established(id, connection);
 
         tracing::info!(?duration_since_intent, remote = %hex::encode(remote.as_bytes()), "Signalling protocol completed");
 
@@ -894,7 +942,7 @@ where
             "server to not use `initial_connections`"
         );
 
-        if self.connections.established.remove(&id).is_some() {
+        if self.connections.remove_established(&id).is_some() {
             tracing::info!("Replacing existing established connection");
         };
 
@@ -922,7 +970,7 @@ where
             now, // Technically, this isn't fully correct because gateways don't send intents so we just use the current time.
             now,
         );
-        let existing = self.connections.established.insert(id, connection);
+        let existing = self.connections.insert_established(id, connection);
 
         debug_assert!(existing.is_none());
 
@@ -960,6 +1008,8 @@ where
 struct Connections<TId, RId> {
     initial: HashMap<TId, InitialConnection>,
     established: HashMap<TId, Connection<RId>>,
+    /// The established connections by the index of their WireGuard tunnel, see [`peer_index`].
+    by_index: HashMap<u32, TId>,
 }
 
 impl<TId, RId> Default for Connections<TId, RId> {
@@ -967,6 +1017,7 @@ impl<TId, RId> Default for Connections<TId, RId> {
         Self {
             initial: Default::default(),
             established: Default::default(),
+            by_index: Default::default(),
         }
     }
 }
@@ -999,10 +1050,48 @@ where
 
             true
         });
+        self.by_index
+            .retain(|_, id| self.established.contains_key(id));
+    }
+
+    fn insert_established(&mut self, id: TId, conn: Connection<RId>) -> Option<Connection<RId>> {
+        self.by_index.insert(conn.index, id);
+        let existing = self.established.insert(id, conn)?;
+        self.by_index.remove(&existing.index);
+
+        Some(existing)
+    }
+
+    fn remove_established(&mut self, id: &TId) -> Option<Connection<RId>> {
+        let conn = self.established.remove(id)?;
+        self.by_index.remove(&conn.index);
+
+        Some(conn)
+    }
+
+    /// Finds the established connection that accepts a WireGuard packet from `from`.
+    ///
+    /// All but handshake initiations tell us the index of the receiving tunnel, which we use to skip scanning all connections.
+    fn find_established(&self, from: &SocketAddr, packet: &[u8]) -> Option<TId> {
+        let by_index = peer_index(packet)
+            .and_then(|index| self.by_index.get(&index))
+            .filter(|id| {
+                self.established
+                    .get(*id)
+                    .is_some_and(|conn| conn.accepts(from))
+            });
+
+        by_index
+            .or_else(|| {
+                self.established
+                    .iter()
+                    .find_map(|(id, conn)| conn.accepts(from).then_some(id))
+            })
+            .copied()
     }
 
     fn stats(&self) -> impl Iterator<Item = (TId, ConnectionStats)> + '_ {
-        self.established.iter().map(move |(id, c)| (*id, c.stats))
+        self.established.iter().map(move |(id, c)| (*id, c.stats()))
     }
 
     fn agent_mut(&mut self, id: TId) -> Option<&mut IceAgent> {
@@ -1022,6 +1111,10 @@ where
         initial_agents.chain(negotiated_agents)
     }
 
+    fn get_established(&self, id: &TId) -> Option<&Connection<RId>> {
+        self.established.get(id)
+    }
+
     fn get_established_mut(&mut self, id: &TId) -> Option<&mut Connection<RId>> {
         self.established.get_mut(id)
     }
@@ -1045,6 +1138,7 @@ where
     fn clear(&mut self) {
         self.initial.clear();
         self.established.clear();
+        self.by_index.clear();
     }
 
     fn iter_ids(&self) -> impl Iterator<Item = TId> + '_ {
@@ -1290,6 +1384,8 @@ struct Connection<RId> {
     agent: IceAgent,
 
     tunnel: Tunn,
+    /// The index we gave to `tunnel`, see [`peer_index`].
+    index: u32,
     remote_pub_key: PublicKey,
     next_timer_update: Instant,
 
@@ -1301,6 +1397,9 @@ struct Connection<RId> {
 
     buffer: Box<[u8; MAX_UDP_SIZE]>,
 
+    path_mtu: PathMtu,
+    quality: Quality,
+
     last_outgoing: Instant,
     last_incoming: Instant,
 }
@@ -1391,6 +1490,29 @@ where
         self.tunnel.time_since_last_handshake().is_some()
     }
 
+    fn stats(&self) -> ConnectionStats {
+        let path = match &self.state {
+            ConnectionState::Connected {
+                peer_socket: PeerSocket::Direct { .. },
+                ..
+            } => PathType::Direct,
+            ConnectionState::Connected {
+                peer_socket: PeerSocket::Relay { .. },
+                ..
+            } => PathType::Relayed,
+            ConnectionState::Connecting { .. }
+            | ConnectionState::Failed
+            | ConnectionState::Idle => PathType::None,
+        };
+
+        ConnectionStats {
+            rtt: self.quality.rtt(),
+            loss: self.quality.loss(),
+            path,
+            ..self.stats
+        }
+    }
+
     fn duration_since_intent(&self, now: Instant) -> Duration {
         now.duration_since(self.intent_sent_at)
     }
@@ -1401,10 +1523,21 @@ where
         let next_wg_timer = Some(self.next_timer_update);
         let candidate_timeout = self.candidate_timeout();
         let idle_timeout = self.idle_timeout();
+        let path_mtu_timeout = self.path_mtu.poll_timeout();
+        let quality_timeout = self.quality.poll_timeout();
 
         earliest(
             Some(idle_timeout),
-            earliest(agent_timeout, earliest(next_wg_timer, candidate_timeout)),
+            earliest(
+                agent_timeout,
+                earliest(
+                    next_wg_timer,
+                    earliest(
+                        candidate_timeout,
+                        earliest(path_mtu_timeout, quality_timeout),
+                    ),
+                ),
+            ),
         )
     }
 
@@ -1554,6 +1687,8 @@ where
 
                     tracing::info!(?old, new = ?remote_socket, duration_since_intent = ?self.duration_since_intent(now), "Updating remote socket");
 
+                    self.path_mtu.reset();
+                    self.quality.reset(now);
                     self.force_handshake(allocations, transmits, now);
                 }
                 IceAgentEvent::IceRestart(_) | IceAgentEvent::IceConnectionStateChange(_) => {}
@@ -1593,6 +1728,22 @@ where
 
             transmits.push_back(channel_data);
         }
+
+        self.path_mtu.handle_timeout(now);
+        self.quality.handle_timeout(now);
+
+        // Probe and ping only once we can actually send through the tunnel, otherwise they would count as lost.
+        if self.socket().is_none() || !self.wg_handshake_complete() {
+            self.quality.postpone(now);
+            return;
+        }
+
+        if let Some(size) = self.path_mtu.poll_probe(now) {
+            self.send_control_message(mtu::Message::Probe(size), allocations, transmits, now);
+        }
+        if let Some(seq) = self.quality.poll_ping(now) {
+            self.send_control_message(mtu::Message::Ping(seq), allocations, transmits, now);
+        }
     }
 
     fn encapsulate<'b>(
@@ -1611,6 +1762,8 @@ where
         };
 
         self.last_outgoing = now;
+        self.stats.packets_to_peer += 1;
+        self.stats.bytes_to_peer += packet.len();
 
         Ok(Some(&buffer[..len]))
     }
@@ -1633,6 +1786,12 @@ where
             // In our API, we parse the packets directly as an IpPacket.
             // Thus, the caller can query whatever data they'd like, not just the source IP so we don't return it in addition.
             TunnResult::WriteToTunnelV4(packet, ip) => {
+                if let Some(message) = mtu::Message::parse(packet) {
+                    self.handle_control_message(message, allocations, transmits, now);
+
+                    return ControlFlow::Break(Ok(()));
+                }
+
                 let packet_len = packet.len();
                 let ipv4_packet = ConvertibleIpv4Packet::new(&mut buffer[..(packet_len + 20)])
                     .expect("boringtun verifies validity");
@@ -1695,13 +1854,69 @@ where
             }
         };
 
-        if control_flow.is_continue() {
+        if let ControlFlow::Continue(packet) = &control_flow {
             self.last_incoming = now;
+            self.stats.packets_from_peer += 1;
+            self.stats.bytes_from_peer += packet.packet().len();
         }
 
         control_flow
     }
 
+    fn handle_control_message(
+        &mut self,
+        message: mtu::Message,
+        allocations: &mut HashMap<RId, Allocation>,
+        transmits: &mut VecDeque<Transmit<'static>>,
+        now: Instant,
+    ) where
+        RId: Copy,
+    {
+        match message {
+            mtu::Message::Probe(size) => {
+                self.send_control_message(mtu::Message::Ack(size), allocations, transmits, now)
+            }
+            mtu::Message::Ack(size) => self.path_mtu.on_ack(size, now),
+            mtu::Message::Ping(seq) => {
+                self.send_control_message(mtu::Message::Pong(seq), allocations, transmits, now)
+            }
+            mtu::Message::Pong(seq) => self.quality.on_pong(seq, now),
+        }
+    }
+
+    fn send_control_message(
+        &mut self,
+        message: mtu::Message,
+        allocations: &mut HashMap<RId, Allocation>,
+        transmits: &mut VecDeque<Transmit<'static>>,
+        now: Instant,
+    ) where
+        RId: Copy,
+    {
+        let Some(socket) = self.socket() else {
+            return;
+        };
+
+        let mut packet = [0u8; mtu::MAX_MTU];
+        let len = message.write(&mut packet);
+
+        match self
+            .tunnel
+            .encapsulate(&packet[..len], self.buffer.as_mut())
+        {
+            TunnResult::Done => {}
+            TunnResult::Err(e) => {
+                tracing::debug!(?e, ?message, "Failed to encapsulate control message");
+            }
+            TunnResult::WriteToNetwork(bytes) => {
+                transmits.extend(make_owned_transmit(socket, bytes, allocations, now));
+            }
+            TunnResult::WriteToTunnelV4(_, _) | TunnResult::WriteToTunnelV6(_, _) => {
+                unreachable!("never returned from encapsulate")
+            }
+        }
+    }
+
     fn force_handshake(
         &mut self,
         allocations: &mut HashMap<RId, Allocation>,
@@ -1748,6 +1963,22 @@ where
     }
 }
 
+/// The index of the tunnel a WireGuard packet is for, `None` for handshake initiations.
+///
+/// Handshake responses, cookie replies and data messages carry the receiver's session index, of which `boringtun` reserves the lower 8 bits for the session and the upper 24 bits for the index of the tunnel.
+fn peer_index(packet: &[u8]) -> Option<u32> {
+    if !matches!(
+        packet.first(),
+        Some(&HANDSHAKE_RESPONSE | &COOKIE_REPLY | &DATA)
+    ) {
+        return None;
+    }
+
+    let receiver_index = packet.get(4..8)?.try_into().ok()?;
+
+    Some(u32::from_le_bytes(receiver_index) >> 8)
+}
+
 #[must_use]
 fn make_owned_transmit<RId>(
     socket: PeerSocket<RId>,
@@ -1774,3 +2005,30 @@ where
 
     Some(transmit)
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn peer_index_of_data_message_is_upper_24_bits_of_receiver() {
+        let mut packet = vec![DATA, 0, 0, 0];
+        packet.extend_from_slice(&((0xABCDEF << 8) | 0x01u32).to_le_bytes());
+        packet.extend_from_slice(&[0; 24]);
+
+        assert_eq!(peer_index(&packet), Some(0xABCDEF));
+    }
+
+    #[test]
+    fn handshake_initiation_has_no_peer_index() {
+        let mut packet = vec![HANDSHAKE_INIT, 0, 0, 0];
+        packet.extend_from_slice(&[0; 144]);
+
+        assert_eq!(peer_index(&packet), None);
+    }
+
+    #[test]
+    fn truncated_packet_has_no_peer_index() {
+        assert_eq!(peer_index(&[DATA, 0, 0, 0, 1]), None);
+    }
+}
@@ -0,0 +1,181 @@
+//! Measures round-trip time and loss of a connection.
+//!
+//! `str0m` doesn't expose the timing of its ICE consent checks and WireGuard keep-alives are not acknowledged, so neither of them yields round-trip times.
+//! Instead, we periodically send a small ping through the tunnel, using the same in-tunnel messages as path MTU discovery (see [`crate::mtu`]).
+//! Pings travel the same path as data, thus their round-trip time is what an application experiences.
+
+use std::collections::VecDeque;
+use std::time::{Duration, Instant};
+
+/// How often we ping the remote.
+const PING_INTERVAL: Duration = Duration::from_secs(5);
+
+/// Pings that are not answered within this time count as lost.
+const PING_TIMEOUT: Duration = Duration::from_secs(2);
+
+/// The number of most recent pings we compute the loss over, i.e. about a minute and a half.
+const LOSS_WINDOW: usize = 18;
+
+#[derive(Debug)]
+pub(crate) struct Quality {
+    next_seq: u16,
+    next_ping_at: Instant,
+    /// Pings we are waiting for a response to, oldest first.
+    in_flight: VecDeque<(u16, Instant)>,
+    /// Whether the most recent pings were answered, oldest first.
+    outcomes: VecDeque<bool>,
+
+    /// The smoothed round-trip time as per <https://www.rfc-editor.org/rfc/rfc6298#section-2>.
+    srtt: Option<Duration>,
+}
+
+impl Quality {
+    pub(crate) fn new(now: Instant) -> Self {
+        Self {
+            next_seq: 0,
+            next_ping_at: now,
+            in_flight: VecDeque::default(),
+            outcomes: VecDeque::with_capacity(LOSS_WINDOW),
+            srtt: None,
+        }
+    }
+
+    /// Start from scratch, e.g. because the path changed.
+    pub(crate) fn reset(&mut self, now: Instant) {
+        *self = Self::new(now);
+    }
+
+    pub(crate) fn rtt(&self) -> Option<Duration> {
+        self.srtt
+    }
+
+    /// The fraction of recent pings that were not answered.
+    pub(crate) fn loss(&self) -> f32 {
+        if self.outcomes.is_empty() {
+            return 0.0;
+        }
+
+        let lost = self.outcomes.iter().filter(|answered| !**answered).count();
+
+        lost as f32 / self.outcomes.len() as f32
+    }
+
+    pub(crate) fn poll_timeout(&self) -> Option<Instant> {
+        let next_expiry = self.in_flight.front().map(|(_, sent)| *sent + PING_TIMEOUT);
+
+        Some(next_expiry.map_or(self.next_ping_at, |e| e.min(self.next_ping_at)))
+    }
+
+    pub(crate) fn handle_timeout(&mut self, now: Instant) {
+        while self
+            .in_flight
+            .front()
+            .is_some_and(|(_, sent)| now >= *sent + PING_TIMEOUT)
+        {
+            self.in_flight.pop_front();
+            self.record(false);
+        }
+    }
+
+    /// We can't send a ping right now, try again in one interval.
+    pub(crate) fn postpone(&mut self, now: Instant) {
+        if now >= self.next_ping_at {
+            self.next_ping_at = now + PING_INTERVAL;
+        }
+    }
+
+    /// Returns the sequence number of the next ping to send, if any.
+    pub(crate) fn poll_ping(&mut self, now: Instant) -> Option<u16> {
+        if now < self.next_ping_at {
+            return None;
+        }
+
+        let seq = self.next_seq;
+        self.next_seq = self.next_seq.wrapping_add(1);
+        self.next_ping_at = now + PING_INTERVAL;
+        self.in_flight.push_back((seq, now));
+
+        Some(seq)
+    }
+
+    pub(crate) fn on_pong(&mut self, seq: u16, now: Instant) {
+        let Some(index) = self.in_flight.iter().position(|(s, _)| *s == seq) else {
+            return; // Answer to a ping that already timed out.
+        };
+        let (_, sent) = self.in_flight.remove(index).expect("index is valid");
+        let rtt = now.duration_since(sent);
+
+        self.srtt = Some(match self.srtt {
+            None => rtt,
+            Some(srtt) => (srtt * 7 + rtt) / 8,
+        });
+        self.record(true);
+    }
+
+    fn record(&mut self, answered: bool) {
+        if self.outcomes.len() == LOSS_WINDOW {
+            self.outcomes.pop_front();
+        }
+
+        self.outcomes.push_back(answered);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn first_sample_is_rtt() {
+        let now = Instant::now();
+        let mut quality = Quality::new(now);
+
+        let seq = quality.poll_ping(now).unwrap();
+        quality.on_pong(seq, now + Duration::from_millis(40));
+
+        assert_eq!(quality.rtt(), Some(Duration::from_millis(40)));
+        assert_eq!(quality.loss(), 0.0);
+    }
+
+    #[test]
+    fn rtt_is_smoothed() {
+        let mut now = Instant::now();
+        let mut quality = Quality::new(now);
+
+        for rtt in [80, 0] {
+            let seq = quality.poll_ping(now).unwrap();
+            quality.on_pong(seq, now + Duration::from_millis(rtt));
+
+            now += PING_INTERVAL;
+        }
+
+        assert_eq!(quality.rtt(), Some(Duration::from_millis(70)));
+    }
+
+    #[test]
+    fn unanswered_pings_count_as_lost() {
+        let mut now = Instant::now();
+        let mut quality = Quality::new(now);
+
+        let seq = quality.poll_ping(now).unwrap();
+        quality.on_pong(seq, now);
+
+        now += PING_INTERVAL;
+        let seq = quality.poll_ping(now).unwrap();
+        now = quality.poll_timeout().unwrap();
+        quality.handle_timeout(now);
+        quality.on_pong(seq, now); // Too late.
+
+        assert_eq!(quality.loss(), 0.5);
+    }
+
+    #[test]
+    fn pings_are_paced() {
+        let now = Instant::now();
+        let mut quality = Quality::new(now);
+
+        assert!(quality.poll_ping(now).is_some());
+        assert!(quality.poll_ping(now + Duration::from_secs(1)).is_none());
+        assert!(quality.poll_ping(now + PING_INTERVAL).is_some());
+    }
+}
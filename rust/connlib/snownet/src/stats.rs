@@ -1,9 +1,14 @@
 use std::ops::AddAssign;
+use std::time::Duration;
 
 #[derive(Default, Debug, Clone, Copy)]
 pub struct NodeStats {
     /// How many bytes we sent as part of exchanging STUN messages with relays (control messages only).
     pub stun_bytes_to_relays: HumanBytes,
+    /// How many WireGuard handshake messages (initiations and responses) we received.
+    ///
+    /// Every handshake consists of exactly one of each, so this counts the handshakes we took part in as either side.
+    pub wireguard_handshakes: u64,
 }
 
 #[derive(Default, Debug, Clone, Copy)]
@@ -12,6 +17,33 @@ pub struct ConnectionStats {
     pub stun_bytes_to_peer_direct: HumanBytes,
     /// How many bytes we sent as part of exchanging STUN messages to other peers via relays.
     pub stun_bytes_to_peer_relayed: HumanBytes,
+
+    /// How many IP packets we sent through the tunnel.
+    pub packets_to_peer: u64,
+    /// The size of all IP packets we sent through the tunnel.
+    pub bytes_to_peer: HumanBytes,
+    /// How many IP packets we received through the tunnel.
+    pub packets_from_peer: u64,
+    /// The size of all IP packets we received through the tunnel.
+    pub bytes_from_peer: HumanBytes,
+
+    /// The smoothed round-trip time through the tunnel, [`None`] until we measured it.
+    pub rtt: Option<Duration>,
+    /// The fraction of recent pings through the tunnel that were not answered.
+    pub loss: f32,
+    /// How we currently reach the peer.
+    pub path: PathType,
+}
+
+#[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PathType {
+    /// We haven't nominated a path yet.
+    #[default]
+    None,
+    /// We send directly to the peer's socket.
+    Direct,
+    /// We send via a relay.
+    Relayed,
 }
 
 #[derive(Default, Clone, Copy)]
@@ -136,6 +136,181 @@ fn idle_connection_is_closed_after_5_minutes() {
         .contains(&(Event::ConnectionClosed(1), clock.now)));
 }
 
+#[test]
+fn discovers_path_mtu_after_connecting() {
+    let _guard = setup_tracing();
+    let mut clock = Clock::new();
+
+    let (alice, bob) = alice_and_bob();
+
+    let mut relays = [(
+        1,
+        TestRelay::new(
+            SocketAddrV4::new(Ipv4Addr::LOCALHOST, 3478),
+            debug_span!("Roger"),
+        ),
+    )];
+    let mut alice = TestNode::new(debug_span!("Alice"), alice, "1.1.1.1:80").with_relays(
+        "alice",
+        HashSet::default(),
+        &mut relays,
+        clock.now,
+    );
+    let mut bob = TestNode::new(debug_span!("Bob"), bob, "2.2.2.2:80").with_relays(
+        "bob",
+        HashSet::default(),
+        &mut relays,
+        clock.now,
+    );
+    let firewall = Firewall::default();
+
+    handshake(&mut alice, &mut bob, &clock);
+
+    loop {
+        if alice.is_connected_to(&bob) && bob.is_connected_to(&alice) {
+            break;
+        }
+
+        progress(&mut alice, &mut bob, &mut relays, &firewall, &mut clock);
+    }
+
+    assert_eq!(alice.node.path_mtu(1), Some(snownet::MIN_MTU));
+
+    let start = clock.now;
+
+    while clock.elapsed(start) <= Duration::from_secs(5) {
+        progress(&mut alice, &mut bob, &mut relays, &firewall, &mut clock);
+    }
+
+    assert_eq!(alice.node.path_mtu(1), Some(snownet::MAX_MTU));
+    assert_eq!(bob.node.path_mtu(1), Some(snownet::MAX_MTU));
+    assert!(
+        alice.received_packets.is_empty(),
+        "probes must not leak out of the tunnel"
+    );
+    assert!(
+        bob.received_packets.is_empty(),
+        "probes must not leak out of the tunnel"
+    );
+}
+
+#[test]
+fn rejects_packets_larger_than_path_mtu_even_if_they_may_be_fragmented() {
+    let _guard = setup_tracing();
+    let mut clock = Clock::new();
+
+    let (alice, bob) = alice_and_bob();
+
+    let mut relays = [(
+        1,
+        TestRelay::new(
+            SocketAddrV4::new(Ipv4Addr::LOCALHOST, 3478),
+            debug_span!("Roger"),
+        ),
+    )];
+    let mut alice = TestNode::new(debug_span!("Alice"), alice, "1.1.1.1:80").with_relays(
+        "alice",
+        HashSet::default(),
+        &mut relays,
+        clock.now,
+    );
+    let mut bob = TestNode::new(debug_span!("Bob"), bob, "2.2.2.2:80").with_relays(
+        "bob",
+        HashSet::default(),
+        &mut relays,
+        clock.now,
+    );
+    let firewall = Firewall::default();
+
+    handshake(&mut alice, &mut bob, &clock);
+
+    loop {
+        if alice.is_connected_to(&bob) && bob.is_connected_to(&alice) {
+            break;
+        }
+
+        progress(&mut alice, &mut bob, &mut relays, &firewall, &mut clock);
+    }
+
+    let mut packet = ip_packet::make::udp_packet(
+        ip("100.64.0.1"),
+        ip("10.0.0.1"),
+        1234,
+        5678,
+        vec![0; snownet::MIN_MTU],
+    )
+    .packet()
+    .to_vec();
+    packet[6] = 0; // Clear "don't fragment".
+    let packet = IpPacket::owned(packet).unwrap();
+    assert!(!packet.dont_fragment());
+
+    let result = alice.node.encapsulate(1, packet, clock.now);
+
+    assert!(matches!(
+        result,
+        Err(snownet::Error::PacketTooBig {
+            mtu: snownet::MIN_MTU
+        })
+    ));
+}
+
+#[test]
+fn measures_rtt_after_connecting() {
+    let _guard = setup_tracing();
+    let mut clock = Clock::new();
+
+    let (alice, bob) = alice_and_bob();
+
+    let mut relays = [(
+        1,
+        TestRelay::new(
+            SocketAddrV4::new(Ipv4Addr::LOCALHOST, 3478),
+            debug_span!("Roger"),
+        ),
+    )];
+    let mut alice = TestNode::new(debug_span!("Alice"), alice, "1.1.1.1:80").with_relays(
+        "alice",
+        HashSet::default(),
+        &mut relays,
+        clock.now,
+    );
+    let mut bob = TestNode::new(debug_span!("Bob"), bob, "2.2.2.2:80").with_relays(
+        "bob",
+        HashSet::default(),
+        &mut relays,
+        clock.now,
+    );
+    let firewall = Firewall::default();
+
+    handshake(&mut alice, &mut bob, &clock);
+
+    loop {
+        if alice.is_connected_to(&bob) && bob.is_connected_to(&alice) {
+            break;
+        }
+
+        progress(&mut alice, &mut bob, &mut relays, &firewall, &mut clock);
+    }
+
+    let start = clock.now;
+
+    while clock.elapsed(start) <= Duration::from_secs(10) {
+        progress(&mut alice, &mut bob, &mut relays, &firewall, &mut clock);
+    }
+
+    let (_, mut connections) = alice.node.stats();
+    let (_, stats) = connections.next().unwrap();
+
+    assert!(stats.rtt.is_some());
+    assert_eq!(stats.loss, 0.0);
+    assert_ne!(stats.path, snownet::PathType::None);
+    assert!(
+        alice.received_packets.is_empty(),
+        "pings must not leak out of the tunnel"
+    );
+}
+
 #[test]
 fn connection_times_out_after_20_seconds() {
     let (mut alice, _) = alice_and_bob();
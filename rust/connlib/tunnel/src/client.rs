@@ -1,3 +1,7 @@
+mod stats;
+
+pub use stats::{ClientStats, GatewayConnection, ResourceTraffic};
+
 use crate::dns::StubResolver;
 use crate::io::DnsQueryError;
 use crate::peer_store::PeerStore;
@@ -9,14 +13,14 @@ use connlib_shared::error::ConnlibError as Error;
 use connlib_shared::messages::client::{Site, SiteId};
 use connlib_shared::messages::ResolveRequest;
 use connlib_shared::messages::{
-    client::ResourceDescription, client::ResourceDescriptionCidr, Answer, ClientPayload, DnsServer,
-    GatewayId, Interface as InterfaceConfig, IpDnsServer, Key, Offer, Relay, RelayId,
-    RequestConnection, ResourceId, ReuseConnection,
+    client::ResourceDescription, Answer, ClientPayload, DnsServer, GatewayId,
+    Interface as InterfaceConfig, IpDnsServer, Key, Offer, Relay, RelayId, RequestConnection,
+    ResourceId, ReuseConnection,
 };
 use connlib_shared::{callbacks, Callbacks, DomainName, PublicKey, StaticSecret};
 use ip_network::{IpNetwork, Ipv4Network, Ipv6Network};
 use ip_network_table::IpNetworkTable;
-use ip_packet::{IpPacket, MutableIpPacket, Packet as _};
+use ip_packet::{Ecn, IpPacket, MutableIpPacket, Packet as _};
 use itertools::Itertools;
 use tracing::Level;
 
@@ -53,13 +57,14 @@ where
         &mut self,
         resources: Vec<ResourceDescription>,
     ) -> connlib_shared::Result<()> {
-        self.role_state.set_resources(resources);
+        if !self.role_state.set_resources(resources) {
+            return Ok(());
+        }
 
         self.io
             .device_mut()
             .set_routes(self.role_state.routes().collect(), &self.callbacks)?;
-        self.callbacks
-            .on_update_resources(self.role_state.resources());
+        self.role_state.on_resources_changed();
 
         Ok(())
     }
@@ -79,8 +84,7 @@ where
         self.io
             .device_mut()
             .set_routes(self.role_state.routes().collect(), &self.callbacks)?;
-        self.callbacks
-            .on_update_resources(self.role_state.resources());
+        self.role_state.on_resources_changed();
 
         Ok(())
     }
@@ -96,8 +100,7 @@ where
             tracing::error!(?ids, "Failed to update routes: {err:?}");
         }
 
-        self.callbacks
-            .on_update_resources(self.role_state.resources())
+        self.role_state.on_resources_changed();
     }
 
     /// Updates the system's dns
@@ -169,9 +172,7 @@ where
         self.role_state.set_resource_offline(id);
 
         self.role_state.on_connection_failed(id);
-
-        self.callbacks
-            .on_update_resources(self.role_state.resources());
+        self.role_state.on_resources_changed();
     }
 
     pub fn add_ice_candidate(&mut self, conn_id: GatewayId, ice_candidate: String) {
@@ -183,6 +184,11 @@ where
         self.role_state.remove_ice_candidate(conn_id, ice_candidate);
     }
 
+    /// A snapshot of the statistics of the data plane.
+    pub fn stats(&self) -> ClientStats {
+        self.role_state.stats()
+    }
+
     pub fn create_or_reuse_connection(
         &mut self,
         resource_id: ResourceId,
@@ -259,8 +265,10 @@ pub struct ClientState {
     sites_status: HashMap<SiteId, Status>,
 
     /// All CIDR resources we know about, indexed by the IP range they cover (like `1.1.0.0/8`).
-    cidr_resources: IpNetworkTable<ResourceDescriptionCidr>,
+    cidr_resources: IpNetworkTable<ResourceId>,
     /// All resources indexed by their ID.
+    ///
+    /// This is the only copy of each description, all other indices only refer to the [`ResourceId`].
     resource_ids: HashMap<ResourceId, ResourceDescription>,
 
     /// The DNS resolvers configured on the system outside of connlib.
@@ -283,6 +291,10 @@ pub struct ClientState {
 
     buffered_events: VecDeque<ClientEvent>,
     buffered_packets: VecDeque<IpPacket<'static>>,
+
+    resource_traffic: HashMap<ResourceId, ResourceTraffic>,
+    encapsulate_drops: u64,
+    decapsulate_drops: u64,
 }
 
 #[derive(Debug, Clone, PartialEq, Eq)]
@@ -314,6 +326,35 @@ impl ClientState {
             gateways_site: Default::default(),
             mangled_dns_queries: Default::default(),
             stub_resolver: StubResolver::new(known_hosts),
+            resource_traffic: Default::default(),
+            encapsulate_drops: 0,
+            decapsulate_drops: 0,
+        }
+    }
+
+    pub(crate) fn stats(&self) -> ClientStats {
+        let (_, connections) = self.node.stats();
+
+        ClientStats {
+            resources: self
+                .resource_traffic
+                .iter()
+                .map(|(id, traffic)| (*id, *traffic))
+                .collect(),
+            gateways: connections
+                .map(|(id, stats)| {
+                    (
+                        id,
+                        GatewayConnection {
+                            rtt: stats.rtt,
+                            loss: stats.loss,
+                            path: stats.path,
+                        },
+                    )
+                })
+                .collect(),
+            encapsulate_drops: self.encapsulate_drops,
+            decapsulate_drops: self.decapsulate_drops,
         }
     }
 
@@ -390,7 +431,10 @@ impl ClientState {
         })
     }
 
-    #[tracing::instrument(level = "trace", skip_all, fields(dst))]
+    #[cfg_attr(
+        feature = "wire-trace",
+        tracing::instrument(level = "trace", skip_all, fields(dst))
+    )]
     pub(crate) fn encapsulate<'s>(
         &'s mut self,
         packet: MutableIpPacket<'_>,
@@ -404,6 +448,7 @@ impl ClientState {
             Err(non_dns_packet) => non_dns_packet,
         };
 
+        #[cfg(feature = "wire-trace")]
         tracing::Span::current().record("dst", tracing::field::display(dest));
 
         if is_definitely_not_a_resource(dest) {
@@ -421,7 +466,7 @@ impl ClientState {
             return None;
         };
 
-        let packet = maybe_mangle_dns_query_to_cidr_resource(
+        let mut packet = maybe_mangle_dns_query_to_cidr_resource(
             packet,
             &self.dns_mapping,
             &mut self.mangled_dns_queries,
@@ -436,11 +481,41 @@ impl ClientState {
 
         let gateway_id = peer.id();
 
-        let transmit = self
+        // Make sure the segments of new TCP connections fit into the tunnel.
+        if let Some(mtu) = self.node.path_mtu(gateway_id) {
+            packet.clamp_tcp_mss(mtu);
+        }
+
+        let len = packet.packet().len();
+
+        let transmit = match self
             .node
             .encapsulate(gateway_id, packet.as_immutable(), now)
-            .inspect_err(|e| tracing::debug!("Failed to encapsulate: {e}"))
-            .ok()??;
+        {
+            Ok(Some(transmit)) => transmit,
+            // WireGuard queued the packet for a handshake or the relay has no channel yet, we only count what we send.
+            Ok(None) => return None,
+            Err(snownet::Error::PacketTooBig { mtu }) => {
+                self.encapsulate_drops += 1;
+                tracing::trace!(%mtu, "Packet exceeds path MTU of gateway");
+
+                self.buffered_packets.push_back(
+                    ip_packet::make::icmp_packet_too_big(packet.as_immutable(), mtu as u16)
+                        .into_immutable(),
+                );
+                return None;
+            }
+            Err(e) => {
+                self.encapsulate_drops += 1;
+                tracing::debug!("Failed to encapsulate: {e}");
+                return None;
+            }
+        };
+
+        self.resource_traffic
+            .entry(resource)
+            .or_default()
+            .on_sent(len);
 
         Some(transmit)
     }
@@ -450,28 +525,53 @@ impl ClientState {
         local: SocketAddr,
         from: SocketAddr,
         packet: &[u8],
+        ecn: Ecn,
         now: Instant,
         buffer: &'b mut [u8],
     ) -> Option<IpPacket<'b>> {
-        let (conn_id, packet) = self.node.decapsulate(
+        let (conn_id, mut packet) = self.node.decapsulate(
             local,
             from,
             packet.as_ref(),
             now,
             buffer,
         )
-        .inspect_err(|e| tracing::debug!(%local, %from, num_bytes = %packet.len(), "Failed to decapsulate incoming packet: {e}"))
+        .inspect_err(|e| {
+            self.decapsulate_drops += 1;
+            tracing::debug!(%local, %from, num_bytes = %packet.len(), "Failed to decapsulate incoming packet: {e}")
+        })
         .ok()??;
 
         let Some(peer) = self.peers.get_mut(&conn_id) else {
+            self.decapsulate_drops += 1;
             tracing::error!(%conn_id, %local, %from, "Couldn't find connection");
 
             return None;
         };
 
-        peer.ensure_allowed_src(&packet)
-            .inspect_err(|e| tracing::debug!(%conn_id, %local, %from, "{e}"))
-            .ok()?;
+        if let Err(e) = peer.ensure_allowed_src(&packet) {
+            self.decapsulate_drops += 1;
+            tracing::debug!(%conn_id, %local, %from, "{e}");
+            return None;
+        }
+
+        if let Err(e) = packet.apply_outer_ecn(ecn) {
+            self.decapsulate_drops += 1;
+            tracing::trace!(%conn_id, %local, %from, "{e}");
+            return None;
+        }
+
+        if let Some(mtu) = self.node.path_mtu(conn_id) {
+            packet.clamp_tcp_mss(mtu);
+        }
+
+        // Account before we mangle DNS responses, the sentinel address isn't a resource.
+        if let Some(resource) = self.get_resource_by_destination(packet.source()) {
+            self.resource_traffic
+                .entry(resource)
+                .or_default()
+                .on_received(packet.packet().len());
+        }
 
         let packet = maybe_mangle_dns_response_from_cidr_resource(
             packet,
@@ -757,12 +857,9 @@ impl ClientState {
         let maybe_cidr_resource_id = self
             .cidr_resources
             .longest_match(destination)
-            .map(|(_, res)| res.id);
+            .map(|(_, id)| *id);
 
-        let maybe_dns_resource_id = self
-            .stub_resolver
-            .get_description(&destination)
-            .map(|r| r.id);
+        let maybe_dns_resource_id = self.stub_resolver.get_resource_id(&destination);
 
         maybe_cidr_resource_id.or(maybe_dns_resource_id)
     }
@@ -842,10 +939,7 @@ impl ClientState {
         }
 
         if resources_changed {
-            self.buffered_events
-                .push_back(ClientEvent::ResourcesChanged {
-                    resources: self.resources(),
-                });
+            self.on_resources_changed();
         }
 
         for (conn_id, candidates) in added_ice_candidates.drain() {
@@ -865,6 +959,16 @@ impl ClientState {
         }
     }
 
+    /// Notifies the layer above us about the new state of our resources.
+    ///
+    /// This is an event rather than a callback so that it can coalesce bursts of changes.
+    pub(crate) fn on_resources_changed(&mut self) {
+        self.buffered_events
+            .push_back(ClientEvent::ResourcesChanged {
+                resources: self.resources(),
+            });
+    }
+
     fn update_site_status_by_gateway(&mut self, gateway_id: &GatewayId, status: Status) {
         // Note: we can do this because in theory we shouldn't have multiple gateways for the same site
         // connected at the same time.
@@ -897,94 +1001,116 @@ impl ClientState {
     /// Instead, it diffs which resources to remove and which ones to add.
     ///
     /// This is important because we don't want to lose state like resolved DNS names for resources that didn't change.
+    /// The diff is keyed by [`ResourceId`], so it is linear in the number of resources and only touches the ones that changed.
     ///
-    /// TODO: Add a test that asserts the above.
-    ///       That is tricky because we need to assert on state deleted by [`ClientState::remove_resources`] and check that it did in fact not get deleted.
-    fn set_resources(&mut self, new_resources: Vec<ResourceDescription>) {
-        self.remove_resources(
-            &HashSet::from_iter(self.resource_ids.keys().copied())
-                .difference(&HashSet::<ResourceId>::from_iter(
-                    new_resources.iter().map(|r| r.id()),
-                ))
-                .copied()
-                .collect_vec(),
-        );
+    /// Returns whether any resource was added, changed or removed.
+    fn set_resources(&mut self, new_resources: Vec<ResourceDescription>) -> bool {
+        let new_ids = HashSet::<ResourceId>::from_iter(new_resources.iter().map(|r| r.id()));
 
-        self.add_resources(
-            &HashSet::from_iter(new_resources.iter().cloned())
-                .difference(&HashSet::<ResourceDescription>::from_iter(
-                    self.resource_ids.values().cloned(),
-                ))
-                .cloned()
-                .collect_vec(),
-        );
+        let to_remove = self
+            .resource_ids
+            .keys()
+            .filter(|id| !new_ids.contains(id))
+            .copied()
+            .collect_vec();
+        let to_add = new_resources
+            .into_iter()
+            .filter(|r| self.resource_ids.get(&r.id()) != Some(r))
+            .collect_vec();
+
+        if to_remove.is_empty() && to_add.is_empty() {
+            return false;
+        }
+
+        self.remove_resources(&to_remove);
+        for resource in to_add {
+            self.add_resource(resource);
+        }
+
+        true
     }
 
     pub(crate) fn add_resources(&mut self, resources: &[ResourceDescription]) {
-        for resource_description in resources {
-            if let Some(resource) = self.resource_ids.get(&resource_description.id()) {
-                if resource.has_different_address(resource_description) {
-                    self.remove_resources(&[resource.id()]);
-                }
-            }
+        for resource in resources {
+            self.add_resource(resource.clone());
+        }
+    }
 
-            match &resource_description {
-                ResourceDescription::Dns(dns) => {
-                    self.stub_resolver.add_resource(dns);
-                }
-                ResourceDescription::Cidr(cidr) => {
-                    let existing = self.cidr_resources.insert(cidr.address, cidr.clone());
+    fn add_resource(&mut self, resource_description: ResourceDescription) {
+        if let Some(resource) = self.resource_ids.get(&resource_description.id()) {
+            if resource.has_different_address(&resource_description) {
+                self.remove_resources(&[resource.id()]);
+            }
+        }
 
-                    match existing {
-                        Some(existing) if existing.id != cidr.id => {
-                            tracing::info!(address = %cidr.address, old = %existing.name, new = %cidr.name, "Replacing CIDR resource");
-                        }
-                        Some(_) => {}
-                        None => {
-                            tracing::info!(address = %cidr.address, name = %cidr.name, "Activating CIDR resource");
-                        }
+        match &resource_description {
+            ResourceDescription::Dns(dns) => {
+                self.stub_resolver.add_resource(dns);
+            }
+            ResourceDescription::Cidr(cidr) => {
+                let existing = self.cidr_resources.insert(cidr.address, cidr.id);
+
+                match existing {
+                    Some(existing) if existing != cidr.id => {
+                        let old = self
+                            .resource_ids
+                            .get(&existing)
+                            .map(|r| r.name())
+                            .unwrap_or_default();
+                        tracing::info!(address = %cidr.address, %old, new = %cidr.name, "Replacing CIDR resource");
+                    }
+                    Some(_) => {}
+                    None => {
+                        tracing::info!(address = %cidr.address, name = %cidr.name, "Activating CIDR resource");
                     }
                 }
             }
-
-            self.resource_ids
-                .insert(resource_description.id(), resource_description.clone());
         }
+
+        self.resource_ids
+            .insert(resource_description.id(), resource_description);
     }
 
     #[tracing::instrument(level = "debug", skip_all, fields(?ids))]
     pub(crate) fn remove_resources(&mut self, ids: &[ResourceId]) {
-        for id in ids {
+        let ids = HashSet::<ResourceId>::from_iter(ids.iter().copied());
+        let mut affected_gateways = HashSet::<GatewayId>::new();
+
+        for id in &ids {
             self.awaiting_connection_details.remove(id);
-            self.stub_resolver.remove_resource(*id);
-            self.cidr_resources.retain(|_, r| {
-                if r.id == *id {
-                    tracing::info!(address = %r.address, name = %r.name, "Deactivating CIDR resource");
-                    return false;
-                }
+            self.resource_traffic.remove(id);
 
-                true
-            });
+            if let Some(gateway_id) = self.resources_gateways.get(id) {
+                affected_gateways.insert(*gateway_id);
+            }
 
-            self.resource_ids.remove(id);
+            // Resources are indexed by their address, look them up via their description instead of scanning all of them.
+            match self.resource_ids.remove(id) {
+                Some(ResourceDescription::Dns(dns)) => self.stub_resolver.remove_resource(&dns),
+                Some(ResourceDescription::Cidr(cidr)) => {
+                    // Another resource with the same address might have replaced this one.
+                    if self
+                        .cidr_resources
+                        .exact_match(cidr.address)
+                        .is_some_and(|r| r == id)
+                    {
+                        self.cidr_resources.remove(cidr.address);
+                        tracing::info!(address = %cidr.address, name = %cidr.name, "Deactivating CIDR resource");
+                    }
+                }
+                None => {}
+            }
+        }
 
-            let Some(peer) = peer_by_resource_mut(&self.resources_gateways, &mut self.peers, *id)
-            else {
+        // Visit the allowed IPs of each affected gateway once, regardless of how many of its resources we removed.
+        for gateway_id in affected_gateways {
+            let Some(peer) = self.peers.get_mut(&gateway_id) else {
                 continue;
             };
-            let gateway_id = peer.id();
 
-            // First we remove the id from all allowed ips
-            for (_, resources) in peer
-                .allowed_ips
-                .iter_mut()
-                .filter(|(_, resources)| resources.contains(id))
-            {
-                resources.remove(id);
-
-                if !resources.is_empty() {
-                    continue;
-                }
+            // First we remove the ids from all allowed ips
+            for (_, resources) in peer.allowed_ips.iter_mut() {
+                resources.retain(|r| !ids.contains(r));
             }
 
             // We remove all empty allowed ips entry since there's no resource that corresponds to it
@@ -1524,7 +1650,10 @@ mod tests {
 #[cfg(all(test, feature = "proptest"))]
 mod proptests {
     use super::*;
-    use connlib_shared::{messages::client::ResourceDescriptionDns, proptest::*};
+    use connlib_shared::{
+        messages::client::{ResourceDescriptionCidr, ResourceDescriptionDns},
+        proptest::*,
+    };
 
     pub fn expected_routes(resource_routes: Vec<IpNetwork>) -> HashSet<IpNetwork> {
         HashSet::from_iter(
@@ -1633,6 +1762,33 @@ mod proptests {
         );
     }
 
+    #[test_strategy::proptest]
+    fn removing_replaced_cidr_resource_keeps_the_replacement(
+        #[strategy(cidr_resource(8))] old: ResourceDescriptionCidr,
+        #[strategy(cidr_resource(8))] new: ResourceDescriptionCidr,
+    ) {
+        proptest::prop_assume!(old.id != new.id);
+
+        let new = ResourceDescriptionCidr {
+            address: old.address,
+            ..new
+        };
+        let mut client_state = ClientState::for_test();
+
+        client_state.add_resources(&[ResourceDescription::Cidr(old.clone())]);
+        client_state.add_resources(&[ResourceDescription::Cidr(new.clone())]);
+        client_state.remove_resources(&[old.id]);
+
+        assert_eq!(
+            client_state.get_resource_by_destination(new.address.network_address()),
+            Some(new.id)
+        );
+        assert_eq!(
+            hashset(client_state.routes()),
+            expected_routes(vec![new.address])
+        );
+    }
+
     #[test_strategy::proptest]
     fn adding_cidr_resource_with_same_id_as_dns_resource_replaces_dns_resource(
         #[strategy(dns_resource())] resource: ResourceDescriptionDns,
@@ -1735,6 +1891,25 @@ mod proptests {
         );
     }
 
+    #[test_strategy::proptest]
+    fn setting_same_resources_is_a_no_op(
+        #[strategy(dns_resource())] dns_resource: ResourceDescriptionDns,
+        #[strategy(cidr_resource(8))] cidr_resource: ResourceDescriptionCidr,
+    ) {
+        let resources = vec![
+            ResourceDescription::Dns(dns_resource),
+            ResourceDescription::Cidr(cidr_resource.clone()),
+        ];
+        let mut client_state = ClientState::for_test();
+
+        assert!(client_state.set_resources(resources.clone()));
+        assert!(!client_state.set_resources(resources));
+        assert_eq!(
+            hashset(client_state.routes()),
+            expected_routes(vec![cidr_resource.address])
+        );
+    }
+
     #[test_strategy::proptest]
     fn setting_gateway_online_sets_all_related_resources_online(
         #[strategy(resources_sharing_site())] resource_config_online: (
@@ -0,0 +1,52 @@
+//! Statistics of the client's data plane.
+//!
+//! Like on the gateway, all counters are plain integers updated inline by [`ClientState`](crate::ClientState).
+//! Take a snapshot via [`ClientTunnel::stats`](crate::ClientTunnel::stats) and export it from there.
+
+use connlib_shared::messages::{GatewayId, ResourceId};
+use snownet::PathType;
+use std::time::Duration;
+
+/// IP packets exchanged with a resource, counted on the TUN device.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct ResourceTraffic {
+    /// Packets read from the TUN device and sent to the resource's gateway.
+    pub packets_sent: u64,
+    pub bytes_sent: u64,
+    /// Packets received from the resource's gateway and written to the TUN device.
+    pub packets_received: u64,
+    pub bytes_received: u64,
+}
+
+impl ResourceTraffic {
+    pub(crate) fn on_sent(&mut self, len: usize) {
+        self.packets_sent += 1;
+        self.bytes_sent += len as u64;
+    }
+
+    pub(crate) fn on_received(&mut self, len: usize) {
+        self.packets_received += 1;
+        self.bytes_received += len as u64;
+    }
+}
+
+/// The quality of our connection to a gateway, see [`snownet::ConnectionStats`].
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+pub struct GatewayConnection {
+    pub rtt: Option<Duration>,
+    pub loss: f32,
+    pub path: PathType,
+}
+
+#[derive(Debug, Default, Clone, PartialEq)]
+pub struct ClientStats {
+    /// Traffic of each resource we currently know about.
+    pub resources: Vec<(ResourceId, ResourceTraffic)>,
+    /// Each gateway we are connected to.
+    pub gateways: Vec<(GatewayId, GatewayConnection)>,
+
+    /// Packets from the TUN device that we failed to send through the tunnel.
+    pub encapsulate_drops: u64,
+    /// Packets from the network that we didn't write to the TUN device.
+    pub decapsulate_drops: u64,
+}
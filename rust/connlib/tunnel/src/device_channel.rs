@@ -22,6 +22,7 @@ use tun_android as tun;
 #[cfg(target_family = "unix")]
 mod utils;
 
+use crate::wire_trace::wire_trace;
 use connlib_shared::{error::ConnlibError, messages::Interface, Callbacks, Error};
 use connlib_shared::{Cidrv4, Cidrv6};
 use ip_network::IpNetwork;
@@ -35,6 +36,11 @@ use tun::Tun;
 pub struct Device {
     tun: Option<Tun>,
     waker: Option<Waker>,
+    /// The routes we last handed to the OS, `None` if the device has not seen any routes since it was (re-)configured.
+    routes: Option<HashSet<IpNetwork>>,
+    /// Whether to open one of several queues of the TUN device.
+    #[cfg(target_os = "linux")]
+    multi_queue: bool,
 }
 
 #[allow(dead_code)]
@@ -58,9 +64,18 @@ impl Device {
         Self {
             tun: None,
             waker: None,
+            routes: None,
+            #[cfg(target_os = "linux")]
+            multi_queue: false,
         }
     }
 
+    /// Opens the TUN device as one of several queues, must be called before [`Device::set_config`].
+    #[cfg(target_os = "linux")]
+    pub(crate) fn set_multi_queue(&mut self) {
+        self.multi_queue = true;
+    }
+
     #[cfg(target_os = "android")]
     pub(crate) fn set_config(
         &mut self,
@@ -69,6 +84,7 @@ impl Device {
         callbacks: &impl Callbacks,
     ) -> Result<(), ConnlibError> {
         self.tun = Some(Tun::new(config, dns_config, callbacks)?);
+        self.routes = None;
 
         if let Some(waker) = self.waker.take() {
             waker.wake();
@@ -94,10 +110,16 @@ impl Device {
         // this unregisters the file descriptor with the reactor so we never wake up
         // in case an event is triggered.
         if self.tun.is_none() {
-            self.tun = Some(Tun::new()?);
+            #[cfg(target_os = "linux")]
+            let tun = Tun::new(self.multi_queue)?;
+            #[cfg(not(target_os = "linux"))]
+            let tun = Tun::new()?;
+
+            self.tun = Some(tun);
         }
 
         callbacks.on_set_interface_config(config.ipv4, config.ipv6, dns_config);
+        self.routes = None;
 
         if let Some(waker) = self.waker.take() {
             waker.wake();
@@ -135,7 +157,7 @@ impl Device {
             )
         })?;
 
-        tracing::trace!(target: "wire::dev::recv", dst = %packet.destination(), src = %packet.source(), bytes = %packet.packet().len());
+        wire_trace!(target: "wire::dev::recv", dst = %packet.destination(), src = %packet.source(), bytes = %packet.packet().len());
 
         Poll::Ready(Ok(packet))
     }
@@ -169,7 +191,7 @@ impl Device {
             )
         })?;
 
-        tracing::trace!(target: "wire::dev::recv", dst = %packet.destination(), src = %packet.source(), bytes = %packet.packet().len());
+        wire_trace!(target: "wire::dev::recv", dst = %packet.destination(), src = %packet.source(), bytes = %packet.packet().len());
 
         Poll::Ready(Ok(packet))
     }
@@ -186,12 +208,19 @@ impl Device {
         routes: HashSet<IpNetwork>,
         callbacks: &impl Callbacks,
     ) -> Result<(), Error> {
-        self.tun_mut()?.set_routes(routes, callbacks)?;
+        // Reprogramming routes is expensive for the OS (and on Android, re-creates the TUN device), skip it if nothing changed.
+        if self.routes.as_ref() == Some(&routes) {
+            return Ok(());
+        }
+
+        self.tun_mut()?.set_routes(routes.clone(), callbacks)?;
+        self.routes = Some(routes);
+
         Ok(())
     }
 
     pub fn write(&self, packet: IpPacket<'_>) -> io::Result<usize> {
-        tracing::trace!(target: "wire::dev::send", dst = %packet.destination(), src = %packet.source(), bytes = %packet.packet().len());
+        wire_trace!(target: "wire::dev::send", dst = %packet.destination(), src = %packet.source(), bytes = %packet.packet().len());
 
         match packet {
             IpPacket::Ipv4(msg) => self.tun()?.write4(msg.packet()),
@@ -3,8 +3,8 @@ use crate::device_channel::ioctl;
 use connlib_shared::{tun_device_manager::platform::IFACE_NAME, Callbacks, Error, Result};
 use ip_network::IpNetwork;
 use libc::{
-    close, fcntl, makedev, mknod, open, F_GETFL, F_SETFL, IFF_NO_PI, IFF_TUN, O_NONBLOCK, O_RDWR,
-    S_IFCHR,
+    close, fcntl, makedev, mknod, open, F_GETFL, F_SETFL, IFF_MULTI_QUEUE, IFF_NO_PI, IFF_TUN,
+    O_NONBLOCK, O_RDWR, S_IFCHR,
 };
 use std::collections::HashSet;
 use std::path::Path;
@@ -50,7 +50,10 @@ impl Tun {
         utils::poll_raw_fd(&self.fd, |fd| read(fd, buf), cx)
     }
 
-    pub fn new() -> Result<Self> {
+    /// Opens the TUN device.
+    ///
+    /// With `multi_queue`, every call opens another queue of the same device and the kernel spreads packets across them.
+    pub fn new(multi_queue: bool) -> Result<Self> {
         create_tun_device()?;
 
         let fd = match unsafe { open(TUN_FILE.as_ptr() as _, O_RDWR) } {
@@ -63,7 +66,7 @@ impl Tun {
             ioctl::exec(
                 fd,
                 TUNSETIFF,
-                &mut ioctl::Request::<SetTunFlagsPayload>::new(),
+                &mut ioctl::Request::<SetTunFlagsPayload>::new(multi_queue),
             )?;
         }
 
@@ -151,18 +154,21 @@ fn write(fd: RawFd, buf: &[u8]) -> io::Result<usize> {
 }
 
 impl ioctl::Request<SetTunFlagsPayload> {
-    fn new() -> Self {
+    fn new(multi_queue: bool) -> Self {
         let name_as_bytes = IFACE_NAME.as_bytes();
         debug_assert!(name_as_bytes.len() < libc::IF_NAMESIZE);
 
         let mut name = [0u8; libc::IF_NAMESIZE];
         name[..name_as_bytes.len()].copy_from_slice(name_as_bytes);
 
+        let mut flags = IFF_TUN | IFF_NO_PI;
+        if multi_queue {
+            flags |= IFF_MULTI_QUEUE;
+        }
+
         Self {
             name,
-            payload: SetTunFlagsPayload {
-                flags: (IFF_TUN | IFF_NO_PI) as _,
-            },
+            payload: SetTunFlagsPayload { flags: flags as _ },
         }
     }
 }
@@ -128,7 +128,9 @@ pub struct StubResolver {
     ips_to_fqdn: HashMap<IpAddr, DomainName>,
     ip_provider: IpProvider,
     /// All DNS resources we know about, indexed by their domain (could be wildcard domain like `*.mycompany.com`).
-    dns_resources: HashMap<String, ResourceDescriptionDns>,
+    ///
+    /// The descriptions themselves live in [`ClientState`](crate::ClientState), we only need to know which resource a domain belongs to.
+    dns_resources: HashMap<String, ResourceId>,
     /// Fixed dns name that will be resolved to fixed ip addrs, similar to /etc/hosts
     known_hosts: KnownHosts,
 }
@@ -167,9 +169,9 @@ impl StubResolver {
         }
     }
 
-    pub(crate) fn get_description(&self, ip: &IpAddr) -> Option<ResourceDescriptionDns> {
+    pub(crate) fn get_resource_id(&self, ip: &IpAddr) -> Option<ResourceId> {
         let name = self.ips_to_fqdn.get(ip)?;
-        get_description(name, &self.dns_resources)
+        get_resource_id(name, &self.dns_resources)
     }
 
     pub(crate) fn get_fqdn(&self, ip: &IpAddr) -> Option<(&DomainName, &Vec<IpAddr>)> {
@@ -180,22 +182,23 @@ impl StubResolver {
     pub(crate) fn add_resource(&mut self, resource: &ResourceDescriptionDns) {
         let existing = self
             .dns_resources
-            .insert(resource.address.clone(), resource.clone());
+            .insert(resource.address.clone(), resource.id);
 
         if existing.is_none() {
             tracing::info!(address = %resource.address, "Activating DNS resource");
         }
     }
 
-    pub(crate) fn remove_resource(&mut self, id: ResourceId) {
-        self.dns_resources.retain(|_, r| {
-            if r.id == id {
-                tracing::info!(address = %r.address, "Deactivating DNS resource");
-                return false;
-            }
-
-            true
-        });
+    pub(crate) fn remove_resource(&mut self, resource: &ResourceDescriptionDns) {
+        // Another resource with the same address might have replaced this one.
+        if self
+            .dns_resources
+            .get(&resource.address)
+            .is_some_and(|id| *id == resource.id)
+        {
+            self.dns_resources.remove(&resource.address);
+            tracing::info!(address = %resource.address, "Deactivating DNS resource");
+        }
     }
 
     fn get_or_assign_ips(&mut self, fqdn: DomainName) -> Vec<IpAddr> {
@@ -258,7 +261,7 @@ impl StubResolver {
         match question.qtype() {
             Rtype::PTR => reverse_dns_addr(&question.qname().to_name::<Vec<_>>().to_string())
                 .is_some_and(|addr| self.fqdn_to_ips.values().flatten().contains(&addr)),
-            _ => get_description(&question.qname().to_name(), &self.dns_resources).is_some(),
+            _ => get_resource_id(&question.qname().to_name(), &self.dns_resources).is_some(),
         }
     }
 
@@ -476,12 +479,12 @@ pub fn is_subdomain(name: &DomainName, resource: &str) -> bool {
     name == &resource
 }
 
-fn get_description(
+fn get_resource_id(
     name: &DomainName,
-    dns_resources: &HashMap<String, ResourceDescriptionDns>,
-) -> Option<ResourceDescriptionDns> {
+    dns_resources: &HashMap<String, ResourceId>,
+) -> Option<ResourceId> {
     if let Some(resource) = dns_resources.get(&name.to_string()) {
-        return Some(resource.clone());
+        return Some(*resource);
     }
 
     if let Some(resource) = dns_resources.get(
@@ -491,7 +494,7 @@ fn get_description(
             .ok()?
             .to_string(),
     ) {
-        return Some(resource.clone());
+        return Some(*resource);
     }
 
     if let Some(parent) = name.parent() {
@@ -502,14 +505,14 @@ fn get_description(
                 .ok()?
                 .to_string(),
         ) {
-            return Some(resource.clone());
+            return Some(*resource);
         }
     }
 
     name.iter_suffixes().find_map(|n| {
         dns_resources
             .get(&RelativeName::wildcard_vec().chain(n).ok()?.to_string())
-            .cloned()
+            .copied()
     })
 }
 
@@ -562,11 +565,14 @@ fn get_v6(ip: IpAddr) -> Option<Ipv6Addr> {
 
 #[cfg(test)]
 mod test {
-    use connlib_shared::{messages::client::ResourceDescriptionDns, DomainName};
+    use connlib_shared::{
+        messages::{client::ResourceDescriptionDns, ResourceId},
+        DomainName,
+    };
 
     use crate::dns::is_subdomain;
 
-    use super::{get_description, reverse_dns_addr};
+    use super::{get_resource_id, reverse_dns_addr};
     use std::{collections::HashMap, net::Ipv4Addr};
 
     fn foo() -> ResourceDescriptionDns {
@@ -608,14 +614,14 @@ mod test {
         .unwrap()
     }
 
-    fn dns_resource_fixture() -> HashMap<String, ResourceDescriptionDns> {
+    fn dns_resource_fixture() -> HashMap<String, ResourceId> {
         let mut dns_resources_fixture = HashMap::new();
 
-        dns_resources_fixture.insert("*.foo.com".to_string(), foo());
+        dns_resources_fixture.insert("*.foo.com".to_string(), foo().id);
 
-        dns_resources_fixture.insert("?.bar.com".to_string(), bar());
+        dns_resources_fixture.insert("?.bar.com".to_string(), bar().id);
 
-        dns_resources_fixture.insert("baz.com".to_string(), baz());
+        dns_resources_fixture.insert("baz.com".to_string(), baz().id);
 
         dns_resources_fixture
     }
@@ -678,33 +684,33 @@ mod test {
         let dns_resources_fixture = dns_resource_fixture();
 
         assert_eq!(
-            get_description(
+            get_resource_id(
                 &DomainName::vec_from_str("a.foo.com").unwrap(),
                 &dns_resources_fixture,
             )
             .unwrap(),
-            foo(),
+            foo().id,
         );
 
         assert_eq!(
-            get_description(
+            get_resource_id(
                 &DomainName::vec_from_str("foo.com").unwrap(),
                 &dns_resources_fixture,
             )
             .unwrap(),
-            foo(),
+            foo().id,
         );
 
         assert_eq!(
-            get_description(
+            get_resource_id(
                 &DomainName::vec_from_str("a.b.foo.com").unwrap(),
                 &dns_resources_fixture,
             )
             .unwrap(),
-            foo(),
+            foo().id,
         );
 
-        assert!(get_description(
+        assert!(get_resource_id(
             &DomainName::vec_from_str("oo.com").unwrap(),
             &dns_resources_fixture,
         )
@@ -716,24 +722,24 @@ mod test {
         let dns_resources_fixture = dns_resource_fixture();
 
         assert_eq!(
-            get_description(
+            get_resource_id(
                 &DomainName::vec_from_str("a.bar.com").unwrap(),
                 &dns_resources_fixture,
             )
             .unwrap(),
-            bar(),
+            bar().id,
         );
 
         assert_eq!(
-            get_description(
+            get_resource_id(
                 &DomainName::vec_from_str("bar.com").unwrap(),
                 &dns_resources_fixture,
             )
             .unwrap(),
-            bar(),
+            bar().id,
         );
 
-        assert!(get_description(
+        assert!(get_resource_id(
             &DomainName::vec_from_str("a.b.bar.com").unwrap(),
             &dns_resources_fixture,
         )
@@ -745,21 +751,21 @@ mod test {
         let dns_resources_fixture = dns_resource_fixture();
 
         assert_eq!(
-            get_description(
+            get_resource_id(
                 &DomainName::vec_from_str("baz.com").unwrap(),
                 &dns_resources_fixture,
             )
             .unwrap(),
-            baz(),
+            baz().id,
         );
 
-        assert!(get_description(
+        assert!(get_resource_id(
             &DomainName::vec_from_str("a.baz.com").unwrap(),
             &dns_resources_fixture,
         )
         .is_none());
 
-        assert!(get_description(
+        assert!(get_resource_id(
             &DomainName::vec_from_str("a.b.baz.com").unwrap(),
             &dns_resources_fixture,
         )
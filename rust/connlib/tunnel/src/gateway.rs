@@ -1,27 +1,91 @@
 use crate::peer::ClientOnGateway;
 use crate::peer_store::PeerStore;
+use crate::sockets::{ControlQueueStats, QueueStats, ReceiveStats};
 use crate::utils::earliest;
 use crate::{GatewayEvent, GatewayTunnel};
 use boringtun::x25519::PublicKey;
 use chrono::{DateTime, Utc};
 use connlib_shared::messages::{
-    gateway::ResolvedResourceDescriptionDns, gateway::ResourceDescription, Answer, ClientId,
-    Interface as InterfaceConfig, Key, Offer, RelayId, ResourceId,
+    gateway::RateLimit, gateway::ResolvedResourceDescriptionDns, gateway::ResourceDescription,
+    Answer, ClientId, Interface as InterfaceConfig, Key, Offer, RelayId, ResourceId,
 };
 use connlib_shared::{Callbacks, DomainName, Error, Result, StaticSecret};
-use ip_packet::{IpPacket, MutableIpPacket};
+use ip_packet::{Ecn, IpPacket, MutableIpPacket, Packet as _};
 use secrecy::{ExposeSecret as _, Secret};
 use snownet::{RelaySocket, ServerNode};
 use std::collections::{HashMap, HashSet, VecDeque};
+use std::hash::{Hash as _, Hasher as _};
 use std::net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr};
 use std::time::{Duration, Instant};
 
+pub use stats::{ClientQueue, DropReason, Drops, GatewayStats, Traffic};
+
+mod stats;
+
 const EXPIRE_RESOURCES_INTERVAL: Duration = Duration::from_secs(1);
 
+/// How many buffers of [`ForeignPacket`]s a shard keeps around for reuse.
+const MAX_FOREIGN_PACKET_BUFFERS: usize = 1024;
+
+/// The tag of a client's datagrams in our send queues, see [`Priority::Data`](crate::sockets::Priority::Data).
+pub(crate) fn queue_tag(client: &ClientId) -> u64 {
+    let mut hasher = std::collections::hash_map::DefaultHasher::new();
+    client.hash(&mut hasher);
+
+    hasher.finish()
+}
+
 impl<CB> GatewayTunnel<CB>
 where
     CB: Callbacks + 'static,
 {
+    /// Creates one of several tunnels that share the TUN device, each with their own sockets and a disjoint set of clients.
+    ///
+    /// Every shard opens its own queue of the TUN device.
+    /// The kernel may hand us packets for clients of another shard, we emit those as [`GatewayEvent::ForeignPacket`] instead of dropping them.
+    /// Pass them to the owning shard via [`GatewayTunnel::send_to_client`].
+    #[cfg(target_os = "linux")]
+    pub fn new_shard(
+        private_key: StaticSecret,
+        sockets: crate::Sockets,
+        callbacks: CB,
+    ) -> std::io::Result<Self> {
+        let mut tunnel = Self::new(private_key, sockets, callbacks)?;
+        tunnel.io.device_mut().set_multi_queue();
+        tunnel.role_state.forward_unknown_clients = true;
+
+        Ok(tunnel)
+    }
+
+    /// Sends a packet that another shard read from the TUN device to the client.
+    ///
+    /// Hand the packet back to the shard that emitted it afterwards, see [`ForeignPacket`].
+    pub fn send_to_client(&mut self, packet: &mut ForeignPacket) -> Result<()> {
+        let packet = packet.as_mutable();
+        let ecn = packet.ecn();
+
+        let Some((client, transmit)) = self.role_state.encapsulate(packet, Instant::now()) else {
+            return Ok(());
+        };
+
+        self.io.send_network(transmit, ecn, queue_tag(&client))?;
+
+        Ok(())
+    }
+
+    /// Takes back the buffer of a [`ForeignPacket`] we emitted, to reuse it for the next one.
+    pub fn recycle_foreign_packet(&mut self, packet: ForeignPacket) {
+        self.role_state.recycle_foreign_packet(packet);
+    }
+
+    /// Drops a [`ForeignPacket`] we emitted because no shard knows its client.
+    pub fn drop_foreign_packet(&mut self, packet: ForeignPacket) {
+        self.role_state
+            .encapsulate_drops
+            .record(DropReason::UnknownClient);
+        self.role_state.recycle_foreign_packet(packet);
+    }
+
     #[tracing::instrument(level = "trace", skip(self))]
     pub fn set_interface(&mut self, config: &InterfaceConfig) -> connlib_shared::Result<()> {
         // Note: the dns fallback strategy is irrelevant for gateways
@@ -71,7 +135,7 @@ where
     }
 
     pub fn cleanup_connection(&mut self, id: &ClientId) {
-        self.role_state.peers.remove(id);
+        self.role_state.remove_peer(id);
     }
 
     pub fn allow_access(
@@ -96,6 +160,11 @@ where
             .refresh_translation(client, resource_id, name, resolved_ips, Instant::now())
     }
 
+    /// Limits the bandwidth of every client, `None` lifts the limit.
+    pub fn set_client_rate_limit(&mut self, limit: Option<RateLimit>) {
+        self.role_state.set_client_rate_limit(limit);
+    }
+
     pub fn update_resource(&mut self, resource: ResourceDescription) {
         for peer in self.role_state.peers.iter_mut() {
             peer.update_resource(&resource);
@@ -104,14 +173,7 @@ where
 
     #[tracing::instrument(level = "debug", skip_all, fields(%resource, %client))]
     pub fn remove_access(&mut self, client: &ClientId, resource: &ResourceId) {
-        let Some(peer) = self.role_state.peers.get_mut(client) else {
-            return;
-        };
-
-        peer.remove_resource(resource);
-        if peer.is_emptied() {
-            self.role_state.peers.remove(client);
-        }
+        self.role_state.remove_access(client, resource);
 
         tracing::debug!("Access removed");
     }
@@ -124,6 +186,60 @@ where
     pub fn remove_ice_candidate(&mut self, conn_id: ClientId, ice_candidate: String) {
         self.role_state.remove_ice_candidate(conn_id, ice_candidate);
     }
+
+    /// A snapshot of the statistics of the data plane.
+    pub fn stats(&self) -> GatewayStats {
+        let mut sockets = ReceiveStats::default();
+        for stats in self.io.sockets().receive_stats() {
+            sockets += stats;
+        }
+
+        let mut send_queue = QueueStats::default();
+        let mut control_queue = ControlQueueStats::default();
+        for stats in self.io.sockets().queue_stats() {
+            send_queue += stats.data;
+            control_queue += stats.control;
+        }
+
+        let depths = self.io.sockets().queue_depth_by_tag();
+        let mut stats = self.role_state.stats();
+
+        for (client, queue) in &mut stats.client_queues {
+            let depth = depths.get(&queue_tag(client)).copied().unwrap_or_default();
+
+            queue.queued_bytes = depth.bytes;
+            queue.queued_datagrams = depth.datagrams;
+        }
+
+        GatewayStats {
+            sockets,
+            send_queue,
+            control_queue,
+            ..stats
+        }
+    }
+}
+
+/// A packet read from the TUN device for a client of another shard, see [`GatewayTunnel::new_shard`].
+///
+/// Its buffer is reused to avoid allocating for every packet:
+/// once the owning shard sent it with [`GatewayTunnel::send_to_client`], hand it back to the shard that emitted it via [`GatewayTunnel::recycle_foreign_packet`].
+#[derive(Debug, Clone)]
+pub struct ForeignPacket {
+    /// The packet, prefixed with the 20 bytes of headroom that [`MutableIpPacket`] needs for NAT64.
+    buf: Vec<u8>,
+}
+
+impl ForeignPacket {
+    pub fn destination(&self) -> IpAddr {
+        IpPacket::new(&self.buf[20..])
+            .expect("we only copy valid packets")
+            .destination()
+    }
+
+    fn as_mutable(&mut self) -> MutableIpPacket<'_> {
+        MutableIpPacket::new(&mut self.buf).expect("we only copy valid packets")
+    }
 }
 
 /// A SANS-IO implementation of a gateway's functionality.
@@ -141,6 +257,19 @@ pub struct GatewayState {
     next_expiry_resources_check: Option<Instant>,
 
     buffered_events: VecDeque<GatewayEvent>,
+    /// Packets we generated ourselves that need to be written to the TUN device.
+    buffered_packets: VecDeque<IpPacket<'static>>,
+
+    /// The rate limit we apply to every client.
+    client_rate_limit: Option<RateLimit>,
+    /// Whether packets for clients we don't know belong to another shard, see [`GatewayTunnel::new_shard`].
+    forward_unknown_clients: bool,
+    /// Buffers of [`ForeignPacket`]s that the owning shards handed back.
+    foreign_packet_buffers: Vec<Vec<u8>>,
+
+    traffic: Traffic,
+    encapsulate_drops: Drops,
+    decapsulate_drops: Drops,
 }
 
 impl GatewayState {
@@ -150,6 +279,33 @@ impl GatewayState {
             node: ServerNode::new(private_key.into()),
             next_expiry_resources_check: Default::default(),
             buffered_events: VecDeque::default(),
+            buffered_packets: VecDeque::default(),
+            client_rate_limit: None,
+            forward_unknown_clients: false,
+            foreign_packet_buffers: Vec::new(),
+            traffic: Traffic::default(),
+            encapsulate_drops: Drops::default(),
+            decapsulate_drops: Drops::default(),
+        }
+    }
+
+    pub(crate) fn stats(&self) -> GatewayStats {
+        let (node_stats, _) = self.node.stats();
+
+        GatewayStats {
+            total: self.traffic,
+            clients: self.peers.iter().map(|p| (p.id(), p.traffic())).collect(),
+            client_queues: self.peers.iter().map(|p| (p.id(), p.queue())).collect(),
+            encapsulate_drops: self.encapsulate_drops,
+            decapsulate_drops: self.decapsulate_drops,
+            nat_sessions: self.peers.iter().map(|p| p.num_nat_sessions()).sum(),
+            flows: self.peers.iter().map(|p| p.num_flows()).sum(),
+            relay_allocations: self.node.num_allocations(),
+            wireguard_handshakes: node_stats.wireguard_handshakes,
+            // Filled in by `GatewayTunnel::stats`, the state doesn't own the sockets.
+            sockets: ReceiveStats::default(),
+            send_queue: QueueStats::default(),
+            control_queue: ControlQueueStats::default(),
         }
     }
 
@@ -158,62 +314,173 @@ impl GatewayState {
         self.node.public_key()
     }
 
+    /// Whether the packet should be handed to another shard rather than be dropped.
+    pub(crate) fn is_for_unknown_client(&self, packet: &MutableIpPacket<'_>) -> bool {
+        self.forward_unknown_clients && self.peers.peer_by_ip(packet.destination()).is_none()
+    }
+
+    /// Copies a packet for another shard into a reused buffer.
+    pub(crate) fn make_foreign_packet(&mut self, packet: &MutableIpPacket<'_>) -> ForeignPacket {
+        let mut buf = self.foreign_packet_buffers.pop().unwrap_or_default();
+        buf.clear();
+        buf.resize(20, 0);
+        buf.extend_from_slice(packet.packet());
+
+        ForeignPacket { buf }
+    }
+
+    fn recycle_foreign_packet(&mut self, packet: ForeignPacket) {
+        if self.foreign_packet_buffers.len() < MAX_FOREIGN_PACKET_BUFFERS {
+            self.foreign_packet_buffers.push(packet.buf);
+        }
+    }
+
+    pub(crate) fn set_client_rate_limit(&mut self, limit: Option<RateLimit>) {
+        self.client_rate_limit = limit;
+
+        for peer in self.peers.iter_mut() {
+            peer.set_rate_limit(limit);
+        }
+    }
+
+    /// Encapsulates a packet from the TUN device, returns the client it is for along with the datagram to send.
     pub(crate) fn encapsulate<'s>(
         &'s mut self,
         packet: MutableIpPacket<'_>,
         now: Instant,
-    ) -> Option<snownet::Transmit<'s>> {
+    ) -> Option<(ClientId, snownet::Transmit<'s>)> {
         let dest = packet.destination();
 
-        let peer = self.peers.peer_by_ip_mut(dest)?;
+        let Some(peer) = self.peers.peer_by_ip_mut(dest) else {
+            self.encapsulate_drops.record(DropReason::UnknownClient);
+            return None;
+        };
+
+        let path_mtu = self.node.path_mtu(peer.id());
+
+        // The size that matters is the one after translating, but the ICMP error needs to quote what the resource actually sent.
+        // NAT64 grows a packet by at most 20 bytes, so we only need to look closer at packets near the MTU.
+        if let Some(mtu) = path_mtu.filter(|mtu| packet.packet().len() + 20 > *mtu) {
+            let original = packet.as_immutable();
+            let len = peer.translated_len(&original);
 
-        let packet = peer
-            .encapsulate(packet, now)
-            .inspect_err(|e| tracing::debug!("Failed to encapsulate: {e}"))
-            .ok()??;
+            if len > mtu {
+                tracing::trace!(%mtu, "Packet exceeds path MTU of client");
+                self.encapsulate_drops.record(DropReason::PacketTooBig);
 
+                // Tell the resource the MTU in terms of the packets it sends, i.e. before translating.
+                let mtu = (mtu + original.packet().len()).saturating_sub(len);
+
+                self.buffered_packets.push_back(
+                    ip_packet::make::icmp_packet_too_big(original, mtu as u16).into_immutable(),
+                );
+                return None;
+            }
+        }
+
+        let mut packet = match peer.encapsulate(packet, now) {
+            Ok(Some(packet)) => packet,
+            Ok(None) => {
+                self.encapsulate_drops.record(DropReason::Translation);
+                return None;
+            }
+            Err(e) => {
+                tracing::debug!("Failed to encapsulate: {e}");
+                self.encapsulate_drops
+                    .record(DropReason::from_peer_error(&e));
+                return None;
+            }
+        };
+
+        // Clamp after translating so the MSS accounts for the IP header that is actually sent through the tunnel.
+        if let Some(mtu) = path_mtu {
+            packet.clamp_tcp_mss(mtu);
+        }
+
+        let len = packet.packet().len();
+        let client = peer.id();
         let transmit = self
             .node
-            .encapsulate(peer.id(), packet.as_immutable(), now)
-            .inspect_err(|e| tracing::debug!("Failed to encapsulate: {e}"))
-            .ok()??;
+            .encapsulate(client, packet.as_immutable(), now)
+            .inspect_err(|e| {
+                tracing::debug!("Failed to encapsulate: {e}");
+                self.encapsulate_drops.record(DropReason::Tunnel);
+            })
+            .ok()?;
 
-        Some(transmit)
+        // Only count what `snownet` accepted, either sent right away or buffered until the connection is up.
+        peer.on_encapsulated(len);
+        self.traffic.on_encapsulated(len);
+
+        Some((client, transmit?))
     }
 
-    #[tracing::instrument(level = "trace", skip_all, fields(src, dst))]
+    #[cfg_attr(
+        feature = "wire-trace",
+        tracing::instrument(level = "trace", skip_all, fields(src, dst))
+    )]
     pub(crate) fn decapsulate<'b>(
         &mut self,
         local: SocketAddr,
         from: SocketAddr,
         packet: &[u8],
+        ecn: Ecn,
         now: Instant,
         buffer: &'b mut [u8],
     ) -> Option<IpPacket<'b>> {
-        let (conn_id, packet) = self.node.decapsulate(
+        let (conn_id, mut packet) = self.node.decapsulate(
             local,
             from,
             packet,
             now,
             buffer,
         )
-        .inspect_err(|e| tracing::debug!(%local, %from, num_bytes = %packet.len(), "Failed to decapsulate incoming packet: {e}"))
+        .inspect_err(|e| {
+            tracing::debug!(%local, %from, num_bytes = %packet.len(), "Failed to decapsulate incoming packet: {e}");
+            self.decapsulate_drops.record(DropReason::Tunnel);
+        })
         .ok()??;
 
-        tracing::Span::current().record("src", tracing::field::display(packet.source()));
-        tracing::Span::current().record("dst", tracing::field::display(packet.destination()));
+        #[cfg(feature = "wire-trace")]
+        {
+            tracing::Span::current().record("src", tracing::field::display(packet.source()));
+            tracing::Span::current().record("dst", tracing::field::display(packet.destination()));
+        }
 
         let Some(peer) = self.peers.get_mut(&conn_id) else {
             tracing::error!(%conn_id, %local, %from, "Couldn't find connection");
+            self.decapsulate_drops.record(DropReason::UnknownClient);
 
             return None;
         };
 
-        let packet = peer
+        // Clamp before translating so the MSS accounts for the IP header that is actually sent through the tunnel.
+        if let Some(mtu) = self.node.path_mtu(conn_id) {
+            packet.clamp_tcp_mss(mtu);
+        }
+
+        let mut packet = peer
             .decapsulate(packet, now)
-            .inspect_err(|e| tracing::debug!(%conn_id, %local, %from, "Invalid packet: {e}"))
+            .inspect_err(|e| {
+                tracing::debug!(%conn_id, %local, %from, "Invalid packet: {e}");
+                self.decapsulate_drops
+                    .record(DropReason::from_peer_error(e));
+            })
             .ok()?;
 
+        // NAT64 carries the ECN bits over, applying them after translating is equivalent.
+        packet
+            .apply_outer_ecn(ecn)
+            .inspect_err(|e| {
+                tracing::trace!(%conn_id, %local, %from, "{e}");
+                self.decapsulate_drops.record(DropReason::Ecn);
+            })
+            .ok()?;
+
+        let len = packet.packet().len();
+        peer.on_decapsulated(len);
+        self.traffic.on_decapsulated(len);
+
         Some(packet.into_immutable())
     }
 
@@ -252,6 +519,7 @@ impl GatewayState {
         let answer = self.node.accept_connection(client_id, offer, client, now);
 
         let mut peer = ClientOnGateway::new(client_id, ipv4, ipv6);
+        peer.set_rate_limit(self.client_rate_limit);
 
         peer.add_resource(
             resource.addresses(),
@@ -260,11 +528,35 @@ impl GatewayState {
             expires_at,
             domain.clone().map(|(n, _)| n),
         );
+        peer.set_resource_rate_limit(resource.id(), resource.rate_limit());
 
         peer.assign_proxies(&resource, domain, now)?;
 
+        let ips = [IpAddr::from(ipv4), IpAddr::from(ipv6)];
+
+        // A client that reconnects replaces its old state, including its flows.
+        // Its routes to this shard only change if it got new IPs.
+        if let Some(old) = self.peers.remove(&client_id) {
+            let old_ips = old.allowed_ips();
+            self.end_peer(old);
+
+            if self.forward_unknown_clients && old_ips != ips {
+                self.buffered_events.push_back(GatewayEvent::ClientRemoved {
+                    conn_id: client_id,
+                    ips: old_ips,
+                });
+            }
+        }
         self.peers.insert(peer, &[ipv4.into(), ipv6.into()]);
 
+        // Announced only once the client is in place, so other shards never route to us for a client we failed to accept.
+        if self.forward_unknown_clients {
+            self.buffered_events.push_back(GatewayEvent::ClientAdded {
+                conn_id: client_id,
+                ips,
+            });
+        }
+
         Ok(Answer {
             username: answer.credentials.username,
             password: answer.credentials.password,
@@ -317,11 +609,46 @@ impl GatewayState {
             expires_at,
             domain.map(|(n, _)| n),
         );
+        peer.set_resource_rate_limit(resource.id(), resource.rate_limit());
 
         tracing::info!(%client, resource = %resource.id(), expires = ?expires_at.map(|e| e.to_rfc3339()), "Allowing access to resource");
         Ok(())
     }
 
+    pub(crate) fn remove_access(&mut self, client: &ClientId, resource: &ResourceId) {
+        let Some(peer) = self.peers.get_mut(client) else {
+            return;
+        };
+
+        peer.remove_resource(resource);
+        if peer.is_emptied() {
+            self.remove_peer(client);
+        }
+    }
+
+    /// Removes a client and all its connection-specific state.
+    ///
+    /// Every removal must go through here so the flows of the client are reported as ended.
+    pub(crate) fn remove_peer(&mut self, id: &ClientId) {
+        let Some(peer) = self.peers.remove(id) else {
+            return;
+        };
+        let ips = peer.allowed_ips();
+
+        self.end_peer(peer);
+
+        if self.forward_unknown_clients {
+            self.buffered_events
+                .push_back(GatewayEvent::ClientRemoved { conn_id: *id, ips });
+        }
+    }
+
+    fn end_peer(&mut self, mut peer: ClientOnGateway) {
+        self.buffered_events
+            .extend(std::iter::from_fn(|| peer.poll_event()));
+        self.buffered_events.extend(peer.end_flows());
+    }
+
     pub fn poll_timeout(&mut self) -> Option<Instant> {
         // TODO: This should check when the next resource actually expires instead of doing it at a fixed interval.
         earliest(self.next_expiry_resources_check, self.node.poll_timeout())
@@ -336,7 +663,15 @@ impl GatewayState {
                     p.expire_resources(utc_now);
                     p.handle_timeout(now)
                 });
-                self.peers.retain(|_, p| !p.is_emptied());
+                let emptied = self
+                    .peers
+                    .iter()
+                    .filter(|p| p.is_emptied())
+                    .map(|p| p.id())
+                    .collect::<Vec<_>>();
+                for id in emptied {
+                    self.remove_peer(&id);
+                }
 
                 self.next_expiry_resources_check = Some(now + EXPIRE_RESOURCES_INTERVAL);
             }
@@ -350,7 +685,7 @@ impl GatewayState {
         while let Some(event) = self.node.poll_event() {
             match event {
                 snownet::Event::ConnectionFailed(id) | snownet::Event::ConnectionClosed(id) => {
-                    self.peers.remove(&id);
+                    self.remove_peer(&id);
                 }
                 snownet::Event::NewIceCandidate {
                     connection,
@@ -395,6 +730,10 @@ impl GatewayState {
         self.node.poll_transmit()
     }
 
+    pub(crate) fn poll_packets(&mut self) -> Option<IpPacket<'static>> {
+        self.buffered_packets.pop_front()
+    }
+
     pub(crate) fn poll_event(&mut self) -> Option<GatewayEvent> {
         if let Some(ev) = self.buffered_events.pop_front() {
             return Some(ev);
@@ -418,3 +757,108 @@ impl GatewayState {
         self.node.update_relays(to_remove, &to_add, now);
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use ip_network::Ipv4Network;
+    use rand_core::OsRng;
+
+    #[test]
+    fn removing_peer_ends_flows() {
+        let mut state = GatewayState::for_test();
+        let now = Instant::now();
+        state.add_client_with_flow(None, now);
+
+        state.remove_peer(&client_id()); // What `GatewayTunnel::cleanup_connection` does.
+
+        assert!(state.peers.get(&client_id()).is_none());
+        assert_eq!(state.num_ended_flows(), 1);
+    }
+
+    #[test]
+    fn removing_last_resource_ends_flows() {
+        let mut state = GatewayState::for_test();
+        let now = Instant::now();
+        state.add_client_with_flow(None, now);
+
+        state.remove_access(&client_id(), &resource_id());
+
+        assert!(state.peers.get(&client_id()).is_none());
+        assert_eq!(state.num_ended_flows(), 1);
+    }
+
+    #[test]
+    fn expiring_last_resource_ends_flows() {
+        let mut state = GatewayState::for_test();
+        let now = Instant::now();
+        let utc_now = Utc::now();
+        state.add_client_with_flow(Some(utc_now), now);
+
+        state.handle_timeout(now, utc_now); // Schedules the first check.
+        state.handle_timeout(now + EXPIRE_RESOURCES_INTERVAL, utc_now);
+
+        assert!(state.peers.get(&client_id()).is_none());
+        assert_eq!(state.num_ended_flows(), 1);
+    }
+
+    impl GatewayState {
+        fn for_test() -> GatewayState {
+            GatewayState::new(StaticSecret::random_from_rng(OsRng))
+        }
+
+        fn add_client_with_flow(&mut self, expires_at: Option<DateTime<Utc>>, now: Instant) {
+            let mut peer = ClientOnGateway::new(client_id(), client_v4(), client_v6());
+            peer.add_resource(
+                vec![resource().into()],
+                resource_id(),
+                vec![],
+                expires_at,
+                None,
+            );
+            peer.decapsulate(
+                ip_packet::make::udp_packet(
+                    client_v4(),
+                    resource().network_address(),
+                    5401,
+                    53,
+                    vec![0; 100],
+                ),
+                now,
+            )
+            .unwrap();
+            assert_eq!(peer.num_flows(), 1);
+
+            self.peers
+                .insert(peer, &[client_v4().into(), client_v6().into()]);
+        }
+
+        fn num_ended_flows(&mut self) -> usize {
+            std::iter::from_fn(|| self.poll_event())
+                .filter(|e| {
+                    matches!(e, GatewayEvent::FlowEnded { conn_id, .. } if *conn_id == client_id())
+                })
+                .count()
+        }
+    }
+
+    fn client_id() -> ClientId {
+        "9d4b79f6-1db7-4cb3-a077-712102204d73".parse().unwrap()
+    }
+
+    fn client_v4() -> Ipv4Addr {
+        "100.64.0.1".parse().unwrap()
+    }
+
+    fn client_v6() -> Ipv6Addr {
+        "fd00:2021:1111::1".parse().unwrap()
+    }
+
+    fn resource() -> Ipv4Network {
+        "10.0.0.0/24".parse().unwrap()
+    }
+
+    fn resource_id() -> ResourceId {
+        "ed29c148-2acf-4ceb-8db5-d796c2671631".parse().unwrap()
+    }
+}
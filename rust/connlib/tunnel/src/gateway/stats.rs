@@ -0,0 +1,241 @@
+//! Statistics of the gateway's data plane.
+//!
+//! All counters are plain integers updated inline by [`GatewayState`](crate::GatewayState).
+//! Take a snapshot via [`GatewayTunnel::stats`](crate::GatewayTunnel::stats) and export it from there.
+
+use crate::sockets::{ControlQueueStats, QueueStats, ReceiveStats};
+use connlib_shared::messages::ClientId;
+
+/// Packets and bytes that went through the tunnel, counted as IP packets on the TUN device.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct Traffic {
+    /// Packets read from the TUN device and sent to a client.
+    pub packets_to_client: u64,
+    pub bytes_to_client: u64,
+    /// Packets received from a client and written to the TUN device.
+    pub packets_from_client: u64,
+    pub bytes_from_client: u64,
+}
+
+impl Traffic {
+    pub(crate) fn on_encapsulated(&mut self, len: usize) {
+        self.packets_to_client += 1;
+        self.bytes_to_client += len as u64;
+    }
+
+    pub(crate) fn on_decapsulated(&mut self, len: usize) {
+        self.packets_from_client += 1;
+        self.bytes_from_client += len as u64;
+    }
+}
+
+impl std::ops::AddAssign for Traffic {
+    fn add_assign(&mut self, rhs: Self) {
+        self.packets_to_client += rhs.packets_to_client;
+        self.bytes_to_client += rhs.bytes_to_client;
+        self.packets_from_client += rhs.packets_from_client;
+        self.bytes_from_client += rhs.bytes_from_client;
+    }
+}
+
+/// The egress queue and rate limit of a client.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct ClientQueue {
+    /// Bytes of datagrams waiting in our send queues to be sent to the client.
+    pub queued_bytes: u64,
+    pub queued_datagrams: u64,
+    /// Packets we dropped because the client exceeded a rate limit.
+    pub rate_limited_to_client: u64,
+    pub rate_limited_from_client: u64,
+}
+
+/// Why we didn't forward a packet.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum DropReason {
+    /// There is no client for the packet.
+    UnknownClient,
+    /// The packet exceeds the path MTU, we answered with an ICMP error instead.
+    PacketTooBig,
+    /// The packet couldn't be translated, e.g. because the NAT table is exhausted or the protocol is unsupported.
+    Translation,
+    /// The packet isn't allowed by the client's resources and their filters.
+    Filtered,
+    /// `snownet` failed to en- or decrypt the packet, e.g. because there is no connection (yet).
+    Tunnel,
+    /// The outer header experienced congestion but the packet isn't ECN-capable.
+    Ecn,
+    /// The client exceeded its own rate limit or the one of the resource.
+    RateLimited,
+}
+
+impl DropReason {
+    pub const ALL: [DropReason; 7] = [
+        DropReason::UnknownClient,
+        DropReason::PacketTooBig,
+        DropReason::Translation,
+        DropReason::Filtered,
+        DropReason::Tunnel,
+        DropReason::Ecn,
+        DropReason::RateLimited,
+    ];
+
+    pub fn as_str(&self) -> &'static str {
+        match self {
+            DropReason::UnknownClient => "unknown_client",
+            DropReason::PacketTooBig => "packet_too_big",
+            DropReason::Translation => "translation",
+            DropReason::Filtered => "filtered",
+            DropReason::Tunnel => "tunnel",
+            DropReason::Ecn => "ecn",
+            DropReason::RateLimited => "rate_limited",
+        }
+    }
+
+    pub(crate) fn from_peer_error(e: &connlib_shared::Error) -> Self {
+        match e {
+            connlib_shared::Error::UnallowedPacket { .. } | connlib_shared::Error::InvalidDst => {
+                DropReason::Filtered
+            }
+            connlib_shared::Error::RateLimited => DropReason::RateLimited,
+            _ => DropReason::Translation,
+        }
+    }
+}
+
+/// Dropped packets by [`DropReason`].
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct Drops([u64; DropReason::ALL.len()]);
+
+impl Drops {
+    pub fn get(&self, reason: DropReason) -> u64 {
+        self.0[reason as usize]
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = (DropReason, u64)> + '_ {
+        DropReason::ALL.into_iter().map(|r| (r, self.get(r)))
+    }
+
+    pub(crate) fn record(&mut self, reason: DropReason) {
+        self.0[reason as usize] += 1;
+    }
+}
+
+impl std::ops::AddAssign for Drops {
+    fn add_assign(&mut self, rhs: Self) {
+        for (n, other) in self.0.iter_mut().zip(rhs.0) {
+            *n += other;
+        }
+    }
+}
+
+#[derive(Debug, Default, Clone)]
+pub struct GatewayStats {
+    /// Traffic of all clients, including the ones we are no longer connected to.
+    pub total: Traffic,
+    /// Traffic of each client we are currently connected to.
+    pub clients: Vec<(ClientId, Traffic)>,
+    /// The egress queue and rate limit of each client we are currently connected to.
+    pub client_queues: Vec<(ClientId, ClientQueue)>,
+
+    /// Packets from the TUN device that we didn't send to a client.
+    pub encapsulate_drops: Drops,
+    /// Packets from the network that we didn't write to the TUN device.
+    pub decapsulate_drops: Drops,
+
+    /// The number of entries in the NAT tables of all clients.
+    pub nat_sessions: usize,
+    /// The number of flows tracked for all clients.
+    pub flows: usize,
+    /// The number of allocations we have on relays.
+    pub relay_allocations: usize,
+    /// The number of WireGuard handshakes we took part in.
+    pub wireguard_handshakes: u64,
+
+    /// The receive side of our sockets, summed over IPv4 and IPv6.
+    pub sockets: ReceiveStats,
+    /// The FQ-CoDel data queues of our sockets, summed over IPv4 and IPv6.
+    pub send_queue: QueueStats,
+    /// The control queues of our sockets, summed over IPv4 and IPv6.
+    pub control_queue: ControlQueueStats,
+}
+
+/// Combines the statistics of several gateway shards, each of which owns a disjoint set of clients.
+impl std::ops::AddAssign for GatewayStats {
+    fn add_assign(&mut self, rhs: Self) {
+        self.total += rhs.total;
+        self.clients.extend(rhs.clients);
+        self.client_queues.extend(rhs.client_queues);
+        self.encapsulate_drops += rhs.encapsulate_drops;
+        self.decapsulate_drops += rhs.decapsulate_drops;
+        self.nat_sessions += rhs.nat_sessions;
+        self.flows += rhs.flows;
+        self.relay_allocations += rhs.relay_allocations;
+        self.wireguard_handshakes += rhs.wireguard_handshakes;
+        self.sockets += rhs.sockets;
+        self.send_queue += rhs.send_queue;
+        self.control_queue += rhs.control_queue;
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn drops_are_indexed_by_reason() {
+        let mut drops = Drops::default();
+
+        drops.record(DropReason::Filtered);
+        drops.record(DropReason::Filtered);
+        drops.record(DropReason::Ecn);
+
+        assert_eq!(drops.get(DropReason::Filtered), 2);
+        assert_eq!(drops.get(DropReason::Ecn), 1);
+        assert_eq!(drops.iter().map(|(_, n)| n).sum::<u64>(), 3);
+    }
+
+    #[test]
+    fn shards_add_up() {
+        let mut a = GatewayStats {
+            total: Traffic {
+                packets_to_client: 1,
+                ..Default::default()
+            },
+            clients: vec![(
+                "00000000-0000-0000-0000-000000000001".parse().unwrap(),
+                Traffic::default(),
+            )],
+            flows: 2,
+            ..Default::default()
+        };
+        a.encapsulate_drops.record(DropReason::Filtered);
+        let mut b = a.clone();
+        b.clients = vec![(
+            "00000000-0000-0000-0000-000000000002".parse().unwrap(),
+            Traffic::default(),
+        )];
+
+        a += b;
+
+        assert_eq!(a.total.packets_to_client, 2);
+        assert_eq!(a.clients.len(), 2);
+        assert_eq!(a.flows, 4);
+        assert_eq!(a.encapsulate_drops.get(DropReason::Filtered), 2);
+    }
+
+    #[test]
+    fn filter_errors_are_filtered_drops() {
+        assert_eq!(
+            DropReason::from_peer_error(&connlib_shared::Error::InvalidDst),
+            DropReason::Filtered
+        );
+        assert_eq!(
+            DropReason::from_peer_error(&connlib_shared::Error::ExhaustedNat),
+            DropReason::Translation
+        );
+        assert_eq!(
+            DropReason::from_peer_error(&connlib_shared::Error::RateLimited),
+            DropReason::RateLimited
+        );
+    }
+}
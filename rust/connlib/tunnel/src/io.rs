@@ -1,7 +1,7 @@
 use crate::{
     device_channel::Device,
     dns::DnsQuery,
-    sockets::{Received, Sockets},
+    sockets::{Priority, Received, Sockets},
 };
 use bytes::Bytes;
 use connlib_shared::messages::DnsServer;
@@ -11,14 +11,14 @@ use hickory_resolver::{
     config::{NameServerConfig, Protocol, ResolverConfig, ResolverOpts},
     TokioAsyncResolver,
 };
-use ip_packet::{IpPacket, MutableIpPacket};
-use quinn_udp::Transmit;
+use ip_packet::{Ecn, IpPacket, MutableIpPacket};
+use quinn_udp::{EcnCodepoint, Transmit};
 use std::{
     collections::HashMap,
     io,
     net::IpAddr,
     pin::Pin,
-    task::{ready, Context, Poll},
+    task::{Context, Poll},
     time::{Duration, Instant},
 };
 
@@ -94,7 +94,11 @@ impl Io {
             return Poll::Ready(Ok(Input::Network(network)));
         }
 
-        ready!(self.sockets.poll_flush(cx))?;
+        // Don't stall reading from the device whilst the sockets are busy.
+        // The send queues are bounded and apply active queue management to whatever cannot be sent right away.
+        if let Poll::Ready(Err(e)) = self.sockets.poll_flush(cx) {
+            return Poll::Ready(Err(e));
+        }
 
         if let Poll::Ready(packet) = self.device.poll_read(device_buffer, cx)? {
             return Poll::Ready(Ok(Input::Device(packet)));
@@ -107,6 +111,10 @@ impl Io {
         &mut self.device
     }
 
+    pub fn sockets(&self) -> &Sockets {
+        &self.sockets
+    }
+
     pub fn sockets_mut(&mut self) -> &mut Sockets {
         &mut self.sockets
     }
@@ -161,14 +169,51 @@ impl Io {
         }
     }
 
-    pub fn send_network(&mut self, transmit: snownet::Transmit) -> io::Result<()> {
-        self.sockets.try_send(Transmit {
-            destination: transmit.dst,
-            ecn: None,
-            contents: Bytes::copy_from_slice(&transmit.payload),
-            segment_size: None,
-            src_ip: transmit.src.map(|s| s.ip()),
-        })?;
+    /// Sends an encapsulated IP packet to the network.
+    ///
+    /// `ecn` is the ECN codepoint of the encapsulated IP packet.
+    /// We copy it onto the outer header as per the "normal mode" of RFC 6040 so congestion signals along the path reach the tunnelled flow.
+    ///
+    /// `tag` identifies who the packet belongs to, see [`Priority::Data`].
+    pub fn send_network(
+        &mut self,
+        transmit: snownet::Transmit,
+        ecn: Ecn,
+        tag: u64,
+    ) -> io::Result<()> {
+        let ecn = match ecn {
+            Ecn::NotEct => None,
+            Ecn::Ect0 => Some(EcnCodepoint::Ect0),
+            Ecn::Ect1 => Some(EcnCodepoint::Ect1),
+            Ecn::Ce => Some(EcnCodepoint::Ce),
+        };
+
+        self.send(transmit, ecn, Priority::Data { tag })
+    }
+
+    /// Sends a control message to the network, i.e. anything emitted by `poll_transmit` of [`snownet`].
+    ///
+    /// These bypass any queued data packets.
+    pub fn send_control(&mut self, transmit: snownet::Transmit) -> io::Result<()> {
+        self.send(transmit, None, Priority::Control)
+    }
+
+    fn send(
+        &mut self,
+        transmit: snownet::Transmit,
+        ecn: Option<EcnCodepoint>,
+        priority: Priority,
+    ) -> io::Result<()> {
+        self.sockets.try_send(
+            Transmit {
+                destination: transmit.dst,
+                ecn,
+                contents: Bytes::copy_from_slice(&transmit.payload),
+                segment_size: None,
+                src_ip: transmit.src.map(|s| s.ip()),
+            },
+            priority,
+        )?;
 
         Ok(())
     }
@@ -19,10 +19,15 @@ use std::{
 };
 
 use bimap::BiMap;
-pub use client::{ClientState, Request};
-pub use gateway::GatewayState;
-pub use sockets::Sockets;
+pub use client::{ClientState, ClientStats, GatewayConnection, Request, ResourceTraffic};
+pub use gateway::{
+    ClientQueue, DropReason, Drops, ForeignPacket, GatewayState, GatewayStats, Traffic,
+};
+pub use peer::{Counters, FlowEnd, FlowRecord};
+pub use snownet::PathType;
+pub use sockets::{ControlQueueStats, QueueStats, ReceiveStats, Sockets};
 use utils::turn;
+pub use wire_trace::set_sample_rate as set_wire_trace_sample_rate;
 
 mod client;
 mod device_channel;
@@ -33,12 +38,16 @@ mod peer;
 mod peer_store;
 mod sockets;
 mod utils;
+mod wire_trace;
 
 #[cfg(all(test, feature = "proptest"))]
 mod tests;
 
 const MAX_UDP_SIZE: usize = (1 << 16) - 1;
-const MTU: usize = 1280;
+/// The MTU of the TUN device, where connlib configures it.
+///
+/// The actual MTU of each connection is discovered by `snownet`, oversized packets are answered with ICMP "packet too big".
+const MTU: usize = snownet::MAX_MTU;
 
 const REALM: &str = "firezone";
 
@@ -109,7 +118,7 @@ where
             }
 
             if let Some(transmit) = self.role_state.poll_transmit() {
-                self.io.send_network(transmit)?;
+                self.io.send_control(transmit)?;
                 continue;
             }
 
@@ -135,11 +144,14 @@ where
                     continue;
                 }
                 Poll::Ready(io::Input::Device(packet)) => {
+                    let ecn = packet.ecn();
+
                     let Some(transmit) = self.role_state.encapsulate(packet, Instant::now()) else {
                         continue;
                     };
 
-                    self.io.send_network(transmit)?;
+                    // All packets of a client belong to the same user, there is nothing to be fair between.
+                    self.io.send_network(transmit, ecn, 0)?;
 
                     continue;
                 }
@@ -149,6 +161,7 @@ where
                             received.local,
                             received.from,
                             received.packet,
+                            received.ecn,
                             std::time::Instant::now(),
                             self.write_buf.as_mut(),
                         ) else {
@@ -203,8 +216,13 @@ where
                 return Poll::Ready(Ok(other));
             }
 
+            if let Some(packet) = self.role_state.poll_packets() {
+                self.io.send_device(packet)?;
+                continue;
+            }
+
             if let Some(transmit) = self.role_state.poll_transmit() {
-                self.io.send_network(transmit)?;
+                self.io.send_control(transmit)?;
                 continue;
             }
 
@@ -223,14 +241,23 @@ where
                     continue;
                 }
                 Poll::Ready(io::Input::Device(packet)) => {
-                    let Some(transmit) = self
+                    if self.role_state.is_for_unknown_client(&packet) {
+                        return Poll::Ready(Ok(GatewayEvent::ForeignPacket {
+                            packet: self.role_state.make_foreign_packet(&packet),
+                        }));
+                    }
+
+                    let ecn = packet.ecn();
+
+                    let Some((client, transmit)) = self
                         .role_state
                         .encapsulate(packet, std::time::Instant::now())
                     else {
                         continue;
                     };
 
-                    self.io.send_network(transmit)?;
+                    self.io
+                        .send_network(transmit, ecn, gateway::queue_tag(&client))?;
 
                     continue;
                 }
@@ -240,6 +267,7 @@ where
                             received.local,
                             received.from,
                             received.packet,
+                            received.ecn,
                             std::time::Instant::now(),
                             self.write_buf.as_mut(),
                         ) else {
@@ -309,4 +337,15 @@ pub enum GatewayEvent {
         conn_id: ClientId,
         resource_id: ResourceId,
     },
+    /// A flow between a client and a resource has ended.
+    FlowEnded {
+        conn_id: ClientId,
+        record: FlowRecord,
+    },
+    /// We read a packet from the TUN device for a client that belongs to another tunnel, see [`GatewayTunnel::new_shard`].
+    ForeignPacket { packet: ForeignPacket },
+    /// A shard accepted a client, other shards should hand it packets for these IPs.
+    ClientAdded { conn_id: ClientId, ips: [IpAddr; 2] },
+    /// A shard removed a client, other shards should no longer hand it packets for these IPs.
+    ClientRemoved { conn_id: ClientId, ips: [IpAddr; 2] },
 }
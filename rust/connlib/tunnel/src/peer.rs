@@ -5,22 +5,29 @@ use std::time::{Duration, Instant};
 use chrono::{DateTime, Utc};
 use connlib_shared::messages::gateway::{ResolvedResourceDescriptionDns, ResourceDescription};
 use connlib_shared::messages::{
-    gateway::Filter, gateway::Filters, ClientId, GatewayId, ResourceId,
+    gateway::Filter, gateway::Filters, gateway::RateLimit, ClientId, GatewayId, ResourceId,
 };
 use connlib_shared::DomainName;
 use ip_network::IpNetwork;
 use ip_network_table::IpNetworkTable;
 use ip_packet::ip::IpNextHeaderProtocols;
-use ip_packet::{IpPacket, MutableIpPacket};
+use ip_packet::{IpPacket, MutableIpPacket, Packet as _};
 use itertools::Itertools;
 use rangemap::RangeInclusiveSet;
 
+use crate::gateway::{ClientQueue, Traffic};
 use crate::utils::network_contains_network;
 use crate::GatewayEvent;
 
+use conntrack::Conntrack;
 use nat_table::NatTable;
+use rate_limit::{Direction, RateLimiter};
 
+pub use conntrack::{Counters, FlowEnd, FlowRecord};
+
+mod conntrack;
 mod nat_table;
+mod rate_limit;
 
 #[derive(Debug)]
 enum FilterEngine {
@@ -145,14 +152,20 @@ impl ClientOnGateway {
             filters: IpNetworkTable::new(),
             permanent_translations: Default::default(),
             nat_table: Default::default(),
+            conntrack: Default::default(),
+            rate_limiter: None,
+            resource_rate_limiters: HashMap::new(),
+            rate_limited_resources: IpNetworkTable::new(),
             buffered_events: Default::default(),
+            traffic: Default::default(),
+            queue: Default::default(),
         }
     }
 
     /// A client is only allowed to send packets from their (portal-assigned) tunnel IPs.
     ///
     /// Failure to enforce this would allow one client to send traffic masquarading as a different client.
-    fn allowed_ips(&self) -> [IpAddr; 2] {
+    pub(crate) fn allowed_ips(&self) -> [IpAddr; 2] {
         [IpAddr::from(self.ipv4), IpAddr::from(self.ipv6)]
     }
 
@@ -167,11 +180,11 @@ impl ClientOnGateway {
             return;
         };
 
-        let old_ips: HashSet<&IpAddr> =
-            HashSet::from_iter(self.permanent_translations.values().filter_map(|state| {
-                (state.name == name && state.resource_id == resource_id)
-                    .then_some(&state.resolved_ip)
-            }));
+        let old_ips: HashSet<&IpAddr> = HashSet::from_iter(
+            self.permanent_translations
+                .group(resource_id, &name)
+                .map(|(_, state)| &state.resolved_ip),
+        );
         let new_ips: HashSet<&IpAddr> = HashSet::from_iter(resolved_ips.iter());
         if old_ips == new_ips {
             return;
@@ -186,10 +199,8 @@ impl ClientOnGateway {
 
         let proxy_ips = self
             .permanent_translations
-            .iter()
-            .filter_map(|(k, state)| {
-                (state.name == name && state.resource_id == resource_id).then_some(*k)
-            })
+            .group(resource_id, &name)
+            .map(|(proxy_ip, _)| *proxy_ip)
             .collect_vec();
 
         self.assign_translations(name, resource_id, &resolved_ips, proxy_ips, now);
@@ -257,12 +268,21 @@ impl ClientOnGateway {
     }
 
     pub(crate) fn expire_resources(&mut self, now: DateTime<Utc>) {
+        let num_resources = self.num_resources();
+
         for resource in self.resources.values_mut() {
             resource.retain(|r| !r.expires_at.is_some_and(|e| e <= now));
         }
-
         self.resources.retain(|_, r| !r.is_empty());
-        self.recalculate_filters();
+
+        // Recalculating the filters invalidates the cached verdicts of all flows, only do it if something expired.
+        if self.num_resources() != num_resources {
+            self.recalculate_filters();
+        }
+    }
+
+    fn num_resources(&self) -> usize {
+        self.resources.values().map(Vec::len).sum()
     }
 
     pub(crate) fn poll_event(&mut self) -> Option<GatewayEvent> {
@@ -270,24 +290,22 @@ impl ClientOnGateway {
     }
 
     pub(crate) fn handle_timeout(&mut self, now: Instant) {
-        let expired_translations = self
-            .permanent_translations
-            .iter()
-            .filter(|(_, state)| state.is_expired(now));
-
         let mut for_refresh = HashSet::new();
 
-        for (proxy_ip, expired_state) in expired_translations {
+        for (proxy_ip, expired_state) in self.permanent_translations.expired(now) {
             let domain = &expired_state.name;
             let resource_id = expired_state.resource_id;
             let resolved_ip = expired_state.resolved_ip;
 
+            if for_refresh.contains(&(domain.clone(), resource_id)) {
+                continue;
+            }
+
             // Only refresh DNS for a domain if all of the resolved IPs stop responding in order to not kill existing connections.
             if self
                 .permanent_translations
-                .values()
-                .filter(|state| state.resource_id == resource_id && state.name == domain)
-                .all(|state| state.no_incoming_in_120s(now))
+                .group(resource_id, domain)
+                .all(|(_, state)| state.no_incoming_in_120s(now))
             {
                 tracing::debug!(%domain, conn_id = %self.id, %resource_id, %resolved_ip, %proxy_ip, "Refreshing DNS");
 
@@ -304,6 +322,56 @@ impl ClientOnGateway {
         }
 
         self.nat_table.handle_timeout(now);
+        self.conntrack.handle_timeout(now);
+
+        while let Some(record) = self.conntrack.poll_flow_record() {
+            self.buffered_events.push_back(GatewayEvent::FlowEnded {
+                conn_id: self.id,
+                record,
+            });
+        }
+    }
+
+    /// Ends all flows of this client, e.g. because the connection to it was closed.
+    pub(crate) fn end_flows(&mut self) -> impl Iterator<Item = GatewayEvent> + '_ {
+        self.conntrack.end_all();
+
+        std::iter::from_fn(|| {
+            let record = self.conntrack.poll_flow_record()?;
+
+            Some(GatewayEvent::FlowEnded {
+                conn_id: self.id,
+                record,
+            })
+        })
+    }
+
+    /// Limits the bandwidth of this client across all resources.
+    pub(crate) fn set_rate_limit(&mut self, limit: Option<RateLimit>) {
+        match (&mut self.rate_limiter, limit) {
+            (Some(limiter), Some(limit)) => limiter.set_limit(limit),
+            (limiter, limit) => *limiter = limit.map(RateLimiter::new),
+        }
+    }
+
+    /// Limits the bandwidth of this client towards the given resource.
+    pub(crate) fn set_resource_rate_limit(
+        &mut self,
+        resource: ResourceId,
+        limit: Option<RateLimit>,
+    ) {
+        match (self.resource_rate_limiters.get_mut(&resource), limit) {
+            (Some(limiter), Some(limit)) => limiter.set_limit(limit),
+            (None, Some(limit)) => {
+                self.resource_rate_limiters
+                    .insert(resource, RateLimiter::new(limit));
+            }
+            (_, None) => {
+                self.resource_rate_limiters.remove(&resource);
+            }
+        }
+
+        self.recalculate_rate_limited_resources();
     }
 
     pub(crate) fn remove_resource(&mut self, resource: &ResourceId) {
@@ -343,6 +411,7 @@ impl ClientOnGateway {
         }
 
         self.recalculate_filters();
+        self.set_resource_rate_limit(resource.id(), resource.rate_limit());
     }
 
     // Call this after any resources change
@@ -350,6 +419,7 @@ impl ClientOnGateway {
     // This recalculate the ip-table rules, this allows us to remove and add resources and keep the allow-list correct
     // in case that 2 or more resources have overlapping rules.
     fn recalculate_filters(&mut self) {
+        self.conntrack.invalidate_verdicts();
         self.filters = IpNetworkTable::new();
         for resource in self.resources.values().flatten() {
             for ip in &resource.ips {
@@ -370,6 +440,59 @@ impl ClientOnGateway {
                 self.filters.insert(*ip, filter_engine);
             }
         }
+
+        self.recalculate_rate_limited_resources();
+    }
+
+    fn recalculate_rate_limited_resources(&mut self) {
+        self.resource_rate_limiters
+            .retain(|id, _| self.resources.contains_key(id));
+        self.rate_limited_resources = IpNetworkTable::new();
+
+        for (id, resources) in &self.resources {
+            if !self.resource_rate_limiters.contains_key(id) {
+                continue;
+            }
+
+            for ip in resources.iter().flat_map(|r| &r.ips) {
+                self.rate_limited_resources.insert(*ip, *id);
+            }
+        }
+    }
+
+    /// Checks the packet against the rate limits of this client and the resource it is sent to or from.
+    fn police(
+        &mut self,
+        direction: Direction,
+        resource_ip: IpAddr,
+        len: usize,
+        now: Instant,
+    ) -> Result<(), connlib_shared::Error> {
+        if self.rate_limiter.is_none() && self.resource_rate_limiters.is_empty() {
+            return Ok(());
+        }
+
+        let resource_limiter = self
+            .rate_limited_resources
+            .longest_match(resource_ip)
+            .and_then(|(_, id)| self.resource_rate_limiters.get_mut(id));
+
+        if rate_limit::admit(
+            self.rate_limiter.as_mut(),
+            resource_limiter,
+            direction,
+            len,
+            now,
+        ) {
+            return Ok(());
+        }
+
+        match direction {
+            Direction::ToClient => self.queue.rate_limited_to_client += 1,
+            Direction::FromClient => self.queue.rate_limited_from_client += 1,
+        }
+
+        Err(connlib_shared::Error::RateLimited)
     }
 
     fn transform_network_to_tun<'a>(
@@ -377,13 +500,14 @@ impl ClientOnGateway {
         packet: MutableIpPacket<'a>,
         now: Instant,
     ) -> Result<MutableIpPacket<'a>, connlib_shared::Error> {
-        let Some(state) = self.permanent_translations.get_mut(&packet.destination()) else {
+        let proxy_ip = packet.destination();
+        let Some(resolved_ip) = self.permanent_translations.resolved_ip(&proxy_ip) else {
             return Ok(packet);
         };
 
         let (source_protocol, real_ip) =
             self.nat_table
-                .translate_outgoing(packet.as_immutable(), state.resolved_ip, now)?;
+                .translate_outgoing(packet.as_immutable(), resolved_ip, now)?;
 
         let mut packet = packet
             .translate_destination(self.ipv4, self.ipv6, real_ip)
@@ -391,7 +515,8 @@ impl ClientOnGateway {
         packet.set_source_protocol(source_protocol.value());
         packet.update_checksum();
 
-        state.on_outgoing_traffic(now);
+        self.permanent_translations
+            .on_outgoing_traffic(&proxy_ip, now);
 
         Ok(packet)
     }
@@ -405,7 +530,17 @@ impl ClientOnGateway {
 
         let packet = self.transform_network_to_tun(packet, now)?;
 
-        self.ensure_allowed_dst(&packet)?;
+        self.police(
+            Direction::FromClient,
+            packet.destination(),
+            packet.packet().len(),
+            now,
+        )?;
+
+        self.conntrack
+            .on_outbound(&packet.to_immutable(), now, || {
+                ensure_allowed_dst(&self.filters, &packet)
+            })?;
 
         Ok(packet)
     }
@@ -415,6 +550,15 @@ impl ClientOnGateway {
         packet: MutableIpPacket<'a>,
         now: Instant,
     ) -> Result<Option<MutableIpPacket<'a>>, connlib_shared::Error> {
+        self.police(
+            Direction::ToClient,
+            packet.source(),
+            packet.packet().len(),
+            now,
+        )?;
+
+        self.conntrack.on_inbound(&packet.to_immutable(), now);
+
         let Some((proto, ip)) = self
             .nat_table
             .translate_incoming(packet.as_immutable(), now)?
@@ -426,10 +570,7 @@ impl ClientOnGateway {
             return Ok(None);
         };
 
-        self.permanent_translations
-            .get_mut(&ip)
-            .expect("inconsistent state")
-            .on_incoming_traffic(now);
+        self.permanent_translations.on_incoming_traffic(&ip, now);
 
         packet.set_destination_protocol(proto.value());
         packet.update_checksum();
@@ -437,6 +578,20 @@ impl ClientOnGateway {
         Ok(Some(packet))
     }
 
+    /// The size `packet` will have after [`ClientOnGateway::encapsulate`] translated it.
+    pub(crate) fn translated_len(&self, packet: &IpPacket<'_>) -> usize {
+        let len = packet.packet().len();
+
+        match (packet, self.nat_table.peek_incoming(packet)) {
+            (IpPacket::Ipv4(p), Some(IpAddr::V6(_))) => {
+                len - p.get_header_length() as usize * 4 + 40
+            }
+            (IpPacket::Ipv6(_), Some(IpAddr::V4(_))) => len - 40 + 20,
+            (IpPacket::Ipv4(_), Some(IpAddr::V4(_)) | None)
+            | (IpPacket::Ipv6(_), Some(IpAddr::V6(_)) | None) => len,
+        }
+    }
+
     fn ensure_allowed_src(
         &self,
         packet: &MutableIpPacket<'_>,
@@ -455,22 +610,53 @@ impl ClientOnGateway {
         &self,
         packet: &MutableIpPacket<'_>,
     ) -> Result<(), connlib_shared::Error> {
-        let dst = packet.destination();
-        if !self
-            .filters
-            .longest_match(dst)
-            .is_some_and(|(_, filter)| filter.is_allowed(&packet.to_immutable()))
-        {
-            tracing::warn!(%dst, "unallowed packet");
-            return Err(connlib_shared::Error::InvalidDst);
-        };
-
-        Ok(())
+        ensure_allowed_dst(&self.filters, packet)
     }
 
     pub fn id(&self) -> ClientId {
         self.id
     }
+
+    pub(crate) fn traffic(&self) -> Traffic {
+        self.traffic
+    }
+
+    /// The rate-limited packets of this client, the queue depth is filled in by [`GatewayTunnel::stats`](crate::GatewayTunnel::stats).
+    pub(crate) fn queue(&self) -> ClientQueue {
+        self.queue
+    }
+
+    pub(crate) fn on_encapsulated(&mut self, len: usize) {
+        self.traffic.on_encapsulated(len);
+    }
+
+    pub(crate) fn on_decapsulated(&mut self, len: usize) {
+        self.traffic.on_decapsulated(len);
+    }
+
+    pub(crate) fn num_nat_sessions(&self) -> usize {
+        self.nat_table.table.len()
+    }
+
+    pub(crate) fn num_flows(&self) -> usize {
+        self.conntrack.len()
+    }
+}
+
+fn ensure_allowed_dst(
+    filters: &IpNetworkTable<FilterEngine>,
+    packet: &MutableIpPacket<'_>,
+) -> Result<(), connlib_shared::Error> {
+    let dst = packet.destination();
+    if !filters
+        .longest_match(dst)
+        .is_some_and(|(_, filter)| filter.is_allowed(&packet.to_immutable()))
+    {
+        tracing::warn!(%dst, "unallowed packet");
+        return Err(connlib_shared::Error::InvalidDst);
+    };
+
+    Ok(())
 }
 
 impl GatewayOnClient {
@@ -588,6 +774,104 @@ impl TranslationState {
     }
 }
 
+/// The DNS resource translations of a client, indexed by proxy IP.
+///
+/// A client can hold thousands of translations for a wildcard resource, so everything that runs periodically only looks at the translations it affects:
+/// translations are grouped by the resource and name they were assigned for, and only translations whose ack grace period has started can expire.
+#[derive(Debug, Default)]
+struct Translations {
+    by_proxy_ip: HashMap<IpAddr, TranslationState>,
+    /// The proxy IPs assigned for each resource and name.
+    groups: HashMap<ResourceId, HashMap<DomainName, HashSet<IpAddr>>>,
+    /// Proxy IPs that are waiting for a response from their resolved IP.
+    awaiting_ack: HashSet<IpAddr>,
+}
+
+impl Translations {
+    fn insert(&mut self, proxy_ip: IpAddr, state: TranslationState) {
+        self.groups
+            .entry(state.resource_id)
+            .or_default()
+            .entry(state.name.clone())
+            .or_default()
+            .insert(proxy_ip);
+        self.awaiting_ack.remove(&proxy_ip);
+
+        let Some(old) = self.by_proxy_ip.insert(proxy_ip, state) else {
+            return;
+        };
+        let new = &self.by_proxy_ip[&proxy_ip];
+        if old.resource_id == new.resource_id && old.name == new.name {
+            return;
+        }
+
+        // The proxy IP has moved to a different resource or name.
+        let Some(names) = self.groups.get_mut(&old.resource_id) else {
+            return;
+        };
+        if let Some(proxy_ips) = names.get_mut(&old.name) {
+            proxy_ips.remove(&proxy_ip);
+            if proxy_ips.is_empty() {
+                names.remove(&old.name);
+            }
+        }
+        if names.is_empty() {
+            self.groups.remove(&old.resource_id);
+        }
+    }
+
+    fn resolved_ip(&self, proxy_ip: &IpAddr) -> Option<IpAddr> {
+        Some(self.by_proxy_ip.get(proxy_ip)?.resolved_ip)
+    }
+
+    /// All translations assigned for `name` of the given resource.
+    fn group<'a>(
+        &'a self,
+        resource_id: ResourceId,
+        name: &DomainName,
+    ) -> impl Iterator<Item = (&'a IpAddr, &'a TranslationState)> + 'a {
+        self.groups
+            .get(&resource_id)
+            .and_then(|names| names.get(name))
+            .into_iter()
+            .flatten()
+            .filter_map(|proxy_ip| Some((proxy_ip, self.by_proxy_ip.get(proxy_ip)?)))
+    }
+
+    fn expired(&self, now: Instant) -> impl Iterator<Item = (&IpAddr, &TranslationState)> + '_ {
+        self.awaiting_ack
+            .iter()
+            .filter_map(|proxy_ip| Some((proxy_ip, self.by_proxy_ip.get(proxy_ip)?)))
+            .filter(move |(_, state)| state.is_expired(now))
+    }
+
+    fn on_outgoing_traffic(&mut self, proxy_ip: &IpAddr, now: Instant) {
+        let Some(state) = self.by_proxy_ip.get_mut(proxy_ip) else {
+            return;
+        };
+
+        let was_awaiting_ack = state.ack_grace_period_started_at.is_some();
+        state.on_outgoing_traffic(now);
+
+        if !was_awaiting_ack && state.ack_grace_period_started_at.is_some() {
+            self.awaiting_ack.insert(*proxy_ip);
+        }
+    }
+
+    fn on_incoming_traffic(&mut self, proxy_ip: &IpAddr, now: Instant) {
+        let state = self
+            .by_proxy_ip
+            .get_mut(proxy_ip)
+            .expect("inconsistent state");
+
+        if state.ack_grace_period_started_at.is_some() {
+            self.awaiting_ack.remove(proxy_ip);
+        }
+
+        state.on_incoming_traffic(now);
+    }
+}
+
 /// The state of one client on a gateway.
 pub struct ClientOnGateway {
     id: ClientId,
@@ -595,9 +879,18 @@ pub struct ClientOnGateway {
     ipv6: Ipv6Addr,
     resources: HashMap<ResourceId, Vec<ResourceOnGateway>>,
     filters: IpNetworkTable<FilterEngine>,
-    permanent_translations: HashMap<IpAddr, TranslationState>,
+    permanent_translations: Translations,
     nat_table: NatTable,
+    conntrack: Conntrack,
+    /// Limits this client across all resources.
+    rate_limiter: Option<RateLimiter>,
+    /// Limits this client per resource.
+    resource_rate_limiters: HashMap<ResourceId, RateLimiter>,
+    /// The addresses of the resources in `resource_rate_limiters`.
+    rate_limited_resources: IpNetworkTable<ResourceId>,
     buffered_events: VecDeque<GatewayEvent>,
+    traffic: Traffic,
+    queue: ClientQueue,
 }
 
 #[cfg(test)]
@@ -609,12 +902,14 @@ mod tests {
 
     use chrono::Utc;
     use connlib_shared::messages::{
-        gateway::{Filter, PortRange},
+        gateway::{Filter, PortRange, ResolvedResourceDescriptionDns, ResourceDescription},
         ClientId, ResourceId,
     };
-    use ip_network::Ipv4Network;
+    use ip_network::{Ipv4Network, Ipv6Network};
+    use ip_packet::Ecn;
 
-    use super::{ClientOnGateway, TranslationState};
+    use super::{ClientOnGateway, TranslationState, Translations};
+    use connlib_shared::messages::gateway::RateLimit;
 
     #[test]
     fn gateway_filters_expire_individually() {
@@ -685,6 +980,95 @@ mod tests {
         ));
     }
 
+    #[test]
+    fn resource_rate_limit_only_applies_to_its_resource() {
+        let mut peer = ClientOnGateway::new(client_id(), source_v4_addr(), source_v6_addr());
+        let now = Instant::now();
+        let limited = cidr_v4_resource().hosts().next().unwrap();
+        let unlimited = Ipv4Addr::new(10, 0, 1, 1);
+        peer.add_resource(
+            vec![cidr_v4_resource().into()],
+            resource_id(),
+            vec![],
+            None,
+            None,
+        );
+        peer.add_resource(
+            vec![Ipv4Network::new(unlimited, 32).unwrap().into()],
+            resource2_id(),
+            vec![],
+            None,
+            None,
+        );
+        peer.set_resource_rate_limit(
+            resource_id(),
+            Some(RateLimit {
+                bytes_per_second: 100_000,
+                burst_bytes: None,
+            }),
+        );
+
+        let mut send = |dst| {
+            peer.decapsulate(
+                ip_packet::make::udp_packet(source_v4_addr(), dst, 5401, 80, vec![0; 1000]),
+                now,
+            )
+        };
+
+        let passed = (0..100).filter(|_| send(limited).is_ok()).count();
+        assert!(passed < 100);
+        assert!(matches!(
+            send(limited),
+            Err(connlib_shared::Error::RateLimited)
+        ));
+        assert!(send(unlimited).is_ok());
+        assert_eq!(
+            peer.queue().rate_limited_from_client,
+            100 - passed as u64 + 1
+        );
+    }
+
+    #[test]
+    fn congestion_mark_survives_nat64() {
+        let mut peer = ClientOnGateway::new(client_id(), source_v4_addr(), source_v6_addr());
+        let now = Instant::now();
+        let name = "example.com".parse().unwrap();
+        let resolved_ip = "2001:db8::1".parse::<Ipv6Addr>().unwrap();
+        let resource = ResourceDescription::Dns(ResolvedResourceDescriptionDns {
+            id: resource_id(),
+            domain: "example.com".to_owned(),
+            name: "example.com".to_owned(),
+            addresses: vec![resolved_ip.into()],
+            filters: vec![],
+            rate_limit: None,
+        });
+        peer.add_resource(
+            vec![Ipv6Network::new(resolved_ip, 128).unwrap().into()],
+            resource_id(),
+            vec![],
+            None,
+            Some(name.clone()),
+        );
+        peer.assign_proxies(&resource, Some((name, vec![proxy_ip_v4(1)])), now)
+            .unwrap();
+
+        let mut packet = ip_packet::make::udp_packet(
+            IpAddr::V4(source_v4_addr()),
+            proxy_ip_v4(1),
+            5401,
+            80,
+            vec![0; 100],
+        );
+        packet.set_ecn(Ecn::Ect0);
+
+        // The same order as `GatewayState::decapsulate`: translate, then apply the ECN of the outer header.
+        let mut packet = peer.decapsulate(packet, now).unwrap();
+        packet.apply_outer_ecn(Ecn::Ce).unwrap();
+
+        assert_eq!(packet.destination(), IpAddr::V6(resolved_ip));
+        assert_eq!(packet.ecn(), Ecn::Ce);
+    }
+
     #[test]
     fn initial_translation_state_is_not_expired() {
         let now = Instant::now();
@@ -952,6 +1336,67 @@ mod tests {
         assert!(state.is_expired(now));
     }
 
+    #[test]
+    fn reassigned_proxy_ip_moves_between_groups() {
+        let now = Instant::now();
+        let mut translations = Translations::default();
+        let foo = "foo.example.com".parse().unwrap();
+        let bar = "bar.example.com".parse().unwrap();
+
+        for (proxy_ip, name) in [(1, &foo), (2, &foo), (3, &bar), (2, &bar)] {
+            translations.insert(
+                proxy_ip_v4(proxy_ip),
+                TranslationState::new(
+                    resource_id(),
+                    name.clone(),
+                    IpAddr::V4(Ipv4Addr::LOCALHOST),
+                    now,
+                ),
+            );
+        }
+
+        assert_eq!(translations.group(resource_id(), &foo).count(), 1);
+        assert_eq!(translations.group(resource_id(), &bar).count(), 2);
+        assert_eq!(translations.group(resource2_id(), &bar).count(), 0);
+    }
+
+    #[test]
+    fn only_translations_awaiting_ack_expire() {
+        let mut now = Instant::now();
+        let mut translations = Translations::default();
+        for proxy_ip in [1, 2] {
+            translations.insert(
+                proxy_ip_v4(proxy_ip),
+                TranslationState::new(
+                    resource_id(),
+                    "example.com".parse().unwrap(),
+                    IpAddr::V4(Ipv4Addr::LOCALHOST),
+                    now,
+                ),
+            );
+        }
+
+        now += Duration::from_secs(120);
+        translations.on_outgoing_traffic(&proxy_ip_v4(1), now);
+        now += Duration::from_secs(1);
+
+        assert_eq!(
+            translations
+                .expired(now)
+                .map(|(ip, _)| *ip)
+                .collect::<Vec<_>>(),
+            vec![proxy_ip_v4(1)]
+        );
+
+        translations.on_incoming_traffic(&proxy_ip_v4(1), now);
+
+        assert_eq!(translations.expired(now).count(), 0);
+    }
+
+    fn proxy_ip_v4(n: u8) -> IpAddr {
+        IpAddr::V4(Ipv4Addr::new(100, 96, 0, n))
+    }
+
     fn source_v4_addr() -> Ipv4Addr {
         "100.64.0.1".parse().unwrap()
     }
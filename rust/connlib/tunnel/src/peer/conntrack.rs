@@ -0,0 +1,523 @@
+//! Connection tracking for the traffic of a client through the gateway.
+//!
+//! A flow is identified by the addresses and ports (or ICMP identifiers) of the client's packets, after NAT.
+//! Packets from the resource belong to the same flow with source and destination swapped.
+//!
+//! Each flow remembers the filter generation it was last allowed in, so packets of established flows skip the filter lookup until the filters change.
+//! Flows also count packets and bytes in both directions and are reported as a [`FlowRecord`] once they end,
+//! either because TCP closed the connection or because the flow has been idle for too long.
+//!
+//! To find idle flows without visiting all of them, each flow is filed under a deadline in an ordered index.
+//! Packets don't touch the index: when a deadline passes, we re-file the flow if it has been seen since.
+//! Only a TCP state change that shortens the timeout moves a flow forward in the index right away.
+
+use ip_packet::tcp::TcpFlags;
+use ip_packet::{IpPacket, Packet as _, Protocol};
+use std::collections::{BTreeSet, HashMap, VecDeque};
+use std::net::IpAddr;
+use std::time::{Duration, Instant};
+
+/// How many flows we track per client.
+///
+/// Packets of untracked flows still pass; they just take the slow path and aren't reported.
+const MAX_FLOWS: usize = 16 * 1024;
+
+const TCP_HANDSHAKE_TIMEOUT: Duration = Duration::from_secs(30);
+const TCP_ESTABLISHED_TIMEOUT: Duration = Duration::from_secs(2 * 60 * 60);
+/// How long we keep a closed TCP flow around to absorb retransmitted FINs and ACKs.
+const TCP_CLOSED_TIMEOUT: Duration = Duration::from_secs(10);
+const UDP_TIMEOUT: Duration = Duration::from_secs(120);
+const ICMP_TIMEOUT: Duration = Duration::from_secs(30);
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
+struct FlowKey {
+    src: (IpAddr, Protocol),
+    dst: (IpAddr, Protocol),
+}
+
+impl FlowKey {
+    fn outbound(packet: &IpPacket) -> Option<Self> {
+        Some(Self {
+            src: (packet.source(), packet.source_protocol().ok()?),
+            dst: (packet.destination(), packet.destination_protocol().ok()?),
+        })
+    }
+
+    fn inbound(packet: &IpPacket) -> Option<Self> {
+        Some(Self {
+            src: (packet.destination(), packet.destination_protocol().ok()?),
+            dst: (packet.source(), packet.source_protocol().ok()?),
+        })
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum TcpState {
+    SynSent,
+    Established,
+    /// A FIN was sent in one direction.
+    Closing {
+        fin_outbound: bool,
+    },
+    Closed,
+}
+
+#[derive(Debug)]
+struct Flow {
+    tcp: Option<TcpState>,
+    /// The filter generation in which this flow was last allowed.
+    allowed_in: u64,
+    started_at: Instant,
+    last_seen: Instant,
+    /// The deadline this flow is filed under in [`Conntrack::expiries`].
+    ///
+    /// Never later than [`Flow::deadline`] was when the flow was filed, but may be earlier than it is now.
+    filed_at: Instant,
+    outbound: Counters,
+    inbound: Counters,
+}
+
+impl Flow {
+    fn new(key: &FlowKey, generation: u64, now: Instant) -> Self {
+        let mut flow = Self {
+            tcp: matches!(key.src.1, Protocol::Tcp(_)).then_some(TcpState::SynSent),
+            allowed_in: generation,
+            started_at: now,
+            last_seen: now,
+            filed_at: now,
+            outbound: Counters::default(),
+            inbound: Counters::default(),
+        };
+        flow.filed_at = flow.deadline(key);
+
+        flow
+    }
+
+    /// Records a packet of this flow.
+    ///
+    /// Returns whether the TCP state changed, which may change the idle timeout.
+    fn on_packet(&mut self, packet: &IpPacket, outbound: bool, now: Instant) -> bool {
+        self.last_seen = now;
+
+        let counters = if outbound {
+            &mut self.outbound
+        } else {
+            &mut self.inbound
+        };
+        counters.packets += 1;
+        counters.bytes += packet.packet().len() as u64;
+
+        let (Some(state), Some(tcp)) = (self.tcp, packet.as_tcp()) else {
+            return false;
+        };
+        let flags = tcp.get_flags();
+
+        self.tcp = Some(match state {
+            _ if flags & TcpFlags::RST != 0 => TcpState::Closed,
+            TcpState::SynSent if !outbound && flags & TcpFlags::ACK != 0 => TcpState::Established,
+            TcpState::SynSent | TcpState::Established if flags & TcpFlags::FIN != 0 => {
+                TcpState::Closing {
+                    fin_outbound: outbound,
+                }
+            }
+            TcpState::Closing { fin_outbound }
+                if flags & TcpFlags::FIN != 0 && fin_outbound != outbound =>
+            {
+                TcpState::Closed
+            }
+            state => state,
+        });
+
+        self.tcp != Some(state)
+    }
+
+    /// When this flow ends unless we see another packet.
+    fn deadline(&self, key: &FlowKey) -> Instant {
+        self.last_seen + self.idle_timeout(key)
+    }
+
+    fn idle_timeout(&self, key: &FlowKey) -> Duration {
+        match (self.tcp, key.src.1) {
+            (Some(TcpState::SynSent), _) => TCP_HANDSHAKE_TIMEOUT,
+            (Some(TcpState::Established | TcpState::Closing { .. }), _) => TCP_ESTABLISHED_TIMEOUT,
+            (Some(TcpState::Closed), _) => TCP_CLOSED_TIMEOUT,
+            (None, Protocol::Icmp(_)) => ICMP_TIMEOUT,
+            (None, Protocol::Tcp(_) | Protocol::Udp(_)) => UDP_TIMEOUT,
+        }
+    }
+
+    fn record(&self, key: FlowKey, reason: FlowEnd) -> FlowRecord {
+        FlowRecord {
+            src: key.src,
+            dst: key.dst,
+            outbound: self.outbound,
+            inbound: self.inbound,
+            duration: self.last_seen.duration_since(self.started_at),
+            reason,
+        }
+    }
+}
+
+/// Packets and bytes of one direction of a flow.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct Counters {
+    pub packets: u64,
+    pub bytes: u64,
+}
+
+/// A finished flow, modelled after the flow records of IPFIX (RFC 7011).
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct FlowRecord {
+    /// The client's tunnel IP and source port (or ICMP identifier), after NAT.
+    pub src: (IpAddr, Protocol),
+    /// The resource's IP and port (or ICMP identifier).
+    pub dst: (IpAddr, Protocol),
+    /// Client to resource.
+    pub outbound: Counters,
+    /// Resource to client.
+    pub inbound: Counters,
+    /// Time between the first and the last packet.
+    pub duration: Duration,
+    pub reason: FlowEnd,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum FlowEnd {
+    /// TCP closed the connection.
+    Closed,
+    /// We haven't seen a packet for a while.
+    Idle,
+    /// The connection to the client was closed.
+    Disconnected,
+}
+
+#[derive(Debug, Default)]
+pub(crate) struct Conntrack {
+    flows: HashMap<FlowKey, Flow>,
+    /// All flows, ordered by the deadline they are filed under, see [`Flow::filed_at`].
+    expiries: BTreeSet<(Instant, FlowKey)>,
+    /// Bumped whenever the filters change, which invalidates the verdict of all flows.
+    generation: u64,
+    ended: VecDeque<FlowRecord>,
+}
+
+impl Conntrack {
+    /// Records an outbound packet, checking it against the filters unless its flow was already allowed.
+    ///
+    /// Packets that are not allowed don't create a flow.
+    pub(crate) fn on_outbound<E>(
+        &mut self,
+        packet: &IpPacket,
+        now: Instant,
+        is_allowed: impl FnOnce() -> Result<(), E>,
+    ) -> Result<(), E> {
+        let Some(key) = FlowKey::outbound(packet) else {
+            return is_allowed();
+        };
+
+        let flow = match self.flows.get_mut(&key) {
+            Some(flow) if flow.tcp == Some(TcpState::Closed) && is_syn(packet) => {
+                // The client reuses the port for a new connection.
+                is_allowed()?;
+
+                self.ended.push_back(flow.record(key, FlowEnd::Closed));
+
+                // The new flow takes over the old one's entry in the index.
+                let filed_at = flow.filed_at;
+                *flow = Flow::new(&key, self.generation, now);
+                flow.filed_at = filed_at;
+                refile_if_earlier(&mut self.expiries, key, flow);
+
+                flow
+            }
+            Some(flow) => {
+                if flow.allowed_in != self.generation {
+                    is_allowed()?;
+                    flow.allowed_in = self.generation;
+                }
+
+                flow
+            }
+            None => {
+                is_allowed()?;
+
+                if self.flows.len() >= MAX_FLOWS {
+                    return Ok(());
+                }
+
+                let flow = Flow::new(&key, self.generation, now);
+                self.expiries.insert((flow.filed_at, key));
+
+                self.flows.entry(key).or_insert(flow)
+            }
+        };
+
+        if flow.on_packet(packet, true, now) {
+            refile_if_earlier(&mut self.expiries, key, flow);
+        }
+
+        Ok(())
+    }
+
+    pub(crate) fn on_inbound(&mut self, packet: &IpPacket, now: Instant) {
+        let Some(key) = FlowKey::inbound(packet) else {
+            return;
+        };
+        let Some(flow) = self.flows.get_mut(&key) else {
+            return;
+        };
+
+        if flow.on_packet(packet, false, now) {
+            refile_if_earlier(&mut self.expiries, key, flow);
+        }
+    }
+
+    /// Re-checks all flows against the filters on their next packet.
+    pub(crate) fn invalidate_verdicts(&mut self) {
+        self.generation += 1;
+    }
+
+    /// Ends the flows that have been idle for too long.
+    ///
+    /// Only visits the flows whose deadline in the index has passed.
+    pub(crate) fn handle_timeout(&mut self, now: Instant) {
+        while let Some(&(filed_at, key)) = self.expiries.first() {
+            if filed_at > now {
+                break;
+            }
+            self.expiries.pop_first();
+
+            let Some(flow) = self.flows.get_mut(&key) else {
+                debug_assert!(false, "Every flow in the index must exist");
+                continue;
+            };
+
+            let deadline = flow.deadline(&key);
+            if deadline > now {
+                // We have seen the flow since we filed it.
+                flow.filed_at = deadline;
+                self.expiries.insert((deadline, key));
+                continue;
+            }
+
+            let reason = match flow.tcp {
+                Some(TcpState::Closed) => FlowEnd::Closed,
+                _ => FlowEnd::Idle,
+            };
+            self.ended.push_back(flow.record(key, reason));
+            self.flows.remove(&key);
+        }
+    }
+
+    /// Ends all flows, e.g. because the client disconnected.
+    pub(crate) fn end_all(&mut self) {
+        self.expiries.clear();
+        self.ended.extend(
+            self.flows
+                .drain()
+                .map(|(key, flow)| flow.record(key, FlowEnd::Disconnected)),
+        );
+    }
+
+    pub(crate) fn poll_flow_record(&mut self) -> Option<FlowRecord> {
+        self.ended.pop_front()
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        self.flows.len()
+    }
+}
+
+/// Moves a flow forward in the index if its idle timeout got shorter, e.g. because TCP closed the connection.
+fn refile_if_earlier(expiries: &mut BTreeSet<(Instant, FlowKey)>, key: FlowKey, flow: &mut Flow) {
+    let deadline = flow.deadline(&key);
+    if deadline >= flow.filed_at {
+        return;
+    }
+
+    expiries.remove(&(flow.filed_at, key));
+    expiries.insert((deadline, key));
+    flow.filed_at = deadline;
+}
+
+fn is_syn(packet: &IpPacket) -> bool {
+    packet.as_tcp().is_some_and(|tcp| {
+        let flags = tcp.get_flags();
+
+        flags & TcpFlags::SYN != 0 && flags & TcpFlags::ACK == 0
+    })
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use ip_packet::MutableIpPacket;
+    use std::convert::Infallible;
+    use std::net::Ipv4Addr;
+
+    const CLIENT: Ipv4Addr = Ipv4Addr::new(100, 64, 0, 1);
+    const RESOURCE: Ipv4Addr = Ipv4Addr::new(10, 0, 0, 1);
+
+    #[test]
+    fn established_flow_skips_filters() {
+        let now = Instant::now();
+        let mut conntrack = Conntrack::default();
+        let mut checks = 0;
+
+        for _ in 0..3 {
+            conntrack
+                .on_outbound(&udp(CLIENT, RESOURCE).to_immutable(), now, || {
+                    checks += 1;
+                    Ok::<_, Infallible>(())
+                })
+                .unwrap();
+        }
+
+        assert_eq!(checks, 1);
+
+        conntrack.invalidate_verdicts();
+        conntrack
+            .on_outbound(&udp(CLIENT, RESOURCE).to_immutable(), now, || {
+                checks += 1;
+                Ok::<_, Infallible>(())
+            })
+            .unwrap();
+
+        assert_eq!(checks, 2);
+    }
+
+    #[test]
+    fn denied_packet_creates_no_flow() {
+        let mut conntrack = Conntrack::default();
+
+        let result = conntrack.on_outbound(
+            &udp(CLIENT, RESOURCE).to_immutable(),
+            Instant::now(),
+            || Err(()),
+        );
+
+        assert!(result.is_err());
+        assert_eq!(conntrack.len(), 0);
+    }
+
+    #[test]
+    fn idle_flow_is_reported() {
+        let now = Instant::now();
+        let mut conntrack = Conntrack::default();
+
+        allow(&mut conntrack, udp(CLIENT, RESOURCE), now);
+        conntrack.on_inbound(
+            &udp(RESOURCE, CLIENT).to_immutable(),
+            now + Duration::from_secs(1),
+        );
+
+        conntrack.handle_timeout(now + Duration::from_secs(60));
+        assert_eq!(conntrack.poll_flow_record(), None);
+
+        conntrack.handle_timeout(now + Duration::from_secs(1) + UDP_TIMEOUT);
+        let record = conntrack.poll_flow_record().unwrap();
+
+        assert_eq!(record.outbound.packets, 1);
+        assert_eq!(record.inbound.packets, 1);
+        assert_eq!(record.duration, Duration::from_secs(1));
+        assert_eq!(record.reason, FlowEnd::Idle);
+        assert_eq!(conntrack.len(), 0);
+    }
+
+    #[test]
+    fn active_flow_is_refiled_instead_of_ended() {
+        let now = Instant::now();
+        let mut conntrack = Conntrack::default();
+
+        allow(&mut conntrack, udp(CLIENT, RESOURCE), now);
+        allow(
+            &mut conntrack,
+            udp(CLIENT, RESOURCE),
+            now + Duration::from_secs(100),
+        );
+
+        conntrack.handle_timeout(now + UDP_TIMEOUT);
+        assert_eq!(conntrack.poll_flow_record(), None);
+        assert_eq!(
+            conntrack.expiries.first().map(|(deadline, _)| *deadline),
+            Some(now + Duration::from_secs(100) + UDP_TIMEOUT)
+        );
+
+        conntrack.handle_timeout(now + Duration::from_secs(100) + UDP_TIMEOUT);
+        assert_eq!(conntrack.poll_flow_record().unwrap().outbound.packets, 2);
+        assert!(conntrack.expiries.is_empty());
+    }
+
+    #[test]
+    fn tcp_close_shortens_timeout() {
+        let now = Instant::now();
+        let mut conntrack = Conntrack::default();
+
+        allow(&mut conntrack, tcp(CLIENT, RESOURCE, TcpFlags::SYN), now);
+        conntrack.on_inbound(
+            &tcp(RESOURCE, CLIENT, TcpFlags::SYN | TcpFlags::ACK).to_immutable(),
+            now,
+        );
+        allow(
+            &mut conntrack,
+            tcp(CLIENT, RESOURCE, TcpFlags::FIN | TcpFlags::ACK),
+            now,
+        );
+        conntrack.on_inbound(
+            &tcp(RESOURCE, CLIENT, TcpFlags::FIN | TcpFlags::ACK).to_immutable(),
+            now,
+        );
+
+        conntrack.handle_timeout(now + TCP_CLOSED_TIMEOUT);
+        let record = conntrack.poll_flow_record().unwrap();
+
+        assert_eq!(record.reason, FlowEnd::Closed);
+        assert_eq!(record.outbound.packets, 2);
+        assert_eq!(record.inbound.packets, 2);
+    }
+
+    #[test]
+    fn established_tcp_flow_outlives_udp_timeout() {
+        let now = Instant::now();
+        let mut conntrack = Conntrack::default();
+
+        allow(&mut conntrack, tcp(CLIENT, RESOURCE, TcpFlags::SYN), now);
+        conntrack.on_inbound(
+            &tcp(RESOURCE, CLIENT, TcpFlags::SYN | TcpFlags::ACK).to_immutable(),
+            now,
+        );
+
+        conntrack.handle_timeout(now + UDP_TIMEOUT);
+
+        assert_eq!(conntrack.len(), 1);
+    }
+
+    fn allow(conntrack: &mut Conntrack, packet: MutableIpPacket, now: Instant) {
+        conntrack
+            .on_outbound(&packet.to_immutable(), now, || Ok::<_, Infallible>(()))
+            .unwrap();
+    }
+
+    fn udp(src: Ipv4Addr, dst: Ipv4Addr) -> MutableIpPacket<'static> {
+        let (sport, dport) = ports(src);
+
+        ip_packet::make::udp_packet(src, dst, sport, dport, vec![0; 100])
+    }
+
+    fn tcp(src: Ipv4Addr, dst: Ipv4Addr, flags: u8) -> MutableIpPacket<'static> {
+        let (sport, dport) = ports(src);
+        let mut packet = ip_packet::make::tcp_packet(src, dst, sport, dport, vec![0; 100]);
+        packet.as_tcp().unwrap().set_flags(flags);
+
+        packet
+    }
+
+    /// The client sends from port 5401 to port 80.
+    fn ports(src: Ipv4Addr) -> (u16, u16) {
+        if src == CLIENT {
+            (5401, 80)
+        } else {
+            (80, 5401)
+        }
+    }
+}
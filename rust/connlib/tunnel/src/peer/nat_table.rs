@@ -83,6 +83,14 @@ impl NatTable {
         Ok(outside)
     }
 
+    /// The address an incoming packet would be translated to, without refreshing its NAT session.
+    pub(crate) fn peek_incoming(&self, packet: &IpPacket) -> Option<IpAddr> {
+        let outside = (packet.destination_protocol().ok()?, packet.source());
+        let (_, inside) = self.table.get_by_right(&outside)?;
+
+        Some(*inside)
+    }
+
     pub(crate) fn translate_incoming(
         &mut self,
         packet: IpPacket,
@@ -0,0 +1,214 @@
+//! Token buckets that police how much bandwidth a client may use.
+//!
+//! Each limit has one bucket per direction.
+//! A packet passes if every bucket that applies to it has enough tokens, it then takes its size in bytes from all of them.
+//! Packets that don't pass are dropped: we can't hold them back without a queue, and TCP backs off from drops just fine.
+
+use connlib_shared::messages::gateway::RateLimit;
+use std::time::Instant;
+
+/// The smallest burst we allow, otherwise a limit below the MTU would drop every full-sized packet.
+const MIN_BURST: u64 = u16::MAX as u64;
+const NANOS_PER_SEC: u128 = 1_000_000_000;
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub(crate) enum Direction {
+    ToClient,
+    FromClient,
+}
+
+/// The buckets of one [`RateLimit`].
+#[derive(Debug)]
+pub(crate) struct RateLimiter {
+    to_client: TokenBucket,
+    from_client: TokenBucket,
+}
+
+impl RateLimiter {
+    pub(crate) fn new(limit: RateLimit) -> Self {
+        Self {
+            to_client: TokenBucket::new(limit),
+            from_client: TokenBucket::new(limit),
+        }
+    }
+
+    pub(crate) fn set_limit(&mut self, limit: RateLimit) {
+        self.to_client.set_limit(limit);
+        self.from_client.set_limit(limit);
+    }
+
+    fn bucket(&mut self, direction: Direction) -> &mut TokenBucket {
+        match direction {
+            Direction::ToClient => &mut self.to_client,
+            Direction::FromClient => &mut self.from_client,
+        }
+    }
+}
+
+/// Takes `len` bytes from the buckets of the client's and the resource's limiter if both have enough tokens.
+pub(crate) fn admit(
+    mut client: Option<&mut RateLimiter>,
+    mut resource: Option<&mut RateLimiter>,
+    direction: Direction,
+    len: usize,
+    now: Instant,
+) -> bool {
+    let len = len as u64;
+
+    let has_tokens = |l: &mut Option<&mut RateLimiter>| {
+        l.as_mut()
+            .map_or(true, |l| l.bucket(direction).has(len, now))
+    };
+
+    if !has_tokens(&mut client) || !has_tokens(&mut resource) {
+        return false;
+    }
+
+    for limiter in [client, resource].into_iter().flatten() {
+        limiter.bucket(direction).take(len);
+    }
+
+    true
+}
+
+#[derive(Debug)]
+struct TokenBucket {
+    bytes_per_second: u64,
+    burst: u64,
+
+    tokens: u64,
+    /// When we last added tokens, `None` until the first packet.
+    last_refill: Option<Instant>,
+}
+
+impl TokenBucket {
+    fn new(limit: RateLimit) -> Self {
+        let burst = limit.burst().max(MIN_BURST);
+
+        Self {
+            bytes_per_second: limit.bytes_per_second,
+            burst,
+            tokens: burst,
+            last_refill: None,
+        }
+    }
+
+    fn set_limit(&mut self, limit: RateLimit) {
+        self.bytes_per_second = limit.bytes_per_second;
+        self.burst = limit.burst().max(MIN_BURST);
+        self.tokens = self.tokens.min(self.burst);
+    }
+
+    fn has(&mut self, len: u64, now: Instant) -> bool {
+        self.refill(now);
+
+        self.tokens >= len
+    }
+
+    fn take(&mut self, len: u64) {
+        self.tokens = self.tokens.saturating_sub(len);
+    }
+
+    fn refill(&mut self, now: Instant) {
+        let Some(last_refill) = self.last_refill else {
+            self.last_refill = Some(now);
+            return;
+        };
+
+        let elapsed = now.saturating_duration_since(last_refill);
+        let new_tokens = elapsed.as_nanos() * u128::from(self.bytes_per_second) / NANOS_PER_SEC;
+
+        // Wait until we earned at least one token, otherwise frequent calls would round all progress away.
+        if new_tokens == 0 {
+            return;
+        }
+
+        self.tokens = self
+            .tokens
+            .saturating_add(u64::try_from(new_tokens).unwrap_or(u64::MAX))
+            .min(self.burst);
+        self.last_refill = Some(now);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::time::Duration;
+
+    #[test]
+    fn passes_burst_then_drops() {
+        let mut limiter = RateLimiter::new(limit(100_000, MIN_BURST));
+        let now = Instant::now();
+
+        let passed = (0..100)
+            .filter(|_| admit(Some(&mut limiter), None, Direction::ToClient, 1000, now))
+            .count();
+
+        assert_eq!(passed as u64, MIN_BURST / 1000);
+    }
+
+    #[test]
+    fn refills_at_configured_rate() {
+        let mut limiter = RateLimiter::new(limit(100_000, MIN_BURST));
+        let start = Instant::now();
+
+        while admit(Some(&mut limiter), None, Direction::ToClient, 1000, start) {}
+
+        assert!(!admit(
+            Some(&mut limiter),
+            None,
+            Direction::ToClient,
+            1000,
+            start + Duration::from_millis(1)
+        ));
+        assert!(admit(
+            Some(&mut limiter),
+            None,
+            Direction::ToClient,
+            1000,
+            start + Duration::from_millis(10)
+        ));
+    }
+
+    #[test]
+    fn directions_are_independent() {
+        let mut limiter = RateLimiter::new(limit(100_000, MIN_BURST));
+        let now = Instant::now();
+
+        while admit(Some(&mut limiter), None, Direction::ToClient, 1000, now) {}
+
+        assert!(admit(
+            Some(&mut limiter),
+            None,
+            Direction::FromClient,
+            1000,
+            now
+        ));
+    }
+
+    #[test]
+    fn takes_from_no_bucket_if_one_is_empty() {
+        let mut client = RateLimiter::new(limit(100_000, MIN_BURST));
+        let mut resource = RateLimiter::new(limit(100_000, MIN_BURST));
+        let now = Instant::now();
+
+        while admit(None, Some(&mut resource), Direction::FromClient, 1000, now) {}
+        assert!(!admit(
+            Some(&mut client),
+            Some(&mut resource),
+            Direction::FromClient,
+            1000,
+            now
+        ));
+
+        assert_eq!(client.from_client.tokens, MIN_BURST);
+    }
+
+    fn limit(bytes_per_second: u64, burst_bytes: u64) -> RateLimit {
+        RateLimit {
+            bytes_per_second,
+            burst_bytes: Some(burst_bytes),
+        }
+    }
+}
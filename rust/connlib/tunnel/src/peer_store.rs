@@ -42,12 +42,6 @@ where
     TId: Hash + Eq + Copy,
     P: Peer<Id = TId>,
 {
-    pub(crate) fn retain(&mut self, f: impl Fn(&TId, &mut P) -> bool) {
-        self.peer_by_id.retain(f);
-        self.id_by_ip
-            .retain(|_, id| self.peer_by_id.contains_key(id));
-    }
-
     pub(crate) fn add_ip(&mut self, id: &TId, ip: &IpNetwork) -> Option<&mut P> {
         let peer = self.peer_by_id.get_mut(id)?;
         self.id_by_ip.insert(*ip, *id);
@@ -91,6 +85,10 @@ where
         self.peer_by_id.get_mut(id)
     }
 
+    pub(crate) fn iter(&self) -> impl Iterator<Item = &P> {
+        self.peer_by_id.values()
+    }
+
     pub(crate) fn iter_mut(&mut self) -> impl Iterator<Item = &mut P> {
         self.peer_by_id.values_mut()
     }
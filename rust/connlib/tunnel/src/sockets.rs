@@ -1,15 +1,84 @@
+use control_queue::ControlQueue;
 use core::slice;
-use quinn_udp::{RecvMeta, UdpSockRef, UdpSocketState};
+use fq_codel::FqCodel;
+use ip_packet::Ecn;
+use quinn_udp::{EcnCodepoint, RecvMeta, UdpSockRef, UdpSocketState};
 use socket2::{SockAddr, Type};
 use std::{
+    cell::Cell,
+    collections::HashMap,
     io::{self, IoSliceMut},
     net::{Ipv4Addr, Ipv6Addr, SocketAddr, SocketAddrV4, SocketAddrV6},
     task::{ready, Context, Poll},
+    time::Instant,
 };
 use tokio::{io::Interest, net::UdpSocket};
 
+use crate::wire_trace::wire_trace;
 use crate::Result;
 
+pub use control_queue::ControlQueueStats;
+pub use fq_codel::{QueueDepth, QueueStats};
+
+mod control_queue;
+mod fq_codel;
+mod meminfo;
+
+/// The receive and send buffer size we ask the kernel for.
+///
+/// The kernel caps this at `net.core.rmem_max` / `net.core.wmem_max`, raise those to make use of it.
+const SOCKET_BUFFER_SIZE: usize = 4 * 1024 * 1024;
+
+/// The priority class of an outgoing datagram.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Priority {
+    /// Control traffic like STUN binding requests, TURN refreshes and WireGuard handshakes and keep-alives.
+    ///
+    /// Always sent before any [`Priority::Data`].
+    Control,
+    /// Encapsulated IP packets.
+    ///
+    /// Datagrams to the same destination are scheduled fairly between tags, the gateway uses one tag per client.
+    Data { tag: u64 },
+}
+
+#[derive(Default, Debug, Clone, Copy)]
+pub struct SendQueueStats {
+    pub control: ControlQueueStats,
+    pub data: QueueStats,
+}
+
+/// Statistics of the receive side of a socket.
+#[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
+pub struct ReceiveStats {
+    /// Datagrams the kernel dropped because the receive buffer was full, i.e. we didn't read fast enough.
+    ///
+    /// Only available on Linux and Android, always 0 elsewhere.
+    pub drops: u64,
+    /// Bytes waiting in the receive buffer at the time of the snapshot.
+    pub queued_bytes: u64,
+    /// The size of the receive buffer, as granted by the kernel.
+    pub buffer_size: u64,
+
+    /// Datagrams we read from the socket.
+    pub datagrams: u64,
+    /// Reads that yielded datagrams, divide `datagrams` by this for the average batch size.
+    pub batches: u64,
+    /// The largest number of datagrams we received in a single read.
+    pub max_batch_size: u64,
+}
+
+impl std::ops::AddAssign for ReceiveStats {
+    fn add_assign(&mut self, rhs: Self) {
+        self.drops += rhs.drops;
+        self.queued_bytes += rhs.queued_bytes;
+        self.buffer_size += rhs.buffer_size;
+        self.datagrams += rhs.datagrams;
+        self.batches += rhs.batches;
+        self.max_batch_size = self.max_batch_size.max(rhs.max_batch_size);
+    }
+}
+
 pub struct Sockets {
     socket_v4: Option<Socket>,
     socket_v6: Option<Socket>,
@@ -95,36 +164,80 @@ impl Sockets {
         Ok(())
     }
 
+    /// Statistics of the send queues of both sockets.
+    pub fn queue_stats(&self) -> impl Iterator<Item = SendQueueStats> + '_ {
+        self.socket_v4
+            .iter()
+            .chain(self.socket_v6.iter())
+            .map(|s| SendQueueStats {
+                control: s.control.stats(),
+                data: s.queue.stats(),
+            })
+    }
+
+    /// The datagrams waiting in the send queues of both sockets, by tag.
+    pub fn queue_depth_by_tag(&self) -> HashMap<u64, QueueDepth> {
+        let mut depths = HashMap::<u64, QueueDepth>::new();
+
+        for (tag, depth) in self
+            .socket_v4
+            .iter()
+            .chain(self.socket_v6.iter())
+            .flat_map(|s| s.queue.depth_by_tag())
+        {
+            *depths.entry(tag).or_default() += depth;
+        }
+
+        depths
+    }
+
+    /// Statistics of the receive side of both sockets.
+    pub fn receive_stats(&self) -> impl Iterator<Item = ReceiveStats> + '_ {
+        self.socket_v4
+            .iter()
+            .chain(self.socket_v6.iter())
+            .map(|s| s.receive_stats())
+    }
+
     /// Flushes all buffered data on the sockets.
     ///
     /// Returns `Ready` if the socket is able to accept more data.
     pub fn poll_flush(&mut self, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
-        if let Some(socket) = self.socket_v4.as_mut() {
-            ready!(socket.poll_flush(cx))?;
-        }
+        // Flush both sockets independently so a busy IPv4 socket doesn't hold up the IPv6 one and vice versa.
+        let v4 = self
+            .socket_v4
+            .as_mut()
+            .map_or(Poll::Ready(Ok(())), |s| s.poll_flush(cx))?;
+        let v6 = self
+            .socket_v6
+            .as_mut()
+            .map_or(Poll::Ready(Ok(())), |s| s.poll_flush(cx))?;
 
-        if let Some(socket) = self.socket_v6.as_mut() {
-            ready!(socket.poll_flush(cx))?;
-        }
+        ready!(v4);
+        ready!(v6);
 
         Poll::Ready(Ok(()))
     }
 
-    pub fn try_send(&mut self, transmit: quinn_udp::Transmit) -> io::Result<()> {
+    pub fn try_send(
+        &mut self,
+        transmit: quinn_udp::Transmit,
+        priority: Priority,
+    ) -> io::Result<()> {
         match transmit.destination {
             SocketAddr::V4(dst) => {
                 let socket = self.socket_v4.as_mut().ok_or(io::Error::new(
                     io::ErrorKind::NotConnected,
                     format!("failed send packet to {dst}: no IPv4 socket"),
                 ))?;
-                socket.send(transmit);
+                socket.send(transmit, priority);
             }
             SocketAddr::V6(dst) => {
                 let socket = self.socket_v6.as_mut().ok_or(io::Error::new(
                     io::ErrorKind::NotConnected,
                     format!("failed send packet to {dst}: no IPv6 socket"),
                 ))?;
-                socket.send(transmit);
+                socket.send(transmit, priority);
             }
         }
 
@@ -205,6 +318,8 @@ pub struct Received<'a> {
     pub local: SocketAddr,
     pub from: SocketAddr,
     pub packet: &'a [u8],
+    /// The ECN codepoint of the outer IP header.
+    pub ecn: Ecn,
 }
 
 struct Socket {
@@ -212,7 +327,19 @@ struct Socket {
     port: u16,
     socket: UdpSocket,
 
-    buffered_transmits: Vec<quinn_udp::Transmit>,
+    /// Control datagrams that we could not yet send.
+    ///
+    /// These are always sent before any datagrams in `queue`.
+    control: ControlQueue,
+    /// Data datagrams that we could not yet send.
+    ///
+    /// The queue is bounded and applies active queue management to avoid building up a standing queue whilst the socket is not writable.
+    queue: FqCodel,
+    /// Datagrams that have been de-queued from `queue` but not yet accepted by the kernel.
+    batch: Vec<quinn_udp::Transmit>,
+
+    /// Counters of the receive side, updated on every read.
+    received: Cell<ReceiveStats>,
 }
 
 impl Socket {
@@ -224,7 +351,10 @@ impl Socket {
             state: UdpSocketState::new(UdpSockRef::from(&socket))?,
             port,
             socket: tokio::net::UdpSocket::from_std(socket)?,
-            buffered_transmits: Vec::new(),
+            control: ControlQueue::default(),
+            queue: FqCodel::default(),
+            batch: Vec::with_capacity(quinn_udp::BATCH_SIZE),
+            received: Cell::default(),
         })
     }
 
@@ -236,10 +366,25 @@ impl Socket {
             state: UdpSocketState::new(UdpSockRef::from(&socket))?,
             port,
             socket: tokio::net::UdpSocket::from_std(socket)?,
-            buffered_transmits: Vec::new(),
+            control: ControlQueue::default(),
+            queue: FqCodel::default(),
+            batch: Vec::with_capacity(quinn_udp::BATCH_SIZE),
+            received: Cell::default(),
         })
     }
 
+    fn receive_stats(&self) -> ReceiveStats {
+        let mut stats = self.received.get();
+
+        if let Ok(meminfo) = meminfo::read(&self.socket) {
+            stats.drops = meminfo.drops as u64;
+            stats.queued_bytes = meminfo.rmem_alloc as u64;
+            stats.buffer_size = meminfo.rcvbuf as u64;
+        }
+
+        stats
+    }
+
     #[allow(clippy::type_complexity)]
     fn poll_recv_from<'b>(
         &self,
@@ -250,6 +395,7 @@ impl Socket {
             port,
             socket,
             state,
+            received,
             ..
         } = self;
 
@@ -273,7 +419,21 @@ impl Socket {
                     continue;
                 };
 
+                // With GRO, a single read may yield several datagrams of `stride` bytes each.
+                let batch_size = meta.len.div_ceil(meta.stride) as u64;
+                let mut stats = received.get();
+                stats.datagrams += batch_size;
+                stats.batches += 1;
+                stats.max_batch_size = stats.max_batch_size.max(batch_size);
+                received.set(stats);
+
                 let local = SocketAddr::new(local_ip, *port);
+                let ecn = match meta.ecn {
+                    Some(EcnCodepoint::Ect0) => Ecn::Ect0,
+                    Some(EcnCodepoint::Ect1) => Ecn::Ect1,
+                    Some(EcnCodepoint::Ce) => Ecn::Ce,
+                    None => Ecn::NotEct,
+                };
 
                 let iter = buffer[..meta.len]
                     .chunks(meta.stride)
@@ -281,9 +441,10 @@ impl Socket {
                         local,
                         from: meta.addr,
                         packet,
+                        ecn,
                     })
                     .inspect(|r| {
-                        tracing::trace!(target: "wire::net::recv", src = %r.from, dst = %r.local, num_bytes = %r.packet.len());
+                        wire_trace!(target: "wire::net::recv", src = %r.from, dst = %r.local, num_bytes = %r.packet.len());
                     });
 
                 return Poll::Ready(Ok(iter));
@@ -293,43 +454,69 @@ impl Socket {
 
     fn poll_flush(&mut self, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
         loop {
-            match self.socket.try_io(Interest::WRITABLE, || {
-                self.state
-                    .send((&self.socket).into(), &self.buffered_transmits)
+            self.try_flush()?;
+
+            // Ensure we are ready to send more data.
+            ready!(self.socket.poll_send_ready(cx)?);
+
+            // The socket may have become writable in the meantime, flush again in that case.
+            if self.is_empty() {
+                return Poll::Ready(Ok(()));
+            }
+        }
+    }
+
+    /// Sends as many datagrams as the socket accepts without blocking.
+    fn try_flush(&mut self) -> io::Result<()> {
+        let Socket {
+            state,
+            socket,
+            control,
+            queue,
+            batch,
+            ..
+        } = self;
+
+        loop {
+            if batch.is_empty() {
+                let now = Instant::now();
+                let dequeued = std::iter::from_fn(|| control.dequeue(now))
+                    .chain(std::iter::from_fn(|| queue.dequeue(now)));
+
+                batch.extend(dequeued.take(quinn_udp::BATCH_SIZE));
+            }
+
+            if batch.is_empty() {
+                return Ok(());
+            }
+
+            match socket.try_io(Interest::WRITABLE, || {
+                state.send((&*socket).into(), batch.as_slice())
             }) {
-                Ok(0) => break,
-                Err(e) if e.kind() == io::ErrorKind::WouldBlock => break,
-                Err(e) => return Poll::Ready(Err(e)),
+                Ok(0) => return Ok(()),
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(e) => return Err(e),
 
                 Ok(num_sent) => {
-                    self.buffered_transmits.drain(..num_sent);
-
-                    // I am not sure if we'd ever send less than what is in `buffered_transmits`.
-                    // loop once more to be sure we `break` on either an empty buffer or on `WouldBlock`.
+                    batch.drain(..num_sent);
                 }
             };
         }
+    }
 
-        // Ensure we are ready to send more data.
-        ready!(self.socket.poll_send_ready(cx)?);
-
-        assert!(
-            self.buffered_transmits.is_empty(),
-            "buffer must be empty if we are ready to send more data"
-        );
-
-        Poll::Ready(Ok(()))
+    fn is_empty(&self) -> bool {
+        self.batch.is_empty() && self.control.is_empty() && self.queue.is_empty()
     }
 
-    fn send(&mut self, transmit: quinn_udp::Transmit) {
-        tracing::trace!(target: "wire::net::send", src = ?transmit.src_ip, dst = %transmit.destination, num_bytes = %transmit.contents.len());
+    fn send(&mut self, transmit: quinn_udp::Transmit, priority: Priority) {
+        wire_trace!(target: "wire::net::send", src = ?transmit.src_ip, dst = %transmit.destination, num_bytes = %transmit.contents.len(), ?priority);
 
-        self.buffered_transmits.push(transmit);
+        let now = Instant::now();
 
-        debug_assert!(
-            self.buffered_transmits.len() < 10_000,
-            "We are not flushing the packets for some reason"
-        );
+        match priority {
+            Priority::Control => self.control.enqueue(transmit, now),
+            Priority::Data { tag } => self.queue.enqueue(transmit, tag, now),
+        }
     }
 }
 
@@ -347,6 +534,14 @@ fn make_socket(addr: impl Into<SocketAddr>) -> Result<std::net::UdpSocket> {
         socket.set_only_v6(true)?;
     }
 
+    // Larger buffers absorb bursts whilst our event loop is busy; the kernel only allocates memory as needed.
+    if let Err(e) = socket.set_recv_buffer_size(SOCKET_BUFFER_SIZE) {
+        tracing::debug!("Failed to set receive buffer size: {e}");
+    }
+    if let Err(e) = socket.set_send_buffer_size(SOCKET_BUFFER_SIZE) {
+        tracing::debug!("Failed to set send buffer size: {e}");
+    }
+
     socket.set_nonblocking(true)?;
     socket.bind(&addr)?;
 
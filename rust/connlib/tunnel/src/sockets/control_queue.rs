@@ -0,0 +1,137 @@
+//! A strict-priority queue for control traffic.
+//!
+//! Control traffic (STUN binding requests, TURN refreshes and channel bindings, WireGuard handshakes and keep-alives) is low-volume but latency-sensitive.
+//! Queueing it behind bulk data delays ICE consent checks and handshakes which eventually causes connections to flap.
+//! Thus, we keep it in a separate queue that is always drained before any data.
+
+use quinn_udp::Transmit;
+use std::{
+    collections::VecDeque,
+    time::{Duration, Instant},
+};
+
+/// The maximum number of control datagrams we hold.
+///
+/// Control traffic is paced by timers within `snownet`, we should never come close to this.
+const LIMIT: usize = 256;
+
+/// Control datagrams that wait longer than this are logged.
+const SLOW_THRESHOLD: Duration = Duration::from_millis(50);
+
+#[derive(Default, Debug, Clone, Copy)]
+pub struct ControlQueueStats {
+    pub enqueued: u64,
+    pub dequeued: u64,
+    /// Datagrams dropped because the queue was full.
+    pub dropped: u64,
+    /// The queueing delay of the most recently de-queued datagram.
+    pub last_delay: Duration,
+    /// The highest queueing delay observed so far.
+    pub max_delay: Duration,
+    /// The sum of all queueing delays, divide by `dequeued` for the average.
+    pub total_delay: Duration,
+}
+
+/// Combines the statistics of several queues, the delays are the highest of all queues.
+impl std::ops::AddAssign for ControlQueueStats {
+    fn add_assign(&mut self, rhs: Self) {
+        self.enqueued += rhs.enqueued;
+        self.dequeued += rhs.dequeued;
+        self.dropped += rhs.dropped;
+        self.last_delay = self.last_delay.max(rhs.last_delay);
+        self.max_delay = self.max_delay.max(rhs.max_delay);
+        self.total_delay += rhs.total_delay;
+    }
+}
+
+#[derive(Default)]
+pub(crate) struct ControlQueue {
+    inner: VecDeque<(Transmit, Instant)>,
+    stats: ControlQueueStats,
+}
+
+impl ControlQueue {
+    pub(crate) fn is_empty(&self) -> bool {
+        self.inner.is_empty()
+    }
+
+    pub(crate) fn stats(&self) -> ControlQueueStats {
+        self.stats
+    }
+
+    pub(crate) fn enqueue(&mut self, transmit: Transmit, now: Instant) {
+        if self.inner.len() >= LIMIT {
+            self.stats.dropped += 1;
+            tracing::debug!(dst = %transmit.destination, "Control queue is full, dropping datagram");
+
+            return;
+        }
+
+        self.inner.push_back((transmit, now));
+        self.stats.enqueued += 1;
+    }
+
+    pub(crate) fn dequeue(&mut self, now: Instant) -> Option<Transmit> {
+        let (transmit, enqueued_at) = self.inner.pop_front()?;
+        let delay = now.saturating_duration_since(enqueued_at);
+
+        self.stats.dequeued += 1;
+        self.stats.last_delay = delay;
+        self.stats.max_delay = self.stats.max_delay.max(delay);
+        self.stats.total_delay += delay;
+
+        if delay > SLOW_THRESHOLD {
+            tracing::debug!(dst = %transmit.destination, ?delay, "Control datagram was queued for a long time");
+        }
+
+        Some(transmit)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use bytes::Bytes;
+    use std::net::{Ipv4Addr, SocketAddr};
+
+    #[test]
+    fn records_queueing_delay() {
+        let mut queue = ControlQueue::default();
+        let now = Instant::now();
+
+        queue.enqueue(transmit(), now);
+        queue.enqueue(transmit(), now);
+        queue.dequeue(now + Duration::from_millis(1));
+        queue.dequeue(now + Duration::from_millis(3));
+
+        let stats = queue.stats();
+        assert_eq!(stats.dequeued, 2);
+        assert_eq!(stats.last_delay, Duration::from_millis(3));
+        assert_eq!(stats.max_delay, Duration::from_millis(3));
+        assert_eq!(stats.total_delay, Duration::from_millis(4));
+        assert!(queue.is_empty());
+    }
+
+    #[test]
+    fn drops_when_full() {
+        let mut queue = ControlQueue::default();
+        let now = Instant::now();
+
+        for _ in 0..(LIMIT + 1) {
+            queue.enqueue(transmit(), now);
+        }
+
+        assert_eq!(queue.stats().enqueued, LIMIT as u64);
+        assert_eq!(queue.stats().dropped, 1);
+    }
+
+    fn transmit() -> Transmit {
+        Transmit {
+            destination: SocketAddr::from((Ipv4Addr::LOCALHOST, 3478)),
+            ecn: None,
+            contents: Bytes::from_static(&[0u8; 20]),
+            segment_size: None,
+            src_ip: None,
+        }
+    }
+}
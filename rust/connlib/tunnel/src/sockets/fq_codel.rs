@@ -0,0 +1,550 @@
+//! A flow-queueing CoDel (FQ-CoDel) queue for outgoing datagrams.
+//!
+//! Datagrams are queued per destination (i.e. per peer or relay) and tag, and de-queued using deficit round-robin.
+//! The gateway tags datagrams with the client they belong to: clients that are reached through the same relay still get their own flow and a bulk download of one can't starve the others.
+//! Each flow runs its own CoDel instance (<https://www.rfc-editor.org/rfc/rfc8289>) which drops (or CE-marks, if the datagram is ECN-capable) datagrams that sat in the queue for too long.
+//! This keeps bulk transfers from building up a standing queue and starving other flows.
+//!
+//! The design follows <https://www.rfc-editor.org/rfc/rfc8290> but is simplified to our use-case:
+//! we only have a handful of flows (one per remote socket and client), so they are kept in a [`HashMap`] instead of a fixed set of hash buckets.
+
+use quinn_udp::{EcnCodepoint, Transmit};
+use std::{
+    collections::{HashMap, VecDeque},
+    net::SocketAddr,
+    time::{Duration, Instant},
+};
+
+/// The acceptable minimum standing queue delay.
+const TARGET: Duration = Duration::from_millis(5);
+/// The sliding window over which the minimum delay is tracked, roughly a worst-case RTT.
+const INTERVAL: Duration = Duration::from_millis(100);
+/// How many bytes a flow may send per round.
+const QUANTUM: i64 = 1500;
+/// The maximum number of datagrams we hold across all flows.
+const LIMIT: usize = 4096;
+
+#[derive(Default, Debug, Clone, Copy)]
+pub struct QueueStats {
+    pub enqueued: u64,
+    pub dequeued: u64,
+    /// Datagrams dropped because the queue was full.
+    pub dropped_overflow: u64,
+    /// Datagrams dropped by CoDel because their sojourn time exceeded the target for too long.
+    pub dropped_codel: u64,
+    /// ECN-capable datagrams marked with CE instead of being dropped.
+    pub marked_ce: u64,
+    /// The sojourn time of the most recently de-queued datagram.
+    pub last_sojourn: Duration,
+    /// The highest sojourn time observed so far.
+    pub max_sojourn: Duration,
+}
+
+/// Combines the statistics of several queues, the sojourn times are the highest of all queues.
+impl std::ops::AddAssign for QueueStats {
+    fn add_assign(&mut self, rhs: Self) {
+        self.enqueued += rhs.enqueued;
+        self.dequeued += rhs.dequeued;
+        self.dropped_overflow += rhs.dropped_overflow;
+        self.dropped_codel += rhs.dropped_codel;
+        self.marked_ce += rhs.marked_ce;
+        self.last_sojourn = self.last_sojourn.max(rhs.last_sojourn);
+        self.max_sojourn = self.max_sojourn.max(rhs.max_sojourn);
+    }
+}
+
+/// Identifies a flow within the queue.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+struct FlowKey {
+    destination: SocketAddr,
+    tag: u64,
+}
+
+/// The datagrams currently waiting in the queue for one tag.
+#[derive(Default, Debug, Clone, Copy, PartialEq, Eq)]
+pub struct QueueDepth {
+    pub bytes: u64,
+    pub datagrams: u64,
+}
+
+impl std::ops::AddAssign for QueueDepth {
+    fn add_assign(&mut self, rhs: Self) {
+        self.bytes += rhs.bytes;
+        self.datagrams += rhs.datagrams;
+    }
+}
+
+pub(crate) struct FqCodel {
+    flows: HashMap<FlowKey, Flow>,
+    new_flows: VecDeque<FlowKey>,
+    old_flows: VecDeque<FlowKey>,
+
+    len: usize,
+    limit: usize,
+
+    stats: QueueStats,
+}
+
+struct Flow {
+    queue: VecDeque<Queued>,
+    num_bytes: usize,
+    deficit: i64,
+    codel: Codel,
+}
+
+struct Queued {
+    transmit: Transmit,
+    enqueued_at: Instant,
+}
+
+impl Default for FqCodel {
+    fn default() -> Self {
+        Self::new(LIMIT)
+    }
+}
+
+impl FqCodel {
+    pub(crate) fn new(limit: usize) -> Self {
+        Self {
+            flows: HashMap::default(),
+            new_flows: VecDeque::default(),
+            old_flows: VecDeque::default(),
+            len: 0,
+            limit,
+            stats: QueueStats::default(),
+        }
+    }
+
+    pub(crate) fn is_empty(&self) -> bool {
+        self.len == 0
+    }
+
+    pub(crate) fn stats(&self) -> QueueStats {
+        self.stats
+    }
+
+    /// The datagrams waiting in the queue, by tag.
+    pub(crate) fn depth_by_tag(&self) -> impl Iterator<Item = (u64, QueueDepth)> + '_ {
+        self.flows.iter().map(|(key, flow)| {
+            (
+                key.tag,
+                QueueDepth {
+                    bytes: flow.num_bytes as u64,
+                    datagrams: flow.queue.len() as u64,
+                },
+            )
+        })
+    }
+
+    pub(crate) fn enqueue(&mut self, transmit: Transmit, tag: u64, now: Instant) {
+        if self.len >= self.limit {
+            self.drop_from_fattest_flow();
+        }
+
+        let key = FlowKey {
+            destination: transmit.destination,
+            tag,
+        };
+        let flow = self.flows.entry(key).or_insert_with(|| {
+            self.new_flows.push_back(key);
+
+            Flow {
+                queue: VecDeque::default(),
+                num_bytes: 0,
+                deficit: QUANTUM,
+                codel: Codel::default(),
+            }
+        });
+
+        flow.num_bytes += transmit.contents.len();
+        flow.queue.push_back(Queued {
+            transmit,
+            enqueued_at: now,
+        });
+
+        self.len += 1;
+        self.stats.enqueued += 1;
+    }
+
+    pub(crate) fn dequeue(&mut self, now: Instant) -> Option<Transmit> {
+        loop {
+            let (key, is_new) = match (self.new_flows.front(), self.old_flows.front()) {
+                (Some(key), _) => (*key, true),
+                (None, Some(key)) => (*key, false),
+                (None, None) => return None,
+            };
+
+            let flow = self
+                .flows
+                .get_mut(&key)
+                .expect("every listed flow must exist");
+
+            if flow.deficit <= 0 {
+                flow.deficit += QUANTUM;
+                self.pop_front(is_new);
+                self.old_flows.push_back(key);
+                continue;
+            }
+
+            let Some(queued) = flow.dequeue(now, &mut self.len, &mut self.stats) else {
+                self.pop_front(is_new);
+
+                // Give a new flow that just emptied a place among the old ones to prevent it from being treated as new again right away.
+                if is_new && !self.old_flows.is_empty() {
+                    self.old_flows.push_back(key);
+                } else {
+                    self.flows.remove(&key);
+                }
+
+                continue;
+            };
+
+            let sojourn = now.saturating_duration_since(queued.enqueued_at);
+            flow.deficit -= queued.transmit.contents.len() as i64;
+
+            self.stats.dequeued += 1;
+            self.stats.last_sojourn = sojourn;
+            self.stats.max_sojourn = self.stats.max_sojourn.max(sojourn);
+
+            return Some(queued.transmit);
+        }
+    }
+
+    fn pop_front(&mut self, is_new: bool) {
+        if is_new {
+            self.new_flows.pop_front();
+        } else {
+            self.old_flows.pop_front();
+        }
+    }
+
+    /// Drops the head of the flow with the most bytes queued, as per <https://www.rfc-editor.org/rfc/rfc8290#section-4.1>.
+    fn drop_from_fattest_flow(&mut self) {
+        let Some(flow) = self.flows.values_mut().max_by_key(|f| f.num_bytes) else {
+            return;
+        };
+        let Some(dropped) = flow.queue.pop_front() else {
+            return;
+        };
+
+        flow.num_bytes -= dropped.transmit.contents.len();
+        self.len -= 1;
+        self.stats.dropped_overflow += 1;
+
+        tracing::trace!(dst = %dropped.transmit.destination, "Send queue is full, dropping datagram");
+    }
+}
+
+impl Flow {
+    fn pop(&mut self, len: &mut usize) -> Option<Queued> {
+        let queued = self.queue.pop_front()?;
+        self.num_bytes -= queued.transmit.contents.len();
+        *len -= 1;
+
+        Some(queued)
+    }
+
+    /// De-queues the next datagram from this flow, applying CoDel's control law.
+    fn dequeue(&mut self, now: Instant, len: &mut usize, stats: &mut QueueStats) -> Option<Queued> {
+        let mut queued = self.pop(len);
+        let mut ok_to_drop = self.codel.should_drop(queued.as_ref(), self.num_bytes, now);
+
+        let Some(mut current) = queued.take() else {
+            self.codel.dropping = false;
+            return None;
+        };
+
+        if self.codel.dropping {
+            if !ok_to_drop {
+                self.codel.dropping = false;
+            }
+
+            while self.codel.dropping && now >= self.codel.drop_next {
+                let Some(marked) = mark_or_drop(current, stats) else {
+                    self.codel.count += 1;
+
+                    queued = self.pop(len);
+                    ok_to_drop = self.codel.should_drop(queued.as_ref(), self.num_bytes, now);
+
+                    let Some(next) = queued.take() else {
+                        self.codel.dropping = false;
+                        return None;
+                    };
+                    current = next;
+
+                    if ok_to_drop {
+                        self.codel.drop_next = control_law(self.codel.drop_next, self.codel.count);
+                    } else {
+                        self.codel.dropping = false;
+                    }
+
+                    continue;
+                };
+
+                // ECN-capable datagrams are marked instead of dropped, CoDel continues with the next interval.
+                self.codel.count += 1;
+                self.codel.drop_next = control_law(self.codel.drop_next, self.codel.count);
+
+                return Some(marked);
+            }
+
+            return Some(current);
+        }
+
+        if ok_to_drop {
+            let delta = self.codel.count.saturating_sub(self.codel.last_count);
+            self.codel.count = if delta > 1
+                && now.saturating_duration_since(self.codel.drop_next) < 16 * INTERVAL
+            {
+                delta
+            } else {
+                1
+            };
+            self.codel.drop_next = control_law(now, self.codel.count);
+            self.codel.last_count = self.codel.count;
+            self.codel.dropping = true;
+
+            if let Some(marked) = mark_or_drop(current, stats) {
+                return Some(marked);
+            }
+
+            let next = self.pop(len);
+            self.codel.should_drop(next.as_ref(), self.num_bytes, now);
+
+            return next;
+        }
+
+        Some(current)
+    }
+}
+
+/// Marks an ECN-capable datagram with CE or drops it otherwise.
+fn mark_or_drop(mut queued: Queued, stats: &mut QueueStats) -> Option<Queued> {
+    match queued.transmit.ecn {
+        Some(EcnCodepoint::Ect0 | EcnCodepoint::Ect1) => {
+            queued.transmit.ecn = Some(EcnCodepoint::Ce);
+            stats.marked_ce += 1;
+
+            Some(queued)
+        }
+        Some(EcnCodepoint::Ce) => Some(queued),
+        None => {
+            stats.dropped_codel += 1;
+            tracing::trace!(dst = %queued.transmit.destination, "CoDel dropped datagram");
+
+            None
+        }
+    }
+}
+
+fn control_law(t: Instant, count: u32) -> Instant {
+    t + INTERVAL.div_f64(f64::from(count.max(1)).sqrt())
+}
+
+/// The per-flow state of the CoDel algorithm.
+struct Codel {
+    /// When we will be allowed to start dropping, iff the sojourn time stays above [`TARGET`].
+    first_above_time: Option<Instant>,
+    /// When to drop the next datagram whilst in dropping state.
+    drop_next: Instant,
+    /// How many datagrams we dropped since entering dropping state.
+    count: u32,
+    /// The value of `count` when we last entered dropping state.
+    last_count: u32,
+    dropping: bool,
+}
+
+impl Default for Codel {
+    fn default() -> Self {
+        Self {
+            first_above_time: None,
+            drop_next: Instant::now(),
+            count: 0,
+            last_count: 0,
+            dropping: false,
+        }
+    }
+}
+
+impl Codel {
+    /// Whether the sojourn time of the given datagram has been above [`TARGET`] for at least [`INTERVAL`].
+    fn should_drop(
+        &mut self,
+        queued: Option<&Queued>,
+        bytes_in_queue: usize,
+        now: Instant,
+    ) -> bool {
+        let Some(queued) = queued else {
+            self.first_above_time = None;
+            return false;
+        };
+
+        let sojourn = now.saturating_duration_since(queued.enqueued_at);
+
+        // Never drop if there isn't at least one full datagram waiting.
+        if sojourn < TARGET || bytes_in_queue <= QUANTUM as usize {
+            self.first_above_time = None;
+            return false;
+        }
+
+        match self.first_above_time {
+            None => {
+                self.first_above_time = Some(now + INTERVAL);
+
+                false
+            }
+            Some(first_above_time) => now >= first_above_time,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use bytes::Bytes;
+
+    #[test]
+    fn round_robins_between_flows() {
+        let mut queue = FqCodel::default();
+        let now = Instant::now();
+
+        for _ in 0..3 {
+            queue.enqueue(transmit(PEER_A, 1500), 0, now);
+        }
+        queue.enqueue(transmit(PEER_B, 1500), 0, now);
+
+        let order = std::iter::from_fn(|| queue.dequeue(now))
+            .map(|t| t.destination)
+            .collect::<Vec<_>>();
+
+        assert_eq!(order, vec![PEER_A, PEER_B, PEER_A, PEER_A]);
+        assert!(queue.is_empty());
+    }
+
+    #[test]
+    fn drops_from_fattest_flow_when_full() {
+        let mut queue = FqCodel::new(4);
+        let now = Instant::now();
+
+        for _ in 0..3 {
+            queue.enqueue(transmit(PEER_A, 1000), 0, now);
+        }
+        queue.enqueue(transmit(PEER_B, 100), 0, now);
+        queue.enqueue(transmit(PEER_B, 100), 0, now);
+
+        assert_eq!(queue.len, 4);
+        assert_eq!(queue.stats().dropped_overflow, 1);
+        assert_eq!(
+            queue.flows[&FlowKey {
+                destination: PEER_B,
+                tag: 0
+            }]
+                .queue
+                .len(),
+            2
+        );
+    }
+
+    #[test]
+    fn round_robins_between_tags_to_the_same_destination() {
+        let mut queue = FqCodel::default();
+        let now = Instant::now();
+
+        // Tell the clients' datagrams apart by their size.
+        for _ in 0..3 {
+            queue.enqueue(transmit(RELAY, 1500), CLIENT_A, now);
+        }
+        queue.enqueue(transmit(RELAY, 1400), CLIENT_B, now);
+
+        let depth = queue.depth_by_tag().collect::<HashMap<_, _>>();
+        assert_eq!(
+            depth[&CLIENT_A],
+            QueueDepth {
+                bytes: 4500,
+                datagrams: 3
+            }
+        );
+
+        let order = std::iter::from_fn(|| queue.dequeue(now))
+            .map(|t| t.contents.len())
+            .collect::<Vec<_>>();
+
+        assert_eq!(order, vec![1500, 1400, 1500, 1500]);
+    }
+
+    #[test]
+    fn drops_after_standing_queue_persists_for_interval() {
+        let mut queue = FqCodel::default();
+        let start = Instant::now();
+
+        for _ in 0..100 {
+            queue.enqueue(transmit(PEER_A, 1200), 0, start);
+        }
+
+        let first = start + TARGET * 2;
+        assert!(queue.dequeue(first).is_some());
+        assert_eq!(queue.stats().dropped_codel, 0);
+
+        let later = first + INTERVAL;
+        assert!(queue.dequeue(later).is_some());
+        assert_eq!(queue.stats().dropped_codel, 1);
+    }
+
+    #[test]
+    fn marks_ecn_capable_datagrams_instead_of_dropping() {
+        let mut queue = FqCodel::default();
+        let start = Instant::now();
+
+        for _ in 0..100 {
+            let mut transmit = transmit(PEER_A, 1200);
+            transmit.ecn = Some(EcnCodepoint::Ect0);
+            queue.enqueue(transmit, 0, start);
+        }
+
+        queue.dequeue(start + TARGET * 2);
+        let marked = queue.dequeue(start + TARGET * 2 + INTERVAL).unwrap();
+
+        assert_eq!(marked.ecn, Some(EcnCodepoint::Ce));
+        assert_eq!(queue.stats().dropped_codel, 0);
+        assert_eq!(queue.stats().marked_ce, 1);
+    }
+
+    #[test]
+    fn does_not_drop_below_target() {
+        let mut queue = FqCodel::default();
+        let start = Instant::now();
+
+        for i in 0..100 {
+            queue.enqueue(transmit(PEER_A, 1200), 0, start + TARGET * i);
+            queue.dequeue(start + TARGET * i + Duration::from_millis(1));
+        }
+
+        assert_eq!(queue.stats().dropped_codel, 0);
+        assert_eq!(queue.stats().max_sojourn, Duration::from_millis(1));
+    }
+
+    const PEER_A: SocketAddr = SocketAddr::new(
+        std::net::IpAddr::V4(std::net::Ipv4Addr::new(10, 0, 0, 1)),
+        52625,
+    );
+    const PEER_B: SocketAddr = SocketAddr::new(
+        std::net::IpAddr::V4(std::net::Ipv4Addr::new(10, 0, 0, 2)),
+        52625,
+    );
+    const RELAY: SocketAddr = SocketAddr::new(
+        std::net::IpAddr::V4(std::net::Ipv4Addr::new(10, 0, 0, 3)),
+        3478,
+    );
+    const CLIENT_A: u64 = 1;
+    const CLIENT_B: u64 = 2;
+
+    fn transmit(destination: SocketAddr, len: usize) -> Transmit {
+        Transmit {
+            destination,
+            ecn: None,
+            contents: Bytes::from(vec![0u8; len]),
+            segment_size: None,
+            src_ip: None,
+        }
+    }
+}
@@ -0,0 +1,58 @@
+//! Memory statistics of a socket, see `SO_MEMINFO` in `socket(7)`.
+//!
+//! Most importantly, this tells us how many datagrams the kernel dropped because our receive buffer was full, i.e. because we didn't read fast enough.
+//! Unlike `SO_RXQ_OVFL`, which reports the drops as ancillary data on every read, this works with `quinn-udp`'s `recvmsg` which doesn't hand us unknown control messages.
+
+use std::io;
+use tokio::net::UdpSocket;
+
+#[derive(Debug, Default, Clone, Copy)]
+pub(crate) struct MemInfo {
+    /// Bytes currently queued in the receive buffer.
+    pub(crate) rmem_alloc: u32,
+    /// The size of the receive buffer, as granted by the kernel.
+    pub(crate) rcvbuf: u32,
+    /// Datagrams dropped since the socket was created.
+    pub(crate) drops: u32,
+}
+
+#[cfg(any(target_os = "linux", target_os = "android"))]
+pub(crate) fn read(socket: &UdpSocket) -> io::Result<MemInfo> {
+    use std::os::fd::AsRawFd as _;
+
+    const SO_MEMINFO: libc::c_int = 55;
+
+    // Indices into the array returned by `SO_MEMINFO`, see `SK_MEMINFO_*` in `linux/sock_diag.h`.
+    const SK_MEMINFO_RMEM_ALLOC: usize = 0;
+    const SK_MEMINFO_RCVBUF: usize = 1;
+    const SK_MEMINFO_DROPS: usize = 8;
+    const SK_MEMINFO_VARS: usize = 9;
+
+    let mut meminfo = [0u32; SK_MEMINFO_VARS];
+    let mut len = std::mem::size_of_val(&meminfo) as libc::socklen_t;
+
+    // Safety: The kernel writes at most `len` bytes into `meminfo`.
+    let ret = unsafe {
+        libc::getsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_SOCKET,
+            SO_MEMINFO,
+            meminfo.as_mut_ptr().cast(),
+            &mut len,
+        )
+    };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(MemInfo {
+        rmem_alloc: meminfo[SK_MEMINFO_RMEM_ALLOC],
+        rcvbuf: meminfo[SK_MEMINFO_RCVBUF],
+        drops: meminfo[SK_MEMINFO_DROPS],
+    })
+}
+
+#[cfg(not(any(target_os = "linux", target_os = "android")))]
+pub(crate) fn read(_: &UdpSocket) -> io::Result<MemInfo> {
+    Err(io::ErrorKind::Unsupported.into())
+}
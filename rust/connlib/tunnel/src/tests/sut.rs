@@ -22,7 +22,7 @@ use hickory_proto::{
 };
 use hickory_resolver::lookup::Lookup;
 use ip_network_table::IpNetworkTable;
-use ip_packet::{IpPacket, MutableIpPacket, Packet as _};
+use ip_packet::{Ecn, IpPacket, MutableIpPacket, Packet as _};
 use proptest_state_machine::{ReferenceStateMachine, StateMachineTest};
 use rand::{rngs::StdRng, SeedableRng as _};
 use secrecy::ExposeSecret as _;
@@ -432,7 +432,7 @@ impl TunnelTest {
         &mut self,
         packet: MutableIpPacket<'_>,
     ) -> Option<(Transmit<'static>, Option<SocketAddr>)> {
-        let transmit = self
+        let (_, transmit) = self
             .gateway
             .span
             .in_scope(|| self.gateway.state.encapsulate(packet, self.now))?;
@@ -525,7 +525,7 @@ impl TunnelTest {
         if let Some(packet) = self.client.span.in_scope(|| {
             self.client
                 .state
-                .decapsulate(dst, src, payload, self.now, &mut buffer)
+                .decapsulate(dst, src, payload, Ecn::NotEct, self.now, &mut buffer)
         }) {
             self.on_client_received_packet(packet);
         };
@@ -550,7 +550,7 @@ impl TunnelTest {
         if let Some(packet) = self.gateway.span.in_scope(|| {
             self.gateway
                 .state
-                .decapsulate(dst, src, payload, self.now, &mut buffer)
+                .decapsulate(dst, src, payload, Ecn::NotEct, self.now, &mut buffer)
         }) {
             let packet = packet.to_owned();
 
@@ -757,7 +757,7 @@ impl TunnelTest {
                 }
             }
             ClientEvent::ResourcesChanged { .. } => {
-                tracing::warn!("Unimplemented");
+                // Only relevant for the UI, the reference state tracks resources on its own.
             }
             ClientEvent::DnsServersChanged { dns_by_sentinel } => {
                 self.client_dns_by_sentinel = dns_by_sentinel;
@@ -784,6 +784,12 @@ impl TunnelTest {
                 })
             }
             GatewayEvent::RefreshDns { .. } => todo!(),
+            GatewayEvent::FlowEnded { .. } => {}
+            GatewayEvent::ForeignPacket { .. }
+            | GatewayEvent::ClientAdded { .. }
+            | GatewayEvent::ClientRemoved { .. } => {
+                unreachable!("Tests only run a single gateway shard")
+            }
         }
     }
 
@@ -908,6 +914,7 @@ fn map_client_resource_to_gateway_resource(
                 address: r.address,
                 name: r.name.clone(),
                 filters: Vec::new(),
+                rate_limit: None,
             },
         ))
     });
@@ -918,6 +925,7 @@ fn map_client_resource_to_gateway_resource(
             filters: Vec::new(),
             domain: r.address.clone(),
             addresses: resolved_ips.clone(),
+            rate_limit: None,
         })
     });
 
@@ -0,0 +1,59 @@
+//! Per-packet ("wire") tracing.
+//!
+//! Emitting an event for every packet is expensive, even if the event is filtered out by the subscriber.
+//! Thus, per-packet events are compiled in only with the `wire-trace` feature.
+//! Without it, a 1-in-N sample of packets can be traced at runtime via [`set_sample_rate`], which is useful to diagnose production systems.
+//! By default, no packets are sampled and the only cost is a single atomic load per packet.
+
+use std::sync::atomic::{AtomicU32, Ordering};
+
+static SAMPLE_RATE: AtomicU32 = AtomicU32::new(0);
+static COUNTER: AtomicU32 = AtomicU32::new(0);
+
+/// Trace every `one_in`-th packet; `0` disables sampling.
+///
+/// Has no effect with the `wire-trace` feature, in which case every packet is traced.
+pub fn set_sample_rate(one_in: u32) {
+    SAMPLE_RATE.store(one_in, Ordering::Relaxed);
+}
+
+#[inline(always)]
+pub(crate) fn sample() -> bool {
+    if cfg!(feature = "wire-trace") {
+        return true;
+    }
+
+    let rate = SAMPLE_RATE.load(Ordering::Relaxed);
+    if rate == 0 {
+        return false;
+    }
+
+    COUNTER.fetch_add(1, Ordering::Relaxed) % rate == 0
+}
+
+/// Like [`tracing::trace!`] but only for sampled packets, see module documentation.
+macro_rules! wire_trace {
+    ($($arg:tt)+) => {
+        if $crate::wire_trace::sample() {
+            tracing::trace!($($arg)+);
+        }
+    };
+}
+
+pub(crate) use wire_trace;
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    #[cfg(not(feature = "wire-trace"))]
+    fn samples_one_in_n() {
+        set_sample_rate(4);
+        let sampled = (0..100).filter(|_| sample()).count();
+        set_sample_rate(0);
+
+        assert_eq!(sampled, 25);
+        assert!(!sample());
+    }
+}
@@ -2,17 +2,19 @@ use crate::messages::{
     AllowAccess, ClientIceCandidates, ClientsIceCandidates, ConnectionReady, EgressMessages,
     IngressMessages, RejectAccess, RequestConnection,
 };
-use crate::CallbackHandler;
+use crate::metrics::{EventloopStats, Metrics};
+use crate::resolver::Resolver;
+use crate::workers::{self, Workers};
 use anyhow::Result;
 use boringtun::x25519::PublicKey;
 use connlib_shared::messages::{
     ClientId, ConnectionAccepted, Interface, RelaysPresence, ResourceAccepted, ResourceId,
 };
 use connlib_shared::{messages::GatewayResponse, DomainName};
-#[cfg(not(target_os = "windows"))]
-use dns_lookup::{AddrInfoHints, AddrInfoIter, LookupError};
-use firezone_tunnel::GatewayTunnel;
+use firezone_tunnel::GatewayStats;
 use futures::channel::mpsc;
+use futures::future::{self, BoxFuture};
+use futures::{FutureExt as _, SinkExt as _};
 use futures_bounded::Timeout;
 use phoenix_channel::PhoenixChannel;
 use std::collections::HashSet;
@@ -23,9 +25,12 @@ use std::time::Duration;
 
 pub const PHOENIX_TOPIC: &str = "gateway";
 
-/// How long we allow a DNS resolution via `libc::get_addr_info`.
+/// How long we allow a DNS resolution of a DNS resource.
 const DNS_RESOLUTION_TIMEOUT: Duration = Duration::from_secs(10);
 
+/// How long we wait for a worker to handle a request of the portal.
+const WORKER_TASK_TIMEOUT: Duration = Duration::from_secs(10);
+
 // DNS resolution happens as part of every connection setup.
 // For a connection to succeed, DNS resolution must be less than `snownet`'s handshake timeout.
 static_assertions::const_assert!(
@@ -39,25 +44,39 @@ enum ResolveTrigger {
     Refresh(DomainName, ClientId, ResourceId),
 }
 
+/// The control plane of the gateway: talks to the portal and hands its requests to the [`Workers`].
 pub struct Eventloop {
-    tunnel: GatewayTunnel<CallbackHandler>,
+    workers: Workers,
     portal: PhoenixChannel<(), IngressMessages, ()>,
     tun_device_channel: mpsc::Sender<Interface>,
 
+    resolver: Resolver,
     resolve_tasks: futures_bounded::FuturesTupleSet<Vec<IpAddr>, ResolveTrigger>,
+    /// Requests of the portal that a worker is handling, yielding the reply to the portal, if any.
+    worker_tasks: futures_bounded::FuturesSet<Option<EgressMessages>>,
+
+    metrics: Metrics,
+    /// The last statistics reported by each worker.
+    worker_stats: Vec<Option<(GatewayStats, EventloopStats)>>,
 }
 
 impl Eventloop {
     pub(crate) fn new(
-        tunnel: GatewayTunnel<CallbackHandler>,
+        workers: Workers,
         portal: PhoenixChannel<(), IngressMessages, ()>,
         tun_device_channel: mpsc::Sender<Interface>,
+        resolver: Resolver,
+        metrics: Metrics,
     ) -> Self {
         Self {
-            tunnel,
+            worker_stats: vec![None; workers.len()],
+            workers,
             portal,
+            resolver,
             resolve_tasks: futures_bounded::FuturesTupleSet::new(DNS_RESOLUTION_TIMEOUT, 100),
+            worker_tasks: futures_bounded::FuturesSet::new(WORKER_TASK_TIMEOUT, 100),
             tun_device_channel,
+            metrics,
         }
     }
 }
@@ -65,13 +84,31 @@ impl Eventloop {
 impl Eventloop {
     pub fn poll(&mut self, cx: &mut Context<'_>) -> Poll<Result<Infallible>> {
         loop {
-            match self.tunnel.poll_next_event(cx) {
-                Poll::Ready(Ok(event)) => {
+            match self.workers.poll_event(cx)? {
+                Poll::Ready(workers::Event::Tunnel(event)) => {
                     self.handle_tunnel_event(event);
                     continue;
                 }
+                Poll::Ready(workers::Event::Stats {
+                    worker,
+                    tunnel,
+                    eventloop,
+                }) => {
+                    self.worker_stats[worker] = Some((tunnel, eventloop));
+                    self.update_metrics();
+                    continue;
+                }
+                Poll::Pending => {}
+            }
+
+            match self.worker_tasks.poll_unpin(cx) {
+                Poll::Ready(Ok(Some(msg))) => {
+                    self.portal.send(PHOENIX_TOPIC, msg);
+                    continue;
+                }
+                Poll::Ready(Ok(None)) => continue,
                 Poll::Ready(Err(e)) => {
-                    tracing::warn!("Tunnel error: {e}");
+                    tracing::warn!("Worker did not handle request in time: {e}");
                     continue;
                 }
                 Poll::Pending => {}
@@ -105,6 +142,27 @@ impl Eventloop {
         }
     }
 
+    fn update_metrics(&self) {
+        let mut tunnel = GatewayStats::default();
+        let mut eventloop = EventloopStats::default();
+
+        for (stats, worker) in self.worker_stats.iter().flatten() {
+            tunnel += stats.clone();
+            eventloop.merge(worker);
+        }
+
+        self.metrics.update(tunnel, &eventloop);
+    }
+
+    fn push_worker_task(
+        &mut self,
+        task: impl std::future::Future<Output = Option<EgressMessages>> + Send + 'static,
+    ) {
+        if self.worker_tasks.try_push(task).is_err() {
+            tracing::warn!("Too many requests pending in workers, dropping new one");
+        }
+    }
+
     fn handle_tunnel_event(&mut self, event: firezone_tunnel::GatewayEvent) {
         match event {
             firezone_tunnel::GatewayEvent::AddedIceCandidates {
@@ -139,7 +197,7 @@ impl Eventloop {
                 if self
                     .resolve_tasks
                     .try_push(
-                        resolve(Some(name.clone())),
+                        resolve(&self.resolver, Some(name.clone())),
                         ResolveTrigger::Refresh(name, conn_id, resource_id),
                     )
                     .is_err()
@@ -147,6 +205,12 @@ impl Eventloop {
                     tracing::warn!("Too many dns resolution requests, dropping existing one");
                 };
             }
+            firezone_tunnel::GatewayEvent::FlowEnded { .. }
+            | firezone_tunnel::GatewayEvent::ForeignPacket { .. }
+            | firezone_tunnel::GatewayEvent::ClientAdded { .. }
+            | firezone_tunnel::GatewayEvent::ClientRemoved { .. } => {
+                unreachable!("Workers handle these themselves")
+            }
         }
     }
 
@@ -159,7 +223,10 @@ impl Eventloop {
                 if self
                     .resolve_tasks
                     .try_push(
-                        resolve(req.client.payload.domain.as_ref().map(|r| r.name())),
+                        resolve(
+                            &self.resolver,
+                            req.client.payload.domain.as_ref().map(|r| r.name()),
+                        ),
                         ResolveTrigger::RequestConnection(req),
                     )
                     .is_err()
@@ -174,7 +241,7 @@ impl Eventloop {
                 if self
                     .resolve_tasks
                     .try_push(
-                        resolve(req.payload.as_ref().map(|r| r.name())),
+                        resolve(&self.resolver, req.payload.as_ref().map(|r| r.name())),
                         ResolveTrigger::AllowAccess(req),
                     )
                     .is_err()
@@ -190,9 +257,11 @@ impl Eventloop {
                     }),
                 ..
             } => {
-                for candidate in candidates {
-                    self.tunnel.add_ice_candidate(client_id, candidate);
-                }
+                self.workers.run(client_id, move |tunnel| {
+                    for candidate in candidates {
+                        tunnel.add_ice_candidate(client_id, candidate);
+                    }
+                });
             }
             phoenix_channel::Event::InboundMessage {
                 msg:
@@ -202,9 +271,11 @@ impl Eventloop {
                     }),
                 ..
             } => {
-                for candidate in candidates {
-                    self.tunnel.remove_ice_candidate(client_id, candidate);
-                }
+                self.workers.run(client_id, move |tunnel| {
+                    for candidate in candidates {
+                        tunnel.remove_ice_candidate(client_id, candidate);
+                    }
+                });
             }
             phoenix_channel::Event::InboundMessage {
                 msg:
@@ -214,7 +285,9 @@ impl Eventloop {
                     }),
                 ..
             } => {
-                self.tunnel.remove_access(&client_id, &resource_id);
+                self.workers.run(client_id, move |tunnel| {
+                    tunnel.remove_access(&client_id, &resource_id);
+                });
             }
             phoenix_channel::Event::InboundMessage {
                 msg:
@@ -223,30 +296,47 @@ impl Eventloop {
                         connected,
                     }),
                 ..
-            } => self
-                .tunnel
-                .update_relays(HashSet::from_iter(disconnected_ids), connected),
+            } => {
+                let disconnected_ids = HashSet::from_iter(disconnected_ids);
+
+                self.workers.run_all(move |tunnel| {
+                    tunnel.update_relays(disconnected_ids.clone(), connected.clone())
+                });
+            }
             phoenix_channel::Event::InboundMessage {
                 msg: IngressMessages::Init(init),
                 ..
             } => {
-                if let Err(e) = self.tunnel.set_interface(&init.interface) {
-                    tracing::warn!("Failed to set interface: {e}");
-                };
-                self.tunnel.update_relays(HashSet::default(), init.relays);
+                let interface = init.interface.clone();
+                let relays = init.relays;
+                let set_interface = self.workers.call_all(move |tunnel| {
+                    if let Err(e) = tunnel.set_interface(&interface) {
+                        tracing::warn!("Failed to set interface: {e}");
+                    };
+                    tunnel.update_relays(HashSet::default(), relays.clone());
+                });
+                let mut tun_device_channel = self.tun_device_channel.clone();
 
                 // FIXME(tech-debt): Currently, the `Tunnel` creates the TUN device as part of `set_interface`.
                 // For the gateway, it doesn't do anything else so in an ideal world, we would cause the side-effect out here and just pass an opaque `Device` to the `Tunnel`.
                 // That requires more refactoring of other platforms, so for now, we need to rely on the `Tunnel` interface and cause the side-effect separately via the `TunDeviceManager`.
-                if let Err(e) = self.tun_device_channel.try_send(init.interface) {
-                    tracing::warn!("Failed to set interface: {e}");
-                }
+                // Only do so once every worker opened its queue of the device.
+                self.push_worker_task(async move {
+                    set_interface.await;
+
+                    if let Err(e) = tun_device_channel.send(init.interface).await {
+                        tracing::warn!("Failed to set interface: {e}");
+                    }
+
+                    None
+                });
             }
             phoenix_channel::Event::InboundMessage {
                 msg: IngressMessages::ResourceUpdated(resource_description),
                 ..
             } => {
-                self.tunnel.update_resource(resource_description);
+                self.workers
+                    .run_all(move |tunnel| tunnel.update_resource(resource_description.clone()));
             }
             phoenix_channel::Event::ErrorResponse { topic, req_id, res } => {
                 tracing::warn!(%topic, %req_id, "Request failed: {res:?}");
@@ -269,21 +359,21 @@ impl Eventloop {
             .inspect_err(|e| tracing::debug!(client = %req.client.id, reference = %req.reference, "DNS resolution timed out as part of connection request: {e}"))
             .unwrap_or_default();
 
-        match self.tunnel.accept(
-            req.client.id,
-            req.client.peer.preshared_key,
-            req.client.payload.ice_parameters,
-            PublicKey::from(req.client.peer.public_key.0),
-            req.client.peer.ipv4,
-            req.client.peer.ipv6,
-            req.client.payload.domain.as_ref().map(|r| r.as_tuple()),
-            req.expires_at,
-            req.resource.into_resolved(addresses.clone()),
-        ) {
-            Ok(accepted) => {
-                self.portal.send(
-                    PHOENIX_TOPIC,
-                    EgressMessages::ConnectionReady(ConnectionReady {
+        let client = req.client.id;
+        let accepted = self.workers.call(client, move |tunnel| {
+            match tunnel.accept(
+                req.client.id,
+                req.client.peer.preshared_key,
+                req.client.payload.ice_parameters,
+                PublicKey::from(req.client.peer.public_key.0),
+                req.client.peer.ipv4,
+                req.client.peer.ipv6,
+                req.client.payload.domain.as_ref().map(|r| r.as_tuple()),
+                req.expires_at,
+                req.resource.into_resolved(addresses.clone()),
+            ) {
+                Ok(accepted) => {
+                    Some(EgressMessages::ConnectionReady(ConnectionReady {
                         reference: req.reference,
                         gateway_payload: GatewayResponse::ConnectionAccepted(ConnectionAccepted {
                             ice_parameters: accepted,
@@ -294,18 +384,20 @@ impl Eventloop {
                                 }
                             }),
                         }),
-                    }),
-                );
+                    }))
 
-                // TODO: If outbound request fails, cleanup connection.
-            }
-            Err(e) => {
-                let client = req.client.id;
+                    // TODO: If outbound request fails, cleanup connection.
+                }
+                Err(e) => {
+                    tunnel.cleanup_connection(&client);
+                    tracing::debug!(%client, "Connection request failed: {:#}", anyhow::Error::new(e));
 
-                self.tunnel.cleanup_connection(&client);
-                tracing::debug!(%client, "Connection request failed: {:#}", anyhow::Error::new(e));
+                    None
+                }
             }
-        }
+        });
+
+        self.push_worker_task(accepted.map(Result::ok).map(Option::flatten));
     }
 
     pub fn allow_access(&mut self, result: Result<Vec<IpAddr>, Timeout>, req: AllowAccess) {
@@ -313,28 +405,31 @@ impl Eventloop {
             .inspect_err(|e| tracing::debug!(client = %req.client_id, reference = %req.reference, "DNS resolution timed out as part of allow access request: {e}"))
             .unwrap_or_default();
 
-        if let (Ok(()), Some(resolve_request)) = (
-            self.tunnel.allow_access(
-                req.resource.into_resolved(addresses.clone()),
-                req.client_id,
-                req.expires_at,
-                req.payload.as_ref().map(|r| r.as_tuple()),
-            ),
-            req.payload,
-        ) {
-            self.portal.send(
-                PHOENIX_TOPIC,
-                EgressMessages::ConnectionReady(ConnectionReady {
-                    reference: req.reference,
-                    gateway_payload: GatewayResponse::ResourceAccepted(ResourceAccepted {
-                        domain_response: connlib_shared::messages::DomainResponse {
-                            domain: resolve_request.name(),
-                            address: addresses,
-                        },
-                    }),
+        let allowed = self.workers.call(req.client_id, move |tunnel| {
+            let (Ok(()), Some(resolve_request)) = (
+                tunnel.allow_access(
+                    req.resource.into_resolved(addresses.clone()),
+                    req.client_id,
+                    req.expires_at,
+                    req.payload.as_ref().map(|r| r.as_tuple()),
+                ),
+                req.payload,
+            ) else {
+                return None;
+            };
+
+            Some(EgressMessages::ConnectionReady(ConnectionReady {
+                reference: req.reference,
+                gateway_payload: GatewayResponse::ResourceAccepted(ResourceAccepted {
+                    domain_response: connlib_shared::messages::DomainResponse {
+                        domain: resolve_request.name(),
+                        address: addresses,
+                    },
                 }),
-            );
-        }
+            }))
+        });
+
+        self.push_worker_task(allowed.map(Result::ok).map(Option::flatten));
     }
 
     pub fn refresh_translation(
@@ -348,73 +443,15 @@ impl Eventloop {
             .inspect_err(|e| tracing::debug!(%conn_id, "DNS resolution timed out as part of allow access request: {e}"))
             .unwrap_or_default();
 
-        self.tunnel
-            .refresh_translation(conn_id, resource_id, name, addresses);
-    }
-}
-
-async fn resolve(domain: Option<DomainName>) -> Vec<IpAddr> {
-    let Some(domain) = domain.clone() else {
-        return vec![];
-    };
-
-    let dname = domain.to_string();
-
-    match tokio::task::spawn_blocking(move || resolve_addresses(&dname)).await {
-        Ok(Ok(addresses)) => addresses,
-        Ok(Err(e)) => {
-            tracing::warn!("Failed to resolve '{domain}': {e}");
-
-            vec![]
-        }
-        Err(e) => {
-            tracing::warn!("Failed to resolve '{domain}': {e}");
-
-            vec![]
-        }
+        self.workers.run(conn_id, move |tunnel| {
+            tunnel.refresh_translation(conn_id, resource_id, name, addresses)
+        });
     }
 }
 
-#[cfg(target_os = "windows")]
-fn resolve_addresses(_: &str) -> std::io::Result<Vec<IpAddr>> {
-    unimplemented!()
-}
-
-#[cfg(not(target_os = "windows"))]
-fn resolve_addresses(addr: &str) -> std::io::Result<Vec<IpAddr>> {
-    use libc::{AF_INET, AF_INET6};
-    let addr_v4: std::io::Result<Vec<_>> = resolve_address_family(addr, AF_INET)
-        .map_err(|e| e.into())
-        .and_then(|a| a.collect());
-    let addr_v6: std::io::Result<Vec<_>> = resolve_address_family(addr, AF_INET6)
-        .map_err(|e| e.into())
-        .and_then(|a| a.collect());
-    match (addr_v4, addr_v6) {
-        (Ok(v4), Ok(v6)) => Ok(v6
-            .iter()
-            .map(|a| a.sockaddr.ip())
-            .chain(v4.iter().map(|a| a.sockaddr.ip()))
-            .collect()),
-        (Ok(v4), Err(_)) => Ok(v4.iter().map(|a| a.sockaddr.ip()).collect()),
-        (Err(_), Ok(v6)) => Ok(v6.iter().map(|a| a.sockaddr.ip()).collect()),
-        (Err(e), Err(_)) => Err(e),
+fn resolve(resolver: &Resolver, domain: Option<DomainName>) -> BoxFuture<'static, Vec<IpAddr>> {
+    match domain {
+        Some(domain) => resolver.resolve(&domain).boxed(),
+        None => future::ready(vec![]).boxed(),
     }
 }
-
-#[cfg(not(target_os = "windows"))]
-fn resolve_address_family(
-    addr: &str,
-    family: i32,
-) -> std::result::Result<AddrInfoIter, LookupError> {
-    use libc::SOCK_STREAM;
-
-    dns_lookup::getaddrinfo(
-        Some(addr),
-        None,
-        Some(AddrInfoHints {
-            socktype: SOCK_STREAM,
-            address: family,
-            ..Default::default()
-        }),
-    )
-}
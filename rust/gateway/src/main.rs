@@ -1,27 +1,33 @@
 use crate::eventloop::{Eventloop, PHOENIX_TOPIC};
+use crate::metrics::Metrics;
+use crate::resolver::Resolver;
 use anyhow::{Context, Result};
 use backoff::ExponentialBackoffBuilder;
 use clap::Parser;
-use connlib_shared::messages::Interface;
+use connlib_shared::messages::{gateway::RateLimit, Interface};
 use connlib_shared::tun_device_manager::TunDeviceManager;
 use connlib_shared::{get_user_agent, keypair, Callbacks, Cidrv4, Cidrv6, LoginUrl, StaticSecret};
 use firezone_cli_utils::{setup_global_subscriber, CommonArgs};
-use firezone_tunnel::{GatewayTunnel, Sockets};
 use futures::channel::mpsc;
 use futures::{future, StreamExt, TryFutureExt};
 use ip_network::{Ipv4Network, Ipv6Network};
 use phoenix_channel::PhoenixChannel;
 use secrecy::{Secret, SecretString};
 use std::convert::Infallible;
+use std::num::NonZeroUsize;
 use std::path::Path;
 use std::pin::pin;
 use tokio::io::AsyncWriteExt;
 use tokio::signal::ctrl_c;
 use tracing_subscriber::layer;
 use uuid::Uuid;
+use workers::Workers;
 
 mod eventloop;
 mod messages;
+mod metrics;
+mod resolver;
+mod workers;
 
 const ID_PATH: &str = "/var/lib/firezone/gateway_id";
 const PEERS_IPV4: &str = "100.64.0.0/11";
@@ -43,6 +49,7 @@ async fn main() {
 async fn try_main() -> Result<()> {
     let cli = Cli::parse();
     setup_global_subscriber(layer::Identity::new());
+    firezone_tunnel::set_wire_trace_sample_rate(cli.wire_trace_sample_rate);
 
     let firezone_id = get_firezone_id(cli.firezone_id).await
         .context("Couldn't read FIREZONE_ID or write it to disk: Please provide it through the env variable or provide rw access to /var/lib/firezone/")?;
@@ -56,13 +63,28 @@ async fn try_main() -> Result<()> {
         public_key.to_bytes(),
     )?;
 
-    let task = tokio::spawn(run(login, private_key)).err_into();
+    let metrics = Metrics::default();
+
+    let client_rate_limit = cli.client_rate_limit.map(|bytes_per_second| RateLimit {
+        bytes_per_second,
+        burst_bytes: None,
+    });
+
+    let task = tokio::spawn(run(
+        login,
+        private_key,
+        cli.workers,
+        client_rate_limit,
+        metrics.clone(),
+    ))
+    .err_into();
 
     let ctrl_c = pin!(ctrl_c().map_err(anyhow::Error::new));
 
-    tokio::spawn(http_health_check::serve(
+    tokio::spawn(http_health_check::serve_with_metrics(
         cli.health_check.health_check_addr,
         || true,
+        move || metrics.render(),
     ));
 
     match future::try_select(task, ctrl_c)
@@ -99,8 +121,15 @@ async fn get_firezone_id(env_id: Option<String>) -> Result<String> {
     Ok(id)
 }
 
-async fn run(login: LoginUrl, private_key: StaticSecret) -> Result<Infallible> {
-    let tunnel = GatewayTunnel::new(private_key, Sockets::new(), CallbackHandler)?;
+async fn run(
+    login: LoginUrl,
+    private_key: StaticSecret,
+    num_workers: NonZeroUsize,
+    client_rate_limit: Option<RateLimit>,
+    metrics: Metrics,
+) -> Result<Infallible> {
+    let workers = Workers::spawn(num_workers, private_key, client_rate_limit).await?;
+
     let portal = PhoenixChannel::connect(
         Secret::new(login),
         get_user_agent(None, env!("CARGO_PKG_VERSION")),
@@ -115,7 +144,10 @@ async fn run(login: LoginUrl, private_key: StaticSecret) -> Result<Infallible> {
     let tun_device = TunDeviceManager::new()?;
     let update_device_task = update_device_task(tun_device, receiver);
 
-    let mut eventloop = Eventloop::new(tunnel, portal, sender);
+    let resolver =
+        Resolver::from_system_conf().context("Failed to read system DNS configuration")?;
+
+    let mut eventloop = Eventloop::new(workers, portal, sender, resolver, metrics);
     let eventloop_task = future::poll_fn(move |cx| eventloop.poll(cx));
 
     let ((), result) = futures::join!(update_device_task, eventloop_task);
@@ -166,4 +198,23 @@ struct Cli {
     /// Identifier generated by the portal to identify and display the device.
     #[arg(short = 'i', long, env = "FIREZONE_ID")]
     pub firezone_id: Option<String>,
+
+    /// Limits each client to this many bytes per second, in each direction.
+    ///
+    /// Resources can have their own limits on top, configured in the portal.
+    #[arg(long, env = "FIREZONE_CLIENT_RATE_LIMIT")]
+    client_rate_limit: Option<u64>,
+
+    /// How many threads forward packets, each with their own sockets and a share of the clients.
+    #[arg(long, env = "FIREZONE_WORKERS", default_value = "1")]
+    workers: NonZeroUsize,
+
+    /// Trace every n-th packet (target `wire`, level `trace`), 0 disables sampling.
+    #[arg(
+        long,
+        hide = true,
+        env = "FIREZONE_WIRE_TRACE_SAMPLE_RATE",
+        default_value_t = 0
+    )]
+    wire_trace_sample_rate: u32,
 }
@@ -591,6 +591,7 @@ mod test {
                         port_range_start: 0,
                     }),
                 ],
+                rate_limit: None,
             }));
         let ingress_message = serde_json::from_str::<IngressMessages>(message).unwrap();
         assert_eq!(m, ingress_message);
@@ -0,0 +1,559 @@
+//! Metrics of the gateway, served in the Prometheus text exposition format.
+//!
+//! Each [worker](crate::workers) owns the counters of its tunnel and periodically reports them to the [`Eventloop`](crate::eventloop::Eventloop), which adds them up into [`Metrics`].
+//! The HTTP server only ever reads that copy, so scraping doesn't interfere with the data plane.
+
+use firezone_tunnel::{GatewayStats, Traffic};
+use std::fmt::Write as _;
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+/// Upper bounds of the buckets of [`LatencyHistogram`], in seconds.
+const LATENCY_BUCKETS: [f64; 8] = [0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.05];
+
+#[derive(Debug, Default, Clone)]
+pub(crate) struct Metrics {
+    inner: Arc<Mutex<Snapshot>>,
+}
+
+#[derive(Debug, Default, Clone)]
+struct Snapshot {
+    tunnel: GatewayStats,
+    eventloop: EventloopStats,
+}
+
+impl Metrics {
+    pub(crate) fn update(&self, tunnel: GatewayStats, eventloop: &EventloopStats) {
+        let mut snapshot = self.inner.lock().unwrap_or_else(|e| e.into_inner());
+
+        snapshot.tunnel = tunnel;
+        snapshot.eventloop = eventloop.clone();
+    }
+
+    pub(crate) fn render(&self) -> String {
+        let snapshot = self.inner.lock().unwrap_or_else(|e| e.into_inner()).clone();
+
+        let mut out = String::new();
+        render(&mut out, &snapshot).expect("writing to a string never fails");
+
+        out
+    }
+}
+
+/// How busy the event loop of a worker is.
+#[derive(Debug, Default, Clone)]
+pub(crate) struct EventloopStats {
+    /// How long we spent in a single iteration.
+    pub(crate) iterations: LatencyHistogram,
+    /// How late we got to a timer that was due, i.e. how long anything that became ready had to wait for the loop.
+    pub(crate) lag: LatencyHistogram,
+}
+
+impl EventloopStats {
+    /// Adds the samples of `other`, e.g. to combine the statistics of several workers.
+    pub(crate) fn merge(&mut self, other: &Self) {
+        self.iterations.merge(&other.iterations);
+        self.lag.merge(&other.lag);
+    }
+}
+
+/// A histogram of durations within an event loop.
+#[derive(Debug, Default, Clone)]
+pub(crate) struct LatencyHistogram {
+    buckets: [u64; LATENCY_BUCKETS.len()],
+    count: u64,
+    sum: Duration,
+}
+
+impl LatencyHistogram {
+    pub(crate) fn record(&mut self, latency: Duration) {
+        let seconds = latency.as_secs_f64();
+
+        if let Some(bucket) = LATENCY_BUCKETS.iter().position(|upper| seconds <= *upper) {
+            self.buckets[bucket] += 1;
+        }
+        self.count += 1;
+        self.sum += latency;
+    }
+
+    /// Adds the samples of `other`, e.g. to combine the histograms of several workers.
+    pub(crate) fn merge(&mut self, other: &Self) {
+        for (bucket, other) in self.buckets.iter_mut().zip(other.buckets) {
+            *bucket += other;
+        }
+        self.count += other.count;
+        self.sum += other.sum;
+    }
+}
+
+fn render(out: &mut String, snapshot: &Snapshot) -> std::fmt::Result {
+    let stats = &snapshot.tunnel;
+
+    const PACKETS: &str = "firezone_gateway_packets_total";
+    describe(
+        out,
+        PACKETS,
+        "counter",
+        "IP packets forwarded between the TUN device and clients.",
+    )?;
+    write_traffic_packets(out, PACKETS, "", &stats.total)?;
+
+    const BYTES: &str = "firezone_gateway_bytes_total";
+    describe(
+        out,
+        BYTES,
+        "counter",
+        "Bytes of IP packets forwarded between the TUN device and clients.",
+    )?;
+    write_traffic_bytes(out, BYTES, "", &stats.total)?;
+
+    const CLIENT_PACKETS: &str = "firezone_gateway_client_packets_total";
+    describe(
+        out,
+        CLIENT_PACKETS,
+        "counter",
+        "IP packets forwarded per connected client.",
+    )?;
+    for (id, traffic) in &stats.clients {
+        write_traffic_packets(out, CLIENT_PACKETS, &format!("client=\"{id}\","), traffic)?;
+    }
+
+    const CLIENT_BYTES: &str = "firezone_gateway_client_bytes_total";
+    describe(
+        out,
+        CLIENT_BYTES,
+        "counter",
+        "Bytes of IP packets forwarded per connected client.",
+    )?;
+    for (id, traffic) in &stats.clients {
+        write_traffic_bytes(out, CLIENT_BYTES, &format!("client=\"{id}\","), traffic)?;
+    }
+
+    const CLIENT_QUEUED_BYTES: &str = "firezone_gateway_client_queued_bytes";
+    describe(
+        out,
+        CLIENT_QUEUED_BYTES,
+        "gauge",
+        "Bytes waiting in our send queues per connected client.",
+    )?;
+    for (id, queue) in &stats.client_queues {
+        writeln!(
+            out,
+            "{CLIENT_QUEUED_BYTES}{{client=\"{id}\"}} {}",
+            queue.queued_bytes
+        )?;
+    }
+
+    const CLIENT_QUEUED_DATAGRAMS: &str = "firezone_gateway_client_queued_datagrams";
+    describe(
+        out,
+        CLIENT_QUEUED_DATAGRAMS,
+        "gauge",
+        "Datagrams waiting in our send queues per connected client.",
+    )?;
+    for (id, queue) in &stats.client_queues {
+        writeln!(
+            out,
+            "{CLIENT_QUEUED_DATAGRAMS}{{client=\"{id}\"}} {}",
+            queue.queued_datagrams
+        )?;
+    }
+
+    const CLIENT_RATE_LIMITED: &str = "firezone_gateway_client_rate_limited_packets_total";
+    describe(
+        out,
+        CLIENT_RATE_LIMITED,
+        "counter",
+        "Packets dropped because a connected client exceeded a rate limit.",
+    )?;
+    for (id, queue) in &stats.client_queues {
+        writeln!(
+            out,
+            "{CLIENT_RATE_LIMITED}{{client=\"{id}\",direction=\"to_client\"}} {}",
+            queue.rate_limited_to_client
+        )?;
+        writeln!(
+            out,
+            "{CLIENT_RATE_LIMITED}{{client=\"{id}\",direction=\"from_client\"}} {}",
+            queue.rate_limited_from_client
+        )?;
+    }
+
+    const DROPPED: &str = "firezone_gateway_dropped_packets_total";
+    describe(
+        out,
+        DROPPED,
+        "counter",
+        "Packets that were not forwarded, by stage and reason.",
+    )?;
+    for (stage, drops) in [
+        ("encapsulate", &stats.encapsulate_drops),
+        ("decapsulate", &stats.decapsulate_drops),
+    ] {
+        for (reason, num) in drops.iter() {
+            let reason = reason.as_str();
+            writeln!(
+                out,
+                "{DROPPED}{{stage=\"{stage}\",reason=\"{reason}\"}} {num}"
+            )?;
+        }
+    }
+
+    for (name, kind, help, value) in [
+        (
+            "firezone_gateway_clients",
+            "gauge",
+            "Number of connected clients.",
+            stats.clients.len() as u64,
+        ),
+        (
+            "firezone_gateway_nat_sessions",
+            "gauge",
+            "Number of entries in the NAT tables of all clients.",
+            stats.nat_sessions as u64,
+        ),
+        (
+            "firezone_gateway_flows",
+            "gauge",
+            "Number of flows tracked for all clients.",
+            stats.flows as u64,
+        ),
+        (
+            "firezone_gateway_relay_allocations",
+            "gauge",
+            "Number of allocations on relays.",
+            stats.relay_allocations as u64,
+        ),
+        (
+            "firezone_gateway_wireguard_handshakes_total",
+            "counter",
+            "WireGuard handshakes with clients.",
+            stats.wireguard_handshakes,
+        ),
+        (
+            "firezone_gateway_socket_receive_drops_total",
+            "counter",
+            "Datagrams the kernel dropped because we didn't read them fast enough.",
+            stats.sockets.drops,
+        ),
+        (
+            "firezone_gateway_socket_receive_queue_bytes",
+            "gauge",
+            "Bytes waiting in the receive buffers of our sockets.",
+            stats.sockets.queued_bytes,
+        ),
+        (
+            "firezone_gateway_socket_receive_buffer_bytes",
+            "gauge",
+            "Size of the receive buffers of our sockets, as granted by the kernel.",
+            stats.sockets.buffer_size,
+        ),
+        (
+            "firezone_gateway_socket_datagrams_received_total",
+            "counter",
+            "Datagrams read from our sockets.",
+            stats.sockets.datagrams,
+        ),
+        (
+            "firezone_gateway_socket_receive_batches_total",
+            "counter",
+            "Reads from our sockets that yielded datagrams.",
+            stats.sockets.batches,
+        ),
+        (
+            "firezone_gateway_socket_receive_max_batch_size",
+            "gauge",
+            "The largest number of datagrams received in a single read.",
+            stats.sockets.max_batch_size,
+        ),
+        (
+            "firezone_gateway_send_queue_enqueued_total",
+            "counter",
+            "Datagrams added to the data queues of our sockets.",
+            stats.send_queue.enqueued,
+        ),
+        (
+            "firezone_gateway_send_queue_dequeued_total",
+            "counter",
+            "Datagrams taken from the data queues of our sockets to be sent.",
+            stats.send_queue.dequeued,
+        ),
+        (
+            "firezone_gateway_send_queue_marked_ce_total",
+            "counter",
+            "ECN-capable datagrams the data queues marked with CE instead of dropping them.",
+            stats.send_queue.marked_ce,
+        ),
+        (
+            "firezone_gateway_control_queue_enqueued_total",
+            "counter",
+            "Control datagrams added to the control queues of our sockets.",
+            stats.control_queue.enqueued,
+        ),
+        (
+            "firezone_gateway_control_queue_dequeued_total",
+            "counter",
+            "Control datagrams taken from the control queues of our sockets to be sent.",
+            stats.control_queue.dequeued,
+        ),
+        (
+            "firezone_gateway_control_queue_dropped_total",
+            "counter",
+            "Control datagrams dropped because the control queues of our sockets were full.",
+            stats.control_queue.dropped,
+        ),
+    ] {
+        describe(out, name, kind, help)?;
+        writeln!(out, "{name} {value}")?;
+    }
+
+    const SEND_QUEUE_DROPPED: &str = "firezone_gateway_send_queue_dropped_total";
+    describe(
+        out,
+        SEND_QUEUE_DROPPED,
+        "counter",
+        "Datagrams the data queues of our sockets dropped, by reason.",
+    )?;
+    for (reason, num) in [
+        ("overflow", stats.send_queue.dropped_overflow),
+        ("codel", stats.send_queue.dropped_codel),
+    ] {
+        writeln!(out, "{SEND_QUEUE_DROPPED}{{reason=\"{reason}\"}} {num}")?;
+    }
+
+    for (name, help, sojourn) in [
+        (
+            "firezone_gateway_send_queue_sojourn_seconds",
+            "Time the most recently sent datagram spent in the data queues of our sockets.",
+            stats.send_queue.last_sojourn,
+        ),
+        (
+            "firezone_gateway_send_queue_max_sojourn_seconds",
+            "The longest time a datagram spent in the data queues of our sockets.",
+            stats.send_queue.max_sojourn,
+        ),
+        (
+            "firezone_gateway_control_queue_delay_seconds",
+            "Time the most recently sent control datagram spent in the control queues of our sockets.",
+            stats.control_queue.last_delay,
+        ),
+        (
+            "firezone_gateway_control_queue_max_delay_seconds",
+            "The longest time a control datagram spent in the control queues of our sockets.",
+            stats.control_queue.max_delay,
+        ),
+    ] {
+        describe(out, name, "gauge", help)?;
+        writeln!(out, "{name} {}", sojourn.as_secs_f64())?;
+    }
+
+    const CONTROL_QUEUE_DELAY: &str = "firezone_gateway_control_queue_delay_seconds_total";
+    describe(
+        out,
+        CONTROL_QUEUE_DELAY,
+        "counter",
+        "Time all control datagrams spent in the control queues of our sockets, divide by the dequeued datagrams for the average.",
+    )?;
+    writeln!(
+        out,
+        "{CONTROL_QUEUE_DELAY} {}",
+        stats.control_queue.total_delay.as_secs_f64()
+    )?;
+
+    write_histogram(
+        out,
+        "firezone_gateway_eventloop_iteration_seconds",
+        "Time spent in a single iteration of the event loop of a worker.",
+        &snapshot.eventloop.iterations,
+    )?;
+    write_histogram(
+        out,
+        "firezone_gateway_eventloop_lag_seconds",
+        "How late the event loop of a worker got to a timer that was due.",
+        &snapshot.eventloop.lag,
+    )?;
+
+    Ok(())
+}
+
+fn write_histogram(
+    out: &mut String,
+    name: &str,
+    help: &str,
+    histogram: &LatencyHistogram,
+) -> std::fmt::Result {
+    describe(out, name, "histogram", help)?;
+
+    let mut cumulative = 0;
+    for (upper, num) in LATENCY_BUCKETS.iter().zip(histogram.buckets) {
+        cumulative += num;
+        writeln!(out, "{name}_bucket{{le=\"{upper}\"}} {cumulative}")?;
+    }
+    writeln!(out, "{name}_bucket{{le=\"+Inf\"}} {}", histogram.count)?;
+    writeln!(out, "{name}_sum {}", histogram.sum.as_secs_f64())?;
+    writeln!(out, "{name}_count {}", histogram.count)?;
+
+    Ok(())
+}
+
+fn describe(out: &mut String, name: &str, kind: &str, help: &str) -> std::fmt::Result {
+    writeln!(out, "# HELP {name} {help}")?;
+    writeln!(out, "# TYPE {name} {kind}")?;
+
+    Ok(())
+}
+
+fn write_traffic_packets(
+    out: &mut String,
+    name: &str,
+    labels: &str,
+    traffic: &Traffic,
+) -> std::fmt::Result {
+    writeln!(
+        out,
+        "{name}{{{labels}direction=\"to_client\"}} {}",
+        traffic.packets_to_client
+    )?;
+    writeln!(
+        out,
+        "{name}{{{labels}direction=\"from_client\"}} {}",
+        traffic.packets_from_client
+    )?;
+
+    Ok(())
+}
+
+fn write_traffic_bytes(
+    out: &mut String,
+    name: &str,
+    labels: &str,
+    traffic: &Traffic,
+) -> std::fmt::Result {
+    writeln!(
+        out,
+        "{name}{{{labels}direction=\"to_client\"}} {}",
+        traffic.bytes_to_client
+    )?;
+    writeln!(
+        out,
+        "{name}{{{labels}direction=\"from_client\"}} {}",
+        traffic.bytes_from_client
+    )?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use firezone_tunnel::{ControlQueueStats, QueueStats};
+
+    #[test]
+    fn histogram_buckets_are_cumulative() {
+        let metrics = Metrics::default();
+        let mut eventloop = EventloopStats::default();
+
+        eventloop.iterations.record(Duration::from_micros(50));
+        eventloop.iterations.record(Duration::from_micros(200));
+        eventloop.iterations.record(Duration::from_secs(1));
+        metrics.update(GatewayStats::default(), &eventloop);
+
+        let rendered = metrics.render();
+
+        assert!(rendered
+            .contains("firezone_gateway_eventloop_iteration_seconds_bucket{le=\"0.0001\"} 1\n"));
+        assert!(rendered
+            .contains("firezone_gateway_eventloop_iteration_seconds_bucket{le=\"0.05\"} 2\n"));
+        assert!(rendered
+            .contains("firezone_gateway_eventloop_iteration_seconds_bucket{le=\"+Inf\"} 3\n"));
+        assert!(rendered.contains("firezone_gateway_eventloop_iteration_seconds_count 3\n"));
+    }
+
+    #[test]
+    fn renders_eventloop_lag() {
+        let metrics = Metrics::default();
+        let mut eventloop = EventloopStats::default();
+
+        eventloop.lag.record(Duration::from_millis(2));
+        metrics.update(GatewayStats::default(), &eventloop);
+
+        let rendered = metrics.render();
+
+        assert!(
+            rendered.contains("firezone_gateway_eventloop_lag_seconds_bucket{le=\"0.001\"} 0\n")
+        );
+        assert!(
+            rendered.contains("firezone_gateway_eventloop_lag_seconds_bucket{le=\"0.0025\"} 1\n")
+        );
+        assert!(rendered.contains("firezone_gateway_eventloop_iteration_seconds_count 0\n"));
+    }
+
+    #[test]
+    fn renders_send_queue() {
+        let metrics = Metrics::default();
+        let stats = GatewayStats {
+            send_queue: QueueStats {
+                enqueued: 10,
+                dequeued: 7,
+                dropped_overflow: 1,
+                dropped_codel: 2,
+                max_sojourn: Duration::from_millis(25),
+                ..Default::default()
+            },
+            ..Default::default()
+        };
+        metrics.update(stats, &EventloopStats::default());
+
+        let rendered = metrics.render();
+
+        assert!(rendered.contains("firezone_gateway_send_queue_enqueued_total 10\n"));
+        assert!(
+            rendered.contains("firezone_gateway_send_queue_dropped_total{reason=\"codel\"} 2\n")
+        );
+        assert!(rendered.contains("firezone_gateway_send_queue_max_sojourn_seconds 0.025\n"));
+    }
+
+    #[test]
+    fn renders_control_queue() {
+        let metrics = Metrics::default();
+        let stats = GatewayStats {
+            control_queue: ControlQueueStats {
+                dequeued: 4,
+                dropped: 1,
+                total_delay: Duration::from_millis(2),
+                ..Default::default()
+            },
+            ..Default::default()
+        };
+        metrics.update(stats, &EventloopStats::default());
+
+        let rendered = metrics.render();
+
+        assert!(rendered.contains("firezone_gateway_control_queue_dequeued_total 4\n"));
+        assert!(rendered.contains("firezone_gateway_control_queue_dropped_total 1\n"));
+        assert!(rendered.contains("firezone_gateway_control_queue_delay_seconds_total 0.002\n"));
+    }
+
+    #[test]
+    fn renders_totals_by_direction() {
+        let metrics = Metrics::default();
+        let stats = GatewayStats {
+            total: Traffic {
+                packets_to_client: 3,
+                bytes_to_client: 300,
+                packets_from_client: 1,
+                bytes_from_client: 100,
+            },
+            ..Default::default()
+        };
+        metrics.update(stats, &EventloopStats::default());
+
+        let rendered = metrics.render();
+
+        assert!(rendered.contains("firezone_gateway_packets_total{direction=\"to_client\"} 3\n"));
+        assert!(rendered.contains("firezone_gateway_bytes_total{direction=\"from_client\"} 100\n"));
+        assert!(rendered.contains(
+            "firezone_gateway_dropped_packets_total{stage=\"decapsulate\",reason=\"filtered\"} 0\n"
+        ));
+    }
+}
@@ -0,0 +1,208 @@
+//! Resolves the addresses of DNS resources on behalf of clients.
+//!
+//! Every connection to a DNS resource needs its addresses, so when many clients log in at once, we see the same names over and over.
+//! The [`Resolver`] therefore
+//! - caches answers for as long as their TTL allows,
+//! - shares a single lookup between all requests for a name that arrive while it is in flight and
+//! - queries A and AAAA records in parallel.
+
+use connlib_shared::DomainName;
+use futures::future::{BoxFuture, Shared};
+use futures::FutureExt as _;
+use hickory_resolver::config::{LookupIpStrategy, ResolverConfig, ResolverOpts};
+use hickory_resolver::error::ResolveError;
+use hickory_resolver::TokioAsyncResolver;
+use std::collections::HashMap;
+use std::net::IpAddr;
+use std::sync::{Arc, Mutex};
+
+/// How many answers we cache.
+const CACHE_SIZE: usize = 4096;
+
+type Lookup = Shared<BoxFuture<'static, Vec<IpAddr>>>;
+
+/// A cheaply cloneable handle to the gateway's resolver.
+///
+/// All clones share the cache and the in-flight lookups.
+#[derive(Clone)]
+pub(crate) struct Resolver {
+    inner: TokioAsyncResolver,
+    in_flight: Arc<Mutex<HashMap<String, Lookup>>>,
+}
+
+impl Resolver {
+    /// Creates a resolver that uses the system's nameservers.
+    pub(crate) fn from_system_conf() -> Result<Self, ResolveError> {
+        let (config, opts) = hickory_resolver::system_conf::read_system_conf()?;
+
+        Ok(Self::new(config, opts))
+    }
+
+    pub(crate) fn new(config: ResolverConfig, mut opts: ResolverOpts) -> Self {
+        opts.ip_strategy = LookupIpStrategy::Ipv4AndIpv6;
+        opts.cache_size = CACHE_SIZE;
+
+        Self {
+            inner: TokioAsyncResolver::tokio(config, opts),
+            in_flight: Arc::default(),
+        }
+    }
+
+    /// Resolves the IPv4 and IPv6 addresses of `domain`.
+    ///
+    /// Errors are logged and result in an empty list.
+    pub(crate) fn resolve(&self, domain: &DomainName) -> Lookup {
+        let name = domain.to_string();
+        let mut in_flight = self.in_flight.lock().unwrap_or_else(|e| e.into_inner());
+
+        if let Some(lookup) = in_flight.get(&name) {
+            return lookup.clone();
+        }
+
+        let lookup = lookup(self.inner.clone(), self.in_flight.clone(), name.clone())
+            .boxed()
+            .shared();
+        in_flight.insert(name, lookup.clone());
+
+        lookup
+    }
+}
+
+async fn lookup(
+    resolver: TokioAsyncResolver,
+    in_flight: Arc<Mutex<HashMap<String, Lookup>>>,
+    name: String,
+) -> Vec<IpAddr> {
+    // The names of DNS resources are always fully-qualified, don't apply the search domains.
+    let result = resolver
+        .lookup_ip(format!("{}.", name.trim_end_matches('.')))
+        .await;
+
+    in_flight
+        .lock()
+        .unwrap_or_else(|e| e.into_inner())
+        .remove(&name);
+
+    match result {
+        Ok(addresses) => addresses.iter().collect(),
+        Err(e) => {
+            tracing::warn!("Failed to resolve '{name}': {e}");
+
+            vec![]
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use hickory_resolver::config::NameServerConfigGroup;
+    use hickory_resolver::proto::op::{Message, MessageType};
+    use hickory_resolver::proto::rr::{rdata::A, RData, Record, RecordType};
+    use std::net::{Ipv4Addr, SocketAddr};
+    use std::sync::atomic::{AtomicUsize, Ordering};
+    use tokio::net::UdpSocket;
+
+    const ADDRESS: Ipv4Addr = Ipv4Addr::new(10, 0, 0, 1);
+
+    #[tokio::test]
+    async fn resolves_names() {
+        let (resolver, _) = stub_resolver().await;
+
+        let addresses = resolver.resolve(&"example.com".parse().unwrap()).await;
+
+        assert_eq!(addresses, vec![IpAddr::V4(ADDRESS)]);
+    }
+
+    #[tokio::test]
+    async fn concurrent_lookups_share_a_query() {
+        let (resolver, a_queries) = stub_resolver().await;
+        let name = "example.com".parse().unwrap();
+
+        let (a, b) = futures::join!(resolver.resolve(&name), resolver.clone().resolve(&name));
+
+        assert_eq!(a, b);
+        assert_eq!(a_queries.load(Ordering::SeqCst), 1);
+    }
+
+    #[tokio::test]
+    async fn answers_are_cached() {
+        let (resolver, a_queries) = stub_resolver().await;
+        let name = "example.com".parse().unwrap();
+
+        resolver.resolve(&name).await;
+        resolver.resolve(&name).await;
+
+        assert_eq!(a_queries.load(Ordering::SeqCst), 1);
+    }
+
+    #[tokio::test]
+    async fn failed_lookup_is_empty() {
+        let (resolver, _) = stub_resolver().await;
+
+        let addresses = resolver.resolve(&"example.org".parse().unwrap()).await;
+
+        assert!(addresses.is_empty());
+    }
+
+    /// Spawns a DNS server on localhost that answers A queries for `example.com` with [`ADDRESS`].
+    ///
+    /// Returns a resolver that uses it and the number of A queries the server has answered.
+    async fn stub_resolver() -> (Resolver, Arc<AtomicUsize>) {
+        let socket = UdpSocket::bind((Ipv4Addr::LOCALHOST, 0)).await.unwrap();
+        let SocketAddr::V4(addr) = socket.local_addr().unwrap() else {
+            unreachable!()
+        };
+        let a_queries = Arc::new(AtomicUsize::new(0));
+
+        tokio::spawn({
+            let a_queries = a_queries.clone();
+
+            async move {
+                let mut buf = [0u8; 512];
+
+                loop {
+                    let (len, from) = socket.recv_from(&mut buf).await.unwrap();
+                    let query = Message::from_vec(&buf[..len]).unwrap();
+
+                    let mut response = Message::new();
+                    response
+                        .set_id(query.id())
+                        .set_message_type(MessageType::Response)
+                        .set_recursion_desired(true)
+                        .set_recursion_available(true)
+                        .add_queries(query.queries().to_vec());
+
+                    for q in query.queries() {
+                        if q.query_type() != RecordType::A {
+                            continue;
+                        }
+
+                        a_queries.fetch_add(1, Ordering::SeqCst);
+
+                        if q.name().to_ascii() == "example.com." {
+                            response.add_answer(Record::from_rdata(
+                                q.name().clone(),
+                                300,
+                                RData::A(A(ADDRESS)),
+                            ));
+                        }
+                    }
+
+                    socket
+                        .send_to(&response.to_vec().unwrap(), from)
+                        .await
+                        .unwrap();
+                }
+            }
+        });
+
+        let config = ResolverConfig::from_parts(
+            None,
+            vec![],
+            NameServerConfigGroup::from_ips_clear(&[IpAddr::V4(*addr.ip())], addr.port(), true),
+        );
+
+        (Resolver::new(config, ResolverOpts::default()), a_queries)
+    }
+}
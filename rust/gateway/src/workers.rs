@@ -0,0 +1,677 @@
+//! The data plane of the gateway, sharded across threads.
+//!
+//! Each worker runs a [`GatewayTunnel`] on its own thread with
+//! - its own UDP sockets,
+//! - its own queue of the TUN device and
+//! - a disjoint set of clients.
+//!
+//! Clients are assigned to workers by hashing their ID, so all messages from the portal about a client reach the same worker.
+//!
+//! Steering datagrams from the network needs no help: every worker binds its own ephemeral ports and advertises them through its own ICE candidates and relay allocations.
+//! The kernel thus delivers each datagram straight to the socket of the worker that owns the connection.
+//! On the TUN device, the kernel picks a queue by flow hash and remembers which queue last wrote a flow, so replies from resources usually come back to the owning worker too.
+//! The rest, e.g. the first packet after a flow was idle for a few seconds, is handed to the owner through a channel.
+//! The owner sends the buffer back once it is done with the packet, so forwarding doesn't allocate either.
+//! The hot path doesn't take any locks.
+//!
+//! Only the owner announces which IPs belong to its clients, as its tunnel adds and removes them.
+//! Every worker thus learns about a client's removal and its reconnect in the order they happened, and never about a client that failed to connect.
+
+use crate::metrics::EventloopStats;
+use crate::CallbackHandler;
+use anyhow::{Context as _, Result};
+use connlib_shared::messages::{gateway::RateLimit, ClientId};
+use connlib_shared::StaticSecret;
+use firezone_tunnel::{ForeignPacket, GatewayEvent, GatewayStats, GatewayTunnel, Sockets};
+use futures::channel::{mpsc, oneshot};
+use futures::future::{self, JoinAll};
+use futures::StreamExt as _;
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::{Hash as _, Hasher as _};
+use std::net::IpAddr;
+use std::num::NonZeroUsize;
+use std::task::{Context, Poll};
+use std::time::{Duration, Instant};
+
+/// How often a worker reports the statistics of its tunnel.
+const STATS_INTERVAL: Duration = Duration::from_secs(5);
+
+/// How often a worker checks how late it gets to a timer, see [`EventloopStats::lag`].
+const LAG_PROBE_INTERVAL: Duration = Duration::from_millis(100);
+
+/// How many packets we buffer for a worker that another worker read from the TUN device.
+const FOREIGN_PACKETS_QUEUE_SIZE: usize = 1024;
+
+type Tunnel = GatewayTunnel<CallbackHandler>;
+type Task = Box<dyn FnOnce(&mut Tunnel) + Send>;
+
+/// A handle to all workers.
+///
+/// Dropping it stops them.
+pub(crate) struct Workers {
+    commands: Vec<mpsc::UnboundedSender<Command>>,
+    events: mpsc::UnboundedReceiver<Event>,
+}
+
+enum Command {
+    Run(Task),
+}
+
+/// What a worker announces to all workers about its clients.
+#[derive(Debug, Clone, Copy)]
+enum Route {
+    /// The client with these IPs belongs to the given worker.
+    Add { ips: [IpAddr; 2], owner: usize },
+    /// The given worker removed the client with these IPs.
+    Remove { ips: [IpAddr; 2], owner: usize },
+}
+
+/// What workers send each other through their packet queues.
+enum Message<P> {
+    /// A packet for a client of the receiving worker.
+    Packet { from: usize, packet: P },
+    /// A packet that the receiving worker forwarded earlier, handed back so it can reuse the buffer.
+    Recycle(P),
+}
+
+pub(crate) enum Event {
+    /// An event of a tunnel that concerns the portal.
+    Tunnel(GatewayEvent),
+    Stats {
+        worker: usize,
+        tunnel: GatewayStats,
+        eventloop: EventloopStats,
+    },
+}
+
+impl Workers {
+    /// Spawns `num` workers, each on their own thread.
+    pub(crate) async fn spawn(
+        num: NonZeroUsize,
+        private_key: StaticSecret,
+        client_rate_limit: Option<RateLimit>,
+    ) -> Result<Self> {
+        let num = num.get();
+        let (event_tx, events) = mpsc::unbounded();
+        let (command_txs, command_rxs) = (0..num)
+            .map(|_| mpsc::unbounded::<Command>())
+            .unzip::<_, _, Vec<_>, Vec<_>>();
+        let (packet_txs, packet_rxs) = (0..num)
+            .map(|_| mpsc::channel::<Message<ForeignPacket>>(FOREIGN_PACKETS_QUEUE_SIZE))
+            .unzip::<_, _, Vec<_>, Vec<_>>();
+        let (route_txs, route_rxs) = (0..num)
+            .map(|_| mpsc::unbounded::<Route>())
+            .unzip::<_, _, Vec<_>, Vec<_>>();
+
+        let mut ready = Vec::with_capacity(num);
+
+        for (index, ((commands, packets), routes)) in command_rxs
+            .into_iter()
+            .zip(packet_rxs)
+            .zip(route_rxs)
+            .enumerate()
+        {
+            let (ready_tx, ready_rx) = oneshot::channel();
+            let private_key = private_key.clone();
+            let peers = packet_txs.clone();
+            let announcer = Announcer::new(index, route_txs.clone());
+            let events = event_tx.clone();
+
+            std::thread::Builder::new()
+                .name(format!("gateway-worker-{index}"))
+                .spawn(move || {
+                    let runtime = match tokio::runtime::Builder::new_current_thread()
+                        .enable_all()
+                        .build()
+                    {
+                        Ok(runtime) => runtime,
+                        Err(e) => {
+                            let _ = ready_tx.send(Err(e));
+                            return;
+                        }
+                    };
+
+                    runtime.block_on(async move {
+                        let tunnel = if num == 1 {
+                            GatewayTunnel::new(private_key, Sockets::new(), CallbackHandler)
+                        } else {
+                            GatewayTunnel::new_shard(private_key, Sockets::new(), CallbackHandler)
+                        };
+                        let mut tunnel = match tunnel {
+                            Ok(tunnel) => tunnel,
+                            Err(e) => {
+                                let _ = ready_tx.send(Err(e));
+                                return;
+                            }
+                        };
+                        tunnel.set_client_rate_limit(client_rate_limit);
+                        let _ = ready_tx.send(Ok(()));
+
+                        let mut worker = Worker {
+                            index,
+                            tunnel,
+                            commands,
+                            packets,
+                            forwarder: Forwarder::new(index, peers),
+                            routes,
+                            announcer,
+                            events,
+                            stats_interval: tokio::time::interval(STATS_INTERVAL),
+                            lag_probe: lag_probe(),
+                            stats: EventloopStats::default(),
+                        };
+
+                        future::poll_fn(|cx| worker.poll(cx)).await
+                    });
+                })
+                .context("Failed to spawn worker thread")?;
+
+            ready.push(ready_rx);
+        }
+
+        for (index, ready) in ready.into_iter().enumerate() {
+            ready
+                .await
+                .with_context(|| format!("Worker {index} died during startup"))?
+                .with_context(|| format!("Failed to create tunnel of worker {index}"))?;
+        }
+
+        Ok(Self {
+            commands: command_txs,
+            events,
+        })
+    }
+
+    pub(crate) fn len(&self) -> usize {
+        self.commands.len()
+    }
+
+    /// Runs `task` on the worker that owns `client`.
+    pub(crate) fn run(&self, client: ClientId, task: impl FnOnce(&mut Tunnel) + Send + 'static) {
+        self.send(self.owner(&client), Command::Run(Box::new(task)));
+    }
+
+    /// Runs `task` on the worker that owns `client` and returns its result.
+    pub(crate) fn call<R>(
+        &self,
+        client: ClientId,
+        task: impl FnOnce(&mut Tunnel) -> R + Send + 'static,
+    ) -> oneshot::Receiver<R>
+    where
+        R: Send + 'static,
+    {
+        let (tx, rx) = oneshot::channel();
+        self.run(client, move |tunnel| {
+            let _ = tx.send(task(tunnel));
+        });
+
+        rx
+    }
+
+    /// Runs `task` on every worker.
+    pub(crate) fn run_all(&self, task: impl Fn(&mut Tunnel) + Clone + Send + 'static) {
+        for worker in 0..self.len() {
+            self.send(worker, Command::Run(Box::new(task.clone())));
+        }
+    }
+
+    /// Runs `task` on every worker and returns their results.
+    pub(crate) fn call_all<R>(
+        &self,
+        task: impl Fn(&mut Tunnel) -> R + Clone + Send + 'static,
+    ) -> JoinAll<oneshot::Receiver<R>>
+    where
+        R: Send + 'static,
+    {
+        let results = (0..self.len())
+            .map(|worker| {
+                let (tx, rx) = oneshot::channel();
+                let task = task.clone();
+                self.send(
+                    worker,
+                    Command::Run(Box::new(move |tunnel| {
+                        let _ = tx.send(task(tunnel));
+                    })),
+                );
+
+                rx
+            })
+            .collect::<Vec<_>>();
+
+        future::join_all(results)
+    }
+
+    pub(crate) fn poll_event(&mut self, cx: &mut Context<'_>) -> Poll<Result<Event>> {
+        match futures::ready!(self.events.poll_next_unpin(cx)) {
+            Some(event) => Poll::Ready(Ok(event)),
+            None => Poll::Ready(Err(anyhow::anyhow!("All workers stopped"))),
+        }
+    }
+
+    fn owner(&self, client: &ClientId) -> usize {
+        owner(client, self.len())
+    }
+
+    fn send(&self, worker: usize, command: Command) {
+        if self.commands[worker].unbounded_send(command).is_err() {
+            tracing::error!(%worker, "Worker stopped");
+        }
+    }
+}
+
+struct Worker {
+    index: usize,
+    tunnel: Tunnel,
+
+    commands: mpsc::UnboundedReceiver<Command>,
+    /// Packets for our clients that other workers read from the TUN device, and buffers of the ones we forwarded.
+    packets: mpsc::Receiver<Message<ForeignPacket>>,
+    forwarder: Forwarder<ForeignPacket>,
+    /// Which worker owns which client IPs, as announced by the owners.
+    routes: mpsc::UnboundedReceiver<Route>,
+    announcer: Announcer,
+
+    events: mpsc::UnboundedSender<Event>,
+    stats_interval: tokio::time::Interval,
+    lag_probe: tokio::time::Interval,
+    stats: EventloopStats,
+}
+
+impl Worker {
+    fn poll(&mut self, cx: &mut Context<'_>) -> Poll<()> {
+        let start = Instant::now();
+        let poll = self.poll_inner(cx);
+        self.stats.iterations.record(start.elapsed());
+
+        poll
+    }
+
+    fn poll_inner(&mut self, cx: &mut Context<'_>) -> Poll<()> {
+        loop {
+            // Checked first so the lag only reflects how long it took to poll us, not how we prioritise within an iteration.
+            if let Poll::Ready(deadline) = self.lag_probe.poll_tick(cx) {
+                self.stats.lag.record(deadline.elapsed());
+                continue;
+            }
+
+            match self.commands.poll_next_unpin(cx) {
+                Poll::Ready(Some(Command::Run(task))) => {
+                    task(&mut self.tunnel);
+                    continue;
+                }
+                Poll::Ready(None) => return Poll::Ready(()),
+                Poll::Pending => {}
+            }
+
+            // Every worker holds a sender to our routes, so this never ends before we stop.
+            if let Poll::Ready(Some(route)) = self.routes.poll_next_unpin(cx) {
+                self.forwarder.apply(route);
+                continue;
+            }
+
+            match self.packets.poll_next_unpin(cx) {
+                Poll::Ready(Some(Message::Packet { from, mut packet })) => {
+                    if let Err(e) = self.tunnel.send_to_client(&mut packet) {
+                        tracing::warn!("Tunnel error: {e}");
+                    }
+                    self.forwarder.give_back(from, packet);
+                    continue;
+                }
+                Poll::Ready(Some(Message::Recycle(packet))) => {
+                    self.tunnel.recycle_foreign_packet(packet);
+                    continue;
+                }
+                Poll::Ready(None) | Poll::Pending => {}
+            }
+
+            match self.tunnel.poll_next_event(cx) {
+                Poll::Ready(Ok(event)) => {
+                    self.handle_tunnel_event(event);
+                    continue;
+                }
+                Poll::Ready(Err(e)) => {
+                    tracing::warn!("Tunnel error: {e}");
+                    continue;
+                }
+                Poll::Pending => {}
+            }
+
+            if self.stats_interval.poll_tick(cx).is_ready() {
+                let _ = self.events.unbounded_send(Event::Stats {
+                    worker: self.index,
+                    tunnel: self.tunnel.stats(),
+                    eventloop: self.stats.clone(),
+                });
+                continue;
+            }
+
+            return Poll::Pending;
+        }
+    }
+
+    fn handle_tunnel_event(&mut self, event: GatewayEvent) {
+        match event {
+            GatewayEvent::ForeignPacket { packet } => {
+                let dst = packet.destination();
+
+                match self.forwarder.forward(dst, packet) {
+                    Ok(()) => {}
+                    Err(Dropped::UnknownClient(packet)) => {
+                        tracing::trace!(%dst, "Unknown client, dropping packet");
+                        self.tunnel.drop_foreign_packet(packet);
+                    }
+                    Err(Dropped::QueueFull(packet)) => {
+                        tracing::trace!(%dst, "Queue of worker is full, dropping packet");
+                        self.tunnel.recycle_foreign_packet(packet);
+                    }
+                }
+            }
+            GatewayEvent::FlowEnded { conn_id, record } => {
+                tracing::debug!(
+                    target: "flow_records",
+                    client = %conn_id,
+                    src = %record.src.0,
+                    src_protocol = ?record.src.1,
+                    dst = %record.dst.0,
+                    dst_protocol = ?record.dst.1,
+                    packets_out = record.outbound.packets,
+                    bytes_out = record.outbound.bytes,
+                    packets_in = record.inbound.packets,
+                    bytes_in = record.inbound.bytes,
+                    duration = ?record.duration,
+                    reason = ?record.reason,
+                    "Flow ended"
+                );
+            }
+            GatewayEvent::ClientAdded { ips, .. } => {
+                self.announcer.announce(Route::Add {
+                    ips,
+                    owner: self.index,
+                });
+            }
+            GatewayEvent::ClientRemoved { ips, .. } => {
+                self.announcer.announce(Route::Remove {
+                    ips,
+                    owner: self.index,
+                });
+            }
+            GatewayEvent::AddedIceCandidates { .. }
+            | GatewayEvent::RemovedIceCandidates { .. }
+            | GatewayEvent::RefreshDns { .. } => {
+                let _ = self.events.unbounded_send(Event::Tunnel(event));
+            }
+        }
+    }
+}
+
+/// Hands packets that a worker read from the TUN device to the worker that owns their client.
+struct Forwarder<P> {
+    index: usize,
+    /// Which worker owns a client IP.
+    routes: HashMap<IpAddr, usize>,
+    /// The packet queues of all workers, indexed by worker.
+    peers: Vec<mpsc::Sender<Message<P>>>,
+}
+
+enum Dropped<P> {
+    UnknownClient(P),
+    QueueFull(P),
+}
+
+impl<P> Forwarder<P> {
+    fn new(index: usize, peers: Vec<mpsc::Sender<Message<P>>>) -> Self {
+        Self {
+            index,
+            routes: HashMap::new(),
+            peers,
+        }
+    }
+
+    fn apply(&mut self, route: Route) {
+        match route {
+            Route::Add { ips, owner } => self.route(ips, owner),
+            Route::Remove { ips, owner } => self.unroute(ips, owner),
+        }
+    }
+
+    fn route(&mut self, ips: [IpAddr; 2], owner: usize) {
+        for ip in ips {
+            self.routes.insert(ip, owner);
+        }
+    }
+
+    fn unroute(&mut self, ips: [IpAddr; 2], owner: usize) {
+        for ip in ips {
+            // The IP may have been handed to a client of another worker in the meantime.
+            if self.routes.get(&ip) == Some(&owner) {
+                self.routes.remove(&ip);
+            }
+        }
+    }
+
+    fn forward(&mut self, dst: IpAddr, packet: P) -> Result<(), Dropped<P>> {
+        // Our tunnel doesn't know the client, so a route to ourselves is stale.
+        let Some(owner) = self.routes.get(&dst).copied().filter(|o| *o != self.index) else {
+            return Err(Dropped::UnknownClient(packet));
+        };
+
+        self.peers[owner]
+            .try_send(Message::Packet {
+                from: self.index,
+                packet,
+            })
+            .map_err(|e| match e.into_inner() {
+                Message::Packet { packet, .. } | Message::Recycle(packet) => {
+                    Dropped::QueueFull(packet)
+                }
+            })
+    }
+
+    /// Hands a packet we received from another worker back to it, so it can reuse the buffer.
+    fn give_back(&mut self, to: usize, packet: P) {
+        // If the queue is full, the buffer is simply freed and the other worker allocates a new one.
+        let _ = self.peers[to].try_send(Message::Recycle(packet));
+    }
+}
+
+/// Tells all workers about the clients of one worker.
+struct Announcer {
+    index: usize,
+    /// The route queues of all workers, indexed by worker.
+    workers: Vec<mpsc::UnboundedSender<Route>>,
+}
+
+impl Announcer {
+    fn new(index: usize, workers: Vec<mpsc::UnboundedSender<Route>>) -> Self {
+        Self { index, workers }
+    }
+
+    fn announce(&self, route: Route) {
+        for (worker, queue) in self.workers.iter().enumerate() {
+            if queue.unbounded_send(route).is_err() {
+                tracing::debug!(from = %self.index, %worker, "Worker stopped, not announcing route");
+            }
+        }
+    }
+}
+
+/// The worker that owns a client, out of `num` workers.
+fn owner(client: &ClientId, num: usize) -> usize {
+    let mut hasher = DefaultHasher::new();
+    client.hash(&mut hasher);
+
+    (hasher.finish() % num as u64) as usize
+}
+
+fn lag_probe() -> tokio::time::Interval {
+    let mut interval = tokio::time::interval(LAG_PROBE_INTERVAL);
+    // Every tick is one sample of how late we were, don't catch up on missed ones.
+    interval.set_missed_tick_behavior(tokio::time::MissedTickBehavior::Delay);
+
+    interval
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn clients_are_spread_across_workers() {
+        let owners = (0..100u128)
+            .map(|n| owner(&client(n), 4))
+            .collect::<Vec<_>>();
+
+        assert!(owners.iter().all(|o| *o < 4));
+        assert!((0..4).all(|worker| owners.contains(&worker)));
+    }
+
+    #[test]
+    fn client_always_has_the_same_owner() {
+        assert_eq!(owner(&client(1), 4), owner(&client(1), 4));
+    }
+
+    #[test]
+    fn forwards_packet_to_owner_and_gets_buffer_back() {
+        let (mut forwarders, mut queues) = workers(2);
+
+        forwarders[0].route(ips(1), 1);
+        assert!(forwarders[0].forward(ip(1), "packet").is_ok());
+
+        let Ok(Some(Message::Packet { from, packet })) = queues[1].try_next() else {
+            panic!("Expected packet in queue of owner");
+        };
+        assert_eq!((from, packet), (0, "packet"));
+
+        forwarders[1].give_back(from, packet);
+
+        let Ok(Some(Message::Recycle(packet))) = queues[0].try_next() else {
+            panic!("Expected buffer to come back");
+        };
+        assert_eq!(packet, "packet");
+    }
+
+    #[test]
+    fn drops_packet_for_unknown_client() {
+        let (mut forwarders, _queues) = workers(2);
+
+        assert!(matches!(
+            forwarders[0].forward(ip(1), "packet"),
+            Err(Dropped::UnknownClient("packet"))
+        ));
+    }
+
+    #[test]
+    fn drops_packet_for_stale_route_to_ourselves() {
+        let (mut forwarders, _queues) = workers(2);
+
+        forwarders[0].route(ips(1), 0);
+
+        assert!(matches!(
+            forwarders[0].forward(ip(1), "packet"),
+            Err(Dropped::UnknownClient("packet"))
+        ));
+    }
+
+    #[test]
+    fn drops_packet_for_removed_client() {
+        let (mut forwarders, _queues) = workers(2);
+
+        forwarders[0].route(ips(1), 1);
+        forwarders[0].unroute(ips(1), 1);
+
+        assert!(matches!(
+            forwarders[0].forward(ip(1), "packet"),
+            Err(Dropped::UnknownClient("packet"))
+        ));
+    }
+
+    #[test]
+    fn unroute_keeps_ips_reassigned_to_another_worker() {
+        let (mut forwarders, _queues) = workers(3);
+
+        forwarders[0].route(ips(1), 1);
+        forwarders[0].route(ips(1), 2);
+        forwarders[0].unroute(ips(1), 1);
+
+        assert!(forwarders[0].forward(ip(1), "packet").is_ok());
+    }
+
+    #[test]
+    fn reconnect_after_removal_keeps_route() {
+        let (mut forwarders, _queues) = workers(2);
+        let (announcer, mut routes) = announcer(2, 1);
+
+        // The owner removes the client and accepts its reconnect before worker 0 gets to its queue.
+        announcer.announce(Route::Add {
+            ips: ips(1),
+            owner: 1,
+        });
+        announcer.announce(Route::Remove {
+            ips: ips(1),
+            owner: 1,
+        });
+        announcer.announce(Route::Add {
+            ips: ips(1),
+            owner: 1,
+        });
+        while let Ok(Some(route)) = routes[0].try_next() {
+            forwarders[0].apply(route);
+        }
+
+        assert!(forwarders[0].forward(ip(1), "packet").is_ok());
+    }
+
+    #[test]
+    fn returns_packet_if_queue_is_full() {
+        let (mut forwarders, _queues) = workers(2);
+        forwarders[0].route(ips(1), 1);
+
+        let result = std::iter::repeat("packet")
+            .map(|packet| forwarders[0].forward(ip(1), packet))
+            .find(|r| r.is_err());
+
+        assert!(matches!(result, Some(Err(Dropped::QueueFull("packet")))));
+    }
+
+    #[allow(clippy::type_complexity)]
+    fn workers(
+        num: usize,
+    ) -> (
+        Vec<Forwarder<&'static str>>,
+        Vec<mpsc::Receiver<Message<&'static str>>>,
+    ) {
+        let (peers, queues) = (0..num)
+            .map(|_| mpsc::channel(FOREIGN_PACKETS_QUEUE_SIZE))
+            .unzip::<_, _, Vec<_>, Vec<_>>();
+        let forwarders = (0..num)
+            .map(|index| Forwarder::new(index, peers.clone()))
+            .collect();
+
+        (forwarders, queues)
+    }
+
+    /// The announcer of worker `index` and the route queues of all workers.
+    fn announcer(num: usize, index: usize) -> (Announcer, Vec<mpsc::UnboundedReceiver<Route>>) {
+        let (workers, routes) = (0..num)
+            .map(|_| mpsc::unbounded())
+            .unzip::<_, _, Vec<_>, Vec<_>>();
+
+        (Announcer::new(index, workers), routes)
+    }
+
+    fn client(n: u128) -> ClientId {
+        uuid::Uuid::from_u128(n).to_string().parse().unwrap()
+    }
+
+    fn ip(n: u8) -> IpAddr {
+        IpAddr::from([100, 64, 0, n])
+    }
+
+    fn ips(n: u8) -> [IpAddr; 2] {
+        [
+            ip(n),
+            IpAddr::from([0xfd00, 0x2021, 0x1111, 0, 0, 0, 0, n as u16]),
+        ]
+    }
+}
@@ -186,10 +186,12 @@ impl Handler {
             };
             match event {
                 Event::Callback(x) => {
-                    if let Err(error) = self.handle_connlib_cb(x).await {
-                        tracing::error!(?error, "Error while handling connlib callback");
-                        continue;
+                    // Drain whatever else connlib queued up, so the GUI gets it with a single write.
+                    let mut batch = vec![x];
+                    while let Ok(x) = self.cb_rx.try_recv() {
+                        batch.push(x);
                     }
+                    self.handle_connlib_cbs(batch).await;
                 }
                 Event::Ipc(msg) => {
                     if let Err(error) = self.handle_ipc_msg(msg) {
@@ -201,6 +203,25 @@ impl Handler {
         }
     }
 
+    async fn handle_connlib_cbs(&mut self, batch: Vec<InternalServerMsg>) {
+        // Only the latest resource list matters.
+        let last_resources = batch.iter().rposition(is_resource_update);
+
+        for (i, msg) in batch.into_iter().enumerate() {
+            if is_resource_update(&msg) && Some(i) != last_resources {
+                continue;
+            }
+            if let Err(error) = self.handle_connlib_cb(msg).await {
+                tracing::error!(?error, "Error while handling connlib callback");
+            }
+        }
+
+        if let Err(error) = self.ipc_tx.flush().await {
+            tracing::error!(?error, "Error while sending IPC messages");
+        }
+    }
+
+    /// Queues the resulting IPC messages, the caller must flush them.
     async fn handle_connlib_cb(&mut self, msg: InternalServerMsg) -> Result<()> {
         match msg {
             InternalServerMsg::Ipc(msg) => {
@@ -212,7 +233,7 @@ impl Handler {
                     }
                 }
                 self.ipc_tx
-                    .send(&msg)
+                    .feed(&msg)
                     .await
                     .context("Error while sending IPC message")?
             }
@@ -220,7 +241,7 @@ impl Handler {
                 self.tun_device.set_ips(ipv4, ipv6).await?;
                 self.dns_controller.set_dns(&dns).await?;
                 self.ipc_tx
-                    .send(&IpcServerMsg::OnTunnelReady)
+                    .feed(&IpcServerMsg::OnTunnelReady)
                     .await
                     .context("Error while sending `OnTunnelReady`")?
             }
@@ -284,6 +305,13 @@ impl Handler {
     }
 }
 
+fn is_resource_update(msg: &InternalServerMsg) -> bool {
+    matches!(
+        msg,
+        InternalServerMsg::Ipc(IpcServerMsg::OnUpdateResources(_))
+    )
+}
+
 /// Starts logging for the production IPC service
 ///
 /// Returns: A `Handle` that must be kept alive. Dropping it stops logging
@@ -1,5 +1,5 @@
 use crate::{IpcClientMsg, IpcServerMsg};
-use anyhow::{Context as _, Result};
+use anyhow::Result;
 use tokio::io::{ReadHalf, WriteHalf};
 use tokio_util::{
     bytes::BytesMut,
@@ -16,8 +16,12 @@ mod platform;
 #[path = "ipc/windows.rs"]
 pub mod platform;
 
+#[path = "ipc/wire.rs"]
+mod wire;
+
 pub(crate) use platform::Server;
 use platform::{ClientStream, ServerStream};
+pub use wire::WireMessage;
 
 pub(crate) type ClientRead = FramedRead<ReadHalf<ClientStream>, Decoder<IpcServerMsg>>;
 pub type ClientWrite = FramedWrite<WriteHalf<ClientStream>, Encoder<IpcClientMsg>>;
@@ -75,35 +79,41 @@ pub enum ServiceId {
     Test(&'static str),
 }
 
-pub struct Decoder<D> {
+/// Decodes one [`WireMessage`] per length-delimited frame.
+///
+/// Lives as long as the connection, so it can apply incremental updates.
+pub struct Decoder<D: WireMessage> {
     inner: LengthDelimitedCodec,
-    _decode_type: std::marker::PhantomData<D>,
+    state: D::DecodeState,
 }
 
-pub struct Encoder<E> {
+/// Encodes one [`WireMessage`] per length-delimited frame.
+///
+/// Several messages can be written with a single syscall by `feed`ing them and `flush`ing once.
+pub struct Encoder<E: WireMessage> {
     inner: LengthDelimitedCodec,
-    _encode_type: std::marker::PhantomData<E>,
+    state: E::EncodeState,
 }
 
-impl<D> Default for Decoder<D> {
+impl<D: WireMessage> Default for Decoder<D> {
     fn default() -> Self {
         Self {
             inner: LengthDelimitedCodec::new(),
-            _decode_type: Default::default(),
+            state: Default::default(),
         }
     }
 }
 
-impl<E> Default for Encoder<E> {
+impl<E: WireMessage> Default for Encoder<E> {
     fn default() -> Self {
         Self {
             inner: LengthDelimitedCodec::new(),
-            _encode_type: Default::default(),
+            state: Default::default(),
         }
     }
 }
 
-impl<D: serde::de::DeserializeOwned> tokio_util::codec::Decoder for Decoder<D> {
+impl<D: WireMessage> tokio_util::codec::Decoder for Decoder<D> {
     type Error = anyhow::Error;
     type Item = D;
 
@@ -111,18 +121,20 @@ impl<D: serde::de::DeserializeOwned> tokio_util::codec::Decoder for Decoder<D> {
         let Some(msg) = self.inner.decode(buf)? else {
             return Ok(None);
         };
-        let msg = serde_json::from_slice(&msg)
-            .with_context(|| format!("Error while deserializing {}", std::any::type_name::<D>()))?;
+        let msg = D::decode(&msg, &mut self.state)?;
         Ok(Some(msg))
     }
 }
 
-impl<E: serde::Serialize> tokio_util::codec::Encoder<&E> for Encoder<E> {
+impl<E: WireMessage> tokio_util::codec::Encoder<&E> for Encoder<E> {
     type Error = anyhow::Error;
 
     fn encode(&mut self, msg: &E, buf: &mut BytesMut) -> Result<()> {
-        let msg = serde_json::to_string(msg)?;
-        self.inner.encode(msg.into(), buf)?;
+        let mut body = Vec::new();
+        if !msg.encode(&mut self.state, &mut body)? {
+            return Ok(());
+        }
+        self.inner.encode(body.into(), buf)?;
         Ok(())
     }
 }
@@ -169,11 +181,15 @@ impl platform::Server {
 
 #[cfg(test)]
 mod tests {
-    use super::{platform::Server, ServiceId};
+    use super::{platform::Server, ServiceId, WireMessage};
     use crate::{IpcClientMsg, IpcServerMsg};
     use anyhow::{bail, ensure, Context as _, Result};
+    use connlib_shared::{
+        callbacks::{ResourceDescription, ResourceDescriptionCidr, Status},
+        messages::ResourceId,
+    };
     use futures::{SinkExt, StreamExt};
-    use std::time::Duration;
+    use std::time::{Duration, Instant};
     use tokio::{task::JoinHandle, time::timeout};
 
     #[tokio::test]
@@ -258,6 +274,98 @@ mod tests {
         Ok(())
     }
 
+    /// Measures latency and throughput of resource list updates through the IPC socket.
+    ///
+    /// Run with `FIREZONE_IPC_BENCHMARK=1 cargo test --release -p firezone-headless-client ipc_benchmark -- --ignored --nocapture`
+    ///
+    /// CI runs ignored tests too, so this does nothing unless `FIREZONE_IPC_BENCHMARK` is set.
+    #[tokio::test]
+    #[ignore = "Benchmark"]
+    async fn ipc_benchmark() -> Result<()> {
+        if std::env::var_os("FIREZONE_IPC_BENCHMARK").is_none() {
+            return Ok(());
+        }
+        let _ = tracing_subscriber::fmt().with_test_writer().try_init();
+
+        const NUM_RESOURCES: usize = 1_000;
+        const NUM_UPDATES: usize = 1_000;
+        const ID: ServiceId = ServiceId::Test("B3NCHQ7K");
+
+        // Each update flips the status of a single resource, like a site going on- or offline.
+        fn update(i: usize) -> IpcServerMsg {
+            let resources = (0..NUM_RESOURCES)
+                .map(|n| {
+                    ResourceDescription::Cidr(ResourceDescriptionCidr {
+                        id: ResourceId::from_bytes((n as u128).to_le_bytes()),
+                        address: format!("10.{}.{}.0/24", n / 256, n % 256).parse().unwrap(),
+                        name: format!("Resource {n}"),
+                        address_description: Some(format!("https://resource-{n}.example.com")),
+                        sites: vec![],
+                        status: if n == i % NUM_RESOURCES && i % 2 == 1 {
+                            Status::Offline
+                        } else {
+                            Status::Online
+                        },
+                    })
+                })
+                .collect();
+
+            IpcServerMsg::OnUpdateResources(resources)
+        }
+
+        let mut server = Server::new(ID).await?;
+        let server_task: JoinHandle<Result<Duration>> = tokio::spawn(async move {
+            let (mut rx, mut tx) = server.next_client_split().await?;
+            let updates = (0..NUM_UPDATES * 2).map(update).collect::<Vec<_>>();
+            let (ping_pong, burst) = updates.split_at(NUM_UPDATES);
+
+            // Latency: wait for the client to acknowledge each update.
+            let start = Instant::now();
+            for msg in ping_pong {
+                tx.send(msg).await?;
+                rx.next().await.context("Client disconnected")??;
+            }
+            let latency = start.elapsed() / NUM_UPDATES as u32;
+
+            // Throughput: queue all updates and let the codec batch them.
+            for msg in burst {
+                tx.feed(msg).await?;
+            }
+            tx.flush().await?;
+
+            Ok(latency)
+        });
+
+        let (mut rx, mut tx) = super::connect_to_service(ID).await?;
+        for _ in 0..NUM_UPDATES {
+            rx.next().await.context("Server disconnected")??;
+            tx.send(&IpcClientMsg::Reconnect).await?;
+        }
+        let start = Instant::now();
+        for _ in 0..NUM_UPDATES {
+            rx.next().await.context("Server disconnected")??;
+        }
+        let throughput = NUM_UPDATES as f64 / start.elapsed().as_secs_f64();
+        let latency = server_task.await??;
+
+        let json_size = serde_json::to_vec(&update(1))?.len();
+        let mut binary_size = Vec::new();
+        let mut sent = Default::default();
+        WireMessage::encode(&update(0), &mut sent, &mut Vec::new())?;
+        WireMessage::encode(&update(1), &mut sent, &mut binary_size)?;
+
+        tracing::info!(
+            resources = NUM_RESOURCES,
+            ?latency,
+            updates_per_second = %format!("{throughput:.0}"),
+            bytes_per_update = binary_size.len(),
+            json_bytes_per_update = json_size,
+            "IPC benchmark, one status flip per update"
+        );
+
+        Ok(())
+    }
+
     /// Replicate #5143
     ///
     /// When the IPC service has disconnected from a GUI and loops over, sometimes
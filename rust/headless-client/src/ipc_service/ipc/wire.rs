@@ -0,0 +1,228 @@
+//! How IPC messages are encoded inside their length-delimited frames.
+//!
+//! [`IpcServerMsg`]s are binary: a tag byte, followed by the variant's fields.
+//! Resource lists are the bulk of the traffic, so they are sent as a [`Delta`](connlib_client_shared::resource_delta::Delta) against the list the GUI already has,
+//! in the encoding of [`resource_delta`](connlib_client_shared::resource_delta).
+//! A resource list that didn't change isn't sent at all.
+//!
+//! [`IpcClientMsg`]s are rare and small, so they stay JSON.
+
+use crate::{IpcClientMsg, IpcServerMsg};
+use anyhow::{bail, ensure, Context as _, Result};
+use connlib_client_shared::resource_delta::{DeltaReader, ResourceDeltas};
+use connlib_shared::{callbacks::ResourceDescription, messages::ResourceId};
+use std::collections::HashMap;
+
+const TAG_OK: u8 = 0;
+const TAG_ON_DISCONNECT: u8 = 1;
+const TAG_ON_TUNNEL_READY: u8 = 2;
+const TAG_ON_UPDATE_RESOURCES: u8 = 3;
+
+/// A message that can be sent over the IPC channel.
+///
+/// Both sides keep state across the messages of a connection, which lets us send only what changed.
+pub trait WireMessage: Sized {
+    type EncodeState: Default;
+    type DecodeState: Default;
+
+    /// Appends the encoded message to `buf`.
+    ///
+    /// Returns `false` if the other side already knows everything in this message and it doesn't need to be sent.
+    fn encode(&self, state: &mut Self::EncodeState, buf: &mut Vec<u8>) -> Result<bool>;
+
+    fn decode(buf: &[u8], state: &mut Self::DecodeState) -> Result<Self>;
+}
+
+/// The resource lists we sent to the GUI.
+#[derive(Debug, Default)]
+pub struct SentResources {
+    deltas: ResourceDeltas,
+}
+
+/// The resource list we received from the IPC service.
+#[derive(Debug, Default)]
+pub struct ReceivedResources {
+    seq: u64,
+    resources: HashMap<ResourceId, ResourceDescription>,
+}
+
+impl WireMessage for IpcServerMsg {
+    type EncodeState = SentResources;
+    type DecodeState = ReceivedResources;
+
+    fn encode(&self, state: &mut SentResources, buf: &mut Vec<u8>) -> Result<bool> {
+        match self {
+            IpcServerMsg::Ok => buf.push(TAG_OK),
+            IpcServerMsg::OnDisconnect {
+                error_msg,
+                is_authentication_error,
+            } => {
+                buf.push(TAG_ON_DISCONNECT);
+                buf.push(u8::from(*is_authentication_error));
+                buf.extend_from_slice(error_msg.as_bytes());
+            }
+            IpcServerMsg::OnTunnelReady => buf.push(TAG_ON_TUNNEL_READY),
+            IpcServerMsg::OnUpdateResources(resources) => {
+                // The GUI waits for the first list, even if it is empty.
+                let Some(delta) = state.deltas.update_or_initial(resources) else {
+                    return Ok(false);
+                };
+
+                buf.push(TAG_ON_UPDATE_RESOURCES);
+                delta.encode(buf);
+            }
+        }
+
+        Ok(true)
+    }
+
+    fn decode(buf: &[u8], state: &mut ReceivedResources) -> Result<Self> {
+        let (tag, body) = buf.split_first().context("Empty IPC message")?;
+
+        let msg = match *tag {
+            TAG_OK => IpcServerMsg::Ok,
+            TAG_ON_DISCONNECT => {
+                let (is_authentication_error, error_msg) =
+                    body.split_first().context("Truncated `OnDisconnect`")?;
+
+                IpcServerMsg::OnDisconnect {
+                    error_msg: String::from_utf8(error_msg.to_vec())?,
+                    is_authentication_error: *is_authentication_error != 0,
+                }
+            }
+            TAG_ON_TUNNEL_READY => IpcServerMsg::OnTunnelReady,
+            TAG_ON_UPDATE_RESOURCES => {
+                let delta = DeltaReader::new(body)?;
+
+                // Deltas build on each other, so we must not have missed one.
+                // Seq 0 is the initial, empty list.
+                ensure!(
+                    delta.seq() == 0 || delta.seq() == state.seq + 1,
+                    "Expected resource delta {}, got {}",
+                    state.seq + 1,
+                    delta.seq()
+                );
+                state.seq = delta.seq();
+
+                for id in delta.removed() {
+                    state.resources.remove(&id);
+                }
+                for resource in delta.upserted() {
+                    let resource = resource?.to_owned();
+                    state.resources.insert(resource.id(), resource);
+                }
+
+                // Same order as connlib hands them to us.
+                let mut resources = state.resources.values().cloned().collect::<Vec<_>>();
+                resources.sort_by(|a, b| (a.name(), a.id()).cmp(&(b.name(), b.id())));
+
+                IpcServerMsg::OnUpdateResources(resources)
+            }
+            other => bail!("Unknown IPC message tag {other}"),
+        };
+
+        Ok(msg)
+    }
+}
+
+impl WireMessage for IpcClientMsg {
+    type EncodeState = ();
+    type DecodeState = ();
+
+    fn encode(&self, _: &mut (), buf: &mut Vec<u8>) -> Result<bool> {
+        serde_json::to_writer(buf, self)?;
+
+        Ok(true)
+    }
+
+    fn decode(buf: &[u8], _: &mut ()) -> Result<Self> {
+        serde_json::from_slice(buf).context("Error while deserializing `IpcClientMsg`")
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use connlib_shared::callbacks::{ResourceDescriptionCidr, Status};
+
+    #[test]
+    fn resource_lists_roundtrip_as_deltas() {
+        let mut sent = SentResources::default();
+        let mut received = ReceivedResources::default();
+
+        let first =
+            IpcServerMsg::OnUpdateResources(vec![cidr(1, Status::Online), cidr(2, Status::Online)]);
+        let second = IpcServerMsg::OnUpdateResources(vec![cidr(1, Status::Offline)]);
+
+        for msg in [first, second] {
+            let mut buf = Vec::new();
+            assert!(msg.encode(&mut sent, &mut buf).unwrap());
+
+            assert_eq!(IpcServerMsg::decode(&buf, &mut received).unwrap(), msg);
+        }
+    }
+
+    #[test]
+    fn unchanged_resource_list_is_not_sent() {
+        let mut sent = SentResources::default();
+        let msg = IpcServerMsg::OnUpdateResources(vec![cidr(1, Status::Online)]);
+
+        assert!(msg.encode(&mut sent, &mut Vec::new()).unwrap());
+        assert!(!msg.encode(&mut sent, &mut Vec::new()).unwrap());
+    }
+
+    #[test]
+    fn initial_empty_resource_list_is_sent() {
+        let mut sent = SentResources::default();
+        let mut received = ReceivedResources::default();
+        let msg = IpcServerMsg::OnUpdateResources(vec![]);
+
+        let mut buf = Vec::new();
+        assert!(msg.encode(&mut sent, &mut buf).unwrap());
+        assert_eq!(IpcServerMsg::decode(&buf, &mut received).unwrap(), msg);
+        assert!(!msg.encode(&mut sent, &mut Vec::new()).unwrap());
+    }
+
+    #[test]
+    fn missed_delta_is_an_error() {
+        let mut sent = SentResources::default();
+        let mut received = ReceivedResources::default();
+
+        IpcServerMsg::OnUpdateResources(vec![cidr(1, Status::Online)])
+            .encode(&mut sent, &mut Vec::new())
+            .unwrap();
+        let mut buf = Vec::new();
+        IpcServerMsg::OnUpdateResources(vec![cidr(2, Status::Online)])
+            .encode(&mut sent, &mut buf)
+            .unwrap();
+
+        assert!(IpcServerMsg::decode(&buf, &mut received).is_err());
+    }
+
+    #[test]
+    fn disconnect_roundtrips() {
+        let msg = IpcServerMsg::OnDisconnect {
+            error_msg: "token expired".to_owned(),
+            is_authentication_error: true,
+        };
+
+        let mut buf = Vec::new();
+        msg.encode(&mut SentResources::default(), &mut buf).unwrap();
+
+        assert_eq!(
+            IpcServerMsg::decode(&buf, &mut ReceivedResources::default()).unwrap(),
+            msg
+        );
+    }
+
+    fn cidr(n: u8, status: Status) -> ResourceDescription {
+        ResourceDescription::Cidr(ResourceDescriptionCidr {
+            id: ResourceId::from_bytes([n; 16]),
+            address: format!("10.0.{n}.0/24").parse().unwrap(),
+            name: format!("Network {n}"),
+            address_description: None,
+            sites: vec![],
+            status,
+        })
+    }
+}
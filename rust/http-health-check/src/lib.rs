@@ -1,4 +1,4 @@
-use axum::http::StatusCode;
+use axum::http::{header, StatusCode};
 use axum::routing::get;
 use axum::Router;
 use std::net::SocketAddr;
@@ -8,22 +8,49 @@ pub async fn serve(
     addr: impl Into<SocketAddr>,
     is_healthy: impl Fn() -> bool + Clone + Send + Sync + 'static,
 ) -> std::io::Result<()> {
-    let addr = addr.into();
+    serve_router(addr.into(), health_check_router(is_healthy)).await
+}
+
+/// Like [`serve`] but additionally responds to `GET /metrics` with the return value of `metrics`.
+///
+/// `metrics` is expected to render the Prometheus text exposition format.
+pub async fn serve_with_metrics(
+    addr: impl Into<SocketAddr>,
+    is_healthy: impl Fn() -> bool + Clone + Send + Sync + 'static,
+    metrics: impl Fn() -> String + Clone + Send + Sync + 'static,
+) -> std::io::Result<()> {
+    let router = health_check_router(is_healthy).route(
+        "/metrics",
+        get(move || async move {
+            (
+                [(header::CONTENT_TYPE, "text/plain; version=0.0.4")],
+                metrics(),
+            )
+        }),
+    );
+
+    serve_router(addr.into(), router).await
+}
 
-    let service = Router::new()
-        .route(
-            "/healthz",
-            get(move || async move {
-                if is_healthy() {
-                    StatusCode::OK
-                } else {
-                    StatusCode::BAD_REQUEST
-                }
-            }),
-        )
-        .into_make_service();
+fn health_check_router(is_healthy: impl Fn() -> bool + Clone + Send + Sync + 'static) -> Router {
+    Router::new().route(
+        "/healthz",
+        get(move || async move {
+            if is_healthy() {
+                StatusCode::OK
+            } else {
+                StatusCode::BAD_REQUEST
+            }
+        }),
+    )
+}
 
-    axum::serve(tokio::net::TcpListener::bind(addr).await?, service).await?;
+async fn serve_router(addr: SocketAddr, router: Router) -> std::io::Result<()> {
+    axum::serve(
+        tokio::net::TcpListener::bind(addr).await?,
+        router.into_make_service(),
+    )
+    .await?;
 
     Ok(())
 }
@@ -33,6 +60,7 @@ pub struct HealthCheckArgs {
     /// The address of the local interface where we should serve our health-check endpoint.
     ///
     /// The actual health-check endpoint will be at `http://<health_check_addr>/healthz`.
+    /// Components that export metrics serve them at `http://<health_check_addr>/metrics`.
     #[arg(long, env, hide = true, default_value = "0.0.0.0:8080")]
     pub health_check_addr: SocketAddr,
 }
@@ -0,0 +1,127 @@
+//! Explicit Congestion Notification (ECN) as per RFC 3168 and its propagation across tunnels as per RFC 6040.
+
+/// The ECN codepoint, i.e. the lower two bits of the IPv4 TOS / IPv6 traffic class octet.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash, Default)]
+#[repr(u8)]
+pub enum Ecn {
+    /// Not ECN-Capable Transport.
+    #[default]
+    NotEct = 0b00,
+    /// ECN-Capable Transport, codepoint 1.
+    Ect1 = 0b01,
+    /// ECN-Capable Transport, codepoint 0.
+    Ect0 = 0b10,
+    /// Congestion Experienced.
+    Ce = 0b11,
+}
+
+impl Ecn {
+    /// Extracts the ECN codepoint from a TOS / traffic class octet.
+    ///
+    /// Only the lower two bits are considered, making this safe to call with the entire octet.
+    pub fn from_bits(bits: u8) -> Self {
+        match bits & 0b11 {
+            0b00 => Ecn::NotEct,
+            0b01 => Ecn::Ect1,
+            0b10 => Ecn::Ect0,
+            _ => Ecn::Ce,
+        }
+    }
+
+    pub fn bits(self) -> u8 {
+        self as u8
+    }
+
+    /// Combines the ECN codepoint of an arriving inner header with the one of the outer header.
+    ///
+    /// Implements the decapsulation table from <https://www.rfc-editor.org/rfc/rfc6040#section-4.2>.
+    /// Returns [`None`] if the packet must be dropped, i.e. the outer header experienced congestion but the inner packet is not ECN-capable.
+    pub fn decapsulate(inner: Ecn, outer: Ecn) -> Option<Ecn> {
+        let ecn = match (inner, outer) {
+            (Ecn::NotEct, Ecn::Ce) => return None,
+            (Ecn::NotEct, _) => Ecn::NotEct,
+            (Ecn::Ce, _) | (_, Ecn::Ce) => Ecn::Ce,
+            (Ecn::Ect0, Ecn::Ect1) => Ecn::Ect1,
+            (inner @ (Ecn::Ect0 | Ecn::Ect1), Ecn::NotEct | Ecn::Ect0 | Ecn::Ect1) => inner,
+        };
+
+        Some(ecn)
+    }
+}
+
+#[derive(Debug, thiserror::Error)]
+#[error("Outer header experienced congestion but inner packet is not ECN-capable")]
+pub struct CongestionOnNotEct;
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::make::udp_packet;
+    use pnet_packet::{ipv4, ipv6::MutableIpv6Packet, MutablePacket as _};
+    use std::net::{Ipv4Addr, Ipv6Addr};
+
+    #[test]
+    fn rfc6040_decapsulation_table() {
+        use Ecn::*;
+
+        let table = [
+            // inner, [outer: NotEct, Ect0, Ect1, Ce]
+            (NotEct, [Some(NotEct), Some(NotEct), Some(NotEct), None]),
+            (Ect0, [Some(Ect0), Some(Ect0), Some(Ect1), Some(Ce)]),
+            (Ect1, [Some(Ect1), Some(Ect1), Some(Ect1), Some(Ce)]),
+            (Ce, [Some(Ce), Some(Ce), Some(Ce), Some(Ce)]),
+        ];
+
+        for (inner, expected) in table {
+            for (outer, expected) in [NotEct, Ect0, Ect1, Ce].into_iter().zip(expected) {
+                assert_eq!(
+                    Ecn::decapsulate(inner, outer),
+                    expected,
+                    "inner = {inner:?}, outer = {outer:?}"
+                );
+            }
+        }
+    }
+
+    #[test]
+    fn from_bits_ignores_dscp() {
+        assert_eq!(Ecn::from_bits(0b1011_1010), Ecn::Ect0);
+        assert_eq!(Ecn::from_bits(0b1011_1011), Ecn::Ce);
+    }
+
+    #[test]
+    fn ipv4_apply_ce_keeps_header_checksum_valid() {
+        let mut packet = udp_packet(Ipv4Addr::LOCALHOST, Ipv4Addr::LOCALHOST, 1, 2, vec![0; 8]);
+        packet.set_ecn(Ecn::Ect0);
+
+        packet.apply_outer_ecn(Ecn::Ce).unwrap();
+
+        assert_eq!(packet.ecn(), Ecn::Ce);
+        let crate::IpPacket::Ipv4(ipv4) = packet.as_immutable() else {
+            panic!("expected IPv4 packet")
+        };
+        assert_eq!(ipv4.get_checksum(), ipv4::checksum(&ipv4));
+    }
+
+    #[test]
+    fn ipv6_apply_ce_preserves_dscp() {
+        let mut packet = udp_packet(Ipv6Addr::LOCALHOST, Ipv6Addr::LOCALHOST, 1, 2, vec![0; 8]);
+        MutableIpv6Packet::new(packet.packet_mut())
+            .unwrap()
+            .set_traffic_class(0b1011_1001);
+
+        packet.apply_outer_ecn(Ecn::Ce).unwrap();
+
+        let crate::IpPacket::Ipv6(ipv6) = packet.as_immutable() else {
+            panic!("expected IPv6 packet")
+        };
+        assert_eq!(ipv6.get_traffic_class(), 0b1011_1011);
+    }
+
+    #[test]
+    fn drops_not_ect_packet_with_ce_outer_header() {
+        let mut packet = udp_packet(Ipv4Addr::LOCALHOST, Ipv4Addr::LOCALHOST, 1, 2, vec![0; 8]);
+
+        assert!(packet.apply_outer_ecn(Ecn::Ce).is_err());
+    }
+}
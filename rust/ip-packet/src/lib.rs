@@ -1,8 +1,12 @@
 pub mod make;
 
+mod ecn;
+mod mss;
+
 #[cfg(feature = "proptest")]
 pub mod proptest;
 
+pub use ecn::{CongestionOnNotEct, Ecn};
 pub use pnet_packet::*;
 
 #[cfg(all(test, feature = "proptest"))]
@@ -44,7 +48,7 @@ macro_rules! swap_src_dst {
     };
 }
 
-#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
 pub enum Protocol {
     /// Contains either the source or destination port.
     Tcp(u16),
@@ -261,7 +265,7 @@ impl<'a> ConvertibleIpv4Packet<'a> {
         dst: Ipv6Addr,
     ) -> Option<ConvertibleIpv6Packet<'a>> {
         // First we store the old values before modifying the old packet
-        let dscp = self.as_ipv4().get_dscp();
+        let traffic_class = (self.as_ipv4().get_dscp() << 2) | self.as_ipv4().get_ecn();
         let total_length = self.as_ipv4().get_total_length();
         let header_length = self.header_length();
         let ttl = self.as_ipv4().get_ttl();
@@ -313,8 +317,8 @@ impl<'a> ConvertibleIpv4Packet<'a> {
         //    addition, if the translator is at an administrative boundary, the
         //    filtering and update considerations of [RFC2475] may be
         //    applicable.
-        // Note: DSCP is the new name for TOS
-        pkt.as_ipv6().set_traffic_class(dscp);
+        // Note: DSCP is the new name for TOS, it is the upper 6 bits of the octet, the lower 2 bits are ECN.
+        pkt.as_ipv6().set_traffic_class(traffic_class);
 
         // Flow Label:  0 (all zero bits)
         pkt.as_ipv6().set_flow_label(0);
@@ -614,7 +618,8 @@ impl<'a> ConvertibleIpv6Packet<'a> {
         //    addition, if the translator is at an administrative boundary, the
         //    filtering and update considerations of [RFC2475] may be
         //    applicable.
-        pkt.as_ipv4().set_dscp(traffic_class);
+        pkt.as_ipv4().set_dscp(traffic_class >> 2);
+        pkt.as_ipv4().set_ecn(traffic_class & 0b11);
 
         // Total Length:  Payload length value from the IPv6 header, plus the
         //    size of the IPv4 header.
@@ -1023,6 +1028,57 @@ impl<'a> MutableIpPacket<'a> {
         for_both!(self, |i| i.get_destination().into())
     }
 
+    pub fn ecn(&self) -> Ecn {
+        self.as_immutable().ecn()
+    }
+
+    /// Sets the ECN codepoint of this packet, keeping the IPv4 header checksum valid.
+    pub fn set_ecn(&mut self, ecn: Ecn) {
+        match self {
+            Self::Ipv4(p) => {
+                p.as_ipv4().set_ecn(ecn.bits());
+            }
+            Self::Ipv6(p) => {
+                let traffic_class = p.as_ipv6().get_traffic_class();
+                p.as_ipv6()
+                    .set_traffic_class((traffic_class & !0b11) | ecn.bits());
+            }
+        }
+
+        self.set_ipv4_checksum();
+    }
+
+    /// Applies the ECN codepoint of the outer (tunnel) header to this packet.
+    ///
+    /// See [`Ecn::decapsulate`] for details.
+    /// The packet MUST be dropped if this returns an error.
+    pub fn apply_outer_ecn(&mut self, outer: Ecn) -> Result<(), CongestionOnNotEct> {
+        let inner = self.ecn();
+        let ecn = Ecn::decapsulate(inner, outer).ok_or(CongestionOnNotEct)?;
+
+        if ecn != inner {
+            self.set_ecn(ecn);
+        }
+
+        Ok(())
+    }
+
+    /// Lowers the MSS option of a TCP SYN or SYN-ACK such that the resulting segments fit into `mtu`.
+    ///
+    /// Returns whether the packet was changed.
+    pub fn clamp_tcp_mss(&mut self, mtu: usize) -> bool {
+        if !self.to_immutable().is_tcp() {
+            return false;
+        }
+
+        let ip_header_len = match self {
+            Self::Ipv4(p) => p.header_length(),
+            Self::Ipv6(_) => 40,
+        };
+
+        mss::clamp(self.payload_mut(), mss::for_mtu(mtu, ip_header_len))
+    }
+
     pub fn set_source_protocol(&mut self, v: u16) {
         if let Some(mut p) = self.as_tcp() {
             p.set_source(v);
@@ -1352,6 +1408,23 @@ impl<'a> IpPacket<'a> {
         for_both!(self, |i| i.get_destination().into())
     }
 
+    pub fn ecn(&self) -> Ecn {
+        match self {
+            Self::Ipv4(p) => Ecn::from_bits(p.get_ecn()),
+            Self::Ipv6(p) => Ecn::from_bits(p.get_traffic_class()),
+        }
+    }
+
+    /// Whether routers along the path are forbidden to fragment this packet.
+    ///
+    /// This is always the case for IPv6; for IPv4 it depends on the DF flag.
+    pub fn dont_fragment(&self) -> bool {
+        match self {
+            Self::Ipv4(p) => p.get_flags() & Ipv4Flags::DontFragment != 0,
+            Self::Ipv6(_) => true,
+        }
+    }
+
     pub fn udp_payload(&self) -> &[u8] {
         debug_assert_eq!(
             match self {
@@ -47,6 +47,59 @@ pub fn icmp_response_packet(packet: IpPacket<'static>) -> MutableIpPacket<'stati
     )
 }
 
+/// Makes an ICMP "packet too big" message in response to `packet`, advertising `mtu` as the maximum size we can forward.
+///
+/// For IPv4, this is a "destination unreachable, fragmentation needed" message (RFC 1191), for IPv6 a "packet too big" message (RFC 8201).
+/// The message appears to originate from the original destination so it is routed back to the sender like any other reply.
+pub fn icmp_packet_too_big(packet: IpPacket<'_>, mtu: u16) -> MutableIpPacket<'static> {
+    use crate::{ip::IpNextHeaderProtocols, Packet as _};
+
+    /// Type 3 (destination unreachable), code 4 (fragmentation needed and DF set).
+    const ICMPV4_FRAG_NEEDED: [u8; 2] = [3, 4];
+    /// Type 2 (packet too big), code 0.
+    const ICMPV6_PACKET_TOO_BIG: [u8; 2] = [2, 0];
+
+    let original = packet.packet();
+
+    match (packet.destination(), packet.source()) {
+        (IpAddr::V4(src), IpAddr::V4(dst)) => {
+            // RFC 1812 allows quoting as much of the original datagram as fits in 576 bytes.
+            let quoted = original.len().min(576 - 20 - 8);
+            let mut buf = vec![0u8; 20 + 20 + 8 + quoted];
+
+            ipv4_header(src, dst, IpNextHeaderProtocols::Icmp, 5, &mut buf[20..]);
+
+            let icmp = &mut buf[40..];
+            icmp[..2].copy_from_slice(&ICMPV4_FRAG_NEEDED);
+            icmp[6..8].copy_from_slice(&mtu.to_be_bytes());
+            icmp[8..].copy_from_slice(&original[..quoted]);
+
+            let mut result = MutableIpPacket::owned(buf).unwrap();
+            result.update_checksum();
+            result
+        }
+        (IpAddr::V6(src), IpAddr::V6(dst)) => {
+            // The ICMPv6 error must not exceed the minimum IPv6 MTU.
+            let quoted = original.len().min(1280 - 40 - 8);
+            let mut buf = vec![0u8; 20 + 40 + 8 + quoted];
+
+            ipv6_header(src, dst, IpNextHeaderProtocols::Icmpv6, &mut buf[20..]);
+
+            let icmp = &mut buf[60..];
+            icmp[..2].copy_from_slice(&ICMPV6_PACKET_TOO_BIG);
+            icmp[4..8].copy_from_slice(&(mtu as u32).to_be_bytes());
+            icmp[8..].copy_from_slice(&original[..quoted]);
+
+            let mut result = MutableIpPacket::owned(buf).unwrap();
+            result.update_checksum();
+            result
+        }
+        (IpAddr::V6(_), IpAddr::V4(_)) | (IpAddr::V4(_), IpAddr::V6(_)) => {
+            unreachable!("IP packets always have the same version for source and destination")
+        }
+    }
+}
+
 #[cfg_attr(test, derive(Debug, test_strategy::Arbitrary))]
 pub(crate) enum IcmpKind {
     Request,
@@ -0,0 +1,164 @@
+//! TCP maximum segment size (MSS) clamping.
+//!
+//! Endpoints derive the MSS they announce from the MTU of their physical interface.
+//! Through the tunnel, segments of that size need to be fragmented or are dropped altogether.
+//! Rewriting the MSS option of SYN and SYN-ACK segments makes both ends send segments that fit into the tunnel.
+
+const TCP_HEADER_LEN: usize = 20;
+const SYN: u8 = 0b0000_0010;
+
+const OPTION_END: u8 = 0;
+const OPTION_NOP: u8 = 1;
+const OPTION_MSS: u8 = 2;
+
+/// Lowers the MSS option of a TCP segment to `mss` if it is a SYN and announces a larger one.
+///
+/// Updates the TCP checksum incrementally, see <https://www.rfc-editor.org/rfc/rfc1624>.
+/// Returns whether the segment was changed.
+pub(crate) fn clamp(tcp: &mut [u8], mss: u16) -> bool {
+    if tcp.len() < TCP_HEADER_LEN || tcp[13] & SYN == 0 {
+        return false;
+    }
+
+    let header_len = ((tcp[12] >> 4) as usize * 4).min(tcp.len());
+    let mut i = TCP_HEADER_LEN;
+
+    while i < header_len {
+        let kind = tcp[i];
+
+        match kind {
+            OPTION_END => return false,
+            OPTION_NOP => {
+                i += 1;
+                continue;
+            }
+            _ => {}
+        }
+
+        let Some(len) = tcp.get(i + 1).map(|l| *l as usize) else {
+            return false;
+        };
+        if len < 2 || i + len > header_len {
+            return false; // Malformed options, leave the segment alone.
+        }
+
+        if kind != OPTION_MSS || len != 4 {
+            i += len;
+            continue;
+        }
+
+        let value = i + 2;
+        let old = u16::from_be_bytes([tcp[value], tcp[value + 1]]);
+        if old <= mss {
+            return false;
+        }
+
+        tcp[value..value + 2].copy_from_slice(&mss.to_be_bytes());
+
+        // The checksum is a sum of 16-bit words; a value at an odd offset contributes its bytes swapped.
+        let (old, new) = if value % 2 == 0 {
+            (old, mss)
+        } else {
+            (old.swap_bytes(), mss.swap_bytes())
+        };
+        let checksum = u16::from_be_bytes([tcp[16], tcp[17]]);
+        tcp[16..18].copy_from_slice(&adjust_checksum(checksum, old, new).to_be_bytes());
+
+        return true;
+    }
+
+    false
+}
+
+/// The MSS that makes a segment of `ip_header_len` fit into `mtu`.
+pub(crate) fn for_mtu(mtu: usize, ip_header_len: usize) -> u16 {
+    mtu.saturating_sub(ip_header_len + TCP_HEADER_LEN)
+        .min(u16::MAX as usize) as u16
+}
+
+/// `HC' = ~(~HC + ~m + m')` as per RFC 1624, eqn. 3.
+fn adjust_checksum(checksum: u16, old: u16, new: u16) -> u16 {
+    let mut sum = (!checksum) as u32 + (!old) as u32 + new as u32;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    !(sum as u16)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{make::tcp_packet, MutableIpPacket, Packet as _};
+    use std::net::{Ipv4Addr, Ipv6Addr};
+
+    #[test]
+    fn clamps_mss_of_ipv4_syn() {
+        let mut packet = segment(Ipv4Addr::LOCALHOST.into(), &[2, 4, 0x05, 0xb4], SYN); // MSS 1460
+
+        assert!(packet.clamp_tcp_mss(1280));
+
+        assert_eq!(mss_option(&packet), 1240);
+        assert_checksum_valid(&packet);
+    }
+
+    #[test]
+    fn clamps_mss_at_odd_offset() {
+        let mut packet = segment(
+            Ipv6Addr::LOCALHOST.into(),
+            &[1, 2, 4, 0x05, 0xa0, 0, 0, 0], // NOP, MSS 1440
+            SYN | ACK,
+        );
+
+        assert!(packet.clamp_tcp_mss(1280));
+
+        assert_eq!(mss_option(&packet), 1220);
+        assert_checksum_valid(&packet);
+    }
+
+    #[test]
+    fn leaves_smaller_mss_alone() {
+        let mut packet = segment(Ipv4Addr::LOCALHOST.into(), &[2, 4, 0x04, 0x00], SYN); // MSS 1024
+
+        assert!(!packet.clamp_tcp_mss(1280));
+        assert_eq!(mss_option(&packet), 1024);
+    }
+
+    #[test]
+    fn ignores_non_syn_segments() {
+        let mut packet = segment(Ipv4Addr::LOCALHOST.into(), &[2, 4, 0x05, 0xb4], ACK);
+
+        assert!(!packet.clamp_tcp_mss(1280));
+    }
+
+    const ACK: u8 = 0b0001_0000;
+
+    /// Makes a TCP segment with the given options by turning the start of the payload into options.
+    fn segment(ip: std::net::IpAddr, options: &[u8], flags: u8) -> MutableIpPacket<'static> {
+        let mut packet = tcp_packet(ip, ip, 1, 2, vec![0; 8]);
+        assert!(options.len() <= 8 && options.len() % 4 == 0);
+
+        let mut tcp = packet.as_tcp().unwrap();
+        let segment = crate::MutablePacket::packet_mut(&mut tcp);
+        segment[TCP_HEADER_LEN..TCP_HEADER_LEN + options.len()].copy_from_slice(options);
+        segment[12] = (((TCP_HEADER_LEN + options.len()) / 4) as u8) << 4;
+        segment[13] = flags;
+
+        packet.update_checksum();
+        packet
+    }
+
+    fn mss_option(packet: &MutableIpPacket<'_>) -> u16 {
+        let tcp = packet.as_immutable_tcp().unwrap();
+        let header = &tcp.packet()[TCP_HEADER_LEN..];
+        let at = header.iter().position(|b| *b == OPTION_MSS).unwrap();
+
+        u16::from_be_bytes([header[at + 2], header[at + 3]])
+    }
+
+    fn assert_checksum_valid(packet: &MutableIpPacket<'_>) {
+        let tcp = packet.as_immutable_tcp().unwrap();
+        let immutable = packet.as_immutable();
+
+        assert_eq!(tcp.get_checksum(), immutable.tcp_checksum(&tcp));
+    }
+}
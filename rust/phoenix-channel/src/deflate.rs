@@ -0,0 +1,165 @@
+//! Compression of websocket messages.
+//!
+//! This follows the algorithm of permessage-deflate (RFC 7692) with context takeover in both directions:
+//! Each message is deflated with a sync flush and the trailing `00 00 ff ff` is stripped.
+//! The compression context is kept for the lifetime of the connection, which is what makes repeated JSON keys cheap.
+//!
+//! `tungstenite` doesn't support websocket extensions, so we negotiate this via [`HEADER`] during the handshake and exchange compressed messages as binary frames.
+
+use flate2::{Compress, Compression, Decompress, FlushCompress, FlushDecompress, Status};
+use std::io;
+
+/// The header we use to negotiate compression with the portal.
+pub(crate) const HEADER: &str = "x-firezone-compression";
+pub(crate) const DEFLATE: &str = "deflate";
+
+/// The largest message we are willing to inflate, guards against decompression bombs.
+const MAX_MESSAGE_SIZE: usize = 64 << 20;
+
+const TAIL: [u8; 4] = [0x00, 0x00, 0xff, 0xff];
+
+pub(crate) struct Deflate {
+    compress: Compress,
+    decompress: Decompress,
+}
+
+impl Deflate {
+    pub(crate) fn new() -> Self {
+        Self {
+            compress: Compress::new(Compression::fast(), false),
+            decompress: Decompress::new(false),
+        }
+    }
+
+    pub(crate) fn compress(&mut self, input: &[u8]) -> Vec<u8> {
+        let mut out = Vec::with_capacity(input.len() / 2 + TAIL.len());
+        let start = self.compress.total_in();
+
+        loop {
+            let consumed = (self.compress.total_in() - start) as usize;
+            out.reserve(256);
+
+            self.compress
+                .compress_vec(&input[consumed..], &mut out, FlushCompress::Sync)
+                .expect("compressing into a buffer with spare capacity never fails");
+
+            let consumed = (self.compress.total_in() - start) as usize;
+            if consumed == input.len() && out.len() < out.capacity() {
+                break;
+            }
+        }
+
+        if out.ends_with(&TAIL) {
+            out.truncate(out.len() - TAIL.len());
+        }
+
+        out
+    }
+
+    pub(crate) fn decompress(&mut self, input: &[u8]) -> io::Result<Vec<u8>> {
+        self.decompress_with_capacity(input, (input.len() + TAIL.len()) * 4)
+    }
+
+    fn decompress_with_capacity(&mut self, input: &[u8], capacity: usize) -> io::Result<Vec<u8>> {
+        let input = [input, &TAIL].concat();
+        let mut out = Vec::with_capacity(capacity.max(1));
+        let start = self.decompress.total_in();
+
+        loop {
+            let consumed = (self.decompress.total_in() - start) as usize;
+            let produced = out.len();
+            if out.len() == out.capacity() {
+                out.reserve(out.capacity());
+            }
+
+            let status = self
+                .decompress
+                .decompress_vec(&input[consumed..], &mut out, FlushDecompress::Sync)
+                .map_err(|e| io::Error::new(io::ErrorKind::InvalidData, e))?;
+
+            let now_consumed = (self.decompress.total_in() - start) as usize;
+            let made_progress = now_consumed != consumed || out.len() != produced;
+
+            // With all input consumed, we are done once the output didn't fill the buffer.
+            // If it did, we go around once more in case there is buffered output, and a call that produces nothing means there was none.
+            if now_consumed == input.len() && (out.len() < out.capacity() || !made_progress) {
+                break;
+            }
+            if out.len() > MAX_MESSAGE_SIZE {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "message exceeds maximum size",
+                ));
+            }
+            if status == Status::StreamEnd || !made_progress {
+                return Err(io::Error::new(
+                    io::ErrorKind::InvalidData,
+                    "truncated or trailing deflate data",
+                ));
+            }
+        }
+
+        Ok(out)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn roundtrips_messages_with_shared_context() {
+        let mut sender = Deflate::new();
+        let mut receiver = Deflate::new();
+
+        let msg = br#"{"topic":"client","event":"resource_created_or_updated","payload":{"id":"73037362-715d-4a83-a749-f18eadd970e6"}}"#;
+
+        let first = sender.compress(msg);
+        let second = sender.compress(msg);
+
+        assert!(
+            second.len() < first.len(),
+            "context takeover should make repetitions cheaper"
+        );
+        assert_eq!(receiver.decompress(&first).unwrap(), msg);
+        assert_eq!(receiver.decompress(&second).unwrap(), msg);
+    }
+
+    #[test]
+    fn roundtrips_large_message() {
+        let mut sender = Deflate::new();
+        let mut receiver = Deflate::new();
+
+        let msg = (0..100_000u32)
+            .flat_map(|n| n.to_le_bytes())
+            .collect::<Vec<_>>();
+
+        assert_eq!(receiver.decompress(&sender.compress(&msg)).unwrap(), msg);
+    }
+
+    #[test]
+    fn roundtrips_message_that_exactly_fills_the_buffer() {
+        let msg = (0..4096u32).map(|n| (n % 251) as u8).collect::<Vec<_>>();
+
+        for capacity in [msg.len(), msg.len() / 2, 1] {
+            let mut sender = Deflate::new();
+            let mut receiver = Deflate::new();
+
+            let compressed = sender.compress(&msg);
+
+            assert_eq!(
+                receiver
+                    .decompress_with_capacity(&compressed, capacity)
+                    .unwrap(),
+                msg
+            );
+        }
+    }
+
+    #[test]
+    fn rejects_garbage() {
+        let mut receiver = Deflate::new();
+
+        assert!(receiver.decompress(&[0xff; 16]).is_err());
+    }
+}
@@ -1,5 +1,7 @@
+mod deflate;
 mod heartbeat;
 mod login_url;
+mod resume;
 
 use std::collections::{HashSet, VecDeque};
 use std::mem;
@@ -10,18 +12,20 @@ use std::{fmt, future, marker::PhantomData};
 use backoff::backoff::Backoff;
 use backoff::ExponentialBackoff;
 use base64::Engine;
+use deflate::Deflate;
 use futures::future::BoxFuture;
 use futures::{FutureExt, SinkExt, StreamExt};
 use heartbeat::{Heartbeat, MissedLastHeartbeat};
 use rand_core::{OsRng, RngCore};
+use resume::ResumableSession;
 use secrecy::{ExposeSecret as _, Secret};
 use serde::{de::DeserializeOwned, Deserialize, Serialize};
 use std::task::{Context, Poll, Waker};
 use tokio::net::TcpStream;
 use tokio_tungstenite::connect_async_with_config;
+use tokio_tungstenite::tungstenite::handshake::client::Response;
 use tokio_tungstenite::tungstenite::http::StatusCode;
 use tokio_tungstenite::{
-    connect_async,
     tungstenite::{handshake::client::Request, Message},
     MaybeTlsStream, WebSocketStream,
 };
@@ -47,29 +51,65 @@ pub struct PhoenixChannel<TInitReq, TInboundMsg, TOutboundRes> {
 
     login: &'static str,
     init_req: TInitReq,
+
+    /// Set if the portal agreed to compress messages on the current connection.
+    deflate: Option<Deflate>,
+    /// Set if we opted into resumable sessions, see [`PhoenixChannel::with_resumable_session`].
+    session: Option<ResumableSession>,
 }
 
 enum State {
     Connected(WebSocketStream<MaybeTlsStream<TcpStream>>),
     Connecting(
-        BoxFuture<'static, Result<WebSocketStream<MaybeTlsStream<TcpStream>>, InternalError>>,
+        BoxFuture<
+            'static,
+            Result<(WebSocketStream<MaybeTlsStream<TcpStream>>, Handshake), InternalError>,
+        >,
     ),
     Closing(WebSocketStream<MaybeTlsStream<TcpStream>>),
     Closed,
 }
 
 impl State {
-    fn connect(url: Secret<LoginUrl>, user_agent: String) -> Self {
-        Self::Connecting(Box::pin(async move {
-            let (stream, _) = connect_async_with_config(make_request(url, user_agent), None, true)
-                .await
-                .map_err(InternalError::WebSocket)?;
+    fn connect(request: Request) -> Self {
+        Self::Connecting(Box::pin(connect(request)))
+    }
+}
+
+/// What the portal agreed to during the websocket handshake.
+#[derive(Debug, Default)]
+struct Handshake {
+    compression: bool,
+    session: Option<String>,
+}
+
+impl Handshake {
+    fn from_response(response: &Response) -> Self {
+        let header = |name| {
+            response
+                .headers()
+                .get(name)
+                .and_then(|v| v.to_str().ok())
+                .map(ToOwned::to_owned)
+        };
 
-            Ok(stream)
-        }))
+        Self {
+            compression: header(deflate::HEADER).as_deref() == Some(deflate::DEFLATE),
+            session: header(resume::SESSION_HEADER),
+        }
     }
 }
 
+async fn connect(
+    request: Request,
+) -> Result<(WebSocketStream<MaybeTlsStream<TcpStream>>, Handshake), InternalError> {
+    let (stream, response) = connect_async_with_config(request, None, true)
+        .await
+        .map_err(InternalError::WebSocket)?;
+
+    Ok((stream, Handshake::from_response(&response)))
+}
+
 #[derive(Debug, thiserror::Error)]
 pub enum Error {
     #[error("client error: {0}")]
@@ -96,6 +136,7 @@ impl Error {
 enum InternalError {
     WebSocket(tokio_tungstenite::tungstenite::Error),
     Serde(serde_json::Error),
+    Decompress(std::io::Error),
     MissedHeartbeat,
     CloseMessage,
     StreamClosed,
@@ -116,6 +157,7 @@ impl fmt::Display for InternalError {
             }
             InternalError::WebSocket(e) => write!(f, "websocket connection failed: {e}"),
             InternalError::Serde(e) => write!(f, "failed to deserialize message: {e}"),
+            InternalError::Decompress(e) => write!(f, "failed to decompress message: {e}"),
             InternalError::MissedHeartbeat => write!(f, "portal did not respond to our heartbeat"),
             InternalError::CloseMessage => write!(f, "portal closed the websocket connection"),
             InternalError::StreamClosed => write!(f, "websocket stream was closed"),
@@ -176,9 +218,9 @@ where
 
         Self {
             reconnect_backoff,
-            url: url.clone(),
-            user_agent: user_agent.clone(),
-            state: State::connect(url, user_agent),
+            state: State::connect(make_request(url.clone(), user_agent.clone(), None)),
+            url,
+            user_agent,
             waker: None,
             pending_messages: Default::default(),
             _phantom: PhantomData,
@@ -191,9 +233,23 @@ where
             pending_join_requests: Default::default(),
             login,
             init_req,
+            deflate: None,
+            session: None,
         }
     }
 
+    /// Opts into resumable sessions.
+    ///
+    /// After a reconnect, the portal will only replay the messages we missed instead of sending the complete state again, if it still has our session.
+    /// The caller must therefore retain the state it built from previous messages across reconnects.
+    pub fn with_resumable_session(mut self) -> Self {
+        self.session = Some(ResumableSession::default());
+        // We haven't polled the initial connection attempt yet, so replacing it is free.
+        self.state = State::connect(self.new_request());
+
+        self
+    }
+
     /// Join the provided room.
     ///
     /// If successful, a [`Event::JoinedRoom`] event will be emitted.
@@ -218,9 +274,7 @@ where
         self.reconnect_backoff.reset();
 
         // 2. Set state to `Connecting` without a timer.
-        let url = self.url.clone();
-        let user_agent = self.user_agent.clone();
-        self.state = State::connect(url, user_agent);
+        self.state = State::connect(self.new_request());
 
         // 3. In case we were already re-connecting, we need to wake the suspended task.
         if let Some(waker) = self.waker.take() {
@@ -268,14 +322,20 @@ where
                 },
                 State::Connected(stream) => stream,
                 State::Connecting(future) => match future.poll_unpin(cx) {
-                    Poll::Ready(Ok(stream)) => {
+                    Poll::Ready(Ok((stream, handshake))) => {
                         self.reconnect_backoff.reset();
                         self.heartbeat.reset();
                         self.state = State::Connected(stream);
+                        self.deflate = handshake.compression.then(Deflate::new);
+
+                        let resumed = self
+                            .session
+                            .as_mut()
+                            .is_some_and(|s| s.on_connected(handshake.session.as_deref()));
 
                         let host = self.url.expose_secret().host();
 
-                        tracing::info!(%host, "Connected to portal");
+                        tracing::info!(%host, compression = %handshake.compression, %resumed, "Connected to portal");
                         self.join(self.login, self.init_req.clone());
 
                         continue;
@@ -291,19 +351,14 @@ where
                             return Poll::Ready(Err(Error::MaxRetriesReached));
                         };
 
-                        let secret_url = self.url.clone();
-                        let user_agent = self.user_agent.clone();
+                        let request = self.new_request();
 
                         tracing::debug!(?backoff, max_elapsed_time = ?self.reconnect_backoff.max_elapsed_time, "Reconnecting to portal on transient client error: {e}");
 
                         self.state = State::Connecting(Box::pin(async move {
                             tokio::time::sleep(backoff).await;
 
-                            let (stream, _) = connect_async(make_request(secret_url, user_agent))
-                                .await
-                                .map_err(InternalError::WebSocket)?;
-
-                            Ok(stream)
+                            connect(request).await
                         }));
                         continue;
                     }
@@ -319,7 +374,12 @@ where
             match stream.poll_ready_unpin(cx) {
                 Poll::Ready(Ok(())) => {
                     if let Some(message) = self.pending_messages.pop_front() {
-                        match stream.start_send_unpin(Message::Text(message.clone())) {
+                        let frame = match self.deflate.as_mut() {
+                            Some(deflate) => Message::Binary(deflate.compress(message.as_bytes())),
+                            None => Message::Text(message.clone()),
+                        };
+
+                        match stream.start_send_unpin(frame) {
                             Ok(()) => {
                                 tracing::trace!(target: "wire::api::send", %message);
 
@@ -354,9 +414,29 @@ where
             // Priority 2: Handle incoming messages.
             match stream.poll_next_unpin(cx) {
                 Poll::Ready(Some(Ok(message))) => {
-                    let Ok(message) = message.into_text() else {
-                        tracing::warn!("Received non-text message from portal");
-                        continue;
+                    let message = match (message, self.deflate.as_mut()) {
+                        (Message::Binary(bytes), Some(deflate)) => {
+                            match deflate.decompress(&bytes).and_then(|b| {
+                                String::from_utf8(b).map_err(|e| {
+                                    std::io::Error::new(std::io::ErrorKind::InvalidData, e)
+                                })
+                            }) {
+                                Ok(message) => message,
+                                Err(e) => {
+                                    // The compression context is now out of sync with the portal's.
+                                    self.reconnect_on_transient_error(InternalError::Decompress(e));
+                                    continue;
+                                }
+                            }
+                        }
+                        (message, _) => {
+                            let Ok(message) = message.into_text() else {
+                                tracing::warn!("Received non-text message from portal");
+                                continue;
+                            };
+
+                            message
+                        }
                     };
 
                     tracing::trace!(target: "wire::api::recv", %message);
@@ -376,6 +456,13 @@ where
                         }
                     };
 
+                    if let Some(session) = self.session.as_mut() {
+                        if !session.on_message(message.seq) {
+                            tracing::debug!(seq = ?message.seq, "Skipping message we already processed");
+                            continue;
+                        }
+                    }
+
                     match (message.payload, message.reference) {
                         (Payload::Message(msg), _) => {
                             return Poll::Ready(Ok(Event::InboundMessage {
@@ -461,9 +548,11 @@ where
             // Priority 3: Handle heartbeats.
             match self.heartbeat.poll(cx) {
                 Poll::Ready(Ok(id)) => {
+                    let ack = self.session.as_ref().and_then(|s| s.last_seq());
+
                     self.pending_messages.push_back(serialize_msg(
                         "phoenix",
-                        EgressControlMessage::<()>::Heartbeat(Empty {}),
+                        EgressControlMessage::<()>::Heartbeat(HeartbeatPayload { ack }),
                         id.copy(),
                     ));
 
@@ -487,6 +576,14 @@ where
         self.state = State::Connecting(future::ready(Err(e)).boxed())
     }
 
+    fn new_request(&self) -> Request {
+        make_request(
+            self.url.clone(),
+            self.user_agent.clone(),
+            self.session.as_ref(),
+        )
+    }
+
     fn make_message(
         &mut self,
         topic: impl Into<String>,
@@ -543,6 +640,9 @@ pub struct PhoenixMessage<T, R> {
     payload: Payload<T, R>,
     #[serde(rename = "ref")]
     reference: Option<OutboundRequestId>,
+    /// Only present on resumable sessions.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    seq: Option<u64>,
 }
 
 #[derive(Debug, PartialEq, Eq, Deserialize, Serialize, Clone)]
@@ -623,6 +723,7 @@ impl<T, R> PhoenixMessage<T, R> {
             topic: topic.into(),
             payload: Payload::Message(payload),
             reference,
+            seq: None,
         }
     }
 
@@ -635,6 +736,7 @@ impl<T, R> PhoenixMessage<T, R> {
             topic: topic.into(),
             payload: Payload::Reply(Reply::Ok(OkReply::Message(payload))),
             reference,
+            seq: None,
         }
     }
 
@@ -648,19 +750,24 @@ impl<T, R> PhoenixMessage<T, R> {
             topic: topic.into(),
             payload: Payload::Reply(Reply::Error { reason }),
             reference,
+            seq: None,
         }
     }
 }
 
 // This is basically the same as tungstenite does but we add some new headers (namely user-agent)
-fn make_request(url: Secret<LoginUrl>, user_agent: String) -> Request {
+fn make_request(
+    url: Secret<LoginUrl>,
+    user_agent: String,
+    session: Option<&ResumableSession>,
+) -> Request {
     use secrecy::ExposeSecret as _;
 
     let mut r = [0u8; 16];
     OsRng.fill_bytes(&mut r);
     let key = base64::engine::general_purpose::STANDARD.encode(r);
 
-    Request::builder()
+    let mut request = Request::builder()
         .method("GET")
         .header("Host", url.expose_secret().host())
         .header("Connection", "Upgrade")
@@ -668,6 +775,13 @@ fn make_request(url: Secret<LoginUrl>, user_agent: String) -> Request {
         .header("Sec-WebSocket-Version", "13")
         .header("Sec-WebSocket-Key", key)
         .header("User-Agent", user_agent)
+        .header(deflate::HEADER, deflate::DEFLATE);
+
+    for (name, value) in session.map(|s| s.request_headers()).unwrap_or_default() {
+        request = request.header(name, value);
+    }
+
+    request
         .uri(url.expose_secret().inner().as_str())
         .body(())
         .expect("building static request always works")
@@ -677,7 +791,14 @@ fn make_request(url: Secret<LoginUrl>, user_agent: String) -> Request {
 #[serde(rename_all = "snake_case", tag = "event", content = "payload")]
 enum EgressControlMessage<T> {
     PhxJoin(T),
-    Heartbeat(Empty),
+    Heartbeat(HeartbeatPayload),
+}
+
+#[derive(Debug, Deserialize, Serialize, Clone)]
+struct HeartbeatPayload {
+    /// The last sequence number we processed on a resumable session.
+    #[serde(default, skip_serializing_if = "Option::is_none")]
+    ack: Option<u64>,
 }
 
 fn serialize_msg(
@@ -847,6 +968,111 @@ mod tests {
         assert_eq!(actual_reply, expected_reply);
     }
 
+    #[test]
+    fn heartbeat_acks_last_seq() {
+        let with_ack = serialize_msg(
+            "phoenix",
+            EgressControlMessage::<()>::Heartbeat(HeartbeatPayload { ack: Some(3) }),
+            OutboundRequestId(1),
+        );
+        let without_ack = serialize_msg(
+            "phoenix",
+            EgressControlMessage::<()>::Heartbeat(HeartbeatPayload { ack: None }),
+            OutboundRequestId(1),
+        );
+
+        assert!(with_ack.contains(r#""payload":{"ack":3}"#));
+        assert!(without_ack.contains(r#""payload":{}"#));
+    }
+
+    #[tokio::test]
+    async fn compressed_session_resumes_after_reconnect() {
+        use tokio_tungstenite::tungstenite::handshake::server;
+
+        let listener = tokio::net::TcpListener::bind("127.0.0.1:0").await.unwrap();
+        let port = listener.local_addr().unwrap().port();
+
+        // A stub portal that issues a session, closes the connection after the first message and replays it after the reconnect.
+        let portal = tokio::spawn(async move {
+            for (expected_last_seq, seqs) in [(None, 1..=1), (Some("1"), 1..=2)] {
+                let (tcp, _) = listener.accept().await.unwrap();
+                let mut ws = tokio_tungstenite::accept_hdr_async(
+                    tcp,
+                    |req: &server::Request, mut res: server::Response| {
+                        let header = |name| req.headers().get(name).and_then(|v| v.to_str().ok());
+
+                        assert_eq!(header(deflate::HEADER), Some(deflate::DEFLATE));
+                        assert_eq!(header(resume::LAST_SEQ_HEADER), expected_last_seq);
+
+                        let headers = res.headers_mut();
+                        headers.insert(deflate::HEADER, deflate::DEFLATE.parse().unwrap());
+                        headers.insert(resume::SESSION_HEADER, "abc".parse().unwrap());
+
+                        Ok(res)
+                    },
+                )
+                .await
+                .unwrap();
+                let mut deflate = Deflate::new();
+
+                let join = ws.next().await.unwrap().unwrap().into_data();
+                let join = String::from_utf8(deflate.decompress(&join).unwrap()).unwrap();
+                assert!(join.contains("phx_join"));
+
+                for seq in seqs {
+                    let msg = format!(
+                        r#"{{"topic":"client","event":"shout","payload":{{"hello":"{seq}"}},"ref":null,"seq":{seq}}}"#
+                    );
+                    ws.send(Message::Binary(deflate.compress(msg.as_bytes())))
+                        .await
+                        .unwrap();
+                }
+                ws.close(None).await.unwrap();
+            }
+        });
+
+        let url = LoginUrl::relay(
+            format!("ws://127.0.0.1:{port}").as_str(),
+            &secrecy::SecretString::new("token".to_owned()),
+            None,
+            3478,
+            None,
+            None,
+        )
+        .unwrap();
+        let mut channel = PhoenixChannel::<(), Msg, ()>::connect(
+            Secret::new(url),
+            "test".to_owned(),
+            "client",
+            (),
+            backoff::ExponentialBackoffBuilder::default()
+                .with_initial_interval(std::time::Duration::from_millis(10))
+                .build(),
+        )
+        .with_resumable_session();
+
+        let received = tokio::time::timeout(std::time::Duration::from_secs(5), async {
+            let mut received = Vec::new();
+
+            while received.len() < 2 {
+                if let Event::InboundMessage {
+                    msg: Msg::Shout { hello },
+                    ..
+                } = future::poll_fn(|cx| channel.poll(cx)).await.unwrap()
+                {
+                    received.push(hello);
+                }
+            }
+
+            received
+        })
+        .await
+        .unwrap();
+
+        assert_eq!(received, ["1", "2"]);
+        portal.await.unwrap();
+    }
+
     #[test]
     fn disabled_err_reply() {
         let json = r#"{"event":"phx_reply","ref":null,"topic":"client","payload":{"status":"error","response":{"reason": "disabled"}}}"#;
@@ -0,0 +1,125 @@
+//! Resumable sessions with the portal.
+//!
+//! Normally, the portal sends its complete state (resources, relays, ...) in an `init` message after every (re)connect.
+//! With a resumable session, the portal issues a session ID during the handshake and tags every message with a sequence number.
+//! When we reconnect, we present the session ID and the last sequence number we processed.
+//! If the portal still has the session, it answers with the same ID and only replays the messages we missed instead of sending `init`.
+//!
+//! We acknowledge the last sequence number in every heartbeat, allowing the portal to discard messages we have already seen.
+
+/// The header carrying the session ID, in both directions.
+pub(crate) const SESSION_HEADER: &str = "x-firezone-session";
+/// The header carrying the last sequence number we processed.
+pub(crate) const LAST_SEQ_HEADER: &str = "x-firezone-last-seq";
+
+/// What we send in [`SESSION_HEADER`] to ask for a new session.
+const NEW_SESSION: &str = "new";
+
+#[derive(Debug, Default)]
+pub(crate) struct ResumableSession {
+    id: Option<String>,
+    last_seq: Option<u64>,
+}
+
+impl ResumableSession {
+    pub(crate) fn request_headers(&self) -> Vec<(&'static str, String)> {
+        let mut headers = vec![(
+            SESSION_HEADER,
+            self.id.clone().unwrap_or_else(|| NEW_SESSION.to_owned()),
+        )];
+
+        if let Some(seq) = self.last_seq {
+            headers.push((LAST_SEQ_HEADER, seq.to_string()));
+        }
+
+        headers
+    }
+
+    /// Handles the session ID the portal sent in its handshake response.
+    ///
+    /// Returns whether the portal resumed our previous session.
+    pub(crate) fn on_connected(&mut self, id: Option<&str>) -> bool {
+        let resumed = id.is_some() && self.id.as_deref() == id;
+
+        if !resumed {
+            self.id = id.map(ToOwned::to_owned);
+            self.last_seq = None;
+        }
+
+        resumed
+    }
+
+    /// Records the sequence number of an incoming message.
+    ///
+    /// Returns `false` if we already processed this message, e.g. because the portal replayed more than we asked for.
+    pub(crate) fn on_message(&mut self, seq: Option<u64>) -> bool {
+        let Some(seq) = seq else {
+            return true;
+        };
+
+        if self.last_seq.is_some_and(|last| seq <= last) {
+            return false;
+        }
+        self.last_seq = Some(seq);
+
+        true
+    }
+
+    pub(crate) fn last_seq(&self) -> Option<u64> {
+        self.last_seq
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn asks_for_new_session_initially() {
+        let session = ResumableSession::default();
+
+        assert_eq!(
+            session.request_headers(),
+            vec![(SESSION_HEADER, "new".to_owned())]
+        );
+    }
+
+    #[test]
+    fn presents_last_seq_of_previous_session() {
+        let mut session = ResumableSession::default();
+
+        assert!(!session.on_connected(Some("abc")));
+        assert!(session.on_message(Some(1)));
+        assert!(session.on_message(Some(2)));
+
+        assert_eq!(
+            session.request_headers(),
+            vec![
+                (SESSION_HEADER, "abc".to_owned()),
+                (LAST_SEQ_HEADER, "2".to_owned())
+            ]
+        );
+    }
+
+    #[test]
+    fn skips_replayed_messages() {
+        let mut session = ResumableSession::default();
+        session.on_connected(Some("abc"));
+        session.on_message(Some(5));
+
+        assert!(session.on_connected(Some("abc")));
+        assert!(!session.on_message(Some(5)));
+        assert!(session.on_message(Some(6)));
+    }
+
+    #[test]
+    fn new_session_forgets_sequence_numbers() {
+        let mut session = ResumableSession::default();
+        session.on_connected(Some("abc"));
+        session.on_message(Some(5));
+
+        assert!(!session.on_connected(Some("def")));
+        assert_eq!(session.last_seq(), None);
+        assert!(session.on_message(Some(1)));
+    }
+}
@@ -1,3 +1,4 @@
+mod metrics;
 mod net_ext;
 mod server;
 mod sleep;
@@ -7,6 +8,7 @@ pub mod auth;
 pub mod proptest;
 pub mod sockets;
 
+pub use metrics::{Direction, FamilyMetrics, Metrics, SocketMetrics};
 pub use net_ext::IpAddrExt;
 pub use server::{
     Allocate, AllocationPort, Attribute, Binding, ChannelBind, ChannelData, ClientMessage, Command,
@@ -3,8 +3,8 @@ use backoff::ExponentialBackoffBuilder;
 use clap::Parser;
 use firezone_relay::sockets::Sockets;
 use firezone_relay::{
-    sockets, AddressFamily, AllocationPort, ChannelData, ClientSocket, Command, IpStack,
-    PeerSocket, Server, Sleep,
+    sockets, AddressFamily, AllocationPort, ChannelData, ClientSocket, Command, Direction, IpStack,
+    PeerSocket, Server, Sleep, SocketMetrics,
 };
 use futures::{future, FutureExt};
 use opentelemetry::KeyValue;
@@ -27,6 +27,11 @@ use url::Url;
 
 const STATS_LOG_INTERVAL: Duration = Duration::from_secs(10);
 
+/// How often we hand the metrics recorded by the [`Server`] to OpenTelemetry.
+///
+/// This only copies a handful of counters, the exporter batches them up independently.
+const METRICS_PUBLISH_INTERVAL: Duration = Duration::from_secs(1);
+
 const MAX_PARTITION_TIME: Duration = Duration::from_secs(60 * 15);
 
 #[derive(Parser, Debug)]
@@ -306,6 +311,8 @@ struct Eventloop<R> {
 
     stats_log_interval: tokio::time::Interval,
     last_num_bytes_relayed: u64,
+    metrics_publish_interval: tokio::time::Interval,
+    socket_metrics: SocketMetrics,
 
     last_heartbeat_sent: Arc<Mutex<Option<Instant>>>,
 
@@ -351,6 +358,8 @@ where
             sleep: Sleep::default(),
             stats_log_interval: tokio::time::interval(STATS_LOG_INTERVAL),
             last_num_bytes_relayed: 0,
+            metrics_publish_interval: tokio::time::interval(METRICS_PUBLISH_INTERVAL),
+            socket_metrics: SocketMetrics::new(),
             sockets,
             buffer: [0u8; MAX_UDP_SIZE],
             last_heartbeat_sent,
@@ -445,6 +454,11 @@ where
                                 .try_send(port.value(), peer.into_socket(), payload)
                         {
                             tracing::warn!(target: "relay", %peer, "Failed to relay data to peer: {e}");
+                            self.server.on_send_failed(
+                                peer.family(),
+                                Direction::ToPeer,
+                                payload.len(),
+                            );
                         }
                     };
                     continue;
@@ -454,11 +468,12 @@ where
                     from,
                     packet,
                 })) => {
-                    if let Some((client, channel)) = self.server.handle_peer_traffic(
-                        packet,
-                        PeerSocket::new(from),
-                        AllocationPort::new(port),
-                    ) {
+                    let peer = PeerSocket::new(from);
+
+                    if let Some((client, channel)) =
+                        self.server
+                            .handle_peer_traffic(packet, peer, AllocationPort::new(port))
+                    {
                         let total_length = ChannelData::encode_header_to_slice(
                             channel,
                             packet.len() as u16,
@@ -471,6 +486,12 @@ where
                             &self.buffer[..total_length],
                         ) {
                             tracing::warn!(target: "relay", %client, "Failed to relay data to client: {e}");
+                            // `Server` counted the packet under the family of the peer, which may differ from the client's.
+                            self.server.on_send_failed(
+                                peer.family(),
+                                Direction::ToClient,
+                                packet.len(),
+                            );
                         };
                     };
                     continue;
@@ -533,6 +554,13 @@ where
                 Poll::Ready(None) | Poll::Pending => {}
             }
 
+            if self.metrics_publish_interval.poll_tick(cx).is_ready() {
+                self.server.publish_metrics();
+                self.socket_metrics.publish(self.sockets.stats());
+
+                continue;
+            }
+
             if self.stats_log_interval.poll_tick(cx).is_ready() {
                 let num_allocations = self.server.num_allocations();
                 let num_channels = self.server.num_active_channels();
@@ -0,0 +1,503 @@
+//! Shard-local metrics of the data plane.
+//!
+//! Recording an OpenTelemetry instrument for every relayed datagram is expensive: each `add` looks up the attribute set and performs atomic operations that are shared with the exporter.
+//! Instead, the data plane bumps plain integers owned by the (single-threaded) [`Server`](crate::Server) and the deltas are published to OpenTelemetry on an interval.
+//! If the relay is ever sharded across cores, each shard owns its own [`Metrics`] and nothing is shared on the hot path.
+
+use crate::sockets;
+use opentelemetry::metrics::{Counter, Unit, UpDownCounter};
+use opentelemetry::KeyValue;
+use stun_codec::rfc8656::attributes::AddressFamily;
+
+/// Upper bounds of the buckets of the packet size histogram, in bytes.
+const PACKET_SIZE_BUCKETS: [usize; 6] = [64, 128, 256, 512, 1024, 1500];
+const PACKET_SIZE_BUCKET_LABELS: [&str; 7] = ["64", "128", "256", "512", "1024", "1500", "+Inf"];
+
+/// Labels of [`sockets::BATCH_SIZE_BUCKETS`].
+const BATCH_SIZE_BUCKET_LABELS: [&str; sockets::BATCH_SIZE_BUCKETS.len() + 1] =
+    ["1", "2", "4", "8", "16", "32", "64", "+Inf"];
+/// Labels of [`sockets::LOOP_LAG_BUCKETS`], in seconds.
+const LOOP_LAG_BUCKET_LABELS: [&str; sockets::LOOP_LAG_BUCKETS.len() + 1] =
+    ["0.0001", "0.001", "0.01", "0.1", "+Inf"];
+
+#[derive(Debug, Clone, Copy)]
+pub enum Direction {
+    ToPeer,
+    ToClient,
+}
+
+#[derive(Debug, Clone, Copy)]
+pub(crate) enum DropReason {
+    NoChannel,
+    UnboundChannel,
+    SendFailed,
+}
+
+impl DropReason {
+    fn as_str(&self) -> &'static str {
+        match self {
+            DropReason::NoChannel => "no_channel",
+            DropReason::UnboundChannel => "unbound_channel",
+            DropReason::SendFailed => "send_failed",
+        }
+    }
+}
+
+/// The metrics of a single address family.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct FamilyMetrics {
+    pub packets_to_peers: u64,
+    pub bytes_to_peers: u64,
+    pub packets_to_clients: u64,
+    pub bytes_to_clients: u64,
+
+    pub dropped_no_channel: u64,
+    pub dropped_unbound_channel: u64,
+    pub dropped_send_failed: u64,
+
+    /// Histogram of relayed packet sizes, see [`PACKET_SIZE_BUCKETS`].
+    ///
+    /// Each bucket only counts the packets that fall into it, [`cumulative`] turns it into a Prometheus-style histogram.
+    pub packet_sizes: [u64; PACKET_SIZE_BUCKET_LABELS.len()],
+
+    /// Number of allocations, indexed by the client's address family.
+    pub allocations: u64,
+    /// Number of bound channels, indexed by the peer's address family.
+    pub channels: u64,
+}
+
+impl FamilyMetrics {
+    pub fn bytes_relayed(&self) -> u64 {
+        self.bytes_to_peers + self.bytes_to_clients
+    }
+}
+
+#[derive(Debug)]
+pub struct Metrics {
+    v4: FamilyMetrics,
+    v6: FamilyMetrics,
+
+    /// What we last handed to OpenTelemetry, used to compute the deltas.
+    published_v4: FamilyMetrics,
+    published_v6: FamilyMetrics,
+
+    instruments: Instruments,
+}
+
+#[derive(Debug)]
+struct Instruments {
+    packets_relayed: Counter<u64>,
+    data_relayed: Counter<u64>,
+    packets_dropped: Counter<u64>,
+    packet_sizes: Counter<u64>,
+    allocations: UpDownCounter<i64>,
+    channels: UpDownCounter<i64>,
+}
+
+impl Metrics {
+    pub(crate) fn new() -> Self {
+        let meter = opentelemetry::global::meter("relay");
+
+        Self {
+            v4: FamilyMetrics::default(),
+            v6: FamilyMetrics::default(),
+            published_v4: FamilyMetrics::default(),
+            published_v6: FamilyMetrics::default(),
+            instruments: Instruments {
+                packets_relayed: meter
+                    .u64_counter("packets_relayed_total")
+                    .with_description("The number of packets relayed")
+                    .init(),
+                data_relayed: meter
+                    .u64_counter("data_relayed_bytes")
+                    .with_description("The number of bytes relayed")
+                    .with_unit(Unit::new("b"))
+                    .init(),
+                packets_dropped: meter
+                    .u64_counter("packets_dropped_total")
+                    .with_description("The number of packets that could not be relayed")
+                    .init(),
+                packet_sizes: meter
+                    .u64_counter("relayed_packet_size")
+                    .with_description(
+                        "Cumulative histogram of relayed packet sizes: packets of at most `le` bytes",
+                    )
+                    .init(),
+                allocations: meter
+                    .i64_up_down_counter("allocations_total")
+                    .with_description("The number of active allocations")
+                    .init(),
+                channels: meter
+                    .i64_up_down_counter("channels_total")
+                    .with_description("The number of bound channels")
+                    .init(),
+            },
+        }
+    }
+
+    pub fn family(&self, family: AddressFamily) -> &FamilyMetrics {
+        match family {
+            AddressFamily::V4 => &self.v4,
+            AddressFamily::V6 => &self.v6,
+        }
+    }
+
+    pub fn bytes_relayed(&self) -> u64 {
+        self.v4.bytes_relayed() + self.v6.bytes_relayed()
+    }
+
+    /// The caller failed to send a packet that the [`Server`](crate::Server) asked it to relay.
+    ///
+    /// The [`Server`](crate::Server) already counted the packet as relayed, this moves it over to the dropped ones.
+    /// `family` must be the one the packet was counted under, i.e. that of the peer it came from or went to.
+    pub fn on_send_failed(&mut self, family: AddressFamily, direction: Direction, len: usize) {
+        let metrics = self.family_mut(family);
+
+        let (packets, bytes) = match direction {
+            Direction::ToPeer => (&mut metrics.packets_to_peers, &mut metrics.bytes_to_peers),
+            Direction::ToClient => (
+                &mut metrics.packets_to_clients,
+                &mut metrics.bytes_to_clients,
+            ),
+        };
+        *packets = packets.saturating_sub(1);
+        *bytes = bytes.saturating_sub(len as u64);
+
+        let bucket = &mut metrics.packet_sizes[packet_size_bucket(len)];
+        *bucket = bucket.saturating_sub(1);
+
+        self.on_dropped(family, DropReason::SendFailed);
+    }
+
+    #[inline]
+    pub(crate) fn on_relayed(&mut self, family: AddressFamily, direction: Direction, len: usize) {
+        let metrics = self.family_mut(family);
+
+        match direction {
+            Direction::ToPeer => {
+                metrics.packets_to_peers += 1;
+                metrics.bytes_to_peers += len as u64;
+            }
+            Direction::ToClient => {
+                metrics.packets_to_clients += 1;
+                metrics.bytes_to_clients += len as u64;
+            }
+        }
+
+        metrics.packet_sizes[packet_size_bucket(len)] += 1;
+    }
+
+    #[inline]
+    pub(crate) fn on_dropped(&mut self, family: AddressFamily, reason: DropReason) {
+        let metrics = self.family_mut(family);
+
+        match reason {
+            DropReason::NoChannel => metrics.dropped_no_channel += 1,
+            DropReason::UnboundChannel => metrics.dropped_unbound_channel += 1,
+            DropReason::SendFailed => metrics.dropped_send_failed += 1,
+        }
+    }
+
+    pub(crate) fn set_allocations(&mut self, family: AddressFamily, num: usize) {
+        self.family_mut(family).allocations = num as u64;
+    }
+
+    pub(crate) fn set_channels(&mut self, family: AddressFamily, num: usize) {
+        self.family_mut(family).channels = num as u64;
+    }
+
+    /// Hands everything that was recorded since the last call to OpenTelemetry.
+    pub(crate) fn publish(&mut self) {
+        publish_family(&self.instruments, "ip4", &self.v4, &self.published_v4);
+        publish_family(&self.instruments, "ip6", &self.v6, &self.published_v6);
+
+        self.published_v4 = self.v4;
+        self.published_v6 = self.v6;
+    }
+
+    fn family_mut(&mut self, family: AddressFamily) -> &mut FamilyMetrics {
+        match family {
+            AddressFamily::V4 => &mut self.v4,
+            AddressFamily::V6 => &mut self.v6,
+        }
+    }
+}
+
+fn packet_size_bucket(len: usize) -> usize {
+    PACKET_SIZE_BUCKETS
+        .iter()
+        .position(|upper| len <= *upper)
+        .unwrap_or(PACKET_SIZE_BUCKETS.len())
+}
+
+/// Turns per-bucket counts into Prometheus-style ones, where each bucket also counts all smaller buckets.
+///
+/// The last bucket is `+Inf` and thus the total count.
+fn cumulative<const N: usize>(buckets: &[u64; N]) -> [u64; N] {
+    let mut sum = 0;
+
+    buckets.map(|count| {
+        sum += count;
+        sum
+    })
+}
+
+fn publish_family(
+    instruments: &Instruments,
+    family: &'static str,
+    current: &FamilyMetrics,
+    published: &FamilyMetrics,
+) {
+    let to_peer = [
+        KeyValue::new("family", family),
+        KeyValue::new("direction", "to_peer"),
+    ];
+    let to_client = [
+        KeyValue::new("family", family),
+        KeyValue::new("direction", "to_client"),
+    ];
+
+    // Failed sends are taken back from the relayed counters, don't underflow if one lands after its packet was published.
+    instruments.packets_relayed.add(
+        current
+            .packets_to_peers
+            .saturating_sub(published.packets_to_peers),
+        &to_peer,
+    );
+    instruments.packets_relayed.add(
+        current
+            .packets_to_clients
+            .saturating_sub(published.packets_to_clients),
+        &to_client,
+    );
+    instruments.data_relayed.add(
+        current
+            .bytes_to_peers
+            .saturating_sub(published.bytes_to_peers),
+        &to_peer,
+    );
+    instruments.data_relayed.add(
+        current
+            .bytes_to_clients
+            .saturating_sub(published.bytes_to_clients),
+        &to_client,
+    );
+
+    for (reason, current, published) in [
+        (
+            DropReason::NoChannel,
+            current.dropped_no_channel,
+            published.dropped_no_channel,
+        ),
+        (
+            DropReason::UnboundChannel,
+            current.dropped_unbound_channel,
+            published.dropped_unbound_channel,
+        ),
+        (
+            DropReason::SendFailed,
+            current.dropped_send_failed,
+            published.dropped_send_failed,
+        ),
+    ] {
+        instruments.packets_dropped.add(
+            current.saturating_sub(published),
+            &[
+                KeyValue::new("family", family),
+                KeyValue::new("reason", reason.as_str()),
+            ],
+        );
+    }
+
+    for (le, (current, published)) in PACKET_SIZE_BUCKET_LABELS.iter().zip(
+        cumulative(&current.packet_sizes)
+            .into_iter()
+            .zip(cumulative(&published.packet_sizes)),
+    ) {
+        instruments.packet_sizes.add(
+            current.saturating_sub(published),
+            &[KeyValue::new("family", family), KeyValue::new("le", *le)],
+        );
+    }
+
+    let family = [KeyValue::new("family", family)];
+
+    instruments.allocations.add(
+        current.allocations as i64 - published.allocations as i64,
+        &family,
+    );
+    instruments
+        .channels
+        .add(current.channels as i64 - published.channels as i64, &family);
+}
+
+/// Publishes [`sockets::Stats`] to OpenTelemetry.
+///
+/// The stats are owned by [`Sockets`](crate::sockets::Sockets) and polled on the same interval as [`Metrics`].
+#[derive(Debug)]
+pub struct SocketMetrics {
+    published: sockets::Stats,
+
+    receive_drops: Counter<u64>,
+    queued_bytes: UpDownCounter<i64>,
+    datagrams: Counter<u64>,
+    batch_sizes: Counter<u64>,
+    loop_lag: Counter<u64>,
+}
+
+impl SocketMetrics {
+    pub fn new() -> Self {
+        let meter = opentelemetry::global::meter("relay");
+
+        Self {
+            published: sockets::Stats::default(),
+            receive_drops: meter
+                .u64_counter("socket_receive_drops_total")
+                .with_description(
+                    "The number of datagrams the kernel dropped because we didn't read them fast enough",
+                )
+                .init(),
+            queued_bytes: meter
+                .i64_up_down_counter("socket_receive_queue_bytes")
+                .with_description("The number of bytes waiting in the receive buffers of our sockets")
+                .with_unit(Unit::new("b"))
+                .init(),
+            datagrams: meter
+                .u64_counter("socket_datagrams_received_total")
+                .with_description("The number of datagrams read from our sockets")
+                .init(),
+            batch_sizes: meter
+                .u64_counter("socket_receive_batch_size")
+                .with_description(
+                    "Cumulative histogram of datagrams read per readiness event: reads of at most `le` datagrams",
+                )
+                .init(),
+            loop_lag: meter
+                .u64_counter("socket_loop_lag")
+                .with_description(
+                    "Cumulative histogram of the time between a socket becoming readable and us reading from it: reads that lagged at most `le` seconds",
+                )
+                .init(),
+        }
+    }
+
+    /// Hands everything that changed since the last call to OpenTelemetry.
+    pub fn publish(&mut self, current: sockets::Stats) {
+        let published = &self.published;
+
+        self.receive_drops
+            .add(current.receive_drops - published.receive_drops, &[]);
+        self.queued_bytes.add(
+            current.queued_bytes as i64 - published.queued_bytes as i64,
+            &[],
+        );
+        self.datagrams
+            .add(current.datagrams - published.datagrams, &[]);
+
+        for (le, (current, published)) in BATCH_SIZE_BUCKET_LABELS.iter().zip(
+            cumulative(&current.batch_sizes)
+                .into_iter()
+                .zip(cumulative(&published.batch_sizes)),
+        ) {
+            self.batch_sizes
+                .add(current - published, &[KeyValue::new("le", *le)]);
+        }
+        for (le, (current, published)) in LOOP_LAG_BUCKET_LABELS.iter().zip(
+            cumulative(&current.loop_lag)
+                .into_iter()
+                .zip(cumulative(&published.loop_lag)),
+        ) {
+            self.loop_lag
+                .add(current - published, &[KeyValue::new("le", *le)]);
+        }
+
+        self.published = current;
+    }
+}
+
+impl Default for SocketMetrics {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn buckets_packet_sizes() {
+        let mut metrics = Metrics::new();
+
+        metrics.on_relayed(AddressFamily::V4, Direction::ToPeer, 64);
+        metrics.on_relayed(AddressFamily::V4, Direction::ToClient, 65);
+        metrics.on_relayed(AddressFamily::V4, Direction::ToClient, 9000);
+
+        let v4 = metrics.family(AddressFamily::V4);
+        assert_eq!(v4.packet_sizes, [1, 1, 0, 0, 0, 0, 1]);
+        assert_eq!(v4.packets_to_clients, 2);
+        assert_eq!(v4.bytes_relayed(), 64 + 65 + 9000);
+        assert_eq!(metrics.family(AddressFamily::V6), &FamilyMetrics::default());
+    }
+
+    #[test]
+    fn cumulative_buckets_count_all_smaller_ones() {
+        assert_eq!(cumulative(&[1, 1, 0, 0, 0, 0, 1]), [1, 2, 2, 2, 2, 2, 3]);
+    }
+
+    #[test]
+    fn failed_send_is_not_counted_as_relayed() {
+        let mut metrics = Metrics::new();
+
+        metrics.on_relayed(AddressFamily::V4, Direction::ToClient, 100);
+        metrics.on_relayed(AddressFamily::V4, Direction::ToClient, 100);
+        metrics.on_send_failed(AddressFamily::V4, Direction::ToClient, 100);
+
+        let v4 = metrics.family(AddressFamily::V4);
+        assert_eq!(v4.packets_to_clients, 1);
+        assert_eq!(v4.bytes_relayed(), 100);
+        assert_eq!(v4.packet_sizes, [0, 1, 0, 0, 0, 0, 0]);
+        assert_eq!(v4.dropped_send_failed, 1);
+    }
+
+    #[test]
+    fn failed_send_to_client_of_other_family_is_taken_from_the_peer_family() {
+        let mut metrics = Metrics::new();
+
+        // An IPv6 peer sends to an IPv4 client.
+        metrics.on_relayed(AddressFamily::V6, Direction::ToClient, 100);
+        metrics.on_relayed(AddressFamily::V4, Direction::ToPeer, 100);
+        metrics.publish();
+        metrics.on_send_failed(AddressFamily::V6, Direction::ToClient, 100);
+        metrics.publish();
+
+        let v4 = metrics.family(AddressFamily::V4);
+        let v6 = metrics.family(AddressFamily::V6);
+        assert_eq!(v4.packets_to_peers, 1);
+        assert_eq!(v4.dropped_send_failed, 0);
+        assert_eq!(v6.packets_to_clients, 0);
+        assert_eq!(v6.dropped_send_failed, 1);
+    }
+
+    #[test]
+    fn failed_send_in_wrong_family_does_not_underflow() {
+        let mut metrics = Metrics::new();
+
+        metrics.on_relayed(AddressFamily::V6, Direction::ToClient, 100);
+        metrics.on_send_failed(AddressFamily::V4, Direction::ToClient, 100);
+        metrics.publish();
+
+        assert_eq!(metrics.family(AddressFamily::V4).packets_to_clients, 0);
+    }
+
+    #[test]
+    fn publishing_does_not_reset_totals() {
+        let mut metrics = Metrics::new();
+
+        metrics.on_relayed(AddressFamily::V6, Direction::ToPeer, 100);
+        metrics.publish();
+        metrics.on_relayed(AddressFamily::V6, Direction::ToPeer, 100);
+
+        assert_eq!(metrics.bytes_relayed(), 200);
+    }
+}
@@ -7,12 +7,13 @@ pub use crate::server::client_message::{
 };
 
 use crate::auth::{MessageIntegrityExt, Nonces, FIREZONE};
+use crate::metrics::{Direction, DropReason, Metrics};
 use crate::net_ext::IpAddrExt;
 use crate::{ClientSocket, IpStack, PeerSocket};
 use anyhow::Result;
 use bytecodec::EncodeExt;
 use core::fmt;
-use opentelemetry::metrics::{Counter, Unit, UpDownCounter};
+use opentelemetry::metrics::Counter;
 use opentelemetry::KeyValue;
 use rand::Rng;
 use secrecy::SecretString;
@@ -77,9 +78,7 @@ pub struct Server<R> {
 
     nonces: Nonces,
 
-    allocations_up_down_counter: UpDownCounter<i64>,
-    data_relayed_counter: Counter<u64>,
-    data_relayed: u64, // Keep a separate counter because `Counter` doesn't expose the current value :(
+    metrics: Metrics,
     responses_counter: Counter<u64>,
 }
 
@@ -163,19 +162,10 @@ where
 
         let meter = opentelemetry::global::meter("relay");
 
-        let allocations_up_down_counter = meter
-            .i64_up_down_counter("allocations_total")
-            .with_description("The number of active allocations")
-            .init();
         let responses_counter = meter
             .u64_counter("responses_total")
             .with_description("The number of responses")
             .init();
-        let data_relayed_counter = meter
-            .u64_counter("data_relayed_bytes")
-            .with_description("The number of bytes relayed")
-            .with_unit(Unit::new("b"))
-            .init();
 
         Self {
             decoder: Default::default(),
@@ -192,10 +182,8 @@ where
             auth_secret: SecretString::from(hex::encode(rng.gen::<[u8; 32]>())),
             rng,
             nonces: Default::default(),
-            allocations_up_down_counter,
+            metrics: Metrics::new(),
             responses_counter,
-            data_relayed_counter,
-            data_relayed: 0,
             channel_and_client_by_port_and_peer: Default::default(),
         }
     }
@@ -216,7 +204,39 @@ where
     }
 
     pub fn num_relayed_bytes(&self) -> u64 {
-        self.data_relayed
+        self.metrics.bytes_relayed()
+    }
+
+    pub fn metrics(&self) -> &Metrics {
+        &self.metrics
+    }
+
+    /// Records that the caller failed to send a packet we told it to relay.
+    pub fn on_send_failed(&mut self, family: AddressFamily, direction: Direction, len: usize) {
+        self.metrics.on_send_failed(family, direction, len);
+    }
+
+    /// Publishes the metrics recorded since the last call to OpenTelemetry.
+    ///
+    /// Relaying data only updates plain counters, call this periodically to export them.
+    pub fn publish_metrics(&mut self) {
+        for family in [AddressFamily::V4, AddressFamily::V6] {
+            let allocations = self
+                .allocations
+                .keys()
+                .filter(|client| client.family() == family)
+                .count();
+            let channels = self
+                .channels_by_client_and_number
+                .values()
+                .filter(|c| c.bound && c.peer_address.family() == family)
+                .count();
+
+            self.metrics.set_allocations(family, allocations);
+            self.metrics.set_channels(family, channels);
+        }
+
+        self.metrics.publish();
     }
 
     pub fn num_allocations(&self) -> usize {
@@ -311,7 +331,10 @@ where
     ///
     /// - [`Some`] if there is an active channel on this allocation for this peer.
     ///   In that case, you should create a [`ChannelData`] message with the returned channel number and send it to the [`ClientSocket`].
-    #[tracing::instrument(level = "debug", skip_all, fields(%sender, %allocation, recipient, channel))]
+    #[cfg_attr(
+        feature = "wire-trace",
+        tracing::instrument(level = "debug", skip_all, fields(%sender, %allocation, recipient, channel))
+    )]
     pub fn handle_peer_traffic(
         &mut self,
         msg: &[u8],
@@ -323,16 +346,20 @@ where
             .get(&(allocation, sender))
         else {
             tracing::debug!(target: "relay", "no channel");
+            self.metrics
+                .on_dropped(sender.family(), DropReason::NoChannel);
 
             return None;
         };
 
-        Span::current().record("recipient", field::display(&client));
-
-        self.data_relayed_counter.add(msg.len() as u64, &[]);
-        self.data_relayed += msg.len() as u64;
+        #[cfg(feature = "wire-trace")]
+        {
+            Span::current().record("recipient", display(&client));
+            tracing::trace!(target: "wire", num_bytes = %msg.len());
+        }
 
-        tracing::trace!(target: "wire", num_bytes = %msg.len());
+        self.metrics
+            .on_relayed(sender.family(), Direction::ToClient, msg.len());
 
         Some((*client, *channel_number))
     }
@@ -515,15 +542,15 @@ where
         if let Some(second_relay_addr) = maybe_second_relay_addr {
             tracing::info!(
                 target: "relay",
-                first_relay_address = field::display(first_relay_address),
-                second_relay_address = field::display(second_relay_addr),
+                first_relay_address = display(first_relay_address),
+                second_relay_address = display(second_relay_addr),
                 lifetime = field::debug(effective_lifetime.lifetime()),
                 "Created new allocation",
             )
         } else {
             tracing::info!(
                 target: "relay",
-                first_relay_address = field::display(first_relay_address),
+                first_relay_address = display(first_relay_address),
                 lifetime = field::debug(effective_lifetime.lifetime()),
                 "Created new allocation",
             )
@@ -531,7 +558,6 @@ where
 
         self.clients_by_allocation.insert(allocation.port, sender);
         self.allocations.insert(sender, allocation);
-        self.allocations_up_down_counter.add(1, &[]);
 
         Ok(())
     }
@@ -708,7 +734,10 @@ where
         Ok(())
     }
 
-    #[tracing::instrument(level = "debug", skip_all, fields(allocation, recipient, channel, %sender))] // It is important that this is level `debug` otherwise performance is shit!
+    #[cfg_attr(
+        feature = "wire-trace",
+        tracing::instrument(level = "debug", skip_all, fields(allocation, recipient, channel, %sender))
+    )]
     fn handle_channel_data_message(
         &mut self,
         message: ChannelData,
@@ -722,6 +751,8 @@ where
             .get(&(sender, channel_number))
         else {
             tracing::debug!(target: "relay", channel = %channel_number.value(), "Channel does not exist, refusing to forward data");
+            self.metrics
+                .on_dropped(sender.family(), DropReason::NoChannel);
             return None;
         };
 
@@ -730,17 +761,21 @@ where
 
         if !channel.bound {
             tracing::debug!(target: "relay", channel = %channel_number.value(), "Channel exists but is unbound");
+            self.metrics
+                .on_dropped(channel.peer_address.family(), DropReason::UnboundChannel);
             return None;
         }
 
-        Span::current().record("allocation", field::display(&channel.allocation));
-        Span::current().record("recipient", field::display(&channel.peer_address));
-        Span::current().record("channel", field::display(&channel_number.value()));
-
-        tracing::trace!(target: "wire", num_bytes = %data.len());
+        #[cfg(feature = "wire-trace")]
+        {
+            Span::current().record("allocation", display(&channel.allocation));
+            Span::current().record("recipient", display(&channel.peer_address));
+            Span::current().record("channel", display(&channel_number.value()));
+            tracing::trace!(target: "wire", num_bytes = %data.len());
+        }
 
-        self.data_relayed_counter.add(data.len() as u64, &[]);
-        self.data_relayed += data.len() as u64;
+        self.metrics
+            .on_relayed(channel.peer_address.family(), Direction::ToPeer, data.len());
 
         Some((channel.allocation, channel.peer_address))
     }
@@ -930,7 +965,6 @@ where
                 false
             });
 
-        self.allocations_up_down_counter.add(-1, &[]);
         self.pending_commands.push_back(Command::FreeAllocation {
             port,
             family: allocation.first_relay_addr.family(),
@@ -4,11 +4,42 @@ use std::{
     io,
     net::{IpAddr, Ipv4Addr, Ipv6Addr, SocketAddr},
     task::{ready, Context, Poll},
-    time::Duration,
+    time::{Duration, Instant},
 };
 use stun_codec::rfc8656::attributes::AddressFamily;
 use tokio::sync::mpsc;
 
+/// The receive and send buffer size we ask the kernel for.
+///
+/// The kernel caps this at `net.core.rmem_max` / `net.core.wmem_max`, raise those to make use of it.
+const SOCKET_BUFFER_SIZE: usize = 4 * 1024 * 1024;
+
+/// Upper bounds of the buckets of [`Stats::batch_sizes`].
+pub const BATCH_SIZE_BUCKETS: [u64; 7] = [1, 2, 4, 8, 16, 32, 64];
+
+/// Upper bounds of the buckets of [`Stats::loop_lag`].
+pub const LOOP_LAG_BUCKETS: [Duration; 4] = [
+    Duration::from_micros(100),
+    Duration::from_millis(1),
+    Duration::from_millis(10),
+    Duration::from_millis(100),
+];
+
+/// Statistics of the receive side of all sockets.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct Stats {
+    /// Datagrams the kernel dropped because a receive buffer was full, i.e. we didn't read fast enough.
+    pub receive_drops: u64,
+    /// Bytes waiting in the receive buffers at the time of the snapshot.
+    pub queued_bytes: u64,
+    /// Datagrams we read.
+    pub datagrams: u64,
+    /// Histogram of how many datagrams we read per readiness event, see [`BATCH_SIZE_BUCKETS`].
+    pub batch_sizes: [u64; BATCH_SIZE_BUCKETS.len() + 1],
+    /// Histogram of the time between a socket becoming readable and us reading from it, see [`LOOP_LAG_BUCKETS`].
+    pub loop_lag: [u64; LOOP_LAG_BUCKETS.len() + 1],
+}
+
 /// A dynamic collection of UDP sockets, listening on all interfaces of a particular IP family.
 ///
 /// Internally, [`Sockets`] is powered by [`mio`] and uses a separate thread to poll for readiness of a socket.
@@ -24,6 +55,14 @@ pub struct Sockets {
     /// [`mio`] sends us a signal when a socket is ready for reading.
     /// We must read from it until it returns [`io::ErrorKind::WouldBlock`].
     current_ready_socket: Option<mio::Token>,
+    /// How many datagrams we read from `current_ready_socket` so far.
+    current_batch_size: u64,
+
+    stats: Stats,
+    /// The last known drop counter of each socket.
+    ///
+    /// The kernel counts per socket, we keep the sum in [`Stats::receive_drops`] so it doesn't decrease when sockets are closed.
+    drops_by_socket: HashMap<mio::Token, u32>,
 
     cmd_tx: mpsc::Sender<Command>,
     event_rx: mpsc::Receiver<Event>,
@@ -51,6 +90,9 @@ impl Sockets {
             cmd_tx,
             event_rx,
             current_ready_socket: None,
+            current_batch_size: 0,
+            stats: Stats::default(),
+            drops_by_socket: Default::default(),
         }
     }
 
@@ -77,6 +119,7 @@ impl Sockets {
         let Some(socket) = self.inner.remove(&token) else {
             return Ok(());
         };
+        self.drops_by_socket.remove(&token);
 
         self.cmd_tx.try_send(Command::DisposeSocket(socket))?;
 
@@ -102,6 +145,31 @@ impl Sockets {
         Ok(())
     }
 
+    /// A snapshot of the statistics of all sockets.
+    ///
+    /// This queries the kernel for each socket, call it on an interval rather than per packet.
+    pub fn stats(&mut self) -> Stats {
+        let mut queued_bytes = 0;
+
+        for (token, socket) in &self.inner {
+            let Ok(meminfo) = meminfo(socket) else {
+                continue;
+            };
+
+            let last = self
+                .drops_by_socket
+                .insert(*token, meminfo.drops)
+                .unwrap_or(0);
+            self.stats.receive_drops += meminfo.drops.wrapping_sub(last) as u64;
+            queued_bytes += meminfo.rmem_alloc as u64;
+        }
+
+        Stats {
+            queued_bytes,
+            ..self.stats
+        }
+    }
+
     pub fn poll_recv_from<'b>(
         &mut self,
         buf: &'b mut [u8],
@@ -114,6 +182,8 @@ impl Sockets {
                         Ok(ok) => ok,
                         Err(e) if e.kind() == io::ErrorKind::WouldBlock => {
                             self.current_ready_socket = None;
+                            self.stats.batch_sizes
+                                [bucket(&BATCH_SIZE_BUCKETS, &self.current_batch_size)] += 1;
                             continue;
                         }
                         Err(e) => {
@@ -122,6 +192,9 @@ impl Sockets {
                         }
                     };
 
+                    self.current_batch_size += 1;
+                    self.stats.datagrams += 1;
+
                     let (port, _) = token_to_port_and_address_family(current);
 
                     return Poll::Ready(Ok(Received {
@@ -137,8 +210,10 @@ impl Sockets {
                     self.inner.insert(token, socket);
                     continue;
                 }
-                Some(Event::SocketReady(ready)) => {
+                Some(Event::SocketReady(ready, at)) => {
                     self.current_ready_socket = Some(ready);
+                    self.current_batch_size = 0;
+                    self.stats.loop_lag[bucket(&LOOP_LAG_BUCKETS, &at.elapsed())] += 1;
                     continue;
                 }
                 Some(Event::Crashed(error)) => {
@@ -173,7 +248,8 @@ enum Command {
 
 enum Event {
     NewSocket(mio::Token, mio::net::UdpSocket),
-    SocketReady(mio::Token),
+    /// A socket became readable at the given time.
+    SocketReady(mio::Token, Instant),
     Crashed(anyhow::Error),
 }
 
@@ -197,9 +273,11 @@ fn mio_worker_task(
     loop {
         poll.poll(&mut events, Some(Duration::from_secs(1)))?; // Suspend for up to 1 second to wait for IO events.
 
+        let now = Instant::now();
+
         // Send all events into the channel, block as necessary.
         for event in events.iter() {
-            event_tx.blocking_send(Event::SocketReady(event.token()))?;
+            event_tx.blocking_send(Event::SocketReady(event.token(), now))?;
         }
 
         loop {
@@ -272,8 +350,65 @@ fn make_wildcard_socket(family: AddressFamily, port: u16) -> io::Result<std::net
         socket.set_only_v6(true)?;
     }
 
+    // Larger buffers absorb bursts whilst our event loop is busy; the kernel only allocates memory as needed.
+    if let Err(e) = socket.set_recv_buffer_size(SOCKET_BUFFER_SIZE) {
+        tracing::debug!("Failed to set receive buffer size: {e}");
+    }
+    if let Err(e) = socket.set_send_buffer_size(SOCKET_BUFFER_SIZE) {
+        tracing::debug!("Failed to set send buffer size: {e}");
+    }
+
     socket.set_nonblocking(true)?;
     socket.bind(&SockAddr::from(SocketAddr::new(address, port)))?;
 
     Ok(socket.into())
 }
+
+/// Returns the index of the bucket `value` falls into, the last one being unbounded.
+fn bucket<T: PartialOrd>(bounds: &[T], value: &T) -> usize {
+    bounds
+        .iter()
+        .position(|upper| value <= upper)
+        .unwrap_or(bounds.len())
+}
+
+struct MemInfo {
+    rmem_alloc: u32,
+    drops: u32,
+}
+
+/// Reads the memory statistics of a socket via `SO_MEMINFO`, see `socket(7)`.
+///
+/// Unlike `SO_RXQ_OVFL`, which reports drops as ancillary data on every read, this doesn't require `recvmsg` and can be polled on an interval.
+fn meminfo(socket: &mio::net::UdpSocket) -> io::Result<MemInfo> {
+    use std::os::fd::AsRawFd as _;
+
+    const SO_MEMINFO: libc::c_int = 55;
+
+    // Indices into the array returned by `SO_MEMINFO`, see `SK_MEMINFO_*` in `linux/sock_diag.h`.
+    const SK_MEMINFO_RMEM_ALLOC: usize = 0;
+    const SK_MEMINFO_DROPS: usize = 8;
+    const SK_MEMINFO_VARS: usize = 9;
+
+    let mut meminfo = [0u32; SK_MEMINFO_VARS];
+    let mut len = std::mem::size_of_val(&meminfo) as libc::socklen_t;
+
+    // Safety: The kernel writes at most `len` bytes into `meminfo`.
+    let ret = unsafe {
+        libc::getsockopt(
+            socket.as_raw_fd(),
+            libc::SOL_SOCKET,
+            SO_MEMINFO,
+            meminfo.as_mut_ptr().cast(),
+            &mut len,
+        )
+    };
+    if ret != 0 {
+        return Err(io::Error::last_os_error());
+    }
+
+    Ok(MemInfo {
+        rmem_alloc: meminfo[SK_MEMINFO_RMEM_ALLOC],
+        drops: meminfo[SK_MEMINFO_DROPS],
+    })
+}
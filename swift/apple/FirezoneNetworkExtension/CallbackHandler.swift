@@ -30,6 +30,9 @@ public protocol CallbackHandlerDelegate: AnyObject {
 public class CallbackHandler {
   public weak var delegate: CallbackHandlerDelegate?
 
+  // connlib only sends what changed, the delegate still gets the full list.
+  private var resources = ResourceList()
+
   func onSetInterfaceConfig(
     tunnelAddressIPv4: RustString,
     tunnelAddressIPv6: RustString,
@@ -58,9 +61,21 @@ public class CallbackHandler {
     delegate?.onUpdateRoutes(routeList4: routeList4.toString(), routeList6: routeList6.toString())
   }
 
-  func onUpdateResources(resourceList: RustString) {
-    Log.tunnel.log("CallbackHandler.onUpdateResources: \(resourceList.toString())")
-    delegate?.onUpdateResources(resourceList: resourceList.toString())
+  func onUpdateResources(resourceDelta: RustVec<UInt8>) {
+    let bytes = (0..<resourceDelta.len()).map { resourceDelta.get(index: $0)! }
+
+    guard let delta = try? ResourceDelta(bytes: bytes) else {
+      Log.tunnel.error("CallbackHandler.onUpdateResources: failed to decode resource delta")
+      return
+    }
+    guard resources.apply(delta) else {
+      Log.tunnel.error("CallbackHandler.onUpdateResources: missed a resource delta before \(delta.seq)")
+      return
+    }
+
+    let resourceList = resources.toJSON()
+    Log.tunnel.log("CallbackHandler.onUpdateResources: \(resourceList)")
+    delegate?.onUpdateResources(resourceList: resourceList)
   }
 
   func onDisconnect(error: RustString) {
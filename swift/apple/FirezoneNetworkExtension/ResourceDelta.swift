@@ -0,0 +1,205 @@
+//
+//  ResourceDelta.swift
+//  (c) 2024 Firezone, Inc.
+//  LICENSE: Apache-2.0
+//
+
+// Decodes the resource deltas connlib hands us in `onUpdateResources`.
+// See `connlib_client_shared::resource_delta` for the layout.
+
+import Foundation
+import Network
+
+enum ResourceDeltaError: Error {
+  case truncated
+  case invalidKind(UInt8)
+  case invalidStatus(UInt8)
+  case invalidFamily(UInt8)
+  case invalidUtf8
+}
+
+// Matches the JSON connlib used to send, so the app can keep decoding the
+// resource list it gets from us the same way.
+struct ResourceDeltaSite: Encodable {
+  let id: String
+  let name: String
+}
+
+struct ResourceDeltaResource: Encodable {
+  let type: String
+  let id: String
+  let address: String
+  let addressDescription: String?
+  let sites: [ResourceDeltaSite]
+  let name: String
+  let status: String
+
+  enum CodingKeys: String, CodingKey {
+    case type
+    case id
+    case address
+    case addressDescription = "address_description"
+    case sites
+    case name
+    case status
+  }
+}
+
+struct ResourceDelta {
+  let seq: UInt64
+  let upserted: [ResourceDeltaResource]
+  let removed: [String]
+
+  init(bytes: [UInt8]) throws {
+    var reader = Reader(bytes: bytes[...])
+
+    seq = try reader.u64()
+    let numUpserted = try reader.u32()
+    let numRemoved = try reader.u32()
+
+    var upserted: [ResourceDeltaResource] = []
+    for _ in 0..<numUpserted {
+      let len = try reader.u32()
+      var resource = Reader(bytes: try reader.take(Int(len)))
+      upserted.append(try resource.resource())
+    }
+
+    var removed: [String] = []
+    for _ in 0..<numRemoved {
+      removed.append(try reader.uuid())
+    }
+
+    self.upserted = upserted
+    self.removed = removed
+  }
+}
+
+// Applies deltas to the resource list we last saw.
+struct ResourceList {
+  private var resources: [String: ResourceDeltaResource] = [:]
+  private var lastSeq: UInt64 = 0
+
+  // Returns false if a delta got lost, the list is stale until the next reset.
+  mutating func apply(_ delta: ResourceDelta) -> Bool {
+    if delta.seq == 0 {
+      resources.removeAll()
+    } else if delta.seq != lastSeq + 1 {
+      return false
+    }
+    lastSeq = delta.seq
+
+    for resource in delta.upserted {
+      resources[resource.id] = resource
+    }
+    for id in delta.removed {
+      resources.removeValue(forKey: id)
+    }
+
+    return true
+  }
+
+  func toJSON() -> String {
+    let sorted = resources.values.sorted { ($0.name, $0.id) < ($1.name, $1.id) }
+    let data = try! JSONEncoder().encode(sorted)
+
+    return String(data: data, encoding: .utf8)!
+  }
+}
+
+private struct Reader {
+  var bytes: ArraySlice<UInt8>
+
+  mutating func take(_ n: Int) throws -> ArraySlice<UInt8> {
+    guard bytes.count >= n else { throw ResourceDeltaError.truncated }
+    let head = bytes.prefix(n)
+    bytes = bytes.dropFirst(n)
+
+    return head
+  }
+
+  mutating func u8() throws -> UInt8 {
+    return try take(1).first!
+  }
+
+  mutating func u16() throws -> UInt16 {
+    return try take(2).reversed().reduce(0) { $0 << 8 | UInt16($1) }
+  }
+
+  mutating func u32() throws -> UInt32 {
+    return try take(4).reversed().reduce(0) { $0 << 8 | UInt32($1) }
+  }
+
+  mutating func u64() throws -> UInt64 {
+    return try take(8).reversed().reduce(0) { $0 << 8 | UInt64($1) }
+  }
+
+  mutating func string() throws -> String {
+    let len = try u32()
+    guard let s = String(bytes: try take(Int(len)), encoding: .utf8) else {
+      throw ResourceDeltaError.invalidUtf8
+    }
+
+    return s
+  }
+
+  mutating func uuid() throws -> String {
+    let b = Array(try take(16))
+    let uuid = UUID(uuid: (
+      b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7],
+      b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]
+    ))
+
+    // Rust formats UUIDs in lowercase.
+    return uuid.uuidString.lowercased()
+  }
+
+  mutating func status() throws -> String {
+    switch try u8() {
+    case 0: return "Unknown"
+    case 1: return "Online"
+    case 2: return "Offline"
+    case let status: throw ResourceDeltaError.invalidStatus(status)
+    }
+  }
+
+  mutating func cidr() throws -> String {
+    let address: String
+    switch try u8() {
+    case 4: address = "\(IPv4Address(Data(try take(4)))!)"
+    case 6: address = "\(IPv6Address(Data(try take(16)))!)"
+    case let family: throw ResourceDeltaError.invalidFamily(family)
+    }
+    let prefix = try u8()
+
+    return "\(address)/\(prefix)"
+  }
+
+  mutating func resource() throws -> ResourceDeltaResource {
+    let type: String
+    switch try u8() {
+    case 0: type = "dns"
+    case 1: type = "cidr"
+    case let kind: throw ResourceDeltaError.invalidKind(kind)
+    }
+    let id = try uuid()
+    let status = try status()
+    let address = type == "dns" ? try string() : try cidr()
+    let name = try string()
+    let addressDescription = try u8() == 1 ? try string() : nil
+
+    var sites: [ResourceDeltaSite] = []
+    for _ in 0..<(try u16()) {
+      sites.append(ResourceDeltaSite(id: try uuid(), name: try string()))
+    }
+
+    return ResourceDeltaResource(
+      type: type,
+      id: id,
+      address: address,
+      addressDescription: addressDescription,
+      sites: sites,
+      name: name,
+      status: status
+    )
+  }
+}